@@ -18,4 +18,7 @@
 
 - (void)enable_ssss: (BOOL)enabled;
 
+// op: a ToneMapOperator (ToneMap.h); burnout only matters to TONEMAP_REINHARD, INFINITY for plain Reinhard
+- (void)set_tone_map: (int)op exposure: (float)exposure burnout: (float)burnout;
+
 @end
@@ -1,7 +1,7 @@
 /*
  Copyright (C) 2015 Apple Inc. All Rights Reserved.
  See LICENSE.txt for this sample’s licensing information
- 
+
  Abstract:
  Metal Renderer for Metal Basic 3D. Acts as the update and render delegate for the view controller and performs rendering. In MetalBasic3D, the renderer draws 2 cubes, whos color values change every update.
  */
@@ -21,20 +21,77 @@
 #include "TextureLoader.h"
 
 #include "RenderTarget.h"
+#include "FrameCommandBuffers.h"
+#include "FrameConstants.h"
+#include "FrameGraph.h"
+#include "FrameGraphTargets.h"
+#include "RenderTargetPool.h"
 
 #include "Camera.h"
+#include "ClusteredLights.h"
 #include "Light.hpp"
 
+#include "DynamicResolution.h"
+#include "ParallelEncoder.h"
 #include "SeparableSSS.h"
+#include "ShadowAtlas.h"
+#include "ShadowCache.h"
+#include "SSSTransmittance.h"
+#include "TaskGraph.h"
+#include "ThreadPool.h"
+#include "TileCompute.h"
+#include "ToneMapLUT.h"
 #include "Bloom.h"
 #include "DepthOfField.h"
 
 #include "DepthOfField.h"
 
 #define CAMERA_FOV 20.0f
+#define CAMERA_NEAR 0.1f
+#define CAMERA_FAR 100.0f
 #define PI 3.1415926536f
 
-#define N_LIGHTS 3
+// shadow maps rendered per frame at most, the dirty ones in turn (ssss_tool
+// shadow-cache-report), 0 for every map whose light or the head moved
+#define SHADOW_UPDATES_PER_FRAME 0
+
+// side of the depth texture every light's shadow map is a rect of, sized by
+// how much of the screen the head covers (ssss_tool shadow-atlas-report)
+#define SHADOW_ATLAS_SIZE ShadowAtlas::DEFAULT_SIZE
+
+// vertex layout of the head, drawn once per shadow map plus the main pass
+// (ssss_tool vertex-pack-report has the numbers for each)
+#define HEAD_VERTEX_LAYOUT ModelVertexLayoutPacked
+
+// targets of the main pass, declared to the frame graph every frame; the
+// color format is also the one of every post-process target: RGBA8Unorm,
+// RG11B10Float or RGBA16Float (ssss_tool precision-report compares them)
+#define SCENE_COLOR_FORMAT  FrameGraphFormatRGBA8Unorm
+// linear depth, read by SSS and DOF, with the SSS strength in green when the color has no alpha
+#define SCENE_DEPTH_FORMAT  (FrameGraphTextureDesc::has_alpha(SCENE_COLOR_FORMAT) ? FrameGraphFormatR32Float : FrameGraphFormatRG32Float)
+#define DEPTH_BUFFER_FORMAT FrameGraphFormatDepth32Float
+
+// SSS, glare detection and the DOF blur as tile classified compute kernels
+// (ssss_tool tile-report runs the same classes on the CPU), 0 for the fragment passes
+#define POST_PROCESS_TILES 1
+
+// size of the ToneMapLUT the bloom combine samples for the operators it reproduces
+// (ToneMapLUT::reproduces; ssss_tool tonemap-lut-report has its error and cost), the
+// others keep their specialized combine pass; 0 to evaluate every operator per pixel
+#define TONE_MAP_LUT_SIZE ToneMapLUT::DEFAULT_SIZE
+
+// command buffers the frame's passes are encoded into, on as many threads
+// (ssss_tool encode-bench times 1 to 4 on a mock of this frame), 1 to encode serially
+#define ENCODE_BATCHES 3
+
+// GPU frame times kept for the trace written on pause (ssss_tool dynres-replay), 10 minutes at 60 fps
+#define MAX_TRACE_FRAMES 36000
+
+struct FrameTime
+{
+    float ms;
+    vec3 scales;    // ssss, bloom, dof
+};
 
 using namespace AAPL;
 using namespace simd;
@@ -44,9 +101,8 @@ using namespace simd;
     CFTimeInterval              _frameTime;
     // constant synchronization for buffering <kInFlightCommandBuffers> frames
     dispatch_semaphore_t        _inflight_semaphore;
-    id <MTLBuffer>              _shadow_pass_buffer[kInFlightCommandBuffers][N_LIGHTS];
-    id <MTLBuffer>              _sky_pass_buffer[kInFlightCommandBuffers];
-    id <MTLBuffer>              _main_pass_buffer[kInFlightCommandBuffers];
+    // the constants of every pass, a slot per frame in flight
+    FrameConstants              _frame_constants;
     
     // renderer global ivars
     id <MTLDevice>              _device;
@@ -54,6 +110,7 @@ using namespace simd;
     id <MTLLibrary>             _defaultLibrary;
     id <MTLRenderPipelineState> _pipeline_main_pass;
     id <MTLRenderPipelineState> _pipeline_shadow_pass;
+    id <MTLRenderPipelineState> _pipeline_shadow_clear;
     id <MTLRenderPipelineState> _pipeline_skydome;
     id <MTLRenderPipelineState> _pipeline_quad;
     
@@ -63,20 +120,48 @@ using namespace simd;
     
     id <MTLDepthStencilState>   _depth_state_none;
     id <MTLDepthStencilState>   _depth_state_shadow;
+    id <MTLDepthStencilState>   _depth_state_shadow_clear;
     id <MTLDepthStencilState>   _depth_state_main;
     id <MTLDepthStencilState>   _depth_state_sky;
     id <MTLDepthStencilState>   _depth_state_ssss;
     
-    DepthStencil    _depth_stencil;
-    RenderTexture   _rt_main;
-    RenderTexture   _rt_temp;
-    RenderTexture   _rt_depth;
+    // rebuilt every frame; the pool keeps the transient targets from frame
+    // to frame and the targets keep a texture per pool target
+    FrameGraph          _frame_graph;
+    RenderTargetPool    _target_pool;
+    FrameGraphTargets   _frame_targets;
+    bool                _frame_graph_reported;
+    
+    // the schedule cut into ENCODE_BATCHES runs, each encoded on its own
+    // thread into its own command buffer
+    ParallelEncoder     _parallel_encoder;
+    FrameCommandBuffers _command_buffers;
+    ThreadPool          _encode_pool;       // also builds the light clusters and re-bakes the tone map LUT
+    
+    // render scales of the post-process passes, from the GPU frame times
+    DynamicResolution       _dynamic_resolution;
+    CFTimeInterval          _last_completed_time;
+    std::vector<FrameTime>  _frame_trace;
+    
+    // counts of the tiles the compute kernels classify, per frame in flight
+    TileCompute             _tile_compute;
     
     Model       _model_head;
     Model       _model_sphere;
     Model       _model_quad;
     Camera      _camera;
-    Light       _lights[N_LIGHTS];
+    // as many as the preset has, up to MAX_LIGHTS; the main pass shades the
+    // ones of each fragment's cluster (ssss_tool light-cluster-bench)
+    std::vector<Light>  _lights;
+    ClusteredLights     _clustered_lights;
+    std::vector<AAPL::SLight>           _light_constants;
+    std::vector<LightClusters::Light>   _light_culling;
+    // the head's model matrix, the shadow maps are cached against it and the lights
+    mat4        _head_transform;
+    ShadowCache _shadow_cache;
+    // the rects of the maps in _shadow_atlas_texture
+    ShadowAtlas _shadow_atlas;
+    ShadowMap   _shadow_atlas_texture;
     
     bool        enable_ssss;
     bool        enable_bloom;
@@ -97,6 +182,10 @@ using namespace simd;
     id <MTLTexture>     _tex_head_normal_map;
     id <MTLTexture>     _tex_sky_irradiance_map;
     id <MTLTexture>     _tex_beckmann;
+    id <MTLTexture>     _tex_transmittance;
+    
+    SSSTransmittance    _transmittance;
+    ToneMapLUT          _tone_map_lut;
     
     // this value will cycle from 0 to g_max_inflight_buffers whenever a display completes ensuring renderer clients
     // can synchronize between g_max_inflight_buffers count buffers, and thus avoiding a constant buffer from being overwritten between draws
@@ -137,6 +226,9 @@ using namespace simd;
     // create a new command queue
     _commandQueue = [_device newCommandQueue];
     
+    // before the effects are set up, they keep a pointer to it
+    _frame_constants.init(_device);
+    
     _defaultLibrary = [_device newDefaultLibrary];
     if(!_defaultLibrary) {
         NSLog(@">> ERROR: Couldnt create a default shader library");
@@ -151,95 +243,49 @@ using namespace simd;
         // cannot render anything without a valid compiled pipeline state object.
         assert(0);
     }
-
-        
-    // allocate a number of buffers in memory that matches the sempahore count so that
-    // we always have one self contained memory buffer for each buffered frame.
-    // In this case triple buffering is the optimal way to go so we cycle through 3 memory buffers
-    for (int i = 0; i < kInFlightCommandBuffers; i++)
-    {
-        for (int j = 0; j < N_LIGHTS; j++)
-        {
-            _shadow_pass_buffer[i][j] = [_device newBufferWithLength: sizeof(constants_mvp) options:0];
-            _shadow_pass_buffer[i][j].label = [NSString stringWithFormat: @"shadow_pass_constant_buffer%i for light%i", i, j];
-        }
-        
-        _sky_pass_buffer[i] = [_device newBufferWithLength: sizeof(constants_mvp) options:0];
-        _sky_pass_buffer[i].label = [NSString stringWithFormat: @"sky_pass_constant_buffer%i", i];
-
-        _main_pass_buffer[i] = [_device newBufferWithLength:sizeof(constant_main_pass) options:0];
-        _main_pass_buffer[i].label = [NSString stringWithFormat: @"main_pass_constant_buffer%i", i];
-    }
 }
 
-void load_preset(std::string path, Camera& _camera, Light* lights)
+// The camera, then the lights until the end of the file.
+void load_preset(std::string path, Camera& _camera, std::vector<Light>& lights)
 {
     std::ifstream fs(path);
     fs >> _camera;
     _camera.build();
     
-    for (int i = 0; i < N_LIGHTS; i++)
+    lights.clear();
+    while ((int)lights.size() < MAX_LIGHTS)
     {
-        fs >> lights[i];
+        Light light;
+        light.init();
+        if (!(fs >> light))
+            break;
+        lights.push_back(light);
     }
     
     fs.close();
 }
 
-- (BOOL)preparePipelineState:(AAPLView *)view
+// Shaders and pipeline states of the passes drawn here, the effects build
+// their own. Runs on a loader worker: it only needs the head's vertex layout.
+- (void)preparePipelines:(MTLPixelFormat)depthPixelFormat
 {
-    for (int i = 0; i < N_LIGHTS; i++)
-    {
-        _lights[i].init(_device);
-    }
-    
-    ModelManager::static_init(_device);
-    
-    load_preset(IOS_PATH("Preset", "Preset9", "txt"), _camera, _lights);
-    
-    _rt_main.init(_device, MTLPixelFormatRGBA8Unorm);
-    _rt_temp.init(_device, MTLPixelFormatRGBA8Unorm);
-    _rt_depth.init(_device, MTLPixelFormatR32Float);
-    _depth_stencil.init(_device);
-    
-    // load resources
-    //*******************************************************************
-    _model_head.init(_device, IOS_PATH("head", "head_optimized", "obj"), true, true, true, false);
-    _model_sphere.init(_device, IOS_PATH("Models", "Sphere", "obj"), false, false, false, false);
-    _model_quad.init(_device, IOS_PATH("Models", "Quad", "obj"), false, false, false, false);
-    
-    // Load the texture
-    _tex_head_diffuse       = TextureLoader::CreateTexture(_device,         IOS_PATH("head", "DiffuseMap_R8G8B8A8_1024_mipmaps", "dds"), MTLPixelFormatRGBA8Unorm_sRGB);
-    _tex_head_specularAO    = TextureLoader::CreateTexture(_device,         IOS_PATH("head", "SpecularAOMap_RGBA8UNorm", "dds"),        MTLPixelFormatRGBA8Unorm);
-    _tex_head_normal_map    = TextureLoader::CreateTexture(_device,         IOS_PATH("head", "NormalMap_RG16f_1024_mipmaps", "dds"),    MTLPixelFormatRG16Float);
-    _tex_sky                = TextureLoader::CreateTextureCubemap(_device,  IOS_PATH("StPeters", "DiffuseMap", "dds"),                  MTLPixelFormatRGBA16Float);
-    _tex_sky_irradiance_map = TextureLoader::CreateTextureCubemap(_device,  IOS_PATH("StPeters", "IrradianceMap", "dds"),               MTLPixelFormatRGBA32Float);
-    _tex_beckmann           = TextureLoader::CreateTexture(_device,         IOS_PATH("Texture", "BeckmannMap", "dds"),                  MTLPixelFormatR8Unorm);
-    
-    SeparableSSS::static_init();
-    ssss.init(_device, CAMERA_FOV, 0.012f);
-    ssss.prepare_pipeline_state(_device, _defaultLibrary, _rt_main);
-    
-    float exposure = 2.0f;
-    Bloom::static_init();
-    bloom.init(_device, Bloom::TONEMAP_FILMIC, exposure, 0.63f, 1.0f, 1.0f, 0.2f);
-    bloom.prepare_pipeline_state(_device, _defaultLibrary);
-    
-    //bool enable_dof = true;
-    focus_dist = 0.66f;
-    focus_range = 0.76f;
-    focus_falloff = 15.0f;
-    DepthOfField::static_init();
-    dof.init(_device, 0.66f, 0.76f, vec2(15.0f, 15.0f), 2.5f);
-    dof.prepare_pipeline_state(_device, _defaultLibrary);
-    
-    
     // Shader loading
     //*******************************************************************
-    auto shadow_vert    = _newFunctionFromLibrary(_defaultLibrary, @"shadow_pass_vert");
+    NSString* shadow_vert_name = @"shadow_pass_vert";
+    NSString* main_vert_name = @"main_pass_vert";
+    if (_model_head.vertex_layout() == ModelVertexLayoutPacked) {
+        main_vert_name = @"main_pass_vert_packed";
+    }
+    else if (_model_head.vertex_layout() == ModelVertexLayoutPackedHalfPosition) {
+        shadow_vert_name = @"shadow_pass_vert_half";
+        main_vert_name = @"main_pass_vert_packed_half";
+    }
+    
+    auto shadow_vert    = _newFunctionFromLibrary(_defaultLibrary, shadow_vert_name);
+    auto shadow_clear_vert = _newFunctionFromLibrary(_defaultLibrary, @"shadow_clear_vert");
     //auto shadow_frag = _newFunctionFromLibrary(_defaultLibrary, @"shadow_pass_frag");
     
-    auto main_vert      = _newFunctionFromLibrary(_defaultLibrary, @"main_pass_vert");
+    auto main_vert      = _newFunctionFromLibrary(_defaultLibrary, main_vert_name);
     auto main_frag      = _newFunctionFromLibrary(_defaultLibrary, @"main_pass_frag");
     
     auto skydome_vert   = _newFunctionFromLibrary(_defaultLibrary, @"skydome_pass_vert");
@@ -260,12 +306,17 @@ void load_preset(std::string path, Camera& _camera, Light* lights)
         _pipeline_shadow_pass = [_device newRenderPipelineStateWithDescriptor:desc error: &err];
         CheckPipelineError(_pipeline_shadow_pass, err);
         
+        desc.label = @"Shadow Clear";
+        desc.vertexFunction = shadow_clear_vert;
+        _pipeline_shadow_clear = [_device newRenderPipelineStateWithDescriptor:desc error: &err];
+        CheckPipelineError(_pipeline_shadow_clear, err);
+        
         desc.label = @"Main Pass";
         desc.vertexFunction = main_vert;
         desc.fragmentFunction = main_frag;
-        desc.colorAttachments[0].pixelFormat = _rt_main.pixel_format();
-        desc.colorAttachments[1].pixelFormat = _rt_depth.pixel_format();
-        desc.depthAttachmentPixelFormat = _depth_stencil.pixel_format();
+        desc.colorAttachments[0].pixelFormat = FrameGraphTargets::pixel_format(SCENE_COLOR_FORMAT);
+        desc.colorAttachments[1].pixelFormat = FrameGraphTargets::pixel_format(SCENE_DEPTH_FORMAT);
+        desc.depthAttachmentPixelFormat = FrameGraphTargets::pixel_format(DEPTH_BUFFER_FORMAT);
         _pipeline_main_pass = [_device newRenderPipelineStateWithDescriptor: desc error:&err];
         CheckPipelineError(_pipeline_main_pass, err);
         
@@ -274,8 +325,8 @@ void load_preset(std::string path, Camera& _camera, Light* lights)
         desc.label = @"Sky Pass";
         desc.vertexFunction = skydome_vert;
         desc.fragmentFunction = skydome_frag;
-        desc.colorAttachments[0].pixelFormat = _rt_main.pixel_format();
-        desc.depthAttachmentPixelFormat = _depth_stencil.pixel_format();
+        desc.colorAttachments[0].pixelFormat = FrameGraphTargets::pixel_format(SCENE_COLOR_FORMAT);
+        desc.depthAttachmentPixelFormat = FrameGraphTargets::pixel_format(DEPTH_BUFFER_FORMAT);
         _pipeline_skydome = [_device newRenderPipelineStateWithDescriptor: desc error: & err];
         CheckPipelineError(_pipeline_skydome, err);
         
@@ -283,10 +334,122 @@ void load_preset(std::string path, Camera& _camera, Light* lights)
         desc.vertexFunction = quad_vert;
         desc.fragmentFunction = quad_frag;
         desc.colorAttachments[0].pixelFormat = MTLPixelFormatBGRA8Unorm_sRGB;
-        desc.depthAttachmentPixelFormat = view.depthPixelFormat;
+        desc.depthAttachmentPixelFormat = depthPixelFormat;
         _pipeline_quad = [_device newRenderPipelineStateWithDescriptor: desc error: & err];
         CheckPipelineError(_pipeline_quad, err);
     }
+}
+
+- (BOOL)preparePipelineState:(AAPLView *)view
+{
+    _shadow_atlas_texture.init(_device, SHADOW_ATLAS_SIZE, SHADOW_ATLAS_SIZE);
+    _head_transform = glm::scale(mat4(1.0f), vec3(0.7f, 0.7f, 0.7f)) * glm::translate(mat4(1.0f), vec3(0, 0.2f, 0.425f));
+    
+    ModelManager::static_init(_device);
+    _tile_compute.init(_device);
+    _clustered_lights.init(_device);
+    
+    _frame_graph_reported = false;
+    _parallel_encoder.set_max_batches(ENCODE_BATCHES);
+    _last_completed_time = 0;
+    
+    // load resources
+    //*******************************************************************
+    // Files are parsed, kernels generated and pipelines compiled on the
+    // workers; the textures and meshes are uploaded by submit tasks, on this
+    // thread, as soon as their data is ready.
+    ThreadPool pool;
+    TaskGraph loader(pool);
+    
+    const std::string preset_path = IOS_PATH("Preset", "Preset9", "txt");
+    loader.add("preset", [&]() { load_preset(preset_path, _camera, _lights); });
+    
+    auto load_texture = [&](const char* name, id <MTLTexture> __strong & texture, std::string path, MTLPixelFormat format, bool cubemap) {
+        auto file = std::make_shared<std::shared_ptr<TextureFile>>();
+        TaskGraph::Task open = loader.add(std::string("open ") + name, [=]() {
+            *file = cubemap ? TextureLoader::OpenTextureCubemap(path.c_str(), format) : TextureLoader::OpenTexture(path.c_str(), format);
+        });
+        loader.add_submit(std::string("upload ") + name, [=, &texture]() {
+            texture = TextureLoader::UploadTexture(_device, *file);
+        }, { open });
+    };
+    load_texture("head diffuse",    _tex_head_diffuse,       IOS_PATH("head", "DiffuseMap_R8G8B8A8_1024_mipmaps", "dds"), MTLPixelFormatRGBA8Unorm_sRGB, false);
+    load_texture("head specularAO", _tex_head_specularAO,    IOS_PATH("head", "SpecularAOMap_RGBA8UNorm", "dds"),        MTLPixelFormatRGBA8Unorm, false);
+    load_texture("head normal map", _tex_head_normal_map,    IOS_PATH("head", "NormalMap_RG16f_1024_mipmaps", "dds"),    MTLPixelFormatRG16Float, false);
+    load_texture("sky",             _tex_sky,                IOS_PATH("StPeters", "DiffuseMap", "dds"),                  MTLPixelFormatRGBA16Float, true);
+    load_texture("sky irradiance",  _tex_sky_irradiance_map, IOS_PATH("StPeters", "IrradianceMap", "dds"),               MTLPixelFormatRGBA32Float, true);
+    load_texture("beckmann",        _tex_beckmann,           IOS_PATH("Texture", "BeckmannMap", "dds"),                  MTLPixelFormatR8Unorm, false);
+    
+    auto load_model = [&](const char* name, Model& model, std::string path, bool use_normal, bool use_uv, bool use_tangent,
+                          ModelVertexLayout layout) -> TaskGraph::Task {
+        TaskGraph::Task mesh = loader.add(std::string("mesh ") + name, [=, &model]() {
+            model.load(path, use_normal, use_uv, use_tangent, layout);
+        });
+        loader.add_submit(std::string("upload ") + name, [=, &model]() { model.upload(_device); }, { mesh });
+        return mesh;
+    };
+    TaskGraph::Task head = load_model("head", _model_head, IOS_PATH("head", "head_optimized", "obj"), true, true, true, HEAD_VERTEX_LAYOUT);
+    load_model("sphere", _model_sphere, IOS_PATH("Models", "Sphere", "obj"), false, false, false, ModelVertexLayoutSeparate);
+    load_model("quad", _model_quad, IOS_PATH("Models", "Quad", "obj"), false, false, false, ModelVertexLayoutSeparate);
+    
+    TaskGraph::Task ssss_setup = loader.add("ssss kernel", [&]() {
+        SeparableSSS::static_init();
+        ssss.init(&_frame_constants, CAMERA_FOV, 0.012f, 11);
+        ssss.prepare_pipeline_state(_device, _defaultLibrary, SCENE_COLOR_FORMAT);
+        if (POST_PROCESS_TILES)
+            ssss.setTileCompute(&_tile_compute);
+    });
+    
+    // for the SSS falloff, render: bakes it again when that changes
+    TaskGraph::Task transmittance = loader.add("transmittance", [&]() {
+        _transmittance.update(ssss.getFalloff());
+    }, { ssss_setup });
+    loader.add_submit("upload transmittance", [&]() {
+        [self uploadTransmittance];
+    }, { transmittance });
+    
+    TaskGraph::Task bloom_setup = loader.add("bloom", [&]() {
+        float exposure = 2.0f;
+        Bloom::static_init();
+        bloom.init(&_frame_constants, TONEMAP_FILMIC, exposure, 0.63f, 1.0f, 1.0f, 0.2f);
+        bloom.prepare_pipeline_state(_device, _defaultLibrary, SCENE_COLOR_FORMAT);
+        if (POST_PROCESS_TILES)
+            bloom.setTileCompute(&_tile_compute);
+    });
+    if (TONE_MAP_LUT_SIZE > 0)
+    {
+        TaskGraph::Task lut = loader.add("tone map lut", [&]() {
+            if (ToneMapLUT::reproduces(bloom.getToneMapOperator()))
+                _tone_map_lut.bake(pool, TONE_MAP_LUT_SIZE, bloom.getToneMapOperator(), bloom.getExposure(), bloom.getBurnout());
+        }, { bloom_setup });
+        loader.add_submit("upload tone map lut", [&]() {
+            if (_tone_map_lut.size() > 0)
+                [self uploadToneMapLUT];
+        }, { lut });
+    }
+    
+    loader.add("depth of field", [&]() {
+        //bool enable_dof = true;
+        focus_dist = 0.66f;
+        focus_range = 0.76f;
+        focus_falloff = 15.0f;
+        DepthOfField::static_init();
+        dof.init(&_frame_constants, 0.66f, 0.76f, vec2(15.0f, 15.0f), 2.5f);
+        dof.prepare_pipeline_state(_device, _defaultLibrary, SCENE_COLOR_FORMAT);
+        if (POST_PROCESS_TILES)
+            dof.setTileCompute(&_tile_compute);
+    });
+    
+    const MTLPixelFormat depth_pixel_format = view.depthPixelFormat;
+    loader.add("pipelines", [&]() { [self preparePipelines: depth_pixel_format]; }, { head });
+    
+    loader.run();
+    Debug::LogInfo(("startup: " + loader.report()).c_str());
+    // a map per light of the preset
+    _shadow_cache.init((int)_lights.size(), SHADOW_UPDATES_PER_FRAME);
+    NSString* trace_path = [NSTemporaryDirectory() stringByAppendingPathComponent: @"startup_trace.json"];
+    if (loader.write_trace(trace_path.UTF8String))
+        Debug::LogInfo([NSString stringWithFormat: @"startup trace written to %@", trace_path].UTF8String);
     
     //Setup depth and stencil state objects
     //*********************************************************************
@@ -302,6 +465,10 @@ void load_preset(std::string path, Camera& _camera, Light* lights)
         desc.depthCompareFunction = MTLCompareFunctionLess;
         _depth_state_shadow = [_device newDepthStencilStateWithDescriptor: desc];
         
+        desc.depthWriteEnabled = YES;
+        desc.depthCompareFunction = MTLCompareFunctionAlways;
+        _depth_state_shadow_clear = [_device newDepthStencilStateWithDescriptor: desc];
+        
         desc.depthWriteEnabled = YES;
         desc.depthCompareFunction = MTLCompareFunctionLess;
 //        stencil_desc.stencilCompareFunction = MTLCompareFunctionAlways;
@@ -322,89 +489,102 @@ void load_preset(std::string path, Camera& _camera, Light* lights)
     
     //Render Pass Desc
     //*********************************************************************
+    // targets and actions are bound by the frame graph
     {
         _render_pass_desc_main = [MTLRenderPassDescriptor renderPassDescriptor];
         auto color_attachment_0 = _render_pass_desc_main.colorAttachments[0];
         auto color_attachment_1 = _render_pass_desc_main.colorAttachments[1];
-        //color_attachment_0.texture = _rt_main.msaa_texture();
-        //color_attachment_0.resolveTexture = _rt_main.texture();
-        color_attachment_0.texture = _rt_main.texture();
-        color_attachment_0.loadAction = MTLLoadActionClear;
-        //color_attachment_0.storeAction = MTLStoreActionMultisampleResolve;
-        color_attachment_0.storeAction = MTLStoreActionStore;
-        color_attachment_0.clearColor = MTLClearColorMake(1, 0, 0, 1);
-        
-        color_attachment_1.texture = _rt_depth.texture();
-        color_attachment_1.loadAction = MTLLoadActionClear;
-        //color_attachment_0.storeAction = MTLStoreActionMultisampleResolve;
-        color_attachment_1.storeAction = MTLStoreActionStore;
+        color_attachment_0.clearColor = MTLClearColorMake(1, 0, 0, 0);     // alpha is the SSS strength
         color_attachment_1.clearColor = MTLClearColorMake(1, 0, 0, 1);
         
         auto depth_attachment = _render_pass_desc_main.depthAttachment;
-        depth_attachment.texture = _depth_stencil.get_depth_stencil_texture();
-        depth_attachment.loadAction = MTLLoadActionClear;
-        depth_attachment.storeAction = MTLStoreActionStore;
         depth_attachment.clearDepth = 1.0;
     }
     {
         _render_pass_desc_skydome = [MTLRenderPassDescriptor renderPassDescriptor];
         auto color_attachment_0 = _render_pass_desc_skydome.colorAttachments[0];
-        color_attachment_0.texture = _rt_main.texture();
-        color_attachment_0.loadAction = MTLLoadActionLoad;
-        color_attachment_0.storeAction = MTLStoreActionStore;
         color_attachment_0.clearColor = MTLClearColorMake(1, 0, 0, 1);
-        auto depth_attachment = _render_pass_desc_skydome.depthAttachment;
-        depth_attachment.texture = _depth_stencil.get_depth_stencil_texture();
-        depth_attachment.loadAction = MTLLoadActionLoad;
-        depth_attachment.storeAction = MTLStoreActionStore;
-        //depth_attachment.clearDepth = 1.0;
     }
     
+    Debug::LogInfo([NSString stringWithFormat: @"resources loaded, peak resident memory %.1f MB",
+                    Debug::PeakResidentBytes() / (1024.0 * 1024.0)].UTF8String);
+    
     return YES;
 }
 
 #pragma mark Render
-- (void)ShdowPass: (id<MTLCommandBuffer>)commandBuffer
+// The passes may be encoded on different threads at once: they compute
+// their matrices locally instead of going through RenderContext::camera.
+- (void)ShadowAtlasPass: (id<MTLCommandBuffer>)commandBuffer pass:(const FrameGraph::PassInfo &)pass
+                   atlas:(FrameGraph::Resource)atlas updates:(std::vector<int>)lights
 {
-    RenderContext::model_mat = glm::scale(mat4(1.0f), vec3(0.7f, 0.7f, 0.7f)) * glm::translate(mat4(1.0f), vec3(0, 0.2f, 0.425f));
-    for (int i = 0; i < N_LIGHTS; i++)
+    const mat4 & model = _head_transform;
+    MTLRenderPassDescriptor* pass_desc = _shadow_atlas_texture.renderPassDescriptor();
+    _frame_targets.bind(pass_desc.depthAttachment, pass, atlas);
+    bool clear_rects = pass_desc.depthAttachment.loadAction == MTLLoadActionLoad;
+    
+    auto encoder = [commandBuffer renderCommandEncoderWithDescriptor: pass_desc];
+    [encoder pushDebugGroup:@"Shdow Pass"];
+    encoder.label = @"shadow atlas";
+    [encoder setCullMode: MTLCullModeFront];
+    
+    // the maps drawn again are cleared first, the others keep last frame's contents
+    if (clear_rects)
     {
-        auto encoder = [commandBuffer renderCommandEncoderWithDescriptor: _lights[i].shadowMap.renderPassDescriptor()];
-        [encoder pushDebugGroup:[NSString stringWithFormat: @"Shdow Pass %d", i]];
-        encoder.label = [NSString stringWithFormat: @"ShadowMap%d", i];
-        
-        // setup encoder state
-        [encoder setRenderPipelineState: _pipeline_shadow_pass];
-        [encoder setDepthStencilState: _depth_state_shadow];
-        [encoder setCullMode: MTLCullModeFront];
-        [encoder setDepthBias:0.01 slopeScale: 1.0f clamp: 0.01];
-        
-//        auto proj = _lights[i].camera.getProjectionMatrix();
-//        auto linear_proj = proj;
-//        float Q = proj[2][2];
-//        float N = -proj[3][2] / Q;
-//        float F = -N * Q / (1-Q);
-//        linear_proj[2][2] /= F;
-//        linear_proj[3][2] /= F;
-//        
-//        auto mvp = linear_proj * _lights[i].camera.getViewMatrix() * RenderContex::model_mat;
+        [encoder setRenderPipelineState: _pipeline_shadow_clear];
+        [encoder setDepthStencilState: _depth_state_shadow_clear];
+        for (int i : lights)
+        {
+            const ShadowAtlas::Rect & rect = _shadow_atlas.rect(i);
+            [encoder setViewport: (MTLViewport){ (double)rect.x, (double)rect.y, (double)rect.size, (double)rect.size, 0.0, 1.0 }];
+            [encoder setScissorRect: (MTLScissorRect){ (NSUInteger)rect.x, (NSUInteger)rect.y, (NSUInteger)rect.size, (NSUInteger)rect.size }];
+            [encoder drawPrimitives: MTLPrimitiveTypeTriangle vertexStart: 0 vertexCount: 3];
+        }
+    }
+    
+    // setup encoder state
+    [encoder setRenderPipelineState: _pipeline_shadow_pass];
+    [encoder setDepthStencilState: _depth_state_shadow];
+    [encoder setDepthBias:0.01 slopeScale: 1.0f clamp: 0.01];
+    
+//    auto proj = _lights[i].camera.getProjectionMatrix();
+//    auto linear_proj = proj;
+//    float Q = proj[2][2];
+//    float N = -proj[3][2] / Q;
+//    float F = -N * Q / (1-Q);
+//    linear_proj[2][2] /= F;
+//    linear_proj[3][2] /= F;
+//    
+//    auto mvp = linear_proj * _lights[i].camera.getViewMatrix() * RenderContex::model_mat;
+    
+    // a viewport per light: its rect of the atlas
+    for (int i : lights)
+    {
+        const ShadowAtlas::Rect & rect = _shadow_atlas.rect(i);
+        [encoder setViewport: (MTLViewport){ (double)rect.x, (double)rect.y, (double)rect.size, (double)rect.size, 0.0, 1.0 }];
+        [encoder setScissorRect: (MTLScissorRect){ (NSUInteger)rect.x, (NSUInteger)rect.y, (NSUInteger)rect.size, (NSUInteger)rect.size }];
         
-        RenderContext::camera = &_lights[i].camera;
-        auto uniform_buffer = (constants_mvp*)[_shadow_pass_buffer[RenderContext::current_buffer_index][i] contents];
-        uniform_buffer->MVP = to_simd_type(RenderContext::get_mvp_mat());
-        //uniform_buffer->MVP = to_simd_type(mvp);
-        [encoder setVertexBuffer:_shadow_pass_buffer[RenderContext::current_buffer_index][i] offset:0 atIndex:0 ];
+        Camera & camera = _lights[i].camera;
+        constants_mvp uniforms;
+        uniforms.MVP = to_simd_type(camera.getProjectionMatrix() * camera.getViewMatrix() * model);
+        //uniforms.MVP = to_simd_type(mvp);
+        _frame_constants.set_vertex(encoder, uniforms, 0);
         
         _model_head.render(encoder, true, true, true);
-        
-        [encoder popDebugGroup];
-        [encoder endEncoding];
     }
+    
+    [encoder popDebugGroup];
+    [encoder endEncoding];
 }
 
-- (void)MainPass: (id<MTLCommandBuffer>)commandBuffer
+- (void)MainPass: (id<MTLCommandBuffer>)commandBuffer pass:(const FrameGraph::PassInfo &)pass
+                 color:(FrameGraph::Resource)color linearDepth:(FrameGraph::Resource)linear_depth depth:(FrameGraph::Resource)depth
 {
     {
+        _frame_targets.bind(_render_pass_desc_main.colorAttachments[0], pass, color);
+        _frame_targets.bind(_render_pass_desc_main.colorAttachments[1], pass, linear_depth);
+        _frame_targets.bind(_render_pass_desc_main.depthAttachment, pass, depth);
+        
         bool separate_speculars = false;
         //bool enable_ssss = true;
         bool enable_sss_translucency = true;
@@ -420,8 +600,6 @@ void load_preset(std::string path, Camera& _camera, Light* lights)
         float bumpiness = 0.9f;
         float ambient = 0.80f; // 0.61f
         
-        float falloff_width = 0.1f;
-        
         auto encoder = [commandBuffer renderCommandEncoderWithDescriptor: _render_pass_desc_main];
         [encoder pushDebugGroup:@"MainPass"];
         encoder.label = @"main pass";
@@ -429,12 +607,12 @@ void load_preset(std::string path, Camera& _camera, Light* lights)
         [encoder setRenderPipelineState: _pipeline_main_pass];
         [encoder setCullMode: MTLCullModeFront];
         
-        auto constant_buffer = (constant_main_pass*)[ _main_pass_buffer[RenderContext::current_buffer_index] contents];
-        RenderContext::camera = &_camera;
-        RenderContext::model_mat = glm::scale(mat4(1.0f), vec3(0.7f, 0.7f, 0.7f)) * glm::translate(mat4(1.0f), vec3(0, 0.2f, 0.425f));;
-        constant_buffer->MVP = to_simd_type(RenderContext::get_mvp_mat());
-        constant_buffer->Model = to_simd_type(RenderContext::model_mat);
-        constant_buffer->ModelInverseTranspose = to_simd_type(RenderContext::get_model_inverse_transpose());
+        constant_main_pass constants;
+        auto constant_buffer = &constants;
+        const mat4 & model = _head_transform;
+        constant_buffer->MVP = to_simd_type(_camera.getProjectionMatrix() * _camera.getViewMatrix() * model);
+        constant_buffer->Model = to_simd_type(model);
+        constant_buffer->ModelInverseTranspose = to_simd_type(glm::inverse(glm::transpose(model)));
         constant_buffer->camera_position = to_simd_type(vec4(_camera.getEyePosition(), 1.0));
         
         constant_buffer->bumpiness = bumpiness;
@@ -444,45 +622,38 @@ void load_preset(std::string path, Camera& _camera, Light* lights)
         constant_buffer->translucency = translucency;
         constant_buffer->sssWidth = sss_width;
         constant_buffer->ambient = ambient;
+        constant_buffer->transmittanceRange = _transmittance.range();
         constant_buffer->sssEnabled = enable_ssss;
         constant_buffer->sssTranslucencyEnabled = enable_sss_translucency;
         constant_buffer->separate_speculars = separate_speculars;
         
-        for (int i = 0; i < N_LIGHTS; i++)
-        {
-            auto& l = _lights[i];
-            auto& lc = l.camera;
-            auto& pos = lc.getEyePosition();
-            constant_buffer->lights[i].position = to_simd_type(pos);
-            constant_buffer->lights[i].direction = to_simd_type(lc.getLookAtPosition() - pos);
-            constant_buffer->lights[i].color = to_simd_type(l.color);
-            constant_buffer->lights[i].falloffStart = cos(0.5f * l.fov);
-            constant_buffer->lights[i].falloffWidth = falloff_width;
-            constant_buffer->lights[i].attenuation = l.attenuation;
-            constant_buffer->lights[i].farPlane = l.farPlane;
-            constant_buffer->lights[i].bias = l.bias;
-            constant_buffer->lights[i].viewProjection = to_simd_type(ShadowMap::getViewProjectionTextureMatrix(lc.getViewMatrix(), lc.getProjectionMatrix()));
-        }
-
-        [encoder setVertexBuffer: _main_pass_buffer[RenderContext::current_buffer_index] offset:0 atIndex:0];
-        [encoder setFragmentBuffer: _main_pass_buffer[RenderContext::current_buffer_index] offset:0 atIndex:0];
+        // the lights were filled and clustered in render:
+        _clustered_lights.set_constants(constants, RenderContext::window_width, RenderContext::window_height);
+        
+        _frame_constants.set_vertex_fragment(encoder, constants, 0);
         [encoder setFragmentTexture: _tex_head_diffuse atIndex:0];
         [encoder setFragmentTexture: _tex_head_specularAO atIndex:1];
         [encoder setFragmentTexture: _tex_head_normal_map atIndex:2];
         [encoder setFragmentTexture: _tex_beckmann atIndex:3];
         [encoder setFragmentTexture: _tex_sky_irradiance_map atIndex:4];
-        for (int i = 0; i < N_LIGHTS; i++)
-        {
-            [encoder setFragmentTexture: _lights[i].shadowMap.get_depth_stencil_texture() atIndex:5+i];
-        }
+        [encoder setFragmentTexture: _shadow_atlas_texture.get_depth_stencil_texture() atIndex:5];
+        [encoder setFragmentTexture: _tex_transmittance atIndex:8];
+        _clustered_lights.bind(encoder);
 
         _model_head.render(encoder);
         
         [encoder popDebugGroup];
         [encoder endEncoding];
     }
-    
+}
+
+- (void)SkyPass: (id<MTLCommandBuffer>)commandBuffer pass:(const FrameGraph::PassInfo &)pass
+          color:(FrameGraph::Resource)color depth:(FrameGraph::Resource)depth
+{
     {
+        _frame_targets.bind(_render_pass_desc_skydome.colorAttachments[0], pass, color);
+        _frame_targets.bind(_render_pass_desc_skydome.depthAttachment, pass, depth);
+        
         auto encoder = [commandBuffer renderCommandEncoderWithDescriptor: _render_pass_desc_skydome];
         [encoder pushDebugGroup:@"SkyPass"];
         encoder.label = @"sky pass";
@@ -490,11 +661,10 @@ void load_preset(std::string path, Camera& _camera, Light* lights)
         [encoder setRenderPipelineState: _pipeline_skydome];
         [encoder setCullMode: MTLCullModeBack];
         
-        auto constant_buffer = (constants_mvp*)[_sky_pass_buffer[RenderContext::current_buffer_index] contents];
-        RenderContext::camera = &_camera;
-        RenderContext::model_mat = glm::scale(glm::mat4(1.0f), glm::vec3(2.f));
-        constant_buffer->MVP = to_simd_type( RenderContext::get_mvp_mat() );
-        [encoder setVertexBuffer:_sky_pass_buffer[RenderContext::current_buffer_index] offset:0 atIndex:0];
+        constants_mvp constants;
+        mat4 model = glm::scale(glm::mat4(1.0f), glm::vec3(2.f));
+        constants.MVP = to_simd_type(_camera.getProjectionMatrix() * _camera.getViewMatrix() * model);
+        _frame_constants.set_vertex(encoder, constants, 0);
         [encoder setFragmentTexture: _tex_sky atIndex:0];
         
         _model_sphere.render(encoder);
@@ -504,14 +674,10 @@ void load_preset(std::string path, Camera& _camera, Light* lights)
     }
 }
 
-- (void)SkyPass: (id<MTLCommandBuffer>) commandBuffer
-{
-    
-}
-
-- (void)DrawTextureToScreen: (id<MTLTexture>) texture commandBuffer: (id<MTLCommandBuffer>) commandBuffer view:(AAPLView*) view
+- (void)DrawTextureToScreen: (id<MTLTexture>) texture commandBuffer: (id<MTLCommandBuffer>) commandBuffer
+                  renderPass:(MTLRenderPassDescriptor*) renderPassDescriptor
 {
-    auto encoder = [commandBuffer renderCommandEncoderWithDescriptor: view.renderPassDescriptor];
+    auto encoder = [commandBuffer renderCommandEncoderWithDescriptor: renderPassDescriptor];
     [encoder pushDebugGroup:@"texture2ScreenPass"];
     encoder.label = @"texture pass";
     
@@ -533,59 +699,209 @@ void load_preset(std::string path, Camera& _camera, Light* lights)
     // This semaphore will get signaled once the GPU completes a frame's work via addCompletedHandler callback below,
     // signifying the CPU can go ahead and prepare another frame.
     dispatch_semaphore_wait(_inflight_semaphore, DISPATCH_TIME_FOREVER);
+    const NSUInteger buffer_index = RenderContext::current_buffer_index;
+    _tile_compute.begin_frame(buffer_index);
+    // the GPU is done with the frame that used this slot last
+    _frame_constants.begin_frame(buffer_index);
     
     // Prior to sending any data to the GPU, constant buffers should be updated accordingly on the CPU.
     [self updateConstantBuffer];
     
-    // create a new command buffer for each renderpass to the current drawable
-    id <MTLCommandBuffer> commandBuffer = [_commandQueue commandBuffer];
+    // the command buffers are made once the graph is compiled and cut into batches
+    const FrameCommandBuffers* commandBuffers = &_command_buffers;
     
-    [self ShdowPass: commandBuffer];
-    [self MainPass: commandBuffer];
+    // Declare the frame: passes in order, with the targets they read and
+    // write. The graph culls the disabled effects, picks the load / store
+    // actions and shares the textures of targets that don't overlap.
+    //*********************************************************************
+    FrameGraph & graph = _frame_graph;
+    graph.clear();
     
-    if (enable_ssss)
+    // every light gets a rect of the shadow atlas, from how many pixels the head covers and how much of
+    // the light reaches it; a light whose rect changed draws its map again
+    vec3 head_min = _model_head.bounds_min(), head_max = _model_head.bounds_max();
+    vec3 head_center = vec3(_head_transform * vec4(0.5f * (head_min + head_max), 1.0f));
+    float head_radius = 0.5f * glm::length(head_max - head_min) * glm::length(vec3(_head_transform[0]));
+    const int light_count = (int)_lights.size();
+    std::vector<float> importance(light_count);
+    std::vector<mat4> light_view_projection(light_count);
+    for (int i = 0; i < light_count; i++)
     {
-        float sss_width = 0.012f;
-        vec3 sss_strength = vec3(0.48f, 0.41f, 0.28f);
-        vec3 sss_falloff = vec3(1.0f, 0.37f, 0.3f);
-        ssss.setStrength(sss_strength);
-        ssss.setFalloff(sss_falloff);
-        ssss.setWidth(sss_width);
-        ssss.render(commandBuffer, _rt_main, _rt_depth, _depth_stencil);
+        Camera & lc = _lights[i].camera;
+        light_view_projection[i] = lc.getProjectionMatrix() * lc.getViewMatrix();
+        const vec3 & c = _lights[i].color;
+        ShadowAtlas::Light light = { lc.getEyePosition(), glm::normalize(lc.getLookAtPosition() - lc.getEyePosition()),
+                                     _lights[i].fov, _lights[i].farPlane, _lights[i].attenuation, std::max(c.x, std::max(c.y, c.z)) };
+        importance[i] = ShadowAtlas::importance(light, head_center, head_radius, _camera.getEyePosition(), CAMERA_FOV * PI / 180.0f,
+                                                RenderContext::window_height);
     }
-    
-    auto rt_to_next_stage = &_rt_main;
-    
-    if (enable_bloom)
+    if (_shadow_atlas.update(importance))
     {
-        bloom.render(commandBuffer, rt_to_next_stage, &_rt_temp);
-        rt_to_next_stage = &_rt_temp;
+        for (int i = 0; i < light_count; i++)
+            if (_shadow_atlas.moved(i))
+                _shadow_cache.invalidate(i);
     }
+    // the maps of the lights that didn't move, with the head where it was, keep their contents:
+    // the pass draws the others only, and is culled when there are none
+    _shadow_cache.begin_frame(light_view_projection.data(), _head_transform);
+    std::vector<int> shadow_updates;
+    for (int i = 0; i < light_count; i++)
+        if (_shadow_cache.needs_update(i) && _shadow_atlas.rect(i).size > 0)
+            shadow_updates.push_back(i);
+    int atlas_size = _shadow_atlas.size();
+    FrameGraph::Resource shadow_atlas = graph.import("shadow atlas", { atlas_size, atlas_size, FrameGraphFormatDepth32Float });
+    _frame_targets.import(shadow_atlas, _shadow_atlas_texture.get_depth_stencil_texture());
+    FrameGraph::Pass pass = graph.add_pass("shadow atlas", [=](const FrameGraph::PassInfo & info) {
+        [self ShadowAtlasPass: commandBuffers->get(info) pass: info atlas: shadow_atlas updates: shadow_updates];
+    }, !shadow_updates.empty());
+    graph.write(pass, shadow_atlas, (int)shadow_updates.size() == light_count ? FrameGraphLoadClear : FrameGraphLoadLoad);
     
-    if (enable_dof)
+    // The light list of the main pass, and which lights reach each cluster of the
+    // camera's frustum, built on the encoding workers before they encode the frame.
+    float falloff_width = 0.1f;
+    _light_constants.resize(light_count);
+    _light_culling.resize(light_count);
+    for (int i = 0; i < light_count; i++)
     {
-        dof.set_focus_distance(_camera.getDistance() - 1.0f + focus_dist);
-        dof.set_focus_falloff(focus_falloff);
-        dof.set_focus_range(powf(focus_range, 5.0f));
-        dof.render(commandBuffer, *rt_to_next_stage, _rt_main, _rt_depth);
-        rt_to_next_stage = &_rt_main;
+        auto& l = _lights[i];
+        auto& lc = l.camera;
+        auto& pos = lc.getEyePosition();
+        AAPL::SLight & light = _light_constants[i];
+        light.position = to_simd_type(pos);
+        light.direction = to_simd_type(lc.getLookAtPosition() - pos);
+        light.color = to_simd_type(l.color);
+        light.falloffStart = cos(0.5f * l.fov);
+        light.falloffWidth = falloff_width;
+        light.attenuation = l.attenuation;
+        light.farPlane = l.farPlane;
+        light.bias = l.bias;
+        light.viewProjection = to_simd_type(ShadowMap::getViewProjectionTextureMatrix(lc.getViewMatrix(), lc.getProjectionMatrix()));
+        vec4 scale_offset = _shadow_atlas.scale_offset(i);
+        light.atlasScale = to_simd_type(vec2(scale_offset.x, scale_offset.y));
+        light.atlasOffset = to_simd_type(vec2(scale_offset.z, scale_offset.w));
+        _light_culling[i] = { pos, lc.getLookAtPosition() - pos, light.falloffStart, l.farPlane };
     }
+    _clustered_lights.update(buffer_index, _light_constants, _light_culling, _camera.getViewMatrix(), CAMERA_FOV * PI / 180.0f,
+                             (float)RenderContext::window_width / RenderContext::window_height, CAMERA_NEAR, CAMERA_FAR, &_encode_pool);
+    
+    int w = RenderContext::window_width;
+    int h = RenderContext::window_height;
+    FrameGraph::Resource color = graph.create("scene", { w, h, SCENE_COLOR_FORMAT });
+    FrameGraph::Resource linear_depth = graph.create("linear depth", { w, h, SCENE_DEPTH_FORMAT });
+    FrameGraph::Resource depth = graph.create("depth", { w, h, DEPTH_BUFFER_FORMAT });
+    pass = graph.add_pass("main", [=](const FrameGraph::PassInfo & info) {
+        [self MainPass: commandBuffers->get(info) pass: info color: color linearDepth: linear_depth depth: depth];
+    });
+    graph.read(pass, shadow_atlas);
+    graph.write(pass, color, FrameGraphLoadClear);
+    graph.write(pass, linear_depth, FrameGraphLoadClear);
+    graph.write(pass, depth, FrameGraphLoadClear);
+    
+    pass = graph.add_pass("sky", [=](const FrameGraph::PassInfo & info) {
+        [self SkyPass: commandBuffers->get(info) pass: info color: color depth: depth];
+    });
+    graph.write(pass, color, FrameGraphLoadLoad);
+    graph.write(pass, depth, FrameGraphLoadLoad);
+    
+    float sss_width = 0.012f;
+    vec3 sss_strength = vec3(0.48f, 0.41f, 0.28f);
+    vec3 sss_falloff = vec3(1.0f, 0.37f, 0.3f);
+    ssss.setStrength(sss_strength);
+    ssss.setFalloff(sss_falloff);
+    ssss.setWidth(sss_width);
+    if (_transmittance.update(ssss.getFalloff()))
+        [self uploadTransmittance];
+    // the later passes run at the size SSS leaves the image at, a disabled SSS doesn't scale it
+    vec3 scales(_dynamic_resolution.scale(DynamicResolution::PassSSSS),
+                _dynamic_resolution.scale(DynamicResolution::PassBloom),
+                _dynamic_resolution.scale(DynamicResolution::PassDOF));
+    FrameGraph::Resource stage = ssss.add_passes(graph, _frame_targets, _command_buffers, color, linear_depth, enable_ssss,
+                                                 enable_ssss ? scales.x : 1.0f);
     
-    [self DrawTextureToScreen: rt_to_next_stage->texture() commandBuffer: commandBuffer view: view];
+    stage = bloom.add_passes(graph, _frame_targets, _command_buffers, stage, enable_bloom, scales.y);
     
+    dof.set_focus_distance(_camera.getDistance() - 1.0f + focus_dist);
+    dof.set_focus_falloff(focus_falloff);
+    dof.set_focus_range(powf(focus_range, 5.0f));
+    stage = dof.add_passes(graph, _frame_targets, _command_buffers, stage, linear_depth, enable_dof, scales.z);
+    
+    MTLRenderPassDescriptor* screen_pass_desc = view.renderPassDescriptor;
+    id <MTLTexture> drawable = screen_pass_desc.colorAttachments[0].texture;
+    FrameGraph::Resource screen = graph.import("drawable", { (int)drawable.width, (int)drawable.height, FrameGraphFormatBGRA8Unorm_sRGB });
+    _frame_targets.import(screen, drawable);
+    pass = graph.add_pass("present", [=](const FrameGraph::PassInfo & info) {
+        // the view's own depth attachment stays as the view set it up
+        _frame_targets.bind(screen_pass_desc.colorAttachments[0], info, screen);
+        [self DrawTextureToScreen: _frame_targets.texture(stage) commandBuffer: commandBuffers->get(info) renderPass: screen_pass_desc];
+    });
+    graph.read(pass, stage);
+    graph.write(pass, screen, FrameGraphLoadClear);
+    graph.set_output(screen);
+    
+    std::string error;
+    bool compiled = graph.compile(_target_pool, &error);
+    _target_pool.end_frame();
+    // enqueued in schedule order: the GPU runs the batches in that order whichever is committed first
+    _command_buffers.begin(_commandQueue, compiled ? _parallel_encoder.plan(graph) : 1);
+    // the GPU starts on the frame with the first batch, and the frame time counts from there
+    CFTimeInterval committed = 0;
+    if (compiled)
+    {
+        _frame_targets.allocate(_device, graph);
+        _parallel_encoder.execute(graph, _encode_pool, [&](int batch, const std::function<void()> & encode) {
+            // the workers have no autorelease pool of their own
+            @autoreleasepool {
+                encode();
+            }
+            // the last one also presents, it is committed below
+            if (batch != _command_buffers.count() - 1)
+            {
+                if (batch == 0)
+                    committed = CACurrentMediaTime();
+                [_command_buffers.buffer(batch) commit];
+            }
+        });
+        _shadow_cache.end_frame();
+        if (!_frame_graph_reported)
+        {
+            Debug::LogInfo(("frame graph: " + graph.report()).c_str());
+            Debug::LogInfo(("parallel encoder: " + _parallel_encoder.report(graph)).c_str());
+            Debug::LogInfo(("frame constants: " + _frame_constants.allocator().report()).c_str());
+            Debug::LogInfo(("light clusters: " + _clustered_lights.clusters().report()).c_str());
+            _frame_graph_reported = true;
+        }
+    }
+    else
+    {
+        Debug::LogError(("frame graph: " + error).c_str());
+    }
+    _frame_targets.release_imported();
+    
+    id <MTLCommandBuffer> commandBuffer = _command_buffers.last();
     [commandBuffer presentDrawable: view.currentDrawable];
     
     // call the view's completion handler which is required by the view since it will signal its semaphore and set up the next buffer
+    // (the last command buffer completes last, the ones before it run first)
     __block dispatch_semaphore_t block_sema = _inflight_semaphore;
+    if (_command_buffers.count() == 1)
+        committed = CACurrentMediaTime();
     [commandBuffer addCompletedHandler:^(id<MTLCommandBuffer> buffer) {
+        CFTimeInterval completed = CACurrentMediaTime();
+        // the next frame in this slot zeroes the counts once the semaphore is signaled
+        AAPL::tile_stats tiles = _tile_compute.frame_stats(buffer_index);
         
         // GPU has completed rendering the frame and is done using the contents of any buffers previously encoded on the CPU for that frame.
         // Signal the semaphore and allow the CPU to proceed and construct the next frame.
         dispatch_semaphore_signal(block_sema);
+        
+        dispatch_async(dispatch_get_main_queue(), ^{
+            [self frameCommitted: committed completed: completed scales: scales tiles: tiles];
+        });
     }];
     
     // finalize rendering here. this will push the command buffer to the GPU
     [commandBuffer commit];
+    _command_buffers.end();
     
     // This index represents the current portion of the ring buffer being used for a given frame's constant buffer updates.
     // Once the CPU has completed updating a shared CPU/GPU memory buffer region for a frame, this index should be updated so the
@@ -594,11 +910,65 @@ void load_preset(std::string path, Camera& _camera, Light* lights)
     RenderContext::current_buffer_index = (RenderContext::current_buffer_index + 1) % kInFlightCommandBuffers;
 }
 
+// On the main thread, in the order the frames complete.
+- (void)frameCommitted: (CFTimeInterval)committed completed: (CFTimeInterval)completed scales: (vec3)scales
+                 tiles: (AAPL::tile_stats)tiles
+{
+    // The display link interval only tells 60 from 30 fps, it never shows
+    // headroom: time the GPU instead, which starts a frame when it is
+    // committed or when the previous one is done, whichever comes last.
+    double ms = (completed - std::max(committed, _last_completed_time)) * 1000.0;
+    _last_completed_time = completed;
+    
+    if (_frame_trace.size() < MAX_TRACE_FRAMES)
+        _frame_trace.push_back({ (float)ms, scales });
+    if (_dynamic_resolution.add_frame(ms))
+    {
+        Debug::LogInfo([NSString stringWithFormat: @"dynamic resolution: %.2f ms, scales ssss %.3f bloom %.3f dof %.3f",
+                        _dynamic_resolution.average_ms(), _dynamic_resolution.scale(DynamicResolution::PassSSSS),
+                        _dynamic_resolution.scale(DynamicResolution::PassBloom),
+                        _dynamic_resolution.scale(DynamicResolution::PassDOF)].UTF8String);
+    }
+    if (_tile_compute.add_frame(tiles))
+        Debug::LogInfo(("tiles: " + _tile_compute.report()).c_str());
+}
+
+- (void)writeFrameTrace
+{
+    NSString* path = [NSTemporaryDirectory() stringByAppendingPathComponent: @"frame_times.txt"];
+    FILE* f = fopen(path.UTF8String, "w");
+    if (!f)
+        return;
+    fprintf(f, "# gpu ms, scale ssss bloom dof\n");
+    for (const FrameTime & frame : _frame_trace)
+        fprintf(f, "%.3f %.3f %.3f %.3f\n", frame.ms, frame.scales.x, frame.scales.y, frame.scales.z);
+    fclose(f);
+    Debug::LogInfo([NSString stringWithFormat: @"%d frame times written to %@", (int)_frame_trace.size(), path].UTF8String);
+    _frame_trace.clear();
+}
+
 - (void)reshape:(AAPLView *)view
 {
     // when reshape is called, update the view and projection matricies since this means the view orientation or size changed
     float aspect = fabsf(float(view.bounds.size.width) / float(view.bounds.size.height));
-    _camera.setProjection(CAMERA_FOV * PI / 180.0f, aspect, 0.1f, 100.0f);
+    _camera.setProjection(CAMERA_FOV * PI / 180.0f, aspect, CAMERA_NEAR, CAMERA_FAR);
+    
+    // the drawable size AAPLView just set; reshape is also called when only the bounds' origin moved
+    int width = view.bounds.size.width * view.contentScaleFactor;
+    int height = view.bounds.size.height * view.contentScaleFactor;
+    if (width == RenderContext::window_width && height == RenderContext::window_height)
+        return;
+    
+    // The frame graph sizes every target from the window size, the effects
+    // only rewrite the constants that depend on it.
+    RenderContext::set_window_size(width, height);
+    ssss.resize(width, height);
+    bloom.resize(width, height);
+    dof.resize(width, height);
+    
+    // targets of the old size won't be asked for again
+    _target_pool.purge();
+    Debug::LogInfo([NSString stringWithFormat: @"resized to %dx%d", width, height].UTF8String);
 }
 
 #pragma mark Update
@@ -622,6 +992,14 @@ void load_preset(std::string path, Camera& _camera, Light* lights)
 {
     // timer is suspended/resumed
     // Can do any non-rendering related background work here when suspended
+    if (pause && !_frame_trace.empty())
+        [self writeFrameTrace];
+    if (pause)
+    {
+        Debug::LogInfo(("shadow cache: " + _shadow_cache.report()).c_str());
+        Debug::LogInfo(("shadow atlas: " + _shadow_atlas.report()).c_str());
+        Debug::LogInfo(("light clusters: " + _clustered_lights.clusters().report()).c_str());
+    }
 }
 
 - (void)enable_ssss: (BOOL)enabled
@@ -629,5 +1007,35 @@ void load_preset(std::string path, Camera& _camera, Light* lights)
     enable_ssss = enabled;
 }
 
+- (void)set_tone_map: (int)op exposure: (float)exposure burnout: (float)burnout
+{
+    bloom.setToneMapOperator((ToneMapOperator)op);
+    bloom.setExposure(exposure);
+    bloom.setBurnout(burnout);
+    // on the encode pool: it's idle outside render:, on this same thread
+    if (TONE_MAP_LUT_SIZE > 0 && ToneMapLUT::reproduces((ToneMapOperator)op))
+    {
+        _tone_map_lut.bake(_encode_pool, TONE_MAP_LUT_SIZE, (ToneMapOperator)op, exposure, burnout);
+        [self uploadToneMapLUT];
+    }
+    else
+        bloom.setToneMapLUT(nil);
+}
+
+// a new texture for the new falloff, the frames in flight keep the old one
+- (void)uploadTransmittance
+{
+    _tex_transmittance = TextureLoader::CreateTexture(_device, _transmittance.texels().data(), _transmittance.resolution(), 1,
+                                                      MTLPixelFormatRGBA16Float, _transmittance.resolution() * 4 * sizeof(uint16_t));
+}
+
+// a new texture: the frames in flight keep sampling the old one
+- (void)uploadToneMapLUT
+{
+    int size = _tone_map_lut.size();
+    bloom.setToneMapLUT(TextureLoader::CreateTexture3D(_device, _tone_map_lut.texels().data(), size, size, size,
+                                                       MTLPixelFormatRGBA16Float, size * 4 * sizeof(uint16_t)));
+}
+
 
 @end
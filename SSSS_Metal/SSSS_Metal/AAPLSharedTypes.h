@@ -1,7 +1,7 @@
 /*
  Copyright (C) 2015 Apple Inc. All Rights Reserved.
  See LICENSE.txt for this sample’s licensing information
- 
+
  Abstract:
  Shared data types between CPU code and metal shader code
  */
@@ -32,6 +32,20 @@ typedef simd::float4 vec4;
 //using glm::vec3;
 #endif
 
+// upper bound of SeparableSSS nSamples, the kernel lives in constant_ssss_pass
+#define SSSS_MAX_N_SAMPLES 25
+
+// tiles of the tile compute kernels (TileCompute.h): one threadgroup each
+#define TILE_CLASS_SIZE 16
+
+// the light list of the main pass and its clusters (LightClusters.h): screen
+// tiles, depth slices, and the entries of the light index list
+#define MAX_LIGHTS 256
+#define LIGHT_CLUSTERS_X 16
+#define LIGHT_CLUSTERS_Y 16
+#define LIGHT_CLUSTERS_Z 16
+#define LIGHT_CLUSTER_MAX_INDICES 65536
+
 #ifdef __cplusplus
 
 namespace AAPL
@@ -58,6 +72,8 @@ namespace AAPL
         float attenuation;
         float farPlane;
         float bias;
+        float2 atlasScale;      // its shadow map in the shadow atlas: uv * atlasScale + atlasOffset
+        float2 atlasOffset;
     };
     
     struct constant_main_pass
@@ -75,19 +91,33 @@ namespace AAPL
         float translucency;
         float sssWidth;
         float ambient;
+        float transmittanceRange;   // thickness covered by the transmittance LUT
         
         bool sssEnabled;
         bool sssTranslucencyEnabled;
         bool separate_speculars;
         
-        SLight lights[3];
+        // the cluster of a fragment: its pixel * clusterScale, and log2(view depth) * clusterSliceScale + clusterSliceBias
+        float2 clusterScale;
+        float clusterSliceScale;
+        float clusterSliceBias;
+    };
+    
+    // the lights of a cluster: light_indices[offset .. offset + count)
+    struct light_cluster
+    {
+        unsigned int offset;
+        unsigned int count;
     };
     
     struct constant_ssss_pass
     {
+        float4 ssss_kernel[SSSS_MAX_N_SAMPLES];  // (weight.rgb, offset), center sample first
+        int nSamples;
         float sssWidth;
         float2 dir;
         bool initStencil;
+        bool strengthInDepth;   // strength in the linear depth's green, for color targets without alpha
     };
     
     struct constant_bloom_pass_glare
@@ -99,15 +129,18 @@ namespace AAPL
     
     struct constant_bloom_pass_blur
     {
-        float2 step;
+        float2 step;        // a texel of the source level down, the tent step up
+        float2 weight;      // up: share of the level below in rgb, in alpha
     };
     
     struct constant_bloom_pass_combine
     {
         float exposure;
+        float burnout;      // TONEMAP_REINHARD: the luminance mapped to white
         float bloomIntensity;
         float defocus;
         float2 pixelSize;
+        float2 step;        // tent over the top of the upsample chain
         //float2 direction;
     };
     
@@ -138,6 +171,31 @@ namespace AAPL
         float focusRange;
         float2 focusFalloff;
     };
+    
+    // [[ function_constant ]] indices
+    enum FunctionConstant
+    {
+        FunctionConstantToneMapOperator,    // ToneMapOperator of bloom_combine_frag
+        FunctionConstantToneMapLUT,         // bloom_combine_frag samples a ToneMapLUT instead
+    };
+    
+    enum TileKernel
+    {
+        TileKernelSSSSHorizontal,
+        TileKernelSSSSVertical,
+        TileKernelBloomGlare,
+        TileKernelDOFHorizontal,
+        TileKernelDOFVertical,
+        TILE_KERNEL_COUNT
+    };
+    
+    // Tile counts of a frame, the kernels add to them as an array of atomic_uint.
+    struct tile_stats
+    {
+        unsigned int tiles[TILE_KERNEL_COUNT];
+        unsigned int full[TILE_KERNEL_COUNT];      // tiles that ran the full filter
+        unsigned int sky;                           // of the horizontal SSS pass
+    };
 }
 
 
@@ -9,39 +9,55 @@
 #ifndef Bloom_h
 #define Bloom_h
 
+#include "AAPLSharedTypes.h"
+#include "DynamicResolution.h"
+#include "FrameCommandBuffers.h"
+#include "FrameConstants.h"
+#include "FrameGraph.h"
+#include "FrameGraphTargets.h"
 #include "RenderTarget.h"
 #include "RenderContext.h"
+#include "TileCompute.h"
+#include "ToneMap.h"
 #include "Utilities.h"
 
 class Bloom
 {
 public:
-    Bloom() {}
-    
-    enum ToneMapOperator {
-        TONEMAP_LINEAR = 0,
-        TONEMAP_EXPONENTIAL = 1,
-        TONEMAP_EXPONENTIAL_HSV = 2,
-        TONEMAP_REINHARD = 3,
-        TONEMAP_FILMIC = 4
-    };
+    Bloom() : _width(0), _height(0), _tile_compute(nullptr), _frame_constants(nullptr) {}
+    
     static void static_init()
     {
     }
     
-    void init(id<MTLDevice> device,
+    // frame_constants: where the passes copy their constants when they are encoded
+    void init(FrameConstants* frame_constants,
               ToneMapOperator toneMapOperator, float exposure,
               float bloomThreshold, float bloomWidth, float bloomIntensity,
               float defocus);
     
-    void resize(id<MTLDevice> device, int width, int height);
+    /**
+     * Window size changed: rewrites the filter steps and pixel sizes of the
+     * pass constants. The pyramid is sized by add_passes().
+     */
+    void resize(int width, int height);
     
+    // Switches to the combine pass specialized for op, built by prepare_pipeline_state().
+    void setToneMapOperator(ToneMapOperator op);
     ToneMapOperator getToneMapOperator() const { return toneMapOperator; }
     
-    void setExposure(float exposure) { this->exposure = exposure; }
+    /**
+     * A ToneMapLUT baked for the operator, exposure and burnout set here:
+     * the combine pass samples it from now on, and evaluates the operator
+     * again when nil.
+     */
+    void setToneMapLUT(id <MTLTexture> lut);
+    
+    // Written to the pass constants, from the next frame encoded.
+    void setExposure(float exposure);
     float getExposure() const { return exposure; }
     
-    void setBurnout(float burnout) { this->burnout = burnout; }
+    void setBurnout(float burnout);
     float getBurnout() const { return burnout; }
     
     void setBloomThreshold(float bloomThreshold) { this->bloomThreshold = bloomThreshold; }
@@ -56,7 +72,8 @@ public:
     void setDefocus(float defocus) { this->defocus = defocus; }
     float getDefocus() const { return defocus; }
     
-    bool prepare_pipeline_state(id <MTLDevice> _device, id <MTLLibrary> _defaultLibrary)
+    // color_format: the one of the scene color, which the targets of the passes take
+    bool prepare_pipeline_state(id <MTLDevice> _device, id <MTLLibrary> _defaultLibrary, FrameGraphFormat color_format)
     {
         {
             MTLDepthStencilDescriptor *desc = [[MTLDepthStencilDescriptor alloc] init];
@@ -66,29 +83,39 @@ public:
         }
         
         auto vert      = _newFunctionFromLibrary(_defaultLibrary, @"quad_vert");
-        auto blur_frag    = _newFunctionFromLibrary(_defaultLibrary, @"bloom_blur_frag");
-        auto combine_frag = _newFunctionFromLibrary(_defaultLibrary, @"bloom_combine_frag");
+        auto down_frag    = _newFunctionFromLibrary(_defaultLibrary, @"bloom_down_frag");
+        auto up_frag      = _newFunctionFromLibrary(_defaultLibrary, @"bloom_up_frag");
         auto glare_detection_frag = _newFunctionFromLibrary(_defaultLibrary, @"bloom_glare_detection_frag");
         
         {
             MTLRenderPipelineDescriptor *desc = [MTLRenderPipelineDescriptor new];
             NSError *err = nil;
-            desc.label = @"Bloom Blur Pass";
+            desc.label = @"Bloom Downsample Pass";
             desc.vertexFunction = vert;
-            desc.fragmentFunction = blur_frag;
-            desc.colorAttachments[0].pixelFormat = MTLPixelFormatRGBA8Unorm;
+            desc.fragmentFunction = down_frag;
+            desc.colorAttachments[0].pixelFormat = FrameGraphTargets::pixel_format(color_format);
             //desc.depthAttachmentPixelFormat = MTLPixelFormatDepth32Float;
             _pipeline_state[0] = [_device newRenderPipelineStateWithDescriptor: desc error: &err];
             CheckPipelineError(_pipeline_state[0], err);
             err = nil;
 
-            desc.label = @"Bloom Combine Pass";
-            //desc.vertexFunction = vert;
-            desc.fragmentFunction = combine_frag;
-            //desc.colorAttachments[0].pixelFormat = glareRT.pixel_format();
-            _pipeline_state[1] = [_device newRenderPipelineStateWithDescriptor: desc error: &err];
-            CheckPipelineError(_pipeline_state[1], err);
-            err = nil;
+            // the combine pass of every operator up front, so switching doesn't compile anything;
+            // the last one samples the LUT
+            for (int op = 0; op <= TONEMAP_OPERATOR_COUNT; op++)
+            {
+                const bool lut = op == TONEMAP_OPERATOR_COUNT;
+                MTLFunctionConstantValues* values = [MTLFunctionConstantValues new];
+                [values setConstantValue: &op type: MTLDataTypeInt atIndex: AAPL::FunctionConstantToneMapOperator];
+                [values setConstantValue: &lut type: MTLDataTypeBool atIndex: AAPL::FunctionConstantToneMapLUT];
+                desc.label = [NSString stringWithFormat: @"Bloom Combine Pass (%s)", lut ? "LUT" : ToneMap::name((ToneMapOperator)op)];
+                //desc.vertexFunction = vert;
+                desc.fragmentFunction = _newFunctionFromLibrary(_defaultLibrary, @"bloom_combine_frag", values);
+                //desc.colorAttachments[0].pixelFormat = glareRT.pixel_format();
+                _pipeline_combine[op] = [_device newRenderPipelineStateWithDescriptor: desc error: &err];
+                CheckPipelineError(_pipeline_combine[op], err);
+                err = nil;
+            }
+            _pipeline_state[1] = _pipeline_combine[_tone_map_lut != nil ? TONEMAP_OPERATOR_COUNT : toneMapOperator];
 
             desc.label = @"Bloom Glare Detection Pass";
             //desc.vertexFunction = vert;
@@ -96,7 +123,14 @@ public:
             //desc.colorAttachments[0].pixelFormat = glareRT.pixel_format();
             _pipeline_state[2] = [_device newRenderPipelineStateWithDescriptor: desc error: &err];
             CheckPipelineError(_pipeline_state[2], err);
+            err = nil;
+            
+            desc.label = @"Bloom Upsample Pass";
+            desc.fragmentFunction = up_frag;
+            _pipeline_state[3] = [_device newRenderPipelineStateWithDescriptor: desc error: &err];
+            CheckPipelineError(_pipeline_state[3], err);
         }
+        _pipeline_glare_tiles = TileCompute::new_pipeline(_device, _defaultLibrary, @"bloom_glare_tile_kernel");
         
             
         //Render Pass Desc
@@ -104,44 +138,64 @@ public:
         {
             _render_pass_desc = [MTLRenderPassDescriptor renderPassDescriptor];
             auto color_attachment = _render_pass_desc.colorAttachments[0];
-            //color_attachment.texture = _rt_temp.texture();
-            color_attachment.loadAction = MTLLoadActionClear;
-            color_attachment.storeAction = MTLStoreActionStore;
+            // target and actions are bound by the frame graph
             color_attachment.clearColor = MTLClearColorMake(1, 0, 0, 1);
         }
         
         return true;
     }
     
-    void render(id <MTLCommandBuffer> commandBuffer, RenderTexture *src, RenderTexture *dst);
+    /**
+     * Declares glare detection, the pyramid and the combine pass, src in,
+     * the tone mapped color out at the size of src. The pyramid starts at
+     * half of scale times the window size: the glare target, N_PASSES - 1
+     * downsample passes, then as many upsample passes back up, each adding
+     * the level below to its own. When disabled the graph culls them and
+     * hands src on. Each pass goes into its batch's command buffer.
+     */
+    FrameGraph::Resource add_passes(FrameGraph & graph, const FrameGraphTargets & targets, const FrameCommandBuffers & commandBuffers,
+                                    FrameGraph::Resource src, bool enabled, float scale = 1.0f);
+    
+    // Glare detection runs as bloom_glare_tile_kernel from now on, the fragment pass again when nullptr.
+    // The pyramid and the combine pass stay fragment passes: they shade every texel anyway.
+    void setTileCompute(TileCompute* tiles) { _tile_compute = tiles; }
     
 private:
 
     static const int N_PASSES = 6;
     
-    void glareDetection(id <MTLCommandBuffer> commandBuffer, RenderTexture & src);
-    void blur(id <MTLCommandBuffer> commandBuffer, RenderTexture * src, RenderTexture * dst, glm::vec2 direction, int i, int j);
+    // into the attachment bound to desc, a copy of _render_pass_desc, at its size
+    void glareDetection(id <MTLCommandBuffer> commandBuffer, MTLRenderPassDescriptor* desc, id <MTLTexture> src) const;
+    void glareDetectionTiles(id <MTLCommandBuffer> commandBuffer, id <MTLTexture> src, id <MTLTexture> dst) const;
+    // into level i, from level i - 1
+    void downsample(id <MTLCommandBuffer> commandBuffer, MTLRenderPassDescriptor* desc, id <MTLTexture> src, int i) const;
+    // into the upsample target of level i, from its downsample and the upsample of level i + 1
+    void upsample(id <MTLCommandBuffer> commandBuffer, MTLRenderPassDescriptor* desc, id <MTLTexture> down, id <MTLTexture> up, int i) const;
     //void toneMap(RenderTexture * src, RenderTexture *dst);
-    void combine(id <MTLCommandBuffer> commandBuffer, RenderTexture * src, RenderTexture * dst);
+    void combine(id <MTLCommandBuffer> commandBuffer, MTLRenderPassDescriptor* desc, id <MTLTexture> src, id <MTLTexture> bloom) const;
     
     
     ToneMapOperator toneMapOperator;
     float exposure, burnout;
     float bloomThreshold, bloomWidth, bloomIntensity;
     float defocus;
+    int _width, _height;
     
-    RenderTexture glareRT;
-    RenderTexture tmpRT[N_PASSES][2];
-    
-    id <MTLRenderPipelineState> _pipeline_state[3];
+    id <MTLRenderPipelineState> _pipeline_state[4];     // downsample, combine (of toneMapOperator), glare, upsample
+    id <MTLRenderPipelineState> _pipeline_combine[TONEMAP_OPERATOR_COUNT + 1];  // [TONEMAP_OPERATOR_COUNT]: with the LUT
+    id <MTLTexture>             _tone_map_lut;
+    id <MTLComputePipelineState> _pipeline_glare_tiles;
+    TileCompute*                _tile_compute;
     MTLRenderPassDescriptor*    _render_pass_desc;
     
     id <MTLDepthStencilState>   _depth_state;
     
-    //id <MTLBuffer>              _constants_buffer;
-    id <MTLBuffer> _constants_buffer_glare;
-    id <MTLBuffer> _constants_buffer_blur[N_PASSES][2];
-    id <MTLBuffer> _constants_buffer_combine;
+    FrameConstants*                     _frame_constants;
+    AAPL::constant_bloom_pass_glare     _constants_glare;
+    // [i] for the pass into level i: level 0 is the glare target, the last level is not upsampled
+    AAPL::constant_bloom_pass_blur      _constants_down[N_PASSES];
+    AAPL::constant_bloom_pass_blur      _constants_up[N_PASSES];
+    AAPL::constant_bloom_pass_combine   _constants_combine;
 };
 
 
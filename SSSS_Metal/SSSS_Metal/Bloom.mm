@@ -1,6 +1,7 @@
 //#include <algorithm>
 #include <sstream>
 #include <cstdio>
+#include <cstring>
 
 #include <glm/glm.hpp>
 #include "Bloom.h"
@@ -8,6 +9,7 @@
 #include "AAPLSharedTypes.h"
 #include "Utilities.h"
 #include "Model.h"
+#include "PassConstants.h"
 
 using namespace std;
 
@@ -15,7 +17,7 @@ using glm::vec2;
 using glm::vec3;
 
 
-void Bloom::init(id<MTLDevice> device, ToneMapOperator toneMapOperator, float exposure, float bloomThreshold, float bloomWidth, float bloomIntensity, float defocus)
+void Bloom::init(FrameConstants* frame_constants, ToneMapOperator toneMapOperator, float exposure, float bloomThreshold, float bloomWidth, float bloomIntensity, float defocus)
 {
     
     this->toneMapOperator = toneMapOperator;
@@ -25,89 +27,170 @@ void Bloom::init(id<MTLDevice> device, ToneMapOperator toneMapOperator, float ex
     this->bloomWidth = bloomWidth;
     this->bloomIntensity = bloomIntensity;
     this->defocus = defocus;
+    _frame_constants = frame_constants;
     
-    int w = RenderContext::window_width;
-    int h = RenderContext::window_height;
-    resize(device, w, h);
-}
-
-void Bloom::resize(id<MTLDevice> device, int width, int height)
-{
-    glareRT.init(device, MTLPixelFormatRGBA8Unorm, width / 2, height / 2);
-    
-    int base = 2;
-    for (int i = 0; i < N_PASSES; i++)
-    {
-        _constants_buffer_blur[i][0] = [device newBufferWithLength:sizeof(AAPL::constant_bloom_pass_blur) options:0];
-        _constants_buffer_blur[i][1] = [device newBufferWithLength:sizeof(AAPL::constant_bloom_pass_blur) options:0];
-        //_constants_buffer_blur[i][0].label = @"bloom_pass_constant_buffer_combine";
-        //_constants_buffer_blur[i][1].label = @"bloom_pass_constant_buffer_combine";
-        
-        auto buffer = (AAPL::constant_bloom_pass_blur*)[_constants_buffer_blur[i][0] contents];
-        buffer->step = to_simd_type(vec2(1.0f / std::max(width / base, 1), 1.0f / std::max(height / base, 1)) * bloomWidth * vec2(1, 0));
-        
-        buffer = (AAPL::constant_bloom_pass_blur*)[_constants_buffer_blur[i][1] contents];
-        buffer->step = to_simd_type(vec2(1.0f / std::max(width / base, 1), 1.0f / std::max(height / base, 1)) * bloomWidth * vec2(0, 1));
-        
-        _constants_buffer_glare.label = @"bloom_pass_constant_buffer_glare";
-        
-        tmpRT[i][0].init(device, MTLPixelFormatRGBA8Unorm, std::max(width / base, 1), std::max(height / base, 1));
-        tmpRT[i][1].init(device, MTLPixelFormatRGBA8Unorm, std::max(width / base, 1), std::max(height / base, 1));
-        base *= 2;
-    }
+    memset(_constants_down, 0, sizeof(_constants_down));
+    memset(_constants_up, 0, sizeof(_constants_up));
+    for (int i = 1; i < N_PASSES; i++)
+        _constants_up[i - 1].weight = to_simd_type(PassConstants::bloom_up_weight(i - 1, N_PASSES));
     
     {
-        _constants_buffer_glare = [device newBufferWithLength:sizeof(AAPL::constant_bloom_pass_glare) options:0];
-        _constants_buffer_glare.label = @"bloom_pass_constant_buffer_glare";
-        auto buffer = (AAPL::constant_bloom_pass_glare*)[_constants_buffer_glare contents];
-        buffer->pixelSize = { 1.0f / (width / 2), 1.0f / (height / 2)};
+        auto buffer = &_constants_glare;
         buffer->bloomThreshold = this->bloomThreshold;
         buffer->exposure = this->exposure;
     }
     {
-        _constants_buffer_combine = [device newBufferWithLength:sizeof(AAPL::constant_bloom_pass_combine) options:0];
-        _constants_buffer_combine.label = @"bloom_pass_constant_buffer_combine";
-        auto buffer = (AAPL::constant_bloom_pass_combine*)[_constants_buffer_combine contents];
-        buffer->pixelSize = {1.0f / width, 1.0f / height};
+        auto buffer = &_constants_combine;
         buffer->exposure = this->exposure;
+        buffer->burnout = this->burnout;
         buffer->bloomIntensity = this->bloomIntensity;
         buffer->defocus = this->defocus;
     }
+    
+    _width = _height = 0;
+    resize(RenderContext::window_width, RenderContext::window_height);
+}
+
+void Bloom::setToneMapOperator(ToneMapOperator op)
+{
+    toneMapOperator = op;
+    if (_pipeline_combine[op] != nil && _tone_map_lut == nil)
+        _pipeline_state[1] = _pipeline_combine[op];
+}
+
+void Bloom::setToneMapLUT(id <MTLTexture> lut)
+{
+    _tone_map_lut = lut;
+    int pipeline = lut != nil ? TONEMAP_OPERATOR_COUNT : toneMapOperator;
+    if (_pipeline_combine[pipeline] != nil)
+        _pipeline_state[1] = _pipeline_combine[pipeline];
+}
+
+void Bloom::setExposure(float exposure)
+{
+    this->exposure = exposure;
+    _constants_glare.exposure = exposure;
+    _constants_combine.exposure = exposure;
+}
+
+void Bloom::setBurnout(float burnout)
+{
+    this->burnout = burnout;
+    _constants_combine.burnout = burnout;
 }
 
-void Bloom::render(id <MTLCommandBuffer> commandBuffer, RenderTexture *src, RenderTexture *dst)
+void Bloom::resize(int width, int height)
 {
-    if (bloomIntensity > 0.0f)
+    if (width == _width && height == _height)
+        return;
+    _width = width;
+    _height = height;
+    
+    for (int i = 1; i < N_PASSES; i++)
     {
-        glareDetection(commandBuffer, *src);
-        //glareRT.render_to_screen();
-        
-        RenderTexture* current = &glareRT;
-        for (int i = 0; i < N_PASSES; i++)
-        {
-            blur(commandBuffer, current, &tmpRT[i][0], vec2(1.0f, 0.0f), i, 0);		// horizontal
-            blur(commandBuffer, &tmpRT[i][0], &tmpRT[i][1], vec2(0.0, 1.0f), i, 1);	// vertical
-            
-            current = &tmpRT[i][1];
-        }
-        
-        combine(commandBuffer, src, dst);
+        _constants_down[i].step = to_simd_type(PassConstants::bloom_texel(width, height, i - 1));
+        _constants_up[i - 1].step = to_simd_type(PassConstants::bloom_texel(width, height, i) * bloomWidth);
     }
-    else
+    
+    _constants_glare.pixelSize = to_simd_type(PassConstants::bloom_glare_pixel_size(width, height));
+    _constants_combine.pixelSize = to_simd_type(PassConstants::pixel_size(width, height));
+    _constants_combine.step = to_simd_type(PassConstants::bloom_texel(width, height, 0) * bloomWidth);
+}
+
+FrameGraph::Resource Bloom::add_passes(FrameGraph & graph, const FrameGraphTargets & targets, const FrameCommandBuffers & commandBuffers,
+                                       FrameGraph::Resource src, bool enabled, float scale)
+{
+    if (enabled && bloomIntensity <= 0.0f)
     {
         //toneMap(src, dst);
         Debug::LogError("ERROR, no toneMap");
+        enabled = false;
+    }
+    
+    const FrameGraphTargets* t = &targets;
+    const FrameCommandBuffers* c = &commandBuffers;
+    // the filter steps stay those of the full size pyramid (resize()), so a
+    // smaller one covers the same part of the screen
+    FrameGraphTextureDesc desc = graph.resource(src).desc;
+    int width = DynamicResolution::scaled_size(RenderContext::window_width, scale);
+    int height = DynamicResolution::scaled_size(RenderContext::window_height, scale);
+    
+    FrameGraphTextureDesc glare_desc = { width / 2, height / 2, desc.format };
+    FrameGraph::Resource glare = graph.create("bloom glare", glare_desc);
+    const bool tiles = _tile_compute != nullptr;
+    FrameGraph::Pass pass = graph.add_pass("bloom glare", [=](const FrameGraph::PassInfo & info) {
+        if (tiles)
+        {
+            glareDetectionTiles(c->get(info), t->texture(src), t->texture(glare));
+            return;
+        }
+        // a copy per pass: the passes may be encoded on different threads
+        MTLRenderPassDescriptor* pass_desc = [_render_pass_desc copy];
+        t->bind(pass_desc.colorAttachments[0], info, glare);
+        glareDetection(c->get(info), pass_desc, t->texture(src));
+    }, enabled);
+    graph.read(pass, src);
+    if (tiles)
+        graph.write_storage(pass, glare);
+    else
+        graph.write(pass, glare);
+    
+    FrameGraph::Resource down[N_PASSES];
+    down[0] = glare;
+    int base = 4;
+    for (int i = 1; i < N_PASSES; i++)
+    {
+        FrameGraphTextureDesc level_desc = { std::max(width / base, 1), std::max(height / base, 1), desc.format };
+        FrameGraph::Resource from = down[i - 1];
+        FrameGraph::Resource to = down[i] = graph.create("bloom down " + std::to_string(i), level_desc);
+        pass = graph.add_pass("bloom down " + std::to_string(i), [=](const FrameGraph::PassInfo & info) {
+            MTLRenderPassDescriptor* pass_desc = [_render_pass_desc copy];
+            t->bind(pass_desc.colorAttachments[0], info, to);
+            downsample(c->get(info), pass_desc, t->texture(from), i);
+        }, enabled);
+        graph.read(pass, from);
+        graph.write(pass, to);
+        base *= 2;
+    }
+    
+    // the smallest level is its own upsample
+    FrameGraph::Resource up = down[N_PASSES - 1];
+    for (int i = N_PASSES - 2; i >= 0; i--)
+    {
+        FrameGraph::Resource level = down[i];
+        FrameGraph::Resource below = up;
+        FrameGraphTextureDesc level_desc = graph.resource(level).desc;
+        FrameGraph::Resource to = up = graph.create("bloom up " + std::to_string(i), level_desc);
+        pass = graph.add_pass("bloom up " + std::to_string(i), [=](const FrameGraph::PassInfo & info) {
+            MTLRenderPassDescriptor* pass_desc = [_render_pass_desc copy];
+            t->bind(pass_desc.colorAttachments[0], info, to);
+            upsample(c->get(info), pass_desc, t->texture(level), t->texture(below), i);
+        }, enabled);
+        graph.read(pass, level);
+        graph.read(pass, below);
+        graph.write(pass, to);
     }
+    
+    FrameGraph::Resource dst = graph.create("bloom", desc);
+    pass = graph.add_pass("bloom combine", [=](const FrameGraph::PassInfo & info) {
+        MTLRenderPassDescriptor* pass_desc = [_render_pass_desc copy];
+        t->bind(pass_desc.colorAttachments[0], info, dst);
+        combine(c->get(info), pass_desc, t->texture(src), t->texture(up));
+    }, enabled);
+    graph.read(pass, src);
+    graph.read(pass, up);
+    graph.write(pass, dst);
+    graph.bypass(pass, src, dst);
+    return dst;
 }
 
 
-void Bloom::glareDetection(id <MTLCommandBuffer> commandBuffer, RenderTexture & src)
+void Bloom::glareDetection(id <MTLCommandBuffer> commandBuffer, MTLRenderPassDescriptor* desc, id <MTLTexture> src) const
 {
-    int w = glareRT.width();
-    int h = glareRT.height();
+    int w = (int)desc.colorAttachments[0].texture.width;
+    int h = (int)desc.colorAttachments[0].texture.height;
     
-    _render_pass_desc.colorAttachments[0].texture = glareRT.texture();
-    auto encoder = [commandBuffer renderCommandEncoderWithDescriptor: _render_pass_desc];
+    auto encoder = [commandBuffer renderCommandEncoderWithDescriptor: desc];
     [encoder pushDebugGroup:@"BloomGlarePass"];
     encoder.label = @"bloom glare pass";
     
@@ -119,8 +202,8 @@ void Bloom::glareDetection(id <MTLCommandBuffer> commandBuffer, RenderTexture &
     [encoder setDepthStencilState: _depth_state];
     [encoder setRenderPipelineState: _pipeline_state[2]];
     [encoder setCullMode: MTLCullModeNone];
-    [encoder setFragmentBuffer: _constants_buffer_glare offset:0 atIndex:0];
-    [encoder setFragmentTexture: src.texture() atIndex:0];
+    _frame_constants->set_fragment(encoder, _constants_glare, 0);
+    [encoder setFragmentTexture: src atIndex:0];
     
     ModelManager::screen_aligned_quad.render(encoder);
     
@@ -128,27 +211,59 @@ void Bloom::glareDetection(id <MTLCommandBuffer> commandBuffer, RenderTexture &
     [encoder endEncoding];
 }
 
-void Bloom::blur(id <MTLCommandBuffer> commandBuffer, RenderTexture * src, RenderTexture * dst, glm::vec2 direction, int i, int j)
+void Bloom::glareDetectionTiles(id <MTLCommandBuffer> commandBuffer, id <MTLTexture> src, id <MTLTexture> dst) const
 {
-    int w = dst->width();
-    int h = dst->height();
+    auto encoder = [commandBuffer computeCommandEncoder];
+    [encoder pushDebugGroup:@"BloomGlareTiles"];
+    encoder.label = @"bloom glare tiles";
     
-    _render_pass_desc.colorAttachments[0].texture = dst->texture();
-    auto encoder = [commandBuffer renderCommandEncoderWithDescriptor: _render_pass_desc];
-    [encoder pushDebugGroup:@"BloomBlurPass"];
-    encoder.label = @"bloom blur pass";
+    [encoder setComputePipelineState: _pipeline_glare_tiles];
+    _frame_constants->set_compute(encoder, _constants_glare, 0);
+    [encoder setTexture: src atIndex:0];
+    _tile_compute->dispatch(encoder, AAPL::TileKernelBloomGlare, dst);
     
-//    vec2 pixelSize = vec2(1.0f / w, 1.0f / h);
-//    vec2 step = pixelSize * bloomWidth * direction;
-//    auto buffer = (AAPL::constant_bloom_pass*)[_constants_buffer contents];
-//    buffer->step = to_simd_type(step);
+    [encoder popDebugGroup];
+    [encoder endEncoding];
+}
+
+void Bloom::downsample(id <MTLCommandBuffer> commandBuffer, MTLRenderPassDescriptor* desc, id <MTLTexture> src, int i) const
+{
+    int w = (int)desc.colorAttachments[0].texture.width;
+    int h = (int)desc.colorAttachments[0].texture.height;
+    
+    auto encoder = [commandBuffer renderCommandEncoderWithDescriptor: desc];
+    [encoder pushDebugGroup:@"BloomDownPass"];
+    encoder.label = @"bloom down pass";
     
     [encoder setViewport: MTLViewport{0, 0, static_cast<double>(w), static_cast<double>(h)}];
     [encoder setDepthStencilState: _depth_state];
     [encoder setRenderPipelineState: _pipeline_state[0]];
     [encoder setCullMode: MTLCullModeNone];
-    [encoder setFragmentBuffer: _constants_buffer_blur[i][j] offset:0 atIndex:0];
-    [encoder setFragmentTexture: src->texture() atIndex:0];
+    _frame_constants->set_fragment(encoder, _constants_down[i], 0);
+    [encoder setFragmentTexture: src atIndex:0];
+    
+    ModelManager::screen_aligned_quad.render(encoder);
+    
+    [encoder popDebugGroup];
+    [encoder endEncoding];
+}
+
+void Bloom::upsample(id <MTLCommandBuffer> commandBuffer, MTLRenderPassDescriptor* desc, id <MTLTexture> down, id <MTLTexture> up, int i) const
+{
+    int w = (int)desc.colorAttachments[0].texture.width;
+    int h = (int)desc.colorAttachments[0].texture.height;
+    
+    auto encoder = [commandBuffer renderCommandEncoderWithDescriptor: desc];
+    [encoder pushDebugGroup:@"BloomUpPass"];
+    encoder.label = @"bloom up pass";
+    
+    [encoder setViewport: MTLViewport{0, 0, static_cast<double>(w), static_cast<double>(h)}];
+    [encoder setDepthStencilState: _depth_state];
+    [encoder setRenderPipelineState: _pipeline_state[3]];
+    [encoder setCullMode: MTLCullModeNone];
+    _frame_constants->set_fragment(encoder, _constants_up[i], 0);
+    [encoder setFragmentTexture: down atIndex:0];
+    [encoder setFragmentTexture: up atIndex:1];
     
     ModelManager::screen_aligned_quad.render(encoder);
     
@@ -156,13 +271,12 @@ void Bloom::blur(id <MTLCommandBuffer> commandBuffer, RenderTexture * src, Rende
     [encoder endEncoding];
 }
 
-void Bloom::combine(id <MTLCommandBuffer> commandBuffer, RenderTexture *src, RenderTexture *dst)
+void Bloom::combine(id <MTLCommandBuffer> commandBuffer, MTLRenderPassDescriptor* desc, id <MTLTexture> src, id <MTLTexture> bloom) const
 {
-    int w = RenderContext::window_width;
-    int h = RenderContext::window_height;
+    int w = (int)desc.colorAttachments[0].texture.width;
+    int h = (int)desc.colorAttachments[0].texture.height;
     
-    _render_pass_desc.colorAttachments[0].texture = dst->texture();
-    auto encoder = [commandBuffer renderCommandEncoderWithDescriptor: _render_pass_desc];
+    auto encoder = [commandBuffer renderCommandEncoderWithDescriptor: desc];
     [encoder pushDebugGroup:@"BloomCombinePass"];
     encoder.label = @"bloom combine pass";
     
@@ -174,11 +288,11 @@ void Bloom::combine(id <MTLCommandBuffer> commandBuffer, RenderTexture *src, Ren
     [encoder setDepthStencilState: _depth_state];
     [encoder setRenderPipelineState: _pipeline_state[1]];
     [encoder setCullMode: MTLCullModeNone];
-    [encoder setFragmentBuffer: _constants_buffer_combine offset:0 atIndex:0];
-    [encoder setFragmentTexture: src->texture() atIndex:0];
-    for (int i = 0; i < N_PASSES; i++) {
-        [encoder setFragmentTexture: tmpRT[i][1].texture() atIndex: i + 1];
-    }
+    _frame_constants->set_fragment(encoder, _constants_combine, 0);
+    [encoder setFragmentTexture: src atIndex:0];
+    [encoder setFragmentTexture: bloom atIndex:1];
+    if (_tone_map_lut != nil)
+        [encoder setFragmentTexture: _tone_map_lut atIndex:2];
     
     ModelManager::screen_aligned_quad.render(encoder);
     
@@ -0,0 +1,90 @@
+//
+//  CPUFrameGraph.cpp
+//  SSSS_Metal
+//
+
+#include "CPUFrameGraph.h"
+#include "RenderTargetPool.h"
+
+#include <algorithm>
+#include <cassert>
+#include <limits>
+
+void CPUFrameGraph::import(FrameGraph::Resource resource, CPUImage & image)
+{
+    if ((int)_imported.size() <= resource)
+        _imported.resize(resource + 1, nullptr);
+    _imported[resource] = &image;
+}
+
+CPUImage & CPUFrameGraph::image(FrameGraph::Resource resource)
+{
+    const FrameGraph::ResourceInfo & info = _graph->resource(_graph->resolve(resource));
+    if (info.imported)
+    {
+        assert(_graph->resolve(resource) < (int)_imported.size() && _imported[_graph->resolve(resource)]);
+        return *_imported[_graph->resolve(resource)];
+    }
+    assert(info.physical >= 0);
+    return _physical[info.physical];
+}
+
+void CPUFrameGraph::poison(CPUImage & image)
+{
+    if (_poison)
+        std::fill(image.data(), image.data() + (size_t)image.width() * image.height() * image.channels(),
+                  std::numeric_limits<float>::quiet_NaN());
+}
+
+void CPUFrameGraph::execute(const FrameGraph & graph)
+{
+    _graph = &graph;
+    const RenderTargetPool & pool = graph.pool();
+    _physical.resize(pool.target_count());
+    _descs.resize(pool.target_count());
+    for (int t = 0; t < pool.target_count(); t++)
+    {
+        if (!pool.live(t))
+        {
+            _physical[t] = CPUImage();
+            continue;
+        }
+        if (_physical[t].width() == 0 || !(_descs[t] == pool.desc(t)))
+        {
+            _descs[t] = pool.desc(t);
+            _physical[t].init(_descs[t].width, _descs[t].height, pixel_format(_descs[t].format));
+        }
+        poison(_physical[t]);
+    }
+    
+    for (FrameGraph::Pass p : graph.schedule())
+    {
+        const FrameGraph::PassInfo & pass = graph.pass(p);
+        for (const FrameGraph::Attachment & a : pass.writes)
+        {
+            if (a.load == FrameGraphLoadDontCare)
+                poison(image(a.resource));
+        }
+        pass.execute(pass);
+        for (const FrameGraph::Attachment & a : pass.writes)
+        {
+            if (a.store == FrameGraphStoreDontCare)
+                poison(image(a.resource));
+        }
+    }
+}
+
+CPUPixelFormat CPUFrameGraph::pixel_format(FrameGraphFormat format)
+{
+    switch (format)
+    {
+        case FrameGraphFormatR8Unorm:
+        case FrameGraphFormatStencil8:      return CPUPixelFormatR8Unorm;     // 1 where marked
+        case FrameGraphFormatR32Float:
+        case FrameGraphFormatDepth32Float:  return CPUPixelFormatR32Float;
+        case FrameGraphFormatRG32Float:     return CPUPixelFormatRG32Float;
+        case FrameGraphFormatRGBA16Float:   return CPUPixelFormatRGBA16Float;
+        case FrameGraphFormatRG11B10Float:  return CPUPixelFormatRG11B10Float;
+        default:                            return CPUPixelFormatRGBA8Unorm;
+    }
+}
@@ -0,0 +1,52 @@
+//
+//  CPUFrameGraph.h
+//  SSSS_Metal
+//
+//  Runs a compiled FrameGraph on CPUImages, one image per live target of
+//  the graph's RenderTargetPool, kept from frame to frame like the pool
+//  keeps its targets. Attachments the graph loads or stores as "don't
+//  care" are filled with NaNs, so a pass that relies on content the graph
+//  threw away (or on a target shared with another one) shows in its output.
+//
+
+#ifndef SSSS_Metal_CPUFrameGraph_h
+#define SSSS_Metal_CPUFrameGraph_h
+
+#include <vector>
+
+#include "CPUImage.h"
+#include "FrameGraph.h"
+
+class CPUFrameGraph
+{
+public:
+    explicit CPUFrameGraph(bool poison = true) : _graph(nullptr), _poison(poison) {}
+    
+    // Backs an imported resource, before execute().
+    void import(FrameGraph::Resource resource, CPUImage & image);
+    
+    /**
+     * Allocates the images of the pool targets that don't have one yet,
+     * frees the ones of dropped targets, then runs the live passes.
+     */
+    void execute(const FrameGraph & graph);
+    
+    // the image behind a resource, for the passes
+    CPUImage & image(FrameGraph::Resource resource);
+    
+    static CPUPixelFormat pixel_format(FrameGraphFormat format);
+
+private:
+    CPUFrameGraph(const CPUFrameGraph&);
+    CPUFrameGraph& operator=(const CPUFrameGraph&);
+    
+    void poison(CPUImage & image);
+    
+    const FrameGraph* _graph;
+    bool _poison;
+    std::vector<CPUImage> _physical;
+    std::vector<FrameGraphTextureDesc> _descs;
+    std::vector<CPUImage*> _imported;
+};
+
+#endif
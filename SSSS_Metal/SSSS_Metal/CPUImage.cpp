@@ -0,0 +1,116 @@
+//
+//  CPUImage.cpp
+//  SSSS_Metal
+//
+
+#include "CPUImage.h"
+
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+
+void CPUImage::init(int width, int height, CPUPixelFormat format)
+{
+    _width = width;
+    _height = height;
+    _format = format;
+    _channels = (format == CPUPixelFormatR8Unorm || format == CPUPixelFormatR32Float) ? 1 :
+                format == CPUPixelFormatRG32Float ? 2 : 4;
+    _data.resize((size_t)width * height * _channels);
+}
+
+static bool host_is_little_endian()
+{
+    const unsigned int one = 1;
+    return *(const unsigned char*)&one == 1;
+}
+
+static void swap_bytes(float* f, size_t n)
+{
+    for (size_t i = 0; i < n; i++)
+    {
+        unsigned char* b = (unsigned char*)&f[i];
+        std::swap(b[0], b[3]);
+        std::swap(b[1], b[2]);
+    }
+}
+
+bool CPUImage::load_pfm(const std::string & path, CPUPixelFormat format)
+{
+    FILE* fp = fopen(path.c_str(), "rb");
+    if (!fp)
+        return false;
+    
+    char magic[3] = {};
+    int w = 0, h = 0;
+    float scale = 0.0f;
+    if (fscanf(fp, "%2s %d %d %f", magic, &w, &h, &scale) != 4 || w <= 0 || h <= 0 ||
+        (strcmp(magic, "PF") != 0 && strcmp(magic, "Pf") != 0))
+    {
+        fclose(fp);
+        return false;
+    }
+    fgetc(fp); // single whitespace before the raster
+    
+    int src_channels = magic[1] == 'F' ? 3 : 1;
+    std::vector<float> raster((size_t)w * h * src_channels);
+    size_t read = fread(raster.data(), sizeof(float), raster.size(), fp);
+    fclose(fp);
+    if (read != raster.size())
+        return false;
+    if ((scale < 0.0f) != host_is_little_endian())
+        swap_bytes(raster.data(), raster.size());
+    
+    init(w, h, format);
+    // pfm rows go bottom to top
+    for (int y = 0; y < h; y++)
+    {
+        const float* row = &raster[(size_t)(h - 1 - y) * w * src_channels];
+        for (int x = 0; x < w; x++)
+        {
+            const float* p = row + x * src_channels;
+            glm::vec4 v = src_channels == 3 ? glm::vec4(p[0], p[1], p[2], 1.0f) : glm::vec4(p[0], p[0], p[0], 1.0f);
+            store(x, y, v);
+        }
+    }
+    return true;
+}
+
+bool CPUImage::save_pfm(const std::string & path) const
+{
+    FILE* fp = fopen(path.c_str(), "wb");
+    if (!fp)
+        return false;
+    
+    int dst_channels = _channels == 1 ? 1 : 3;
+    fprintf(fp, "%s\n%d %d\n%s\n", dst_channels == 3 ? "PF" : "Pf", _width, _height,
+            host_is_little_endian() ? "-1.0" : "1.0");
+    std::vector<float> row((size_t)_width * dst_channels);
+    for (int y = _height - 1; y >= 0; y--)
+    {
+        for (int x = 0; x < _width; x++)
+        {
+            glm::vec4 v = texel(x, y);
+            for (int c = 0; c < dst_channels; c++)
+                row[x * dst_channels + c] = v[c];
+        }
+        fwrite(row.data(), sizeof(float), row.size(), fp);
+    }
+    bool ok = ferror(fp) == 0;
+    fclose(fp);
+    return ok;
+}
+
+void CPUImage::set_alpha(const CPUImage & src, int channel)
+{
+    if (_channels != 4)
+        return;
+    for (int y = 0; y < _height; y++)
+    {
+        for (int x = 0; x < _width; x++)
+        {
+            float* p = &_data[((size_t)y * _width + x) * 4];
+            p[3] = quantize(src.texel(x, y)[channel], 3);
+        }
+    }
+}
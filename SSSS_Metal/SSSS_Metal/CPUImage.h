@@ -0,0 +1,136 @@
+//
+//  CPUImage.h
+//  SSSS_Metal
+//
+//  Float image used by the CPU reference path. Texels are stored as float
+//  but quantized on store() like the render target format they stand in
+//  for, and sampled with the same conventions as the shaders' samplers
+//  (normalized coordinates, clamp_to_edge).
+//
+//  Formats without alpha keep a fourth channel that always reads 1.
+//
+
+#ifndef SSSS_Metal_CPUImage_h
+#define SSSS_Metal_CPUImage_h
+
+#include <string>
+#include <vector>
+#include <glm/glm.hpp>
+
+#include "Half.h"
+
+enum CPUPixelFormat
+{
+    CPUPixelFormatRGBA8Unorm,
+    CPUPixelFormatR8Unorm,
+    CPUPixelFormatR32Float,
+    CPUPixelFormatRGBA32Float,
+    CPUPixelFormatRG32Float,
+    CPUPixelFormatRGBA16Float,
+    CPUPixelFormatRG11B10Float,
+};
+
+class CPUImage
+{
+public:
+    CPUImage() : _width(0), _height(0), _channels(4), _format(CPUPixelFormatRGBA32Float) {}
+    CPUImage(int width, int height, CPUPixelFormat format = CPUPixelFormatRGBA32Float) { init(width, height, format); }
+    
+    // (Re)allocates the image, keeps the storage if the size is unchanged.
+    void init(int width, int height, CPUPixelFormat format = CPUPixelFormatRGBA32Float);
+    
+    int width() const { return _width; }
+    int height() const { return _height; }
+    int channels() const { return _channels; }
+    CPUPixelFormat pixel_format() const { return _format; }
+    bool empty() const { return _data.empty(); }
+    
+    float* data() { return _data.data(); }
+    const float* data() const { return _data.data(); }
+    
+    // Single and two channel formats read as (r, 0, 0, 1) and (r, g, 0, 1), like Metal does.
+    glm::vec4 texel(int x, int y) const
+    {
+        x = x < 0 ? 0 : (x >= _width ? _width - 1 : x);
+        y = y < 0 ? 0 : (y >= _height ? _height - 1 : y);
+        const float* p = &_data[((size_t)y * _width + x) * _channels];
+        if (_channels == 1)
+            return glm::vec4(p[0], 0.0f, 0.0f, 1.0f);
+        if (_channels == 2)
+            return glm::vec4(p[0], p[1], 0.0f, 1.0f);
+        return glm::vec4(p[0], p[1], p[2], p[3]);
+    }
+    
+    void store(int x, int y, const glm::vec4 & v)
+    {
+        float* p = &_data[((size_t)y * _width + x) * _channels];
+        for (int c = 0; c < _channels; c++)
+            p[c] = quantize(v[c], c);
+    }
+    
+    // nearest filter, clamp_to_edge
+    glm::vec4 sample_point(const glm::vec2 & uv) const
+    {
+        return texel((int)floorf(uv.x * _width), (int)floorf(uv.y * _height));
+    }
+    
+    // linear filter, clamp_to_edge
+    glm::vec4 sample_linear(const glm::vec2 & uv) const
+    {
+        float fx = uv.x * _width - 0.5f;
+        float fy = uv.y * _height - 0.5f;
+        float x0 = floorf(fx);
+        float y0 = floorf(fy);
+        float tx = fx - x0;
+        float ty = fy - y0;
+        int ix = (int)x0, iy = (int)y0;
+        glm::vec4 a = glm::mix(texel(ix, iy),     texel(ix + 1, iy),     tx);
+        glm::vec4 b = glm::mix(texel(ix, iy + 1), texel(ix + 1, iy + 1), tx);
+        return glm::mix(a, b, ty);
+    }
+    
+    // uv of the center of texel (x, y)
+    glm::vec2 texel_center(int x, int y) const
+    {
+        return glm::vec2((x + 0.5f) / _width, (y + 0.5f) / _height);
+    }
+    
+    // v in channel of a texel of this format
+    float quantize(float v, int channel = 0) const
+    {
+        switch (_format)
+        {
+            case CPUPixelFormatRGBA8Unorm:
+            case CPUPixelFormatR8Unorm:
+                v = v < 0.0f ? 0.0f : (v > 1.0f ? 1.0f : v);
+                return floorf(v * 255.0f + 0.5f) / 255.0f;
+            case CPUPixelFormatRGBA16Float:
+                return quantize_half(v);
+            case CPUPixelFormatRG11B10Float:
+                return channel == 3 ? 1.0f : quantize_unsigned_float(v, channel == 2 ? 5 : 6);
+            default:
+                return v;
+        }
+    }
+    
+    bool has_alpha() const { return _channels == 4 && _format != CPUPixelFormatRG11B10Float; }
+    
+    /**
+     * Portable float maps (.pfm): "PF" is RGB, "Pf" is a single channel.
+     * Loading an RGB map into a 4 channel format sets alpha to 1.
+     */
+    bool load_pfm(const std::string & path, CPUPixelFormat format);
+    bool save_pfm(const std::string & path) const;
+    
+    // Copies channel `channel` of src into the alpha channel of this image.
+    void set_alpha(const CPUImage & src, int channel = 0);
+    
+private:
+    int _width;
+    int _height;
+    int _channels;
+    CPUPixelFormat _format;
+    std::vector<float> _data;
+};
+
+#endif
@@ -0,0 +1,613 @@
+//
+//  CPUPostProcess.cpp
+//  SSSS_Metal
+//
+
+#include "CPUPostProcess.h"
+#include "DynamicResolution.h"
+#include "PassConstants.h"
+#include "SSSSBlurSIMD.h"
+
+#include <algorithm>
+#include <cmath>
+#include <string>
+
+using glm::vec2;
+using glm::vec3;
+using glm::vec4;
+
+static float saturate(float x)
+{
+    return std::min(std::max(x, 0.0f), 1.0f);
+}
+
+CPUPostProcess::Settings::Settings() :
+    color_format(FrameGraphFormatRGBA8Unorm),
+    ssss_enabled(true),
+    fovy(20.0f),
+    sss_width(0.012f),
+    sss_samples(11),
+    sss_strength(0.48f, 0.41f, 0.28f),
+    sss_falloff(1.0f, 0.37f, 0.3f),
+    sss_follow_surface(false),
+    sss_simd(true),
+    sss_mask(true),
+    bloom_enabled(true),
+    tone_map(TONEMAP_FILMIC),
+    exposure(2.0f),
+    burnout(INFINITY),
+    tone_map_lut(ToneMapLUT::DEFAULT_SIZE),
+    bloom_threshold(0.63f),
+    bloom_width(1.0f),
+    bloom_intensity(1.0f),
+    defocus(0.2f),
+    dof_enabled(true),
+    focus_distance(0.66f),
+    focus_range(powf(0.76f, 5.0f)),
+    focus_falloff(15.0f, 15.0f),
+    dof_blur_width(2.5f),
+    tiled(false),
+    ssss_scale(1.0f),
+    bloom_scale(1.0f),
+    dof_scale(1.0f)
+{
+}
+
+void CPUPostProcess::set_settings(const Settings & settings)
+{
+    _settings = settings;
+    if (uses_tone_map_lut())
+        _tone_map_lut.bake(_pool, settings.tone_map_lut, settings.tone_map, settings.exposure, settings.burnout, settings.grade);
+}
+
+void CPUPostProcess::render(const CPUImage & color, const CPUImage & depth, CPUImage & output)
+{
+    int w = color.width();
+    int h = color.height();
+    
+    // _stage[0] plays _rt_main, _stage[1] plays _rt_temp
+    main_pass(color, depth, _settings.color_format, _stage[0], _scene_depth);
+    _stage[1].init(w, h, _stage[0].pixel_format());
+    
+    if (_settings.ssss_enabled)
+        ssss(_stage[0], _scene_depth);
+    
+    CPUImage* current = &_stage[0];
+    if (_settings.bloom_enabled)
+    {
+        bloom(*current, _stage[1]);
+        current = &_stage[1];
+    }
+    if (_settings.dof_enabled)
+    {
+        dof(*current, _stage[0], _scene_depth);
+        current = &_stage[0];
+    }
+    output = *current;
+}
+
+FrameGraphFormat CPUPostProcess::depth_format(FrameGraphFormat color_format)
+{
+    return FrameGraphTextureDesc::has_alpha(color_format) ? FrameGraphFormatR32Float : FrameGraphFormatRG32Float;
+}
+
+void CPUPostProcess::main_pass(const CPUImage & color, const CPUImage & depth, FrameGraphFormat color_format,
+                               CPUImage & scene, CPUImage & scene_depth)
+{
+    int w = color.width();
+    int h = color.height();
+    scene.init(w, h, CPUFrameGraph::pixel_format(color_format));
+    scene_depth.init(w, h, CPUFrameGraph::pixel_format(depth_format(color_format)));
+    for (int y = 0; y < h; y++)
+    {
+        for (int x = 0; x < w; x++)
+        {
+            vec4 c = color.texel(x, y);
+            scene.store(x, y, c);
+            scene_depth.store(x, y, vec4(depth.texel(x, y).x, c.w, 0.0f, 1.0f));    // out.depth
+        }
+    }
+}
+
+FrameGraph::Resource CPUPostProcess::add_passes(FrameGraph & graph, CPUFrameGraph & images,
+                                                FrameGraph::Resource color, FrameGraph::Resource depth)
+{
+    typedef FrameGraph::Resource Resource;
+    typedef FrameGraph::Pass Pass;
+    typedef FrameGraph::PassInfo PassInfo;
+    const Settings & s = _settings;
+    CPUFrameGraph* im = &images;
+    const int width = graph.resource(color).desc.width;
+    const int height = graph.resource(color).desc.height;
+    // filter steps are those of the full size, whatever size a pass runs at
+    const vec2 pixel_size = PassConstants::pixel_size(width, height);
+    // the tiled passes are kernels writing their target
+    auto write_target = [&](Pass pass, Resource r) {
+        if (s.tiled)
+            graph.write_storage(pass, r);
+        else
+            graph.write(pass, r);
+    };
+    
+    // SeparableSSS
+    const FrameGraphTextureDesc ssss_desc(DynamicResolution::scaled_size(width, s.ssss_scale),
+                                          DynamicResolution::scaled_size(height, s.ssss_scale), s.color_format);
+    // SSSSBlurSIMD maps texels one to one, and takes the strength from alpha
+    const bool ssss_simd = s.sss_simd && s.ssss_scale == 1.0f && !s.tiled && s.color_format == FrameGraphFormatRGBA8Unorm;
+    Resource ssss_temp = graph.create("ssss temp", ssss_desc);
+    Resource ssss_out = graph.create("ssss", ssss_desc);
+    Resource stencil = -1;
+    if (s.sss_mask && !s.tiled)
+        stencil = graph.create("ssss stencil", { ssss_desc.width, ssss_desc.height, FrameGraphFormatStencil8 });
+    Pass p = graph.add_pass("ssss horizontal", [=](const PassInfo&) {
+        _kernel.update(s.sss_samples, s.sss_strength, s.sss_falloff);
+        CPUImage* mask = stencil >= 0 ? &im->image(stencil) : nullptr;
+        if (ssss_simd)
+            ssss_pass_simd(im->image(color), im->image(ssss_temp), im->image(depth), false, mask, true);
+        else
+            ssss_pass(im->image(color), im->image(ssss_temp), im->image(depth), PassConstants::ssss_direction(width, height, false),
+                      mask, true);
+    }, s.ssss_enabled);
+    graph.read(p, color);
+    graph.read(p, depth);
+    write_target(p, ssss_temp);
+    if (stencil >= 0)
+        graph.write(p, stencil, FrameGraphLoadClear);
+    p = graph.add_pass("ssss vertical", [=](const PassInfo&) {
+        CPUImage* mask = stencil >= 0 ? &im->image(stencil) : nullptr;
+        if (ssss_simd)
+            ssss_pass_simd(im->image(ssss_temp), im->image(ssss_out), im->image(depth), true, mask, false);
+        else
+            ssss_pass(im->image(ssss_temp), im->image(ssss_out), im->image(depth), PassConstants::ssss_direction(width, height, true),
+                      mask, false);
+    }, s.ssss_enabled);
+    graph.read(p, ssss_temp);
+    graph.read(p, depth);
+    write_target(p, ssss_out);
+    if (stencil >= 0)
+        graph.write(p, stencil, FrameGraphLoadLoad);
+    graph.bypass(p, color, ssss_out);
+    
+    // Bloom
+    const int bloom_width = DynamicResolution::scaled_size(width, s.bloom_scale);
+    const int bloom_height = DynamicResolution::scaled_size(height, s.bloom_scale);
+    const FrameGraphTextureDesc half = { bloom_width / 2, bloom_height / 2, s.color_format };
+    Resource glare = graph.create("bloom glare", half);
+    p = graph.add_pass("bloom glare", [=](const PassInfo&) {
+        bloom_glare(im->image(ssss_out), im->image(glare), PassConstants::bloom_glare_pixel_size(width, height));
+    }, s.bloom_enabled);
+    graph.read(p, ssss_out);
+    write_target(p, glare);
+    
+    Resource down[BLOOM_N_PASSES];
+    down[0] = glare;
+    for (int i = 1; i < BLOOM_N_PASSES; i++)
+    {
+        const int base = 2 << i;
+        const FrameGraphTextureDesc desc = { std::max(bloom_width / base, 1), std::max(bloom_height / base, 1), s.color_format };
+        const vec2 texel = PassConstants::bloom_texel(width, height, i - 1);
+        Resource from = down[i - 1];
+        Resource to = down[i] = graph.create("bloom down " + std::to_string(i), desc);
+        p = graph.add_pass("bloom down " + std::to_string(i), [=](const PassInfo&) {
+            bloom_down(im->image(from), im->image(to), texel);
+        }, s.bloom_enabled);
+        graph.read(p, from);
+        graph.write(p, to);
+    }
+    
+    Resource up = down[BLOOM_N_PASSES - 1];
+    for (int i = BLOOM_N_PASSES - 2; i >= 0; i--)
+    {
+        const vec2 step = PassConstants::bloom_texel(width, height, i + 1) * s.bloom_width;
+        const vec2 weight = PassConstants::bloom_up_weight(i, BLOOM_N_PASSES);
+        const FrameGraphTextureDesc desc = graph.resource(down[i]).desc;
+        Resource level = down[i];
+        Resource below = up;
+        Resource to = up = graph.create("bloom up " + std::to_string(i), desc);
+        p = graph.add_pass("bloom up " + std::to_string(i), [=](const PassInfo&) {
+            bloom_up(im->image(level), im->image(below), im->image(to), step, weight);
+        }, s.bloom_enabled);
+        graph.read(p, level);
+        graph.read(p, below);
+        graph.write(p, to);
+    }
+    
+    Resource bloom_out = graph.create("bloom", ssss_desc);
+    const vec2 bloom_step = PassConstants::bloom_texel(width, height, 0) * s.bloom_width;
+    p = graph.add_pass("bloom combine", [=](const PassInfo&) {
+        bloom_combine(im->image(ssss_out), im->image(up), im->image(bloom_out), pixel_size, bloom_step);
+    }, s.bloom_enabled);
+    graph.read(p, ssss_out);
+    graph.read(p, up);
+    graph.write(p, bloom_out);
+    graph.bypass(p, ssss_out, bloom_out);
+    
+    // DepthOfField
+    const FrameGraphTextureDesc dof_desc(DynamicResolution::scaled_size(width, s.dof_scale),
+                                         DynamicResolution::scaled_size(height, s.dof_scale), s.color_format);
+    const FrameGraphTextureDesc coc_desc = { dof_desc.width, dof_desc.height, FrameGraphFormatR8Unorm };
+    const vec2 step_h = PassConstants::dof_step(width, height, s.dof_blur_width, false);
+    const vec2 step_v = PassConstants::dof_step(width, height, s.dof_blur_width, true);
+    Resource coc = graph.create("dof coc", coc_desc);
+    Resource dof_temp = graph.create("dof temp", dof_desc);
+    Resource dof_out = graph.create("dof", dof_desc);
+    p = graph.add_pass("dof coc", [=](const PassInfo&) {
+        dof_coc(im->image(depth), im->image(coc));
+    }, s.dof_enabled);
+    graph.read(p, depth);
+    graph.write(p, coc);
+    p = graph.add_pass("dof horizontal", [=](const PassInfo&) {
+        dof_blur(im->image(bloom_out), im->image(coc), im->image(dof_temp), step_h);
+    }, s.dof_enabled);
+    graph.read(p, bloom_out);
+    graph.read(p, coc);
+    write_target(p, dof_temp);
+    p = graph.add_pass("dof vertical", [=](const PassInfo&) {
+        dof_blur(im->image(dof_temp), im->image(coc), im->image(dof_out), step_v);
+    }, s.dof_enabled);
+    graph.read(p, dof_temp);
+    graph.read(p, coc);
+    write_target(p, dof_out);
+    graph.bypass(p, bloom_out, dof_out);
+    return dof_out;
+}
+
+// SeparableSSS
+//******************************************************************
+void CPUPostProcess::ssss(CPUImage & color, const CPUImage & depth)
+{
+    _kernel.update(_settings.sss_samples, _settings.sss_strength, _settings.sss_falloff);
+    _ssss_temp.init(color.width(), color.height(), color.pixel_format());
+    CPUImage* mask = nullptr;
+    if (_settings.sss_mask && !_settings.tiled)
+    {
+        _ssss_stencil.init(color.width(), color.height(), CPUPixelFormatR8Unorm);
+        mask = &_ssss_stencil;
+    }
+    if (_settings.sss_simd && !_settings.tiled && color.pixel_format() == CPUPixelFormatRGBA8Unorm)
+    {
+        ssss_pass_simd(color, _ssss_temp, depth, false, mask, true);
+        ssss_pass_simd(_ssss_temp, color, depth, true, mask, false);
+    }
+    else
+    {
+        ssss_pass(color, _ssss_temp, depth, PassConstants::ssss_direction(color.width(), color.height(), false), mask, true);
+        ssss_pass(_ssss_temp, color, depth, PassConstants::ssss_direction(color.width(), color.height(), true), mask, false);
+    }
+}
+
+void CPUPostProcess::mark_skin(const CPUImage & src, const CPUImage & depth, CPUImage & stencil)
+{
+    if (src.has_alpha() && stencil.channels() == 1 && src.width() == stencil.width() && src.height() == stencil.height())
+    {
+        // texel for texel, the strength is src's alpha: no sampling
+        const int width = stencil.width();
+        _pool.parallel_for_tiles(width, stencil.height(), TILE_SIZE, [&](int x0, int y0, int x1, int y1)
+        {
+            for (int y = y0; y < y1; y++)
+            {
+                const float* alpha = src.data() + ((size_t)y * width + x0) * 4 + 3;
+                float* mark = stencil.data() + (size_t)y * width;
+                for (int x = x0; x < x1; x++, alpha += 4)
+                    mark[x] = *alpha != 0.0f ? 1.0f : 0.0f;
+            }
+        });
+    }
+    else
+    {
+        run_pass(stencil, [&](vec2 texcoord)
+        {
+            return vec4(TileClassifier::strength(src, depth, texcoord) != 0.0f ? 1.0f : 0.0f);
+        });
+    }
+    size_t skipped = 0;
+    const size_t count = (size_t)stencil.width() * stencil.height();
+    for (size_t i = 0; i < count; i++)
+        skipped += stencil.data()[i] == 0.0f ? 1 : 0;
+    _ssss_skipped = count ? (float)skipped / count : 0.0f;
+}
+
+static float distance_to_projection_window(float fovy)
+{
+    return 1.0f / tanf(0.5f * fovy * 3.1415926536f / 180.0f);
+}
+
+void CPUPostProcess::ssss_pass_simd(const CPUImage & src, CPUImage & dst, const CPUImage & depth, bool vertical,
+                                    CPUImage* stencil, bool mark)
+{
+    if (stencil && mark)
+        mark_skin(src, depth, *stencil);
+    
+    SSSSBlurSIMD::Params params;
+    params.kernel = _kernel.samples().data();
+    params.n_samples = _kernel.size();
+    params.sss_width = _settings.sss_width;
+    params.distance_to_projection_window = distance_to_projection_window(_settings.fovy);
+    params.follow_surface = _settings.sss_follow_surface;
+    params.stencil = stencil ? stencil->data() : nullptr;
+    
+    int height = dst.height();
+    int bands = (height + TILE_SIZE - 1) / TILE_SIZE;
+    _pool.parallel_for(bands, [&](int i)
+    {
+        int y0 = i * TILE_SIZE;
+        SSSSBlurSIMD::blur(src, dst, depth, vertical, params, y0, std::min(y0 + TILE_SIZE, height));
+    });
+}
+
+void CPUPostProcess::ssss_pass(const CPUImage & src, CPUImage & dst, const CPUImage & depth, vec2 dir,
+                               CPUImage* stencil, bool mark)
+{
+    if (_settings.tiled)
+    {
+        // ssss_tile_kernel: no strength in the tile, or on the texel, is a copy
+        _classes.classify_ssss(dst.width(), dst.height(), src, depth);
+        run_tiles(dir.y != 0.0f ? "ssss vertical" : "ssss horizontal", dst, TileClassifier::TileSkin, true, [&](vec2 texcoord)
+        {
+            if (TileClassifier::strength(src, depth, texcoord) == 0.0f)
+                return src.sample_point(texcoord);
+            return ssss_texel(src, depth, texcoord, dir);
+        }, [&](vec2 texcoord)
+        {
+            return src.sample_point(texcoord);
+        });
+        return;
+    }
+    
+    if (stencil && mark)
+        mark_skin(src, depth, *stencil);
+    run_pass(dst, [&](vec2 texcoord)
+    {
+        if (stencil && stencil->sample_point(texcoord).x == 0.0f)
+            return src.sample_point(texcoord);     // ssss_copy_frag
+        return ssss_texel(src, depth, texcoord, dir);
+    });
+}
+
+vec4 CPUPostProcess::ssss_texel(const CPUImage & src, const CPUImage & depth, vec2 texcoord, vec2 dir) const
+{
+    const std::vector<vec4>& kernel = _kernel.samples();
+    const int n_samples = _kernel.size();
+    const float distanceToProjectionWindow = distance_to_projection_window(_settings.fovy);
+    const float sssWidth = _settings.sss_width;
+    
+    vec4 colorM = src.sample_point(texcoord);
+    float depthM = 1.0f / depth.sample_point(texcoord).x;
+    float scale = distanceToProjectionWindow / depthM;
+    
+    vec2 finalStep = sssWidth * scale * dir;
+    finalStep *= TileClassifier::strength(src, depth, texcoord);
+    finalStep *= 1.0f / 3.0f;
+    
+    vec4 colorBlurred = colorM;
+    vec3 rgb = vec3(colorM) * vec3(kernel[0]);
+    for (int i = 1; i < n_samples; i++)
+    {
+        vec2 offset = texcoord + kernel[i].w * finalStep;
+        vec4 color = src.sample_linear(offset);
+        
+        if (_settings.sss_follow_surface)
+        {
+            // If the difference in depth is huge, we lerp color back to "colorM":
+            float depth_tap = 1.0f / depth.sample_linear(offset).x;
+            float s = saturate(300.0f * distanceToProjectionWindow * sssWidth * fabsf(depthM - depth_tap));
+            color = glm::mix(color, colorM, s);
+        }
+        
+        rgb += vec3(kernel[i]) * vec3(color);
+    }
+    colorBlurred.x = rgb.x;
+    colorBlurred.y = rgb.y;
+    colorBlurred.z = rgb.z;
+    return colorBlurred;
+}
+
+// Bloom
+//******************************************************************
+void CPUPostProcess::bloom(const CPUImage & src, CPUImage & dst)
+{
+    int width = src.width();
+    int height = src.height();
+    
+    // glare detection, at half resolution
+    _glare.init(width / 2, height / 2, src.pixel_format());
+    bloom_glare(src, _glare, PassConstants::bloom_glare_pixel_size(width, height));
+    
+    // pyramid: downsample from the glare target, then blend back up
+    const CPUImage* down[BLOOM_N_PASSES];
+    down[0] = &_glare;
+    for (int i = 1; i < BLOOM_N_PASSES; i++)
+    {
+        int base = 2 << i;
+        _bloom_down[i].init(std::max(width / base, 1), std::max(height / base, 1), src.pixel_format());
+        bloom_down(*down[i - 1], _bloom_down[i], PassConstants::bloom_texel(width, height, i - 1));
+        down[i] = &_bloom_down[i];
+    }
+    const CPUImage* up = down[BLOOM_N_PASSES - 1];
+    for (int i = BLOOM_N_PASSES - 2; i >= 0; i--)
+    {
+        _bloom_up[i].init(down[i]->width(), down[i]->height(), src.pixel_format());
+        bloom_up(*down[i], *up, _bloom_up[i], PassConstants::bloom_texel(width, height, i + 1) * _settings.bloom_width,
+                 PassConstants::bloom_up_weight(i, BLOOM_N_PASSES));
+        up = &_bloom_up[i];
+    }
+    
+    // combine + tone map
+    dst.init(width, height, src.pixel_format());
+    bloom_combine(src, *up, dst, PassConstants::pixel_size(width, height),
+                  PassConstants::bloom_texel(width, height, 0) * _settings.bloom_width);
+}
+
+static const vec2 glare_offsets[] = { vec2(0.0f, 0.0f), vec2(-1.0f, 0.0f), vec2(1.0f, 0.0f), vec2(0.0f, -1.0f), vec2(0.0f, 1.0f) };
+
+void CPUPostProcess::bloom_glare(const CPUImage & src, CPUImage & dst, vec2 pixelSize)
+{
+    if (_settings.tiled)
+    {
+        // bloom_glare_tile_kernel: out of bright tiles only the alpha is left
+        _classes.classify_glare(dst.width(), dst.height(), src, _settings.exposure, _settings.bloom_threshold);
+        run_tiles("bloom glare", dst, TileClassifier::TileBright, true, [&](vec2 uv)
+        {
+            return glare_texel(src, uv, pixelSize);
+        }, [&](vec2 uv)
+        {
+            float alpha = src.sample_point(uv).w;
+            for (int i = 1; i < 5; i++)
+                alpha = std::min(src.sample_point(uv + glare_offsets[i] * pixelSize).w, alpha);
+            return vec4(0.0f, 0.0f, 0.0f, alpha);
+        });
+        return;
+    }
+    run_pass(dst, [&](vec2 uv)
+    {
+        return glare_texel(src, uv, pixelSize);
+    });
+}
+
+vec4 CPUPostProcess::glare_texel(const CPUImage & src, vec2 uv, vec2 pixelSize) const
+{
+    const Settings & s = _settings;
+    vec4 color = src.sample_point(uv + glare_offsets[0] * pixelSize);
+    for (int i = 1; i < 5; i++)
+        color = glm::min(src.sample_point(uv + glare_offsets[i] * pixelSize), color);
+    vec3 rgb = vec3(color) * s.exposure;
+    rgb = glm::max(rgb - s.bloom_threshold / (1.0f - s.bloom_threshold), 0.0f);
+    return vec4(rgb, color.w);
+}
+
+// BloomTent
+static vec4 bloom_tent(const CPUImage & src, vec2 uv, vec2 step)
+{
+    vec4 color = 4.0f * src.sample_linear(uv);
+    color += 2.0f * src.sample_linear(uv + step * vec2(-1.0f,  0.0f));
+    color += 2.0f * src.sample_linear(uv + step * vec2( 1.0f,  0.0f));
+    color += 2.0f * src.sample_linear(uv + step * vec2( 0.0f, -1.0f));
+    color += 2.0f * src.sample_linear(uv + step * vec2( 0.0f,  1.0f));
+    color += src.sample_linear(uv + step * vec2(-1.0f, -1.0f));
+    color += src.sample_linear(uv + step * vec2( 1.0f, -1.0f));
+    color += src.sample_linear(uv + step * vec2(-1.0f,  1.0f));
+    color += src.sample_linear(uv + step * vec2( 1.0f,  1.0f));
+    return color / 16.0f;
+}
+
+void CPUPostProcess::bloom_combine(const CPUImage & src, const CPUImage & bloom, CPUImage & dst, vec2 pixel_size, vec2 step)
+{
+    const Settings & s = _settings;
+    const vec2 width_step = pixel_size * s.defocus;
+    const bool lut = uses_tone_map_lut();
+    run_pass(dst, [&](vec2 uv)
+    {
+        // PyramidFilter
+        vec4 color = src.sample_point(uv + vec2( 0.5f,  0.5f) * width_step);
+        color += src.sample_point(uv + vec2(-0.5f,  0.5f) * width_step);
+        color += src.sample_point(uv + vec2( 0.5f, -0.5f) * width_step);
+        color += src.sample_point(uv + vec2(-0.5f, -0.5f) * width_step);
+        color *= 0.25f;
+        
+        vec4 sample = bloom_tent(bloom, uv, step);
+        vec3 rgb = vec3(color) + s.bloom_intensity * 126.0f * vec3(sample) / 127.0f;
+        rgb = lut ? _tone_map_lut.sample(rgb) : ToneMap::apply(s.tone_map, rgb, s.exposure, s.burnout);
+        return vec4(rgb, color.w + sample.w);
+    });
+}
+
+void CPUPostProcess::bloom_down(const CPUImage & src, CPUImage & dst, vec2 t)
+{
+    run_pass(dst, [&](vec2 uv)
+    {
+        vec4 a = src.sample_linear(uv + t * vec2(-2.0f, -2.0f));
+        vec4 b = src.sample_linear(uv + t * vec2( 0.0f, -2.0f));
+        vec4 c = src.sample_linear(uv + t * vec2( 2.0f, -2.0f));
+        vec4 d = src.sample_linear(uv + t * vec2(-2.0f,  0.0f));
+        vec4 e = src.sample_linear(uv);
+        vec4 f = src.sample_linear(uv + t * vec2( 2.0f,  0.0f));
+        vec4 g = src.sample_linear(uv + t * vec2(-2.0f,  2.0f));
+        vec4 h = src.sample_linear(uv + t * vec2( 0.0f,  2.0f));
+        vec4 i = src.sample_linear(uv + t * vec2( 2.0f,  2.0f));
+        vec4 j = src.sample_linear(uv + t * vec2(-1.0f, -1.0f));
+        vec4 k = src.sample_linear(uv + t * vec2( 1.0f, -1.0f));
+        vec4 l = src.sample_linear(uv + t * vec2(-1.0f,  1.0f));
+        vec4 m = src.sample_linear(uv + t * vec2( 1.0f,  1.0f));
+        return e * 0.125f + (a + c + g + i) * 0.03125f + (b + d + f + h) * 0.0625f + (j + k + l + m) * 0.125f;
+    });
+}
+
+void CPUPostProcess::bloom_up(const CPUImage & down, const CPUImage & up, CPUImage & dst, vec2 step, vec2 weight)
+{
+    run_pass(dst, [&](vec2 uv)
+    {
+        return glm::mix(down.sample_point(uv), bloom_tent(up, uv, step), vec4(weight.x, weight.x, weight.x, weight.y));
+    });
+}
+
+// DepthOfField
+//******************************************************************
+void CPUPostProcess::dof(const CPUImage & src, CPUImage & dst, const CPUImage & depth)
+{
+    int w = src.width();
+    int h = src.height();
+    
+    _coc.init(w, h, CPUPixelFormatR8Unorm);
+    dof_coc(depth, _coc);
+    
+    _dof_temp.init(w, h, src.pixel_format());
+    dst.init(w, h, src.pixel_format());
+    dof_blur(src, _coc, _dof_temp, PassConstants::dof_step(w, h, _settings.dof_blur_width, false));
+    dof_blur(_dof_temp, _coc, dst, PassConstants::dof_step(w, h, _settings.dof_blur_width, true));
+}
+
+void CPUPostProcess::dof_coc(const CPUImage & depth, CPUImage & coc)
+{
+    const Settings & s = _settings;
+    run_pass(coc, [&](vec2 uv)
+    {
+        float d = 1.0f / depth.sample_point(uv).x;
+        float dist = fabsf(d - s.focus_distance) - s.focus_range / 2.0f;
+        float c = 0.0f;
+        if (dist > 0.0f)
+        {
+            float t = saturate(dist);
+            c = d - s.focus_distance > 0.0f ? saturate(t * s.focus_falloff.x) : saturate(t * s.focus_falloff.y);
+        }
+        return vec4(c, 0.0f, 0.0f, 1.0f);
+    });
+}
+
+void CPUPostProcess::dof_blur(const CPUImage & src, const CPUImage & coc, CPUImage & dst, vec2 step)
+{
+    if (_settings.tiled)
+    {
+        // dof_tile_kernel: with a CoC of 0 every tap lands on the texel itself
+        _classes.classify_dof(coc);
+        run_tiles(step.y != 0.0f ? "dof vertical" : "dof horizontal", dst, TileClassifier::TileInFocus, false, [&](vec2 uv)
+        {
+            return dof_texel(src, coc, uv, step);
+        }, [&](vec2 uv)
+        {
+            return src.sample_linear(uv);
+        });
+        return;
+    }
+    run_pass(dst, [&](vec2 uv)
+    {
+        return dof_texel(src, coc, uv, step);
+    });
+}
+
+vec4 CPUPostProcess::dof_texel(const CPUImage & src, const CPUImage & coc, vec2 uv, vec2 step) const
+{
+    const float offsets[] = { -1.282f, -0.524f, 0.524f, 1.282f };
+    float CoC = coc.sample_linear(uv).x;
+    vec4 color = src.sample_linear(uv);
+    float sum = 1.0f;
+    for (int i = 0; i < 4; i++)
+    {
+        vec2 tap_uv = uv + step * offsets[i] * CoC;
+        float tapCoC = coc.sample_linear(tap_uv).x;
+        vec4 tap = src.sample_linear(tap_uv);
+        float contribution = tapCoC > CoC ? 1.0f : tapCoC;
+        color += contribution * tap;
+        sum += contribution;
+    }
+    return color / sum;
+}
@@ -0,0 +1,210 @@
+//
+//  CPUPostProcess.h
+//  SSSS_Metal
+//
+//  Headless CPU reference of the post-process chain that AAPLRenderer runs
+//  after the main pass: SeparableSSS, Bloom and DepthOfField. Every pass
+//  mirrors its fragment function in shaders.metal and writes into an image
+//  of the same format as the GPU render target, so the results can be
+//  diffed against device captures.
+//
+
+#ifndef SSSS_Metal_CPUPostProcess_h
+#define SSSS_Metal_CPUPostProcess_h
+
+#include <glm/glm.hpp>
+
+#include "CPUFrameGraph.h"
+#include "CPUImage.h"
+#include "CPUTileExecutor.h"
+#include "FrameGraph.h"
+#include "SSSKernel.h"
+#include "ThreadPool.h"
+#include "TileClassifier.h"
+#include "ToneMap.h"
+#include "ToneMapLUT.h"
+
+class CPUPostProcess
+{
+public:
+    // Defaults are the values AAPLRenderer uses.
+    struct Settings
+    {
+        Settings();
+        
+        // SCENE_COLOR_FORMAT: the main pass color target and every post-process
+        // target; SSSSBlurSIMD only runs on RGBA8Unorm
+        FrameGraphFormat color_format;
+        
+        // SeparableSSS
+        bool ssss_enabled;
+        float fovy;             // SSSS_FOVY in the shader
+        float sss_width;
+        int sss_samples;
+        glm::vec3 sss_strength;
+        glm::vec3 sss_falloff;
+        bool sss_follow_surface;    // SSSS_FOLLOW_SURFACE, off in shaders.metal
+        bool sss_simd;              // SSSSBlurSIMD instead of the per-pixel reference
+        bool sss_mask;              // blur only the pixels with SSS strength, like SeparableSSS's stencil
+        
+        // Bloom
+        bool bloom_enabled;
+        ToneMapOperator tone_map;
+        float exposure;
+        float burnout;
+        int tone_map_lut;           // size of the ToneMapLUT the combine samples if it reproduces tone_map, 0 to run tone_map per pixel
+        ToneMapLUT::Grade grade;    // baked into the LUT after tone_map, only with one
+        float bloom_threshold;
+        float bloom_width;
+        float bloom_intensity;
+        float defocus;
+        
+        // DepthOfField, already resolved the way render: does it
+        bool dof_enabled;
+        float focus_distance;
+        float focus_range;
+        glm::vec2 focus_falloff;
+        float dof_blur_width;
+        
+        // SSS, glare detection and the DOF blur per 16x16 tile like the tile
+        // compute kernels: the full filter only on the tiles of the pass'
+        // TileClassifier class, the cheap path elsewhere. SSS then takes the
+        // per-pixel blur, with neither sss_simd nor sss_mask.
+        bool tiled;
+        
+        // render scales of add_passes, the ones DynamicResolution picks;
+        // render() always runs at full size
+        float ssss_scale;
+        float bloom_scale;
+        float dof_scale;
+    };
+    
+    static const int TILE_SIZE = 64;
+    static const int BLOOM_N_PASSES = 6;
+    
+    explicit CPUPostProcess(ThreadPool & pool) : _pool(pool), _tiles(pool), _ssss_skipped(0.0f) { set_settings(Settings()); }
+    
+    // Bakes the ToneMapLUT when the settings use one for their operator.
+    void set_settings(const Settings & settings);
+    const Settings & settings() const { return _settings; }
+    
+    // The combine samples the ToneMapLUT rather than running tone_map.
+    bool uses_tone_map_lut() const { return _settings.tone_map_lut > 0 && ToneMapLUT::reproduces(_settings.tone_map); }
+    
+    /**
+     * Runs the enabled passes in the order of AAPLRenderer render:.
+     * color is what the main pass shades (SSS strength in alpha), depth its
+     * linear depth (R32Float); both go through main_pass() in the
+     * settings' color_format first.
+     */
+    void render(const CPUImage & color, const CPUImage & depth, CPUImage & output);
+    
+    // SCENE_DEPTH_FORMAT: RG32Float, the SSS strength in green, when color_format has no alpha
+    static FrameGraphFormat depth_format(FrameGraphFormat color_format);
+    
+    /**
+     * The two targets main_pass_frag writes, in color_format: scene, color
+     * quantized to it, and scene_depth, the linear depth and the strength
+     * (which only the depth keeps when the color has no alpha).
+     */
+    static void main_pass(const CPUImage & color, const CPUImage & depth, FrameGraphFormat color_format,
+                          CPUImage & scene, CPUImage & scene_depth);
+    
+    // ssss_pass_frag, horizontal then vertical, in place
+    void ssss(CPUImage & color, const CPUImage & depth);
+    
+    // fraction of the pixels the last SSS pass left out of the skin mask (copied, not blurred)
+    float ssss_skipped() const { return _ssss_skipped; }
+    
+    // tile counts and times of the passes run tiled since clear_tile_stats()
+    const std::vector<CPUTileExecutor::Stats>& tile_stats() const { return _tiles.stats(); }
+    void clear_tile_stats() { _tiles.clear_stats(); }
+    
+    // bloom_glare_detection_frag, bloom_down_frag, bloom_up_frag, bloom_combine_frag
+    void bloom(const CPUImage & src, CPUImage & dst);
+    
+    // dof_coc_frag, dof_blur_frag horizontal then vertical
+    void dof(const CPUImage & src, CPUImage & dst, const CPUImage & depth);
+    
+    /**
+     * Declares the same chain as render(), pass for pass as AAPLRenderer
+     * declares it, for images to run: every intermediate target is a
+     * transient of the graph, disabled effects are bypassed and each
+     * effect runs at its scale of the size of color. Returns the resource
+     * holding the result.
+     */
+    FrameGraph::Resource add_passes(FrameGraph & graph, CPUFrameGraph & images,
+                                    FrameGraph::Resource color, FrameGraph::Resource depth);
+    
+private:
+    CPUPostProcess(const CPUPostProcess&);
+    CPUPostProcess& operator=(const CPUPostProcess&);
+    
+    // Runs shader(uv) for every texel of dst, in parallel over tiles.
+    template<typename Shader>
+    void run_pass(CPUImage & dst, Shader shader)
+    {
+        _pool.parallel_for_tiles(dst.width(), dst.height(), TILE_SIZE, [&](int x0, int y0, int x1, int y1)
+        {
+            for (int y = y0; y < y1; y++)
+                for (int x = x0; x < x1; x++)
+                    dst.store(x, y, shader(dst.texel_center(x, y)));
+        });
+    }
+    
+    // The tiled run_pass: full(uv) on the tiles of _classes in flag's class, cheap(uv) on the others.
+    template<typename Full, typename Cheap>
+    void run_tiles(const std::string & pass, CPUImage & dst, unsigned flag, bool full_when_set, Full full, Cheap cheap)
+    {
+        _tiles.run(pass, _classes, flag, full_when_set, [&](int x0, int y0, int x1, int y1)
+        {
+            for (int y = y0; y < y1; y++)
+                for (int x = x0; x < x1; x++)
+                    dst.store(x, y, full(dst.texel_center(x, y)));
+        }, [&](int x0, int y0, int x1, int y1)
+        {
+            for (int y = y0; y < y1; y++)
+                for (int x = x0; x < x1; x++)
+                    dst.store(x, y, cheap(dst.texel_center(x, y)));
+        });
+    }
+    
+    // one texel of ssss_pass_frag, bloom_glare_detection_frag and dof_blur_frag
+    glm::vec4 ssss_texel(const CPUImage & src, const CPUImage & depth, glm::vec2 texcoord, glm::vec2 dir) const;
+    glm::vec4 glare_texel(const CPUImage & src, glm::vec2 uv, glm::vec2 pixel_size) const;
+    glm::vec4 dof_texel(const CPUImage & src, const CPUImage & coc, glm::vec2 uv, glm::vec2 step) const;
+    
+    // stencil: the skin mask, nullptr to blur every pixel; mark: build it first from src's strength
+    void ssss_pass(const CPUImage & src, CPUImage & dst, const CPUImage & depth, glm::vec2 dir, CPUImage* stencil, bool mark);
+    void ssss_pass_simd(const CPUImage & src, CPUImage & dst, const CPUImage & depth, bool vertical, CPUImage* stencil, bool mark);
+    // the stencil the horizontal ssss_pass_frag leaves: 1 where it didn't discard
+    void mark_skin(const CPUImage & src, const CPUImage & depth, CPUImage & stencil);
+    // pixel_size: of the full size glare target, the combine target for bloom_combine
+    void bloom_glare(const CPUImage & src, CPUImage & dst, glm::vec2 pixel_size);
+    // texel: of src; step, weight: the tent step and blend of level (PassConstants::bloom_up_weight)
+    void bloom_down(const CPUImage & src, CPUImage & dst, glm::vec2 texel);
+    void bloom_up(const CPUImage & down, const CPUImage & up, CPUImage & dst, glm::vec2 step, glm::vec2 weight);
+    void bloom_combine(const CPUImage & src, const CPUImage & bloom, CPUImage & dst, glm::vec2 pixel_size, glm::vec2 step);
+    void dof_coc(const CPUImage & depth, CPUImage & coc);
+    void dof_blur(const CPUImage & src, const CPUImage & coc, CPUImage & dst, glm::vec2 step);
+    
+    ThreadPool & _pool;
+    Settings _settings;
+    SSSKernel _kernel;
+    CPUTileExecutor _tiles;
+    TileClassifier _classes;
+    ToneMapLUT _tone_map_lut;
+    
+    CPUImage _ssss_temp;
+    CPUImage _ssss_stencil;
+    float _ssss_skipped;
+    CPUImage _glare;
+    CPUImage _bloom_down[BLOOM_N_PASSES];  // [0] unused: level 0 is _glare
+    CPUImage _bloom_up[BLOOM_N_PASSES];    // [BLOOM_N_PASSES - 1] unused: the smallest level is its own upsample
+    CPUImage _dof_temp;
+    CPUImage _coc;
+    CPUImage _stage[2];
+    CPUImage _scene_depth;
+};
+
+#endif
@@ -0,0 +1,47 @@
+//
+//  CPUTileExecutor.cpp
+//  SSSS_Metal
+//
+
+#include "CPUTileExecutor.h"
+
+#include <chrono>
+
+void CPUTileExecutor::run(const std::string & pass, const TileClassifier & tiles, unsigned flag, bool full_when_set,
+                          const TileFunction & full, const TileFunction & cheap)
+{
+    using namespace std::chrono;
+    auto start = steady_clock::now();
+    
+    // the full tiles first, so the cheap ones fill in behind them
+    _order.clear();
+    for (int t = 0; t < tiles.tile_count(); t++)
+    {
+        if (((tiles.flags(t) & flag) != 0) == full_when_set)
+            _order.push_back(t);
+    }
+    int n_full = (int)_order.size();
+    for (int t = 0; t < tiles.tile_count(); t++)
+    {
+        if (((tiles.flags(t) & flag) != 0) != full_when_set)
+            _order.push_back(t);
+    }
+    
+    _pool.parallel_for((int)_order.size(), [&](int i)
+    {
+        int x0, y0, x1, y1;
+        tiles.rect(_order[i], x0, y0, x1, y1);
+        if (i < n_full)
+            full(x0, y0, x1, y1);
+        else
+            cheap(x0, y0, x1, y1);
+    });
+    
+    Stats stats;
+    stats.pass = pass;
+    stats.tiles = tiles.tile_count();
+    stats.full = n_full;
+    stats.sky = tiles.count(TileClassifier::TileSky);
+    stats.ms = duration<double, std::milli>(steady_clock::now() - start).count();
+    _stats.push_back(stats);
+}
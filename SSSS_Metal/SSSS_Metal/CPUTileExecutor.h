@@ -0,0 +1,57 @@
+//
+//  CPUTileExecutor.h
+//  SSSS_Metal
+//
+//  Runs a pass tile by tile the way the tile compute kernels dispatch it:
+//  the tiles a TileClassifier put in the pass' class get the full filter,
+//  the others the cheap path, in parallel over the tiles. Keeps per pass
+//  tile counts and times, for the profile of a frame's tile classes.
+//
+
+#ifndef SSSS_Metal_CPUTileExecutor_h
+#define SSSS_Metal_CPUTileExecutor_h
+
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "ThreadPool.h"
+#include "TileClassifier.h"
+
+class CPUTileExecutor
+{
+public:
+    struct Stats
+    {
+        std::string pass;
+        int tiles;
+        int full;       // tiles that ran the full filter
+        int sky;
+        double ms;
+    };
+    
+    // fn(x0, y0, x1, y1), x1/y1 exclusive
+    typedef std::function<void(int, int, int, int)> TileFunction;
+    
+    explicit CPUTileExecutor(ThreadPool & pool) : _pool(pool) {}
+    
+    /**
+     * full on the tiles of tiles whose class flag is full_when_set, cheap on
+     * the others; adds the pass to stats().
+     */
+    void run(const std::string & pass, const TileClassifier & tiles, unsigned flag, bool full_when_set,
+             const TileFunction & full, const TileFunction & cheap);
+    
+    const std::vector<Stats>& stats() const { return _stats; }
+    void clear_stats() { _stats.clear(); }
+
+private:
+    CPUTileExecutor(const CPUTileExecutor&);
+    CPUTileExecutor& operator=(const CPUTileExecutor&);
+    
+    ThreadPool & _pool;
+    std::vector<Stats> _stats;
+    std::vector<int> _order;
+};
+
+#endif
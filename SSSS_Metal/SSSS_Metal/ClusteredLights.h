@@ -0,0 +1,91 @@
+//
+//  ClusteredLights.h
+//  SSSS_Metal
+//
+//  The light list of the main pass and its LightClusters, in a buffer per
+//  frame in flight: the renderer fills the lights and builds the clusters
+//  of its slot before the frame is encoded, the main pass binds them as
+//  fragment buffers 1 (lights), 2 (clusters) and 3 (light indices).
+//
+
+#ifndef SSSS_Metal_ClusteredLights_h
+#define SSSS_Metal_ClusteredLights_h
+
+#import <Metal/Metal.h>
+
+#include <algorithm>
+#include <cstring>
+#include <vector>
+
+#include "AAPLSharedTypes.h"
+#include "LightClusters.h"
+#include "RenderContext.h"
+#include "RenderTarget.h"
+
+static_assert(sizeof(AAPL::light_cluster) == sizeof(LightClusters::Cluster), "light_cluster is LightClusters::Cluster");
+static_assert(LightClusters::MAX_LIGHTS == MAX_LIGHTS, "the light list");
+static_assert(LightClusters::COUNT == LIGHT_CLUSTERS_X * LIGHT_CLUSTERS_Y * LIGHT_CLUSTERS_Z, "cluster grid");
+
+class ClusteredLights
+{
+public:
+    ClusteredLights() : _index(0) {}
+    
+    void init(id <MTLDevice> device)
+    {
+        for (int i = 0; i < kInFlightCommandBuffers; i++)
+        {
+            _lights[i] = [device newBufferWithLength: MAX_LIGHTS * sizeof(AAPL::SLight) options: 0];
+            _lights[i].label = [NSString stringWithFormat: @"lights%i", i];
+            _clusters[i] = [device newBufferWithLength: LightClusters::COUNT * sizeof(AAPL::light_cluster) options: 0];
+            _clusters[i].label = [NSString stringWithFormat: @"light_clusters%i", i];
+            _indices[i] = [device newBufferWithLength: LIGHT_CLUSTER_MAX_INDICES * sizeof(uint16_t) options: 0];
+            _indices[i].label = [NSString stringWithFormat: @"light_indices%i", i];
+        }
+    }
+    
+    /**
+     * Copies lights (MAX_LIGHTS at most) into the frame in flight slot index,
+     * which the GPU is done with, then builds the clusters of the camera's
+     * frustum on pool and copies them in too.
+     */
+    void update(NSUInteger index, const std::vector<AAPL::SLight> & lights, const std::vector<LightClusters::Light> & culling,
+                const glm::mat4 & view, float fov, float aspect, float near_plane, float far_plane, ThreadPool* pool)
+    {
+        _index = index;
+        size_t count = std::min(lights.size(), (size_t)MAX_LIGHTS);
+        memcpy([_lights[index] contents], lights.data(), count * sizeof(AAPL::SLight));
+        _builder.build(culling, view, fov, aspect, near_plane, far_plane, pool);
+        memcpy([_clusters[index] contents], _builder.clusters().data(), LightClusters::COUNT * sizeof(AAPL::light_cluster));
+        memcpy([_indices[index] contents], _builder.indices().data(), _builder.indices().size() * sizeof(uint16_t));
+    }
+    
+    // the cluster lookup of main_pass_frag for a target of width x height
+    void set_constants(AAPL::constant_main_pass & constants, int width, int height) const
+    {
+        constants.clusterScale = { (float)LIGHT_CLUSTERS_X / width, (float)LIGHT_CLUSTERS_Y / height };
+        constants.clusterSliceScale = _builder.slice_scale();
+        constants.clusterSliceBias = _builder.slice_bias();
+    }
+    
+    // This frame's lights, clusters and indices at fragment buffers 1 to 3.
+    void bind(id <MTLRenderCommandEncoder> encoder) const
+    {
+        [encoder setFragmentBuffer: _lights[_index] offset: 0 atIndex: 1];
+        [encoder setFragmentBuffer: _clusters[_index] offset: 0 atIndex: 2];
+        [encoder setFragmentBuffer: _indices[_index] offset: 0 atIndex: 3];
+    }
+    
+    const LightClusters & clusters() const { return _builder; }
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(ClusteredLights)
+    
+    id <MTLBuffer> _lights[kInFlightCommandBuffers];
+    id <MTLBuffer> _clusters[kInFlightCommandBuffers];
+    id <MTLBuffer> _indices[kInFlightCommandBuffers];
+    LightClusters _builder;
+    NSUInteger _index;
+};
+
+#endif
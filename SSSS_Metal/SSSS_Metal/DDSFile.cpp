@@ -0,0 +1,290 @@
+//
+//  DDSFile.cpp
+//  SSSS_Metal
+//
+
+#include "DDSFile.h"
+
+#include <algorithm>
+#include <cstring>
+
+namespace
+{
+    const uint32_t DDS_MAGIC            = 0x20534444;   // "DDS "
+    const size_t   DDS_HEADER_SIZE      = 124;
+    const size_t   DDS_DX10_HEADER_SIZE = 20;
+    
+    const uint32_t DDSD_MIPMAPCOUNT     = 0x20000;
+    const uint32_t DDPF_ALPHAPIXELS     = 0x1;
+    const uint32_t DDPF_ALPHA           = 0x2;
+    const uint32_t DDPF_FOURCC          = 0x4;
+    const uint32_t DDPF_RGB             = 0x40;
+    const uint32_t DDPF_LUMINANCE       = 0x20000;
+    const uint32_t DDSCAPS2_CUBEMAP     = 0x200;
+    const uint32_t DDSCAPS2_ALL_FACES   = 0xfc00;
+    const uint32_t DDSCAPS2_VOLUME      = 0x200000;
+    const uint32_t DDS_RESOURCE_MISC_TEXTURECUBE = 0x4;
+    const uint32_t DDS_DIMENSION_TEXTURE2D = 3;
+    
+    struct DDSPixelFormat
+    {
+        uint32_t size;
+        uint32_t flags;
+        uint32_t four_cc;
+        uint32_t bit_count;
+        uint32_t mask[4];   // r, g, b, a
+    };
+    
+    struct DDSHeader
+    {
+        uint32_t size;
+        uint32_t flags;
+        uint32_t height;
+        uint32_t width;
+        uint32_t pitch_or_linear_size;
+        uint32_t depth;
+        uint32_t mip_map_count;
+        uint32_t reserved1[11];
+        DDSPixelFormat pixel_format;
+        uint32_t caps[4];
+        uint32_t reserved2;
+    };
+    
+    struct DDSHeaderDX10
+    {
+        uint32_t dxgi_format;
+        uint32_t resource_dimension;
+        uint32_t misc_flag;
+        uint32_t array_size;
+        uint32_t misc_flags2;
+    };
+    
+    static_assert(sizeof(DDSHeader) == DDS_HEADER_SIZE, "DDS header layout");
+    static_assert(sizeof(DDSHeaderDX10) == DDS_DX10_HEADER_SIZE, "DX10 header layout");
+    
+    uint32_t four_cc(const char* s)
+    {
+        return (uint32_t)s[0] | ((uint32_t)s[1] << 8) | ((uint32_t)s[2] << 16) | ((uint32_t)s[3] << 24);
+    }
+    
+    bool has_masks(const DDSPixelFormat& pf, uint32_t r, uint32_t g, uint32_t b, uint32_t a)
+    {
+        return pf.mask[0] == r && pf.mask[1] == g && pf.mask[2] == b && pf.mask[3] == a;
+    }
+    
+    DDSFormat legacy_format(const DDSPixelFormat& pf)
+    {
+        if (pf.flags & DDPF_FOURCC)
+        {
+            const uint32_t cc = pf.four_cc;
+            if (cc == four_cc("DXT1")) return DDSFormatBC1;
+            if (cc == four_cc("DXT2") || cc == four_cc("DXT3")) return DDSFormatBC2;
+            if (cc == four_cc("DXT4") || cc == four_cc("DXT5")) return DDSFormatBC3;
+            if (cc == four_cc("ATI1") || cc == four_cc("BC4U")) return DDSFormatBC4;
+            if (cc == four_cc("ATI2") || cc == four_cc("BC5U")) return DDSFormatBC5;
+            // D3DFORMAT values stored in the FourCC field
+            switch (cc)
+            {
+                case 36:  return DDSFormatRGBA16Unorm;
+                case 111: return DDSFormatR16Float;
+                case 112: return DDSFormatRG16Float;
+                case 113: return DDSFormatRGBA16Float;
+                case 114: return DDSFormatR32Float;
+                case 115: return DDSFormatRG32Float;
+                case 116: return DDSFormatRGBA32Float;
+                default:  return DDSFormatUnknown;
+            }
+        }
+        if (pf.flags & DDPF_RGB)
+        {
+            if (pf.bit_count == 32 && has_masks(pf, 0xff, 0xff00, 0xff0000, 0xff000000)) return DDSFormatRGBA8Unorm;
+            if (pf.bit_count == 32 && has_masks(pf, 0xff, 0xff00, 0xff0000, 0)) return DDSFormatRGBA8Unorm;
+            if (pf.bit_count == 32 && has_masks(pf, 0xff0000, 0xff00, 0xff, 0xff000000)) return DDSFormatBGRA8Unorm;
+            if (pf.bit_count == 16 && has_masks(pf, 0xff, 0xff00, 0, 0)) return DDSFormatRG8Unorm;
+            if (pf.bit_count == 8 && pf.mask[0] == 0xff) return DDSFormatR8Unorm;
+            return DDSFormatUnknown;
+        }
+        if (pf.flags & DDPF_LUMINANCE)
+        {
+            if (pf.bit_count == 8) return DDSFormatR8Unorm;
+            if (pf.bit_count == 16 && (pf.flags & DDPF_ALPHAPIXELS)) return DDSFormatRG8Unorm;
+            return DDSFormatUnknown;
+        }
+        if ((pf.flags & DDPF_ALPHA) && pf.bit_count == 8)
+            return DDSFormatR8Unorm;
+        return DDSFormatUnknown;
+    }
+    
+    // block dimension (1 or 4) and bytes per pixel or per block, 0 if unknown
+    void format_layout(DDSFormat format, uint32_t& block_dimension, uint32_t& bytes_per_block)
+    {
+        block_dimension = 1;
+        switch (format)
+        {
+            case DDSFormatRGBA32Float:      bytes_per_block = 16; break;
+            case DDSFormatRGBA16Float:
+            case DDSFormatRGBA16Unorm:
+            case DDSFormatRG32Float:        bytes_per_block = 8; break;
+            case DDSFormatRGBA8Unorm:
+            case DDSFormatRGBA8Unorm_sRGB:
+            case DDSFormatBGRA8Unorm:
+            case DDSFormatRG16Float:
+            case DDSFormatR32Float:         bytes_per_block = 4; break;
+            case DDSFormatRG8Unorm:
+            case DDSFormatR16Float:         bytes_per_block = 2; break;
+            case DDSFormatR8Unorm:          bytes_per_block = 1; break;
+            case DDSFormatBC1:
+            case DDSFormatBC1_sRGB:
+            case DDSFormatBC4:              block_dimension = 4; bytes_per_block = 8; break;
+            case DDSFormatBC2:
+            case DDSFormatBC2_sRGB:
+            case DDSFormatBC3:
+            case DDSFormatBC3_sRGB:
+            case DDSFormatBC5:
+            case DDSFormatBC6HUF16:
+            case DDSFormatBC6HSF16:
+            case DDSFormatBC7:
+            case DDSFormatBC7_sRGB:         block_dimension = 4; bytes_per_block = 16; break;
+            default:                        bytes_per_block = 0; break;
+        }
+    }
+}
+
+bool DDSFile::fail(std::string* error, const std::string & reason)
+{
+    if (error)
+        *error = reason;
+    close();
+    return false;
+}
+
+bool DDSFile::open(const std::string & path, std::string* error)
+{
+    close();
+    if (!_file.open(path))
+        return fail(error, "can not open " + path);
+    
+    const uint8_t* p = _file.data();
+    const size_t file_size = _file.size();
+    uint32_t magic;
+    if (file_size < 4 + DDS_HEADER_SIZE)
+        return fail(error, "file too small for a DDS header");
+    memcpy(&magic, p, 4);
+    DDSHeader header;
+    memcpy(&header, p + 4, sizeof(header));
+    if (magic != DDS_MAGIC || header.size != DDS_HEADER_SIZE || header.pixel_format.size != sizeof(DDSPixelFormat))
+        return fail(error, "not a DDS file");
+    if (header.caps[1] & DDSCAPS2_VOLUME)
+        return fail(error, "volume textures are not supported");
+    
+    _data_offset = 4 + DDS_HEADER_SIZE;
+    _faces = 1;
+    if ((header.pixel_format.flags & DDPF_FOURCC) && header.pixel_format.four_cc == four_cc("DX10"))
+    {
+        if (file_size < _data_offset + DDS_DX10_HEADER_SIZE)
+            return fail(error, "file too small for the DX10 header");
+        DDSHeaderDX10 dx10;
+        memcpy(&dx10, p + _data_offset, sizeof(dx10));
+        _data_offset += DDS_DX10_HEADER_SIZE;
+        if (dx10.resource_dimension != DDS_DIMENSION_TEXTURE2D || dx10.array_size != 1)
+            return fail(error, "only single 2D textures and cubemaps are supported");
+        _format = (DDSFormat)dx10.dxgi_format;
+        if (dx10.misc_flag & DDS_RESOURCE_MISC_TEXTURECUBE)
+            _faces = 6;
+    }
+    else
+    {
+        _format = legacy_format(header.pixel_format);
+        if (header.caps[1] & DDSCAPS2_CUBEMAP)
+        {
+            if ((header.caps[1] & DDSCAPS2_ALL_FACES) != DDSCAPS2_ALL_FACES)
+                return fail(error, "partial cubemaps are not supported");
+            _faces = 6;
+        }
+    }
+    
+    format_layout(_format, _block_dimension, _bytes_per_block);
+    if (_bytes_per_block == 0)
+        return fail(error, "unsupported pixel format");
+    
+    _width = header.width;
+    _height = header.height;
+    if (_width == 0 || _height == 0 || _width > 16384 || _height > 16384)
+        return fail(error, "bad dimensions");
+    if (_faces == 6 && _width != _height)
+        return fail(error, "cubemap faces are not square");
+    
+    uint32_t full_chain = 1;
+    while ((std::max(_width, _height) >> full_chain) != 0)
+        full_chain++;
+    _mips = (header.flags & DDSD_MIPMAPCOUNT) && header.mip_map_count > 0 ? header.mip_map_count : 1;
+    if (_mips > full_chain)
+        return fail(error, "more mip levels than the size allows");
+    
+    _face_size = 0;
+    for (uint32_t mip = 0; mip < _mips; mip++)
+        _face_size += surface(0, mip).size;
+    if (_data_offset + _face_size * _faces > file_size)
+        return fail(error, "file shorter than its header says");
+    return true;
+}
+
+void DDSFile::close()
+{
+    _file.close();
+    _format = DDSFormatUnknown;
+    _width = _height = _mips = _faces = 0;
+}
+
+DDSFile::Surface DDSFile::surface(uint32_t face, uint32_t mip) const
+{
+    Surface s;
+    size_t offset = _data_offset + face * _face_size;
+    for (uint32_t m = 0; ; m++)
+    {
+        s.width = std::max(_width >> m, 1u);
+        s.height = std::max(_height >> m, 1u);
+        uint32_t blocks_x = (s.width + _block_dimension - 1) / _block_dimension;
+        uint32_t blocks_y = (s.height + _block_dimension - 1) / _block_dimension;
+        s.row_pitch = blocks_x * _bytes_per_block;
+        s.size = (size_t)s.row_pitch * blocks_y;
+        if (m == mip)
+            break;
+        offset += s.size;
+    }
+    s.offset = offset;
+    s.data = _file.data() + offset;
+    return s;
+}
+
+const char* DDSFile::format_name(DDSFormat format)
+{
+    switch (format)
+    {
+        case DDSFormatRGBA32Float:      return "RGBA32Float";
+        case DDSFormatRGBA16Float:      return "RGBA16Float";
+        case DDSFormatRGBA16Unorm:      return "RGBA16Unorm";
+        case DDSFormatRG32Float:        return "RG32Float";
+        case DDSFormatRGBA8Unorm:       return "RGBA8Unorm";
+        case DDSFormatRGBA8Unorm_sRGB:  return "RGBA8Unorm_sRGB";
+        case DDSFormatRG16Float:        return "RG16Float";
+        case DDSFormatR32Float:         return "R32Float";
+        case DDSFormatRG8Unorm:         return "RG8Unorm";
+        case DDSFormatR16Float:         return "R16Float";
+        case DDSFormatR8Unorm:          return "R8Unorm";
+        case DDSFormatBC1:              return "BC1";
+        case DDSFormatBC1_sRGB:         return "BC1_sRGB";
+        case DDSFormatBC2:              return "BC2";
+        case DDSFormatBC2_sRGB:         return "BC2_sRGB";
+        case DDSFormatBC3:              return "BC3";
+        case DDSFormatBC3_sRGB:         return "BC3_sRGB";
+        case DDSFormatBC4:              return "BC4";
+        case DDSFormatBC5:              return "BC5";
+        case DDSFormatBGRA8Unorm:       return "BGRA8Unorm";
+        case DDSFormatBC6HUF16:         return "BC6H_UF16";
+        case DDSFormatBC6HSF16:         return "BC6H_SF16";
+        case DDSFormatBC7:              return "BC7";
+        case DDSFormatBC7_sRGB:         return "BC7_sRGB";
+        default:                        return "unknown";
+    }
+}
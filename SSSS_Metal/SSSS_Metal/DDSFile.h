@@ -0,0 +1,125 @@
+//
+//  DDSFile.h
+//  SSSS_Metal
+//
+//  DirectDraw Surface reader working in place on a memory mapping: the
+//  header is validated and every (face, mip) surface is exposed as a view
+//  into the mapped file, so uploading a texture copies each byte once,
+//  from the page cache into the texture.
+//
+//  2D textures and cubemaps, uncompressed formats and BC1-7, with or
+//  without the DX10 header extension.
+//
+
+#ifndef SSSS_Metal_DDSFile_h
+#define SSSS_Metal_DDSFile_h
+
+#include <cstdint>
+#include <string>
+
+#include "MappedFile.h"
+
+// the DXGI_FORMAT values this reader understands
+enum DDSFormat
+{
+    DDSFormatUnknown        = 0,
+    DDSFormatRGBA32Float    = 2,
+    DDSFormatRGBA16Float    = 10,
+    DDSFormatRGBA16Unorm    = 11,
+    DDSFormatRG32Float      = 16,
+    DDSFormatRGBA8Unorm     = 28,
+    DDSFormatRGBA8Unorm_sRGB = 29,
+    DDSFormatRG16Float      = 34,
+    DDSFormatR32Float       = 41,
+    DDSFormatRG8Unorm       = 49,
+    DDSFormatR16Float       = 54,
+    DDSFormatR8Unorm        = 61,
+    DDSFormatBC1            = 71,
+    DDSFormatBC1_sRGB       = 72,
+    DDSFormatBC2            = 74,
+    DDSFormatBC2_sRGB       = 75,
+    DDSFormatBC3            = 77,
+    DDSFormatBC3_sRGB       = 78,
+    DDSFormatBC4            = 80,
+    DDSFormatBC5            = 83,
+    DDSFormatBGRA8Unorm     = 87,
+    DDSFormatBC6HUF16       = 95,
+    DDSFormatBC6HSF16       = 96,
+    DDSFormatBC7            = 98,
+    DDSFormatBC7_sRGB       = 99,
+};
+
+class DDSFile
+{
+public:
+    static const int MAX_MIPS = 16;
+    
+    // one mip level of one face, pointing into the mapping
+    struct Surface
+    {
+        const uint8_t* data;
+        size_t   size;
+        size_t   offset;        // of data from the start of the file
+        uint32_t width;
+        uint32_t height;
+        uint32_t row_pitch;     // bytes per row of pixels, or of 4x4 blocks
+    };
+    
+    DDSFile() : _format(DDSFormatUnknown), _width(0), _height(0), _mips(0), _faces(0),
+                _block_dimension(1), _bytes_per_block(0), _data_offset(0), _face_size(0) {}
+    
+    /**
+     * Maps and validates the file. Returns false, with the reason in
+     * error() if given, when it is not a DDS this reader supports or is
+     * shorter than its header says.
+     */
+    bool open(const std::string & path, std::string* error = nullptr);
+    void close();
+    
+    bool is_open() const { return _file.is_open(); }
+    DDSFormat format() const { return _format; }
+    uint32_t width() const { return _width; }
+    uint32_t height() const { return _height; }
+    uint32_t mip_count() const { return _mips; }
+    uint32_t face_count() const { return _faces; }     // 6 for a cubemap
+    bool is_cubemap() const { return _faces == 6; }
+    bool is_compressed() const { return _block_dimension == 4; }
+    uint32_t block_dimension() const { return _block_dimension; }
+    uint32_t bytes_per_block() const { return _bytes_per_block; }   // bytes per pixel if uncompressed
+    
+    Surface surface(uint32_t face, uint32_t mip) const;
+    
+    /**
+     * Drops the pages of an uploaded surface from the process' resident
+     * set, they are read back from the file if touched again.
+     */
+    void release(const Surface & s) const { _file.release(s.offset, s.size); }
+    
+    // Reads a surface's pages in ahead of the upload.
+    void prefetch(const Surface & s) const { _file.prefetch(s.offset, s.size); }
+    
+    // file layout: every face holds its whole mip chain, one after the other
+    size_t data_size() const { return _file.size() - _data_offset; }
+    size_t file_size() const { return _file.size(); }
+    
+    static const char* format_name(DDSFormat format);
+    
+private:
+    DDSFile(const DDSFile&);
+    DDSFile& operator=(const DDSFile&);
+    
+    bool fail(std::string* error, const std::string & reason);
+    
+    MappedFile _file;
+    DDSFormat _format;
+    uint32_t _width;
+    uint32_t _height;
+    uint32_t _mips;
+    uint32_t _faces;
+    uint32_t _block_dimension;
+    uint32_t _bytes_per_block;
+    size_t   _data_offset;
+    size_t   _face_size;
+};
+
+#endif
@@ -12,6 +12,7 @@
 #include <cstdio>
 #include <iostream>
 #include <string>
+#include <sys/resource.h>
 
 class Debug
 {
@@ -37,6 +38,18 @@ public:
         std::cout << "[Info] " << info << std::endl;
     }
     
+    // high water mark of the process' resident memory, in bytes
+    static size_t PeakResidentBytes()
+    {
+        struct rusage usage;
+        getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+        return (size_t)usage.ru_maxrss;
+#else
+        return (size_t)usage.ru_maxrss * 1024;
+#endif
+    }
+    
 private:
     Debug();
     ~Debug();
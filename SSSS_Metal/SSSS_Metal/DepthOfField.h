@@ -9,15 +9,22 @@
 #ifndef DepthOfField_h
 #define DepthOfField_h
 
+#include "DynamicResolution.h"
+#include "FrameCommandBuffers.h"
+#include "FrameConstants.h"
+#include "FrameGraph.h"
+#include "FrameGraphTargets.h"
+#include "PassConstants.h"
 #include "RenderTarget.h"
 #include "RenderContext.h"
+#include "TileCompute.h"
 #include "AAPLSharedTypes.h"
 #include "Model.h"
 
 class DepthOfField
 {
     public:
-    DepthOfField()
+    DepthOfField() : _width(0), _height(0), _tile_compute(nullptr), _frame_constants(nullptr)
     {
         
     }
@@ -32,48 +39,40 @@ class DepthOfField
         //shader_blur.init(IOS_PATH("shader", "Quad", "vert"), IOS_PATH("shader", "DepthOfField_blur", "frag"));
     }
     
-    void init(id<MTLDevice> device, float focusDistance, float focusRange, const glm::vec2 &focusFalloff, float blurWidth)
+    // frame_constants: where the passes copy their constants when they are encoded
+    void init(FrameConstants* frame_constants, float focusDistance, float focusRange, const glm::vec2 &focusFalloff, float blurWidth)
     {
         _focus_distance = focusDistance;
         _focus_range = focusRange;
         _focus_falloff = focusFalloff;
         _blur_width = blurWidth;
-        
-        int w = RenderContext::window_width;
-        int h = RenderContext::window_height;
-        _rt_temp.init(device, MTLPixelFormatRGBA8Unorm, w, h);
-        _rt_coc.init(device, MTLPixelFormatR8Unorm, w, h);
-        
-        _constants_buffer_coc = [device newBufferWithLength:sizeof(AAPL::constant_dof_pass_coc) options:0];
-        _constants_buffer_blur[0] = [device newBufferWithLength:sizeof(AAPL::constant_dof_pass_blur) options:0];
-        _constants_buffer_blur[1] = [device newBufferWithLength:sizeof(AAPL::constant_dof_pass_blur) options:0];
+        _frame_constants = frame_constants;
         
         {
-            auto buffer = (AAPL::constant_dof_pass_coc*)[_constants_buffer_coc contents];
+            auto buffer = &_constants_coc;
             buffer->focusDistance = focusDistance;
             buffer->focusRange = focusRange;
             buffer->focusFalloff = to_simd_type(focusFalloff);
         }
-        vec2 pixel_size(1.0f / RenderContext::window_width, 1.0f / RenderContext::window_height);
-        vec2 step = pixel_size * _blur_width;
-
-        {
-            auto buffer = (AAPL::constant_dof_pass_blur*)[_constants_buffer_blur[0] contents];
-            buffer->step = {step.x, 0};
-        }
+        _width = _height = 0;
+        resize(RenderContext::window_width, RenderContext::window_height);
+    }
+    
+    // Window size changed: rewrites the blur steps, which are in uv of the window size.
+    void resize(int width, int height)
+    {
+        if (width == _width && height == _height)
+            return;
+        _width = width;
+        _height = height;
+        for (int i = 0; i < 2; i++)
         {
-            auto buffer = (AAPL::constant_dof_pass_blur*)[_constants_buffer_blur[1] contents];
-            buffer->step = {0, step.y};
+            _constants_blur[i].step = to_simd_type(PassConstants::dof_step(width, height, _blur_width, i == 1));
         }
-        
     }
     
-//    void resize(int width, int height)
-//    {
-//        _rt_temp.resize(width, height);
-//        _rt_coc.resize(width, height);
-//    }
-    bool prepare_pipeline_state(id <MTLDevice> _device, id <MTLLibrary> _defaultLibrary)
+    // color_format: the one of the scene color, which the targets of the passes take
+    bool prepare_pipeline_state(id <MTLDevice> _device, id <MTLLibrary> _defaultLibrary, FrameGraphFormat color_format)
     {
         {
             MTLDepthStencilDescriptor *desc = [[MTLDepthStencilDescriptor alloc] init];
@@ -92,7 +91,7 @@ class DepthOfField
             desc.label = @"DOF Blur Pass";
             desc.vertexFunction = vert;
             desc.fragmentFunction = blur_frag;
-            desc.colorAttachments[0].pixelFormat = MTLPixelFormatRGBA8Unorm;
+            desc.colorAttachments[0].pixelFormat = FrameGraphTargets::pixel_format(color_format);
             //desc.depthAttachmentPixelFormat = MTLPixelFormatDepth32Float;
             _pipeline_state[0] = [_device newRenderPipelineStateWithDescriptor: desc error: &err];
             CheckPipelineError(_pipeline_state[0], err);
@@ -107,6 +106,7 @@ class DepthOfField
             CheckPipelineError(_pipeline_state[1], err);
             err = nil;
         }
+        _pipeline_blur_tiles = TileCompute::new_pipeline(_device, _defaultLibrary, @"dof_tile_kernel");
         
         
         //Render Pass Desc
@@ -114,9 +114,7 @@ class DepthOfField
         {
             _render_pass_desc = [MTLRenderPassDescriptor renderPassDescriptor];
             auto color_attachment = _render_pass_desc.colorAttachments[0];
-            //color_attachment.texture = _rt_temp.texture();
-            color_attachment.loadAction = MTLLoadActionClear;
-            color_attachment.storeAction = MTLStoreActionStore;
+            // target and actions are bound by the frame graph
             color_attachment.clearColor = MTLClearColorMake(1, 0, 0, 1);
         }
         
@@ -124,48 +122,105 @@ class DepthOfField
     }
 
     
-    void render(id <MTLCommandBuffer> commandBuffer, RenderTexture & src, RenderTexture & dst, RenderTexture & depth_texture)
+    /**
+     * Declares the CoC pass (from the linear depth) and the two blur
+     * passes, src in, the blurred color out, scale times the size of the
+     * depth. The blur step is set for the full size in resize(), so it covers
+     * the same part of the screen at any scale. When disabled the graph
+     * culls them and hands src on. With a TileCompute the blur passes are
+     * dof_tile_kernel, which copies the tiles in focus. The passes may be
+     * encoded on different threads: each binds its own copy of
+     * _render_pass_desc.
+     */
+    FrameGraph::Resource add_passes(FrameGraph & graph, const FrameGraphTargets & targets, const FrameCommandBuffers & commandBuffers,
+                                    FrameGraph::Resource src, FrameGraph::Resource depth_texture, bool enabled, float scale = 1.0f)
     {
-        //glViewport(0, 0, RenderContext::window_width, RenderContext::window_height);
-        coc(commandBuffer, depth_texture, _rt_coc);
-        blur(commandBuffer, src, _rt_temp, dof_blur_horizon);
-        blur(commandBuffer, _rt_temp, dst, dof_blur_vertical);
+        const FrameGraphTextureDesc & depth_desc = graph.resource(depth_texture).desc;
+        FrameGraphTextureDesc desc(DynamicResolution::scaled_size(depth_desc.width, scale),
+                                   DynamicResolution::scaled_size(depth_desc.height, scale), graph.resource(src).desc.format);
+        FrameGraphTextureDesc coc_desc = { desc.width, desc.height, FrameGraphFormatR8Unorm };
+        FrameGraph::Resource coc_texture = graph.create("dof coc", coc_desc);
+        FrameGraph::Resource temp = graph.create("dof temp", desc);
+        FrameGraph::Resource output = graph.create("dof", desc);
+        const FrameGraphTargets* t = &targets;
+        const FrameCommandBuffers* c = &commandBuffers;
+        
+        FrameGraph::Pass pass = graph.add_pass("dof coc", [=](const FrameGraph::PassInfo & info) {
+            MTLRenderPassDescriptor* pass_desc = [_render_pass_desc copy];
+            t->bind(pass_desc.colorAttachments[0], info, coc_texture);
+            coc(c->get(info), pass_desc, t->texture(depth_texture));
+        }, enabled);
+        graph.read(pass, depth_texture);
+        graph.write(pass, coc_texture);
+        
+        const bool tiles = _tile_compute != nullptr;
+        pass = graph.add_pass("dof horizontal", [=](const FrameGraph::PassInfo & info) {
+            if (tiles)
+            {
+                blur_tiles(c->get(info), t->texture(src), t->texture(coc_texture), t->texture(temp), dof_blur_horizon);
+                return;
+            }
+            MTLRenderPassDescriptor* pass_desc = [_render_pass_desc copy];
+            t->bind(pass_desc.colorAttachments[0], info, temp);
+            blur(c->get(info), pass_desc, t->texture(src), t->texture(coc_texture), dof_blur_horizon);
+        }, enabled);
+        graph.read(pass, src);
+        graph.read(pass, coc_texture);
+        if (tiles)
+            graph.write_storage(pass, temp);
+        else
+            graph.write(pass, temp);
+        
+        pass = graph.add_pass("dof vertical", [=](const FrameGraph::PassInfo & info) {
+            if (tiles)
+            {
+                blur_tiles(c->get(info), t->texture(temp), t->texture(coc_texture), t->texture(output), dof_blur_vertical);
+                return;
+            }
+            MTLRenderPassDescriptor* pass_desc = [_render_pass_desc copy];
+            t->bind(pass_desc.colorAttachments[0], info, output);
+            blur(c->get(info), pass_desc, t->texture(temp), t->texture(coc_texture), dof_blur_vertical);
+        }, enabled);
+        graph.read(pass, temp);
+        graph.read(pass, coc_texture);
+        if (tiles)
+            graph.write_storage(pass, output);
+        else
+            graph.write(pass, output);
+        graph.bypass(pass, src, output);
+        return output;
     }
     
+    // Runs the blur passes as tile compute kernels from now on, the fragment passes again when nullptr.
+    void setTileCompute(TileCompute* tiles) { _tile_compute = tiles; }
+    
     void set_focus_range(float focus_range)
     {
         _focus_range = focus_range;
-        auto buffer = (AAPL::constant_dof_pass_coc*)[_constants_buffer_coc contents];
-        //buffer->focusDistance = focusDistance;
-        buffer->focusRange = focus_range;
-        //buffer->focusFalloff = to_simd_type(focusFalloff);
-
+        _constants_coc.focusRange = focus_range;
     }
     
     void set_focus_falloff(float focus_falloff)
     {
         _focus_falloff.x = _focus_falloff.y = focus_falloff;
-        auto buffer = (AAPL::constant_dof_pass_coc*)[_constants_buffer_coc contents];
-        //buffer->focusDistance = focusDistance;
-        ///buffer->focusRange = focus_range;
-        buffer->focusFalloff = {focus_falloff, focus_falloff};
+        _constants_coc.focusFalloff = {focus_falloff, focus_falloff};
     }
     
     void set_focus_distance(float focus_distance)
     {
         _focus_distance = focus_distance;
-        auto buffer = (AAPL::constant_dof_pass_coc*)[_constants_buffer_coc contents];
-        buffer->focusDistance = focus_distance;
+        _constants_coc.focusDistance = focus_distance;
     }
     
     private:
     
     enum dof_blur_mode{dof_blur_horizon, dof_blur_vertical};
     
-    void blur(id <MTLCommandBuffer> commandBuffer, RenderTexture & src, RenderTexture & dst, dof_blur_mode mode)
+    // into the attachment bound to desc, a copy of _render_pass_desc
+    void blur(id <MTLCommandBuffer> commandBuffer, MTLRenderPassDescriptor* desc, id <MTLTexture> src, id <MTLTexture> coc_texture,
+              dof_blur_mode mode) const
     {
-        _render_pass_desc.colorAttachments[0].texture = dst.texture();
-        auto encoder = [commandBuffer renderCommandEncoderWithDescriptor: _render_pass_desc];
+        auto encoder = [commandBuffer renderCommandEncoderWithDescriptor: desc];
         [encoder pushDebugGroup:@"DOFBlurPass"];
         encoder.label = @"DOF blur pass";
         
@@ -174,13 +229,10 @@ class DepthOfField
         [encoder setRenderPipelineState: _pipeline_state[0]];
         [encoder setCullMode: MTLCullModeNone];
         
-        if (dof_blur_vertical == mode)
-            [encoder setFragmentBuffer: _constants_buffer_blur[1] offset:0 atIndex:0];
-        else
-            [encoder setFragmentBuffer: _constants_buffer_blur[0] offset:0 atIndex:0];
+        _frame_constants->set_fragment(encoder, _constants_blur[dof_blur_vertical == mode ? 1 : 0], 0);
         
-        [encoder setFragmentTexture: src.texture() atIndex:0];
-        [encoder setFragmentTexture: _rt_coc.texture() atIndex:1];
+        [encoder setFragmentTexture: src atIndex:0];
+        [encoder setFragmentTexture: coc_texture atIndex:1];
         
         ModelManager::screen_aligned_quad.render(encoder);
         
@@ -188,10 +240,26 @@ class DepthOfField
         [encoder endEncoding];
     }
     
-    void coc(id <MTLCommandBuffer> commandBuffer, RenderTexture & depth_texture, RenderTexture & dst)
+    void blur_tiles(id <MTLCommandBuffer> commandBuffer, id <MTLTexture> src, id <MTLTexture> coc_texture, id <MTLTexture> dst,
+                    dof_blur_mode mode) const
+    {
+        auto encoder = [commandBuffer computeCommandEncoder];
+        [encoder pushDebugGroup:@"DOFBlurTiles"];
+        encoder.label = @"DOF blur tiles";
+        
+        [encoder setComputePipelineState: _pipeline_blur_tiles];
+        _frame_constants->set_compute(encoder, _constants_blur[dof_blur_vertical == mode ? 1 : 0], 0);
+        [encoder setTexture: src atIndex:0];
+        [encoder setTexture: coc_texture atIndex:1];
+        _tile_compute->dispatch(encoder, dof_blur_vertical == mode ? AAPL::TileKernelDOFVertical : AAPL::TileKernelDOFHorizontal, dst);
+        
+        [encoder popDebugGroup];
+        [encoder endEncoding];
+    }
+    
+    void coc(id <MTLCommandBuffer> commandBuffer, MTLRenderPassDescriptor* desc, id <MTLTexture> depth_texture) const
     {
-        _render_pass_desc.colorAttachments[0].texture = dst.texture();
-        auto encoder = [commandBuffer renderCommandEncoderWithDescriptor: _render_pass_desc];
+        auto encoder = [commandBuffer renderCommandEncoderWithDescriptor: desc];
         [encoder pushDebugGroup:@"DOFCoCPass"];
         encoder.label = @"DOF CoC pass";
         
@@ -200,8 +268,8 @@ class DepthOfField
         [encoder setRenderPipelineState: _pipeline_state[1]];
         [encoder setCullMode: MTLCullModeNone];
 
-        [encoder setFragmentBuffer: _constants_buffer_coc offset:0 atIndex:0];
-        [encoder setFragmentTexture: depth_texture.texture() atIndex:0];
+        _frame_constants->set_fragment(encoder, _constants_coc, 0);
+        [encoder setFragmentTexture: depth_texture atIndex:0];
         
         ModelManager::screen_aligned_quad.render(encoder);
         
@@ -211,6 +279,7 @@ class DepthOfField
     
 
     float _blur_width;
+    int _width, _height;
     float _focus_distance;
     float _focus_range;
     glm::vec2 _focus_falloff;
@@ -220,15 +289,15 @@ private:
 //    static Shader shader_blur;
     
     id <MTLRenderPipelineState> _pipeline_state[2];
+    id <MTLComputePipelineState> _pipeline_blur_tiles;
+    TileCompute*                _tile_compute;
     MTLRenderPassDescriptor*    _render_pass_desc;
     
     id <MTLDepthStencilState>   _depth_state;
     
-    id <MTLBuffer> _constants_buffer_coc;
-    id <MTLBuffer> _constants_buffer_blur[2];
-    
-    RenderTexture _rt_temp;
-    RenderTexture _rt_coc;
+    FrameConstants*                 _frame_constants;
+    AAPL::constant_dof_pass_coc     _constants_coc;
+    AAPL::constant_dof_pass_blur    _constants_blur[2];     // horizontal, vertical
 };
 
 
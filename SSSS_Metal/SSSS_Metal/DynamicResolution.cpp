@@ -0,0 +1,131 @@
+//
+//  DynamicResolution.cpp
+//  SSSS_Metal
+//
+
+#include "DynamicResolution.h"
+
+#include <algorithm>
+#include <cmath>
+
+DynamicResolution::Settings::Settings() :
+    target_ms(1000.0 / 60.0),
+    window(30),                 // the frames the fps label averages
+    settle_frames(3),           // kInFlightCommandBuffers
+    lower_above(0.95),          // headroom for frame to frame noise
+    raise_below(0.8),           // wider apart than what one step changes
+    raise_after(3),
+    scale_step(0.125f)
+{
+    min_scale[PassSSSS] = 0.75f;    // the skin is what the demo is about
+    min_scale[PassBloom] = 0.5f;
+    min_scale[PassDOF] = 0.5f;
+}
+
+DynamicResolution::DynamicResolution(const Settings & settings) : _settings(settings)
+{
+    reset();
+}
+
+void DynamicResolution::reset()
+{
+    for (int p = 0; p < PASS_COUNT; p++)
+        _scale[p] = 1.0f;
+    _sum_ms = 0.0;
+    _frames = 0;
+    _settling = 0;
+    _windows_under = 0;
+    _average_ms = 0.0;
+    _changes = 0;
+}
+
+bool DynamicResolution::add_frame(double ms)
+{
+    if (_settling > 0)
+    {
+        _settling--;
+        return false;
+    }
+    _sum_ms += ms;
+    if (++_frames < _settings.window)
+        return false;
+    
+    _average_ms = _sum_ms / _frames;
+    _sum_ms = 0.0;
+    _frames = 0;
+    
+    bool changed = false;
+    if (_average_ms > _settings.target_ms * _settings.lower_above)
+    {
+        _windows_under = 0;
+        changed = lower();
+    }
+    else if (_average_ms < _settings.target_ms * _settings.raise_below)
+    {
+        if (++_windows_under >= _settings.raise_after)
+        {
+            _windows_under = 0;
+            changed = raise();
+        }
+    }
+    else
+    {
+        _windows_under = 0;
+    }
+    
+    if (changed)
+    {
+        _changes++;
+        _settling = _settings.settle_frames;
+    }
+    return changed;
+}
+
+// The highest pass that can still go down, depth of field first on a tie,
+// then bloom: the passes lose resolution in turn.
+bool DynamicResolution::lower()
+{
+    const Pass order[] = { PassDOF, PassBloom, PassSSSS };
+    int best = -1;
+    for (Pass p : order)
+    {
+        if (_scale[p] - _settings.scale_step >= _settings.min_scale[p] - 1e-4f && (best < 0 || _scale[p] > _scale[best]))
+            best = p;
+    }
+    if (best < 0)
+        return false;
+    _scale[best] -= _settings.scale_step;
+    return true;
+}
+
+// The lowest pass, SSS first on a tie.
+bool DynamicResolution::raise()
+{
+    const Pass order[] = { PassSSSS, PassBloom, PassDOF };
+    int best = -1;
+    for (Pass p : order)
+    {
+        if (_scale[p] < 1.0f && (best < 0 || _scale[p] < _scale[best]))
+            best = p;
+    }
+    if (best < 0)
+        return false;
+    _scale[best] = std::min(_scale[best] + _settings.scale_step, 1.0f);
+    return true;
+}
+
+const char* DynamicResolution::pass_name(Pass pass)
+{
+    switch (pass)
+    {
+        case PassSSSS:  return "ssss";
+        case PassBloom: return "bloom";
+        case PassDOF:   return "dof";
+        default:        return "?";
+    }
+}
+
+int DynamicResolution::scaled_size(int size, float scale)
+{
+    return std::max((int)std::floor(size * scale + 0.5f), 1);
+}
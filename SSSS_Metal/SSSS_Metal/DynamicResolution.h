@@ -0,0 +1,81 @@
+//
+//  DynamicResolution.h
+//  SSSS_Metal
+//
+//  Picks the render scale of the post-process passes (SSS, bloom, depth of
+//  field) from measured frame times. Frames are averaged over a window, a
+//  window over budget lowers one pass a step, and only several windows in a
+//  row well under budget raise one again, so the scales don't oscillate
+//  around the budget. Scales are relative to the window size.
+//
+//  Plain C++: the renderer feeds it GPU frame times, ssss_tool replays
+//  recorded traces through it.
+//
+
+#ifndef SSSS_Metal_DynamicResolution_h
+#define SSSS_Metal_DynamicResolution_h
+
+class DynamicResolution
+{
+public:
+    enum Pass
+    {
+        PassSSSS,
+        PassBloom,
+        PassDOF,
+        PASS_COUNT,
+    };
+    
+    struct Settings
+    {
+        Settings();
+        
+        double target_ms;           // frame budget
+        int window;                 // frames averaged per decision
+        int settle_frames;          // frames ignored after a change, still in flight at the old scales
+        double lower_above;         // a window over target_ms * lower_above lowers a pass
+        double raise_below;         // raise_after windows in a row under target_ms * raise_below raise one
+        int raise_after;
+        float scale_step;
+        float min_scale[PASS_COUNT];
+    };
+    
+    explicit DynamicResolution(const Settings & settings = Settings());
+    
+    const Settings & settings() const { return _settings; }
+    
+    /**
+     * Adds the time of a frame rendered at the current scales. Returns true
+     * when it closed a window that changed a scale.
+     */
+    bool add_frame(double ms);
+    
+    float scale(Pass pass) const { return _scale[pass]; }
+    
+    // average of the last full window, 0 before the first one
+    double average_ms() const { return _average_ms; }
+    int changes() const { return _changes; }
+    
+    // Back to full resolution, the measurements start over.
+    void reset();
+    
+    static const char* pass_name(Pass pass);
+    
+    // size of a target scaled from size, at least 1
+    static int scaled_size(int size, float scale);
+
+private:
+    bool lower();
+    bool raise();
+    
+    Settings _settings;
+    float _scale[PASS_COUNT];
+    double _sum_ms;
+    int _frames;
+    int _settling;
+    int _windows_under;
+    double _average_ms;
+    int _changes;
+};
+
+#endif
@@ -0,0 +1,709 @@
+//
+//  ETC2Codec.cpp
+//  SSSS_Metal
+//
+
+#include "ETC2Codec.h"
+
+#include <algorithm>
+#include <climits>
+#include <cmath>
+
+#include "ThreadPool.h"
+
+namespace
+{
+    // {+a, +b, -a, -b}, indexed by (msb << 1) | lsb of the pixel index
+    const int ETC_MODIFIERS[8][4] = {
+        { 2,   8,  -2,   -8 },
+        { 5,  17,  -5,  -17 },
+        { 9,  29,  -9,  -29 },
+        { 13, 42,  -13, -42 },
+        { 18, 60,  -18, -60 },
+        { 24, 80,  -24, -80 },
+        { 33, 106, -33, -106 },
+        { 47, 183, -47, -183 },
+    };
+    
+    // T and H modes
+    const int ETC_DISTANCES[8] = { 3, 6, 11, 16, 23, 32, 41, 64 };
+    
+    const int EAC_MODIFIERS[16][8] = {
+        { -3, -6,  -9, -15, 2, 5, 8, 14 },
+        { -3, -7, -10, -13, 2, 6, 9, 12 },
+        { -2, -5,  -8, -13, 1, 4, 7, 12 },
+        { -2, -4,  -6, -13, 1, 3, 5, 12 },
+        { -3, -6,  -8, -12, 2, 5, 7, 11 },
+        { -3, -7,  -9, -11, 2, 6, 8, 10 },
+        { -4, -7,  -8, -11, 3, 6, 7, 10 },
+        { -3, -5,  -8, -11, 2, 4, 7, 10 },
+        { -2, -6,  -8, -10, 1, 5, 7, 9 },
+        { -2, -5,  -8, -10, 1, 4, 7, 9 },
+        { -2, -4,  -8, -10, 1, 3, 7, 9 },
+        { -2, -5,  -7, -10, 1, 4, 6, 9 },
+        { -3, -4,  -7, -10, 2, 3, 6, 9 },
+        { -1, -2,  -3, -10, 0, 1, 2, 9 },
+        { -4, -6,  -8,  -9, 3, 5, 7, 8 },
+        { -3, -5,  -7,  -9, 2, 4, 6, 8 },
+    };
+    
+    inline int clamp_int(int v, int lo, int hi) { return v < lo ? lo : (v > hi ? hi : v); }
+    inline int clamp255(int v) { return clamp_int(v, 0, 255); }
+    
+    inline int expand4(int c) { return (c << 4) | c; }
+    inline int expand5(int c) { return (c << 3) | (c >> 2); }
+    inline int expand6(int c) { return (c << 2) | (c >> 4); }
+    inline int expand7(int c) { return (c << 1) | (c >> 6); }
+    inline int sign_extend3(int v) { return v >= 4 ? v - 8 : v; }
+    
+    // pixel indices are stored column by column
+    inline int pixel_bit(int x, int y) { return x * 4 + y; }
+    
+    inline uint32_t read_be32(const uint8_t* p)
+    {
+        return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+    }
+    
+    inline void write_be32(uint8_t* p, uint32_t v)
+    {
+        p[0] = (uint8_t)(v >> 24);
+        p[1] = (uint8_t)(v >> 16);
+        p[2] = (uint8_t)(v >> 8);
+        p[3] = (uint8_t)v;
+    }
+    
+    inline int color_error(const uint8_t* a, const int* b)
+    {
+        int e = 0;
+        for (int c = 0; c < 3; c++)
+        {
+            int d = (int)a[c] - b[c];
+            e += d * d;
+        }
+        return e;
+    }
+    
+    // Row-major pixel numbers of the two halves of a block: left / right
+    // columns without flip, top / bottom rows with it.
+    void subblock_pixels(bool flip, int half, int* pixels)
+    {
+        int n = 0;
+        for (int y = 0; y < 4; y++)
+            for (int x = 0; x < 4; x++)
+                if ((flip ? y >= 2 : x >= 2) == (half == 1))
+                    pixels[n++] = y * 4 + x;
+    }
+    
+    // Index of the modifier closest to a pixel, and its error.
+    int best_modifier(const uint8_t* p, const int* base, int table, int& error)
+    {
+        int best = 0;
+        error = INT_MAX;
+        for (int m = 0; m < 4; m++)
+        {
+            int c[3];
+            for (int k = 0; k < 3; k++)
+                c[k] = clamp255(base[k] + ETC_MODIFIERS[table][m]);
+            int e = color_error(p, c);
+            if (e < error)
+            {
+                error = e;
+                best = m;
+            }
+        }
+        return best;
+    }
+    
+    // Best modifier table for 8 pixels around an (expanded) base color.
+    int fit_table(const uint8_t* rgb, const int* pixels, const int* base, int& table)
+    {
+        int best = INT_MAX;
+        for (int t = 0; t < 8; t++)
+        {
+            int error = 0;
+            for (int i = 0; i < 8 && error < best; i++)
+            {
+                int e;
+                best_modifier(rgb + pixels[i] * 3, base, t, e);
+                error += e;
+            }
+            if (error < best)
+            {
+                best = error;
+                table = t;
+            }
+        }
+        return best;
+    }
+    
+    // Base color candidates of one half in `bits` per channel: the two
+    // levels around the average for each channel.
+    struct BaseCandidate
+    {
+        int color[3];   // quantized
+        int table;
+        int error;
+    };
+    
+    void fit_half(const uint8_t* rgb, const int* pixels, int bits, BaseCandidate* candidates)
+    {
+        const int levels = (1 << bits) - 1;
+        float average[3] = { 0.0f, 0.0f, 0.0f };
+        for (int i = 0; i < 8; i++)
+            for (int c = 0; c < 3; c++)
+                average[c] += rgb[pixels[i] * 3 + c];
+        int lo[3];
+        for (int c = 0; c < 3; c++)
+            lo[c] = clamp_int((int)floorf(average[c] / 8.0f * levels / 255.0f), 0, levels - 1);
+        
+        for (int k = 0; k < 8; k++)
+        {
+            BaseCandidate& candidate = candidates[k];
+            int base[3];
+            for (int c = 0; c < 3; c++)
+            {
+                candidate.color[c] = lo[c] + ((k >> c) & 1);
+                base[c] = bits == 4 ? expand4(candidate.color[c]) : expand5(candidate.color[c]);
+            }
+            candidate.error = fit_table(rgb, pixels, base, candidate.table);
+        }
+    }
+    
+    uint32_t pack_selectors(const uint8_t* rgb, bool flip, const int base[2][3], const int table[2])
+    {
+        uint32_t lo = 0;
+        for (int half = 0; half < 2; half++)
+        {
+            int pixels[8];
+            subblock_pixels(flip, half, pixels);
+            for (int i = 0; i < 8; i++)
+            {
+                int e;
+                int m = best_modifier(rgb + pixels[i] * 3, base[half], table[half], e);
+                int bit = pixel_bit(pixels[i] % 4, pixels[i] / 4);
+                lo |= (uint32_t)(m >> 1) << (16 + bit);
+                lo |= (uint32_t)(m & 1) << bit;
+            }
+        }
+        return lo;
+    }
+    
+    void encode_individual(const uint8_t* rgb, bool flip, uint8_t* block)
+    {
+        BaseCandidate best[2];
+        for (int half = 0; half < 2; half++)
+        {
+            int pixels[8];
+            BaseCandidate candidates[8];
+            subblock_pixels(flip, half, pixels);
+            fit_half(rgb, pixels, 4, candidates);
+            best[half] = *std::min_element(candidates, candidates + 8,
+                [](const BaseCandidate& a, const BaseCandidate& b) { return a.error < b.error; });
+        }
+        
+        uint32_t hi = 0;
+        for (int c = 0; c < 3; c++)
+            hi |= (uint32_t)((best[0].color[c] << 4) | best[1].color[c]) << (24 - c * 8);
+        hi |= (uint32_t)best[0].table << 5 | (uint32_t)best[1].table << 2 | (flip ? 1u : 0u);
+        
+        int base[2][3];
+        int table[2] = { best[0].table, best[1].table };
+        for (int half = 0; half < 2; half++)
+            for (int c = 0; c < 3; c++)
+                base[half][c] = expand4(best[half].color[c]);
+        write_be32(block, hi);
+        write_be32(block + 4, pack_selectors(rgb, flip, base, table));
+    }
+    
+    void encode_differential(const uint8_t* rgb, bool flip, uint8_t* block)
+    {
+        int pixels[2][8];
+        BaseCandidate candidates[2][8];
+        for (int half = 0; half < 2; half++)
+        {
+            subblock_pixels(flip, half, pixels[half]);
+            fit_half(rgb, pixels[half], 5, candidates[half]);
+        }
+        
+        // the second color is stored as a 3 bit signed delta from the first
+        BaseCandidate first, second;
+        int best = INT_MAX;
+        for (int i = 0; i < 8; i++)
+        {
+            for (int j = 0; j < 8; j++)
+            {
+                const BaseCandidate& a = candidates[0][i];
+                const BaseCandidate& b = candidates[1][j];
+                bool representable = true;
+                for (int c = 0; c < 3; c++)
+                {
+                    int d = b.color[c] - a.color[c];
+                    representable &= d >= -4 && d <= 3;
+                }
+                if (representable && a.error + b.error < best)
+                {
+                    best = a.error + b.error;
+                    first = a;
+                    second = b;
+                }
+            }
+        }
+        if (best == INT_MAX)
+        {
+            // halves too far apart: keep the best first color, pull the
+            // second one in range
+            first = *std::min_element(candidates[0], candidates[0] + 8,
+                [](const BaseCandidate& a, const BaseCandidate& b) { return a.error < b.error; });
+            second = *std::min_element(candidates[1], candidates[1] + 8,
+                [](const BaseCandidate& a, const BaseCandidate& b) { return a.error < b.error; });
+            int base[3];
+            for (int c = 0; c < 3; c++)
+            {
+                second.color[c] = clamp_int(second.color[c], first.color[c] - 4, first.color[c] + 3);
+                base[c] = expand5(second.color[c]);
+            }
+            second.error = fit_table(rgb, pixels[1], base, second.table);
+        }
+        
+        uint32_t hi = 0;
+        for (int c = 0; c < 3; c++)
+        {
+            int d = second.color[c] - first.color[c];
+            hi |= (uint32_t)((first.color[c] << 3) | (d & 7)) << (24 - c * 8);
+        }
+        hi |= (uint32_t)first.table << 5 | (uint32_t)second.table << 2 | 2u | (flip ? 1u : 0u);
+        
+        int base[2][3];
+        int table[2] = { first.table, second.table };
+        for (int c = 0; c < 3; c++)
+        {
+            base[0][c] = expand5(first.color[c]);
+            base[1][c] = expand5(second.color[c]);
+        }
+        write_be32(block, hi);
+        write_be32(block + 4, pack_selectors(rgb, flip, base, table));
+    }
+    
+    // Sets the unused bit of a 5 bit base + 3 bit delta field so that the
+    // sum stays in [0, 31]: the field then does not select another mode.
+    uint32_t keep_in_range(uint32_t hi, int base_msb)
+    {
+        bool negative = (hi >> (base_msb - 5)) & 1;
+        return negative ? hi | (1u << base_msb) : hi & ~(1u << base_msb);
+    }
+    
+    // Planar mode: a linear gradient through the origin, horizontal and
+    // vertical end colors, fitted by least squares.
+    void encode_planar(const uint8_t* rgb, uint8_t* block)
+    {
+        int o[3], h[3], v[3];
+        for (int c = 0; c < 3; c++)
+        {
+            float mean = 0.0f, dx = 0.0f, dy = 0.0f;
+            for (int y = 0; y < 4; y++)
+            {
+                for (int x = 0; x < 4; x++)
+                {
+                    float value = rgb[(y * 4 + x) * 3 + c];
+                    mean += value;
+                    dx += (x - 1.5f) * value;
+                    dy += (y - 1.5f) * value;
+                }
+            }
+            mean /= 16.0f;
+            dx /= 20.0f;
+            dy /= 20.0f;
+            float origin = mean - 1.5f * dx - 1.5f * dy;
+            int levels = c == 1 ? 127 : 63;
+            o[c] = clamp_int((int)lroundf(origin * levels / 255.0f), 0, levels);
+            h[c] = clamp_int((int)lroundf((origin + 4.0f * dx) * levels / 255.0f), 0, levels);
+            v[c] = clamp_int((int)lroundf((origin + 4.0f * dy) * levels / 255.0f), 0, levels);
+        }
+        
+        uint32_t hi = 0, lo = 0;
+        hi |= (uint32_t)o[0] << 25;
+        hi |= (uint32_t)(o[1] >> 6) << 24 | (uint32_t)(o[1] & 63) << 17;
+        hi |= (uint32_t)(o[2] >> 5) << 16 | (uint32_t)((o[2] >> 3) & 3) << 11 | (uint32_t)(o[2] & 7) << 7;
+        hi |= (uint32_t)(h[0] >> 1) << 2 | 2u | (uint32_t)(h[0] & 1);
+        lo |= (uint32_t)h[1] << 25 | (uint32_t)h[2] << 19;
+        lo |= (uint32_t)v[0] << 13 | (uint32_t)v[1] << 6 | (uint32_t)v[2];
+        
+        // The red and green differential fields must not overflow, the blue
+        // one must: base bits 47..45 and delta sign 42 are free for that.
+        hi = keep_in_range(hi, 31);
+        hi = keep_in_range(hi, 23);
+        int base_low = (hi >> 11) & 3, delta_low = (hi >> 8) & 3;
+        if (base_low + delta_low < 4)
+            hi = (hi & ~(7u << 13)) | (1u << 10);
+        else
+            hi = (hi | (7u << 13)) & ~(1u << 10);
+        
+        write_be32(block, hi);
+        write_be32(block + 4, lo);
+    }
+    
+    int block_error(const uint8_t* rgb, const uint8_t* block)
+    {
+        uint8_t decoded[16 * 3];
+        ETC2Codec::decode_color_block(block, decoded);
+        int error = 0;
+        for (int i = 0; i < 16 * 3; i++)
+        {
+            int d = (int)rgb[i] - decoded[i];
+            error += d * d;
+        }
+        return error;
+    }
+    
+    inline int eac_value(int base, int multiplier, int modifier, bool eleven_bit)
+    {
+        if (!eleven_bit)
+            return clamp255(base + modifier * multiplier);
+        int step = multiplier ? multiplier * 8 : 1;
+        return clamp_int(base * 8 + 4 + modifier * step, 0, 2047);
+    }
+}
+
+void ETC2Codec::encode_color_block(const uint8_t* rgb, uint8_t* block)
+{
+    uint8_t candidate[8];
+    int best = INT_MAX;
+    for (int mode = 0; mode < 5 && best > 0; mode++)
+    {
+        bool flip = mode & 1;
+        if (mode < 2)
+            encode_differential(rgb, flip, candidate);
+        else if (mode < 4)
+            encode_individual(rgb, flip, candidate);
+        else
+            encode_planar(rgb, candidate);
+        int error = block_error(rgb, candidate);
+        if (error < best)
+        {
+            best = error;
+            std::copy(candidate, candidate + 8, block);
+        }
+    }
+}
+
+void ETC2Codec::decode_color_block(const uint8_t* block, uint8_t* rgb)
+{
+    const uint32_t hi = read_be32(block);
+    const uint32_t lo = read_be32(block + 4);
+    const bool differential = (hi >> 1) & 1;
+    
+    int r = (hi >> 27) & 31, dr = sign_extend3((hi >> 24) & 7);
+    int g = (hi >> 19) & 31, dg = sign_extend3((hi >> 16) & 7);
+    int b = (hi >> 11) & 31, db = sign_extend3((hi >> 8) & 7);
+    
+    if (!differential || (r + dr >= 0 && r + dr <= 31 && g + dg >= 0 && g + dg <= 31 && b + db >= 0 && b + db <= 31))
+    {
+        // ETC1: two halves with a base color and a modifier table each
+        int base[2][3];
+        if (differential)
+        {
+            int first[3] = { r, g, b };
+            int delta[3] = { dr, dg, db };
+            for (int c = 0; c < 3; c++)
+            {
+                base[0][c] = expand5(first[c]);
+                base[1][c] = expand5(first[c] + delta[c]);
+            }
+        }
+        else
+        {
+            for (int c = 0; c < 3; c++)
+            {
+                base[0][c] = expand4((hi >> (28 - c * 8)) & 15);
+                base[1][c] = expand4((hi >> (24 - c * 8)) & 15);
+            }
+        }
+        int table[2] = { (int)(hi >> 5) & 7, (int)(hi >> 2) & 7 };
+        bool flip = hi & 1;
+        for (int y = 0; y < 4; y++)
+        {
+            for (int x = 0; x < 4; x++)
+            {
+                int half = (flip ? y >= 2 : x >= 2) ? 1 : 0;
+                int bit = pixel_bit(x, y);
+                int m = (int)(((lo >> (16 + bit)) & 1) << 1 | ((lo >> bit) & 1));
+                for (int c = 0; c < 3; c++)
+                    rgb[(y * 4 + x) * 3 + c] = (uint8_t)clamp255(base[half][c] + ETC_MODIFIERS[table[half]][m]);
+            }
+        }
+        return;
+    }
+    
+    if (r + dr < 0 || r + dr > 31 || g + dg < 0 || g + dg > 31)
+    {
+        // T or H mode: four paint colors built from two 4 bit colors
+        int paint[4][3];
+        if (r + dr < 0 || r + dr > 31)
+        {
+            int c0[3] = { (int)(((hi >> 27) & 3) << 2 | ((hi >> 24) & 3)), (int)(hi >> 20) & 15, (int)(hi >> 16) & 15 };
+            int c1[3] = { (int)(hi >> 12) & 15, (int)(hi >> 8) & 15, (int)(hi >> 4) & 15 };
+            int d = ETC_DISTANCES[((hi >> 2) & 3) << 1 | (hi & 1)];
+            for (int c = 0; c < 3; c++)
+            {
+                paint[0][c] = expand4(c0[c]);
+                paint[1][c] = clamp255(expand4(c1[c]) + d);
+                paint[2][c] = expand4(c1[c]);
+                paint[3][c] = clamp255(expand4(c1[c]) - d);
+            }
+        }
+        else
+        {
+            int c0[3] = { (int)(hi >> 27) & 15,
+                          (int)(((hi >> 24) & 7) << 1 | ((hi >> 20) & 1)),
+                          (int)(((hi >> 19) & 1) << 3 | ((hi >> 15) & 7)) };
+            int c1[3] = { (int)(hi >> 11) & 15, (int)(hi >> 7) & 15, (int)(hi >> 3) & 15 };
+            int v0 = c0[0] << 8 | c0[1] << 4 | c0[2];
+            int v1 = c1[0] << 8 | c1[1] << 4 | c1[2];
+            int d = ETC_DISTANCES[(hi & 4) | (hi & 1) << 1 | (v0 >= v1 ? 1 : 0)];
+            for (int c = 0; c < 3; c++)
+            {
+                paint[0][c] = clamp255(expand4(c0[c]) + d);
+                paint[1][c] = clamp255(expand4(c0[c]) - d);
+                paint[2][c] = clamp255(expand4(c1[c]) + d);
+                paint[3][c] = clamp255(expand4(c1[c]) - d);
+            }
+        }
+        for (int y = 0; y < 4; y++)
+        {
+            for (int x = 0; x < 4; x++)
+            {
+                int bit = pixel_bit(x, y);
+                int m = (int)(((lo >> (16 + bit)) & 1) << 1 | ((lo >> bit) & 1));
+                for (int c = 0; c < 3; c++)
+                    rgb[(y * 4 + x) * 3 + c] = (uint8_t)paint[m][c];
+            }
+        }
+        return;
+    }
+    
+    // planar
+    int o[3], h[3], v[3];
+    o[0] = expand6((hi >> 25) & 63);
+    o[1] = expand7((int)(((hi >> 24) & 1) << 6 | ((hi >> 17) & 63)));
+    o[2] = expand6((int)(((hi >> 16) & 1) << 5 | ((hi >> 11) & 3) << 3 | ((hi >> 7) & 7)));
+    h[0] = expand6((int)(((hi >> 2) & 31) << 1 | (hi & 1)));
+    h[1] = expand7((lo >> 25) & 127);
+    h[2] = expand6((lo >> 19) & 63);
+    v[0] = expand6((lo >> 13) & 63);
+    v[1] = expand7((lo >> 6) & 127);
+    v[2] = expand6(lo & 63);
+    for (int y = 0; y < 4; y++)
+        for (int x = 0; x < 4; x++)
+            for (int c = 0; c < 3; c++)
+                rgb[(y * 4 + x) * 3 + c] = (uint8_t)clamp255((x * (h[c] - o[c]) + y * (v[c] - o[c]) + 4 * o[c] + 2) >> 2);
+}
+
+void ETC2Codec::encode_eac_block(const int* values, bool eleven_bit, uint8_t* block)
+{
+    const int unit = eleven_bit ? 8 : 1;
+    const int lo = *std::min_element(values, values + 16);
+    const int hi = *std::max_element(values, values + 16);
+    
+    int best = INT_MAX;
+    int best_base = 0, best_multiplier = 0, best_table = 0;
+    for (int t = 0; t < 16 && best > 0; t++)
+    {
+        const int* modifiers = EAC_MODIFIERS[t];
+        int span = modifiers[7] - modifiers[3];
+        int m0 = (int)floorf((hi - lo) / float(span * unit));
+        for (int multiplier = m0; multiplier <= m0 + 1; multiplier++)
+        {
+            if (multiplier > 15)
+                continue;
+            int step = eleven_bit ? (multiplier ? multiplier * 8 : 1) : multiplier;
+            float center = (hi + lo) * 0.5f - (modifiers[7] + modifiers[3]) * step * 0.5f;
+            int base0 = (int)lroundf(eleven_bit ? (center - 4.0f) / 8.0f : center);
+            for (int base = base0 - 1; base <= base0 + 1; base++)
+            {
+                if (base < 0 || base > 255)
+                    continue;
+                int error = 0;
+                for (int i = 0; i < 16 && error < best; i++)
+                {
+                    int e = INT_MAX;
+                    for (int k = 0; k < 8; k++)
+                    {
+                        int d = eac_value(base, multiplier, modifiers[k], eleven_bit) - values[i];
+                        e = std::min(e, d * d);
+                    }
+                    error += e;
+                }
+                if (error < best)
+                {
+                    best = error;
+                    best_base = base;
+                    best_multiplier = multiplier;
+                    best_table = t;
+                }
+            }
+        }
+    }
+    
+    uint64_t bits = (uint64_t)best_base << 56 | (uint64_t)best_multiplier << 52 | (uint64_t)best_table << 48;
+    for (int y = 0; y < 4; y++)
+    {
+        for (int x = 0; x < 4; x++)
+        {
+            int value = values[y * 4 + x];
+            int index = 0, e = INT_MAX;
+            for (int k = 0; k < 8; k++)
+            {
+                int d = eac_value(best_base, best_multiplier, EAC_MODIFIERS[best_table][k], eleven_bit) - value;
+                if (d * d < e)
+                {
+                    e = d * d;
+                    index = k;
+                }
+            }
+            bits |= (uint64_t)index << (45 - 3 * pixel_bit(x, y));
+        }
+    }
+    write_be32(block, (uint32_t)(bits >> 32));
+    write_be32(block + 4, (uint32_t)bits);
+}
+
+void ETC2Codec::decode_eac_block(const uint8_t* block, bool eleven_bit, int* values)
+{
+    uint64_t bits = (uint64_t)read_be32(block) << 32 | read_be32(block + 4);
+    int base = (int)(bits >> 56);
+    int multiplier = (int)(bits >> 52) & 15;
+    const int* modifiers = EAC_MODIFIERS[(bits >> 48) & 15];
+    for (int y = 0; y < 4; y++)
+    {
+        for (int x = 0; x < 4; x++)
+        {
+            int index = (int)(bits >> (45 - 3 * pixel_bit(x, y))) & 7;
+            values[y * 4 + x] = eac_value(base, multiplier, modifiers[index], eleven_bit);
+        }
+    }
+}
+
+std::vector<uint8_t> ETC2Codec::encode(const CPUImage & image, ETC2Format format, ThreadPool* pool)
+{
+    const int blocks_x = (image.width() + 3) / 4;
+    const int blocks_y = (image.height() + 3) / 4;
+    const uint32_t block_size = bytes_per_block(format);
+    std::vector<uint8_t> blocks(encoded_size(format, image.width(), image.height()));
+    
+    auto encode_row = [&](int by)
+    {
+        for (int bx = 0; bx < blocks_x; bx++)
+        {
+            uint8_t rgb[16 * 3];
+            int channel[2][16];
+            for (int i = 0; i < 16; i++)
+            {
+                // texel() clamps to the edge
+                glm::vec4 t = glm::clamp(image.texel(bx * 4 + i % 4, by * 4 + i / 4), 0.0f, 1.0f);
+                for (int c = 0; c < 3; c++)
+                    rgb[i * 3 + c] = (uint8_t)(t[c] * 255.0f + 0.5f);
+                if (format == ETC2FormatRGBA8)
+                    channel[0][i] = (int)(t[3] * 255.0f + 0.5f);
+                else
+                {
+                    channel[0][i] = (int)(t[0] * 2047.0f + 0.5f);
+                    channel[1][i] = (int)(t[1] * 2047.0f + 0.5f);
+                }
+            }
+            
+            uint8_t* block = &blocks[((size_t)by * blocks_x + bx) * block_size];
+            switch (format)
+            {
+                case ETC2FormatRGB8:
+                    encode_color_block(rgb, block);
+                    break;
+                case ETC2FormatRGBA8:
+                    encode_eac_block(channel[0], false, block);
+                    encode_color_block(rgb, block + 8);
+                    break;
+                case ETC2FormatR11:
+                    encode_eac_block(channel[0], true, block);
+                    break;
+                case ETC2FormatRG11:
+                    encode_eac_block(channel[0], true, block);
+                    encode_eac_block(channel[1], true, block + 8);
+                    break;
+            }
+        }
+    };
+    
+    if (pool)
+        pool->parallel_for(blocks_y, encode_row);
+    else
+        for (int by = 0; by < blocks_y; by++)
+            encode_row(by);
+    return blocks;
+}
+
+void ETC2Codec::decode(const uint8_t* blocks, int width, int height, ETC2Format format, CPUImage & image)
+{
+    image.init(width, height, CPUPixelFormatRGBA32Float);
+    const int blocks_x = (width + 3) / 4;
+    const int blocks_y = (height + 3) / 4;
+    const uint32_t block_size = bytes_per_block(format);
+    
+    for (int by = 0; by < blocks_y; by++)
+    {
+        for (int bx = 0; bx < blocks_x; bx++)
+        {
+            const uint8_t* block = blocks + ((size_t)by * blocks_x + bx) * block_size;
+            uint8_t rgb[16 * 3] = {};
+            int channel[2][16] = {};
+            switch (format)
+            {
+                case ETC2FormatRGB8:
+                    decode_color_block(block, rgb);
+                    break;
+                case ETC2FormatRGBA8:
+                    decode_eac_block(block, false, channel[0]);
+                    decode_color_block(block + 8, rgb);
+                    break;
+                case ETC2FormatR11:
+                    decode_eac_block(block, true, channel[0]);
+                    break;
+                case ETC2FormatRG11:
+                    decode_eac_block(block, true, channel[0]);
+                    decode_eac_block(block + 8, true, channel[1]);
+                    break;
+            }
+            
+            for (int i = 0; i < 16; i++)
+            {
+                int x = bx * 4 + i % 4, y = by * 4 + i / 4;
+                if (x >= width || y >= height)
+                    continue;
+                glm::vec4 t(0.0f, 0.0f, 0.0f, 1.0f);
+                if (format == ETC2FormatRGB8 || format == ETC2FormatRGBA8)
+                {
+                    t = glm::vec4(rgb[i * 3], rgb[i * 3 + 1], rgb[i * 3 + 2], 255.0f) / 255.0f;
+                    if (format == ETC2FormatRGBA8)
+                        t[3] = channel[0][i] / 255.0f;
+                }
+                else
+                {
+                    t[0] = channel[0][i] / 2047.0f;
+                    if (format == ETC2FormatRG11)
+                        t[1] = channel[1][i] / 2047.0f;
+                }
+                image.store(x, y, t);
+            }
+        }
+    }
+}
+
+const char* ETC2Codec::format_name(ETC2Format format)
+{
+    switch (format)
+    {
+        case ETC2FormatRGB8:    return "ETC2_RGB8";
+        case ETC2FormatRGBA8:   return "ETC2_RGBA8 (EAC alpha)";
+        case ETC2FormatR11:     return "EAC_R11";
+        case ETC2FormatRG11:    return "EAC_RG11";
+        default:                return "unknown";
+    }
+}
@@ -0,0 +1,77 @@
+//
+//  ETC2Codec.h
+//  SSSS_Metal
+//
+//  ETC2 / EAC block compression, the formats every iOS GPU samples
+//  natively. The encoder is used offline to bake the head textures, the
+//  decoder by the CPU path and to measure the encoding error.
+//
+//  The encoder picks per block between the ETC1 individual and
+//  differential modes and the ETC2 planar mode; the decoder handles every
+//  mode, T and H included, so it reads files from other encoders too.
+//
+
+#ifndef SSSS_Metal_ETC2Codec_h
+#define SSSS_Metal_ETC2Codec_h
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "CPUImage.h"
+
+class ThreadPool;
+
+enum ETC2Format
+{
+    ETC2FormatRGB8,     // 4 bpp, color only
+    ETC2FormatRGBA8,    // 8 bpp, EAC alpha block + ETC2 color block
+    ETC2FormatR11,      // 4 bpp, one 11 bit channel
+    ETC2FormatRG11,     // 8 bpp, two 11 bit channels
+};
+
+class ETC2Codec
+{
+public:
+    static const int BLOCK_DIMENSION = 4;
+    
+    static uint32_t bytes_per_block(ETC2Format format)
+    {
+        return format == ETC2FormatRGB8 || format == ETC2FormatR11 ? 8 : 16;
+    }
+    
+    static size_t encoded_size(ETC2Format format, int width, int height)
+    {
+        return (size_t)((width + 3) / 4) * ((height + 3) / 4) * bytes_per_block(format);
+    }
+    
+    /**
+     * Encodes an image, row of blocks after row of blocks. RGB8 and RGBA8
+     * read the texels as 8 bit values, R11 and RG11 read r (and g) as 11
+     * bit unorm values. Partial blocks on the right and bottom edges repeat
+     * the last row / column. Rows of blocks are spread over the pool when
+     * one is given.
+     */
+    static std::vector<uint8_t> encode(const CPUImage & image, ETC2Format format, ThreadPool* pool = nullptr);
+    
+    /**
+     * Decodes into an RGBA32Float image the way the GPU samples the
+     * format: missing channels read as 0, alpha as 1.
+     */
+    static void decode(const uint8_t* blocks, int width, int height, ETC2Format format, CPUImage & image);
+    
+    // Single blocks. Pixels are in row-major order, 3 bytes (rgb) each.
+    static void encode_color_block(const uint8_t* rgb, uint8_t* block);
+    static void decode_color_block(const uint8_t* block, uint8_t* rgb);
+    
+    // EAC block of 16 values, 8 bit (alpha) or 11 bit (R11 / RG11).
+    static void encode_eac_block(const int* values, bool eleven_bit, uint8_t* block);
+    static void decode_eac_block(const uint8_t* block, bool eleven_bit, int* values);
+    
+    static const char* format_name(ETC2Format format);
+
+private:
+    ETC2Codec();
+};
+
+#endif
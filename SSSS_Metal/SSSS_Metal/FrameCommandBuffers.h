@@ -0,0 +1,57 @@
+//
+//  FrameCommandBuffers.h
+//  SSSS_Metal
+//
+//  The command buffers a frame is encoded into, one per ParallelEncoder
+//  batch. They are enqueued in batch order as they are made, so the GPU
+//  runs them in schedule order whichever is committed first; the passes
+//  find theirs by the batch the plan gave them.
+//
+
+#ifndef SSSS_Metal_FrameCommandBuffers_h
+#define SSSS_Metal_FrameCommandBuffers_h
+
+#import <Metal/Metal.h>
+
+#include <vector>
+
+#include "FrameGraph.h"
+#include "RenderTarget.h"
+
+class FrameCommandBuffers
+{
+public:
+    FrameCommandBuffers() {}
+    
+    // count new command buffers of queue, enqueued in order
+    void begin(id <MTLCommandQueue> queue, int count)
+    {
+        _buffers.clear();
+        for (int i = 0; i < count; i++)
+        {
+            id <MTLCommandBuffer> buffer = [queue commandBuffer];
+            buffer.label = [NSString stringWithFormat: @"frame batch %i", i];
+            [buffer enqueue];
+            _buffers.push_back(buffer);
+        }
+    }
+    
+    // the command buffer pass is encoded into
+    id <MTLCommandBuffer> get(const FrameGraph::PassInfo & pass) const { return _buffers[pass.batch]; }
+    
+    id <MTLCommandBuffer> buffer(int batch) const { return _buffers[batch]; }
+    int count() const { return (int)_buffers.size(); }
+    
+    // the GPU finishes it last: presents and signals the end of the frame
+    id <MTLCommandBuffer> last() const { return _buffers.back(); }
+    
+    // Lets go of the frame's command buffers once they are committed.
+    void end() { _buffers.clear(); }
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(FrameCommandBuffers)
+    
+    std::vector<id <MTLCommandBuffer>> _buffers;
+};
+
+#endif
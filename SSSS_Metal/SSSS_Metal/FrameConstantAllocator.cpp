@@ -0,0 +1,92 @@
+//
+//  FrameConstantAllocator.cpp
+//  SSSS_Metal
+//
+
+#include "FrameConstantAllocator.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstdio>
+
+static size_t align_up(size_t size, size_t alignment)
+{
+    return (size + alignment - 1) & ~(alignment - 1);
+}
+
+FrameConstantAllocator::FrameConstantAllocator()
+    : _memory(nullptr), _frame_bytes(0), _alignment(DEFAULT_ALIGNMENT), _frames(0), _slot(0),
+      _offset(0), _overflows(0), _peak_bytes(0), _overflowed_frames(0)
+{
+}
+
+size_t FrameConstantAllocator::total_bytes(size_t frame_bytes, int frames, size_t alignment)
+{
+    return align_up(frame_bytes, alignment) * frames;
+}
+
+void FrameConstantAllocator::init(void* memory, size_t frame_bytes, int frames, size_t alignment)
+{
+    assert(alignment > 0 && (alignment & (alignment - 1)) == 0 && "alignment must be a power of two");
+    assert(frames > 0);
+    _memory = (uint8_t*)memory;
+    _alignment = alignment;
+    _frame_bytes = align_up(frame_bytes, alignment);
+    _frames = frames;
+    _slot = 0;
+    _offset = 0;
+    _overflows = 0;
+    _peak_bytes = 0;
+    _overflowed_frames = 0;
+}
+
+void FrameConstantAllocator::end_frame()
+{
+    _peak_bytes = std::max(_peak_bytes, used_bytes());
+    if (_overflows.load() > 0)
+        _overflowed_frames++;
+}
+
+void FrameConstantAllocator::begin_frame(int slot)
+{
+    assert(slot >= 0 && slot < _frames);
+    end_frame();
+    _slot = slot;
+    _offset = 0;
+    _overflows = 0;
+}
+
+size_t FrameConstantAllocator::allocate(size_t size)
+{
+    size = align_up(std::max(size, (size_t)1), _alignment);
+    size_t offset = _offset.fetch_add(size);
+    if (offset + size > _frame_bytes)
+    {
+        _overflows++;
+        return INVALID_OFFSET;
+    }
+    return _slot * _frame_bytes + offset;
+}
+
+size_t FrameConstantAllocator::used_bytes() const
+{
+    return std::min(_offset.load(), _frame_bytes);
+}
+
+size_t FrameConstantAllocator::peak_bytes() const
+{
+    return std::max(_peak_bytes, used_bytes());
+}
+
+int FrameConstantAllocator::overflowed_frames() const
+{
+    return _overflowed_frames + (_overflows.load() > 0 ? 1 : 0);
+}
+
+std::string FrameConstantAllocator::report() const
+{
+    char text[128];
+    snprintf(text, sizeof(text), "%d slots of %.1f KB, peak %.1f KB, %d frames out of room",
+             _frames, _frame_bytes / 1024.0, peak_bytes() / 1024.0, overflowed_frames());
+    return text;
+}
@@ -0,0 +1,93 @@
+//
+//  FrameConstantAllocator.h
+//  SSSS_Metal
+//
+//  Linear allocator for the constants of a frame: one block of memory cut
+//  into a slot per frame in flight, each slot a bump allocation that is
+//  reset when the frame that used it last is done. The block is an
+//  MTLBuffer's contents in the app (FrameConstants); the allocator only
+//  hands out offsets into it.
+//
+//  Plain C++: ssss_tool frame-constants-report runs it on a vector standing
+//  in for the MTLBuffer, with slots handed back the way the renderer does.
+//
+
+#ifndef SSSS_Metal_FrameConstantAllocator_h
+#define SSSS_Metal_FrameConstantAllocator_h
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+class FrameConstantAllocator
+{
+public:
+    // Metal wants constant buffer offsets aligned to 256 bytes on macOS, 16 on iOS; take the larger
+    static const size_t DEFAULT_ALIGNMENT = 256;
+    static const size_t INVALID_OFFSET = SIZE_MAX;
+    
+    FrameConstantAllocator();
+    
+    // Bytes of the memory to give init(): frame_bytes, rounded up to alignment, per slot.
+    static size_t total_bytes(size_t frame_bytes, int frames, size_t alignment = DEFAULT_ALIGNMENT);
+    
+    /**
+     * memory: total_bytes(frame_bytes, frames, alignment) bytes, owned by
+     * the caller. alignment is a power of two; every allocation starts on
+     * it, relative to memory.
+     */
+    void init(void* memory, size_t frame_bytes, int frames, size_t alignment = DEFAULT_ALIGNMENT);
+    
+    /**
+     * Starts allocating from slot, dropping what the frame that used it
+     * last allocated: call it once the GPU is done with that frame (the
+     * renderer's in flight semaphore).
+     */
+    void begin_frame(int slot);
+    
+    /**
+     * size bytes of the current slot, rounded up to the alignment. Returns
+     * their offset from the memory, INVALID_OFFSET when the slot is full.
+     * Lock free: any thread can allocate while a frame is encoded.
+     */
+    size_t allocate(size_t size);
+    
+    void* pointer(size_t offset) const { return _memory + offset; }
+    
+    int frames() const { return _frames; }
+    int slot() const { return _slot; }
+    size_t frame_bytes() const { return _frame_bytes; }
+    size_t alignment() const { return _alignment; }
+    
+    // of the current frame: bytes allocated (alignment included) and allocations that failed
+    size_t used_bytes() const;
+    int overflows() const { return _overflows.load(); }
+    
+    // the most bytes a frame used since init(), and the frames that ran out of room
+    size_t peak_bytes() const;
+    int overflowed_frames() const;
+    
+    // one line: slots, bytes per slot, peak use and overflows
+    std::string report() const;
+
+private:
+    FrameConstantAllocator(const FrameConstantAllocator&);
+    FrameConstantAllocator& operator=(const FrameConstantAllocator&);
+    
+    // folds the current frame into the peak and overflow counts
+    void end_frame();
+    
+    uint8_t* _memory;
+    size_t _frame_bytes;
+    size_t _alignment;
+    int _frames;
+    int _slot;
+    // past _frame_bytes after an overflow
+    std::atomic<size_t> _offset;
+    std::atomic<int> _overflows;
+    size_t _peak_bytes;
+    int _overflowed_frames;
+};
+
+#endif
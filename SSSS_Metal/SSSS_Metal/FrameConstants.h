@@ -0,0 +1,119 @@
+//
+//  FrameConstants.h
+//  SSSS_Metal
+//
+//  The constants of every pass of a frame, in one MTLBuffer with a slot per
+//  frame in flight (FrameConstantAllocator does the bookkeeping). The
+//  renderer and the effects keep their constants on the CPU and copy them
+//  in when they encode a pass, so a frame never writes what the GPU may
+//  still be reading for an earlier one.
+//
+
+#ifndef SSSS_Metal_FrameConstants_h
+#define SSSS_Metal_FrameConstants_h
+
+#import <Metal/Metal.h>
+
+#include <atomic>
+#include <cstring>
+
+#include "Debug.h"
+#include "FrameConstantAllocator.h"
+#include "RenderContext.h"
+#include "RenderTarget.h"
+
+class FrameConstants
+{
+public:
+    // per frame: the main pass and its lights, the shadow and sky passes and
+    // the ~15 post-process passes take a few KB at 256 byte alignment
+    static const size_t FRAME_BYTES = 64 * 1024;
+    
+    FrameConstants() : _overflow_reported(false) {}
+    
+    void init(id <MTLDevice> device, size_t frame_bytes = FRAME_BYTES)
+    {
+        _buffer = [device newBufferWithLength: FrameConstantAllocator::total_bytes(frame_bytes, kInFlightCommandBuffers)
+                                      options: 0];
+        _buffer.label = @"frame_constants";
+        _allocator.init([_buffer contents], frame_bytes, kInFlightCommandBuffers);
+    }
+    
+    // Drops the constants of the frame in flight slot index, once the in flight semaphore handed it over.
+    void begin_frame(NSUInteger index) { _allocator.begin_frame((int)index); }
+    
+    const FrameConstantAllocator & allocator() const { return _allocator; }
+    
+    // Copies constants into this frame's slot and binds them at index.
+    template<typename T>
+    void set_vertex(id <MTLRenderCommandEncoder> encoder, const T & constants, NSUInteger index)
+    {
+        NSUInteger offset;
+        if (write(constants, offset))
+            [encoder setVertexBuffer: _buffer offset: offset atIndex: index];
+        else
+            [encoder setVertexBytes: &constants length: sizeof(T) atIndex: index];
+    }
+    
+    template<typename T>
+    void set_fragment(id <MTLRenderCommandEncoder> encoder, const T & constants, NSUInteger index)
+    {
+        NSUInteger offset;
+        if (write(constants, offset))
+            [encoder setFragmentBuffer: _buffer offset: offset atIndex: index];
+        else
+            [encoder setFragmentBytes: &constants length: sizeof(T) atIndex: index];
+    }
+    
+    // one copy for both stages
+    template<typename T>
+    void set_vertex_fragment(id <MTLRenderCommandEncoder> encoder, const T & constants, NSUInteger index)
+    {
+        NSUInteger offset;
+        if (write(constants, offset))
+        {
+            [encoder setVertexBuffer: _buffer offset: offset atIndex: index];
+            [encoder setFragmentBuffer: _buffer offset: offset atIndex: index];
+        }
+        else
+        {
+            [encoder setVertexBytes: &constants length: sizeof(T) atIndex: index];
+            [encoder setFragmentBytes: &constants length: sizeof(T) atIndex: index];
+        }
+    }
+    
+    template<typename T>
+    void set_compute(id <MTLComputeCommandEncoder> encoder, const T & constants, NSUInteger index)
+    {
+        NSUInteger offset;
+        if (write(constants, offset))
+            [encoder setBuffer: _buffer offset: offset atIndex: index];
+        else
+            [encoder setBytes: &constants length: sizeof(T) atIndex: index];
+    }
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(FrameConstants)
+    
+    // false when the slot is full: the caller falls back to setBytes, which Metal copies itself
+    template<typename T>
+    bool write(const T & constants, NSUInteger & offset)
+    {
+        size_t allocation = _allocator.allocate(sizeof(T));
+        if (allocation == FrameConstantAllocator::INVALID_OFFSET)
+        {
+            if (!_overflow_reported.exchange(true))
+                Debug::LogError("frame constants: out of room, raise FrameConstants::FRAME_BYTES (" + _allocator.report() + ")");
+            return false;
+        }
+        memcpy(_allocator.pointer(allocation), &constants, sizeof(T));
+        offset = allocation;
+        return true;
+    }
+    
+    id <MTLBuffer> _buffer;
+    FrameConstantAllocator _allocator;
+    std::atomic<bool> _overflow_reported;     // passes write from several encoding threads
+};
+
+#endif
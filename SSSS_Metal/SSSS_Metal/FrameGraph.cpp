@@ -0,0 +1,385 @@
+//
+//  FrameGraph.cpp
+//  SSSS_Metal
+//
+
+#include "FrameGraph.h"
+
+#include <cassert>
+#include <cstdio>
+#include <set>
+
+#include "RenderTargetPool.h"
+
+const FrameGraph::Attachment & FrameGraph::PassInfo::attachment(Resource resource) const
+{
+    for (const Attachment & a : writes)
+    {
+        if (a.resource == resource)
+            return a;
+    }
+    assert(!"not written by this pass");
+    return writes[0];
+}
+
+void FrameGraph::clear()
+{
+    _passes.clear();
+    _resources.clear();
+    _schedule.clear();
+    _compiled = false;
+}
+
+FrameGraph::Resource FrameGraph::create(const std::string & name, const FrameGraphTextureDesc & desc)
+{
+    ResourceInfo info;
+    info.name = name;
+    info.desc = desc;
+    info.imported = false;
+    info.output = false;
+    info.alias = (Resource)_resources.size();
+    info.physical = -1;
+    info.first_pass = info.last_pass = -1;
+    _resources.push_back(info);
+    return info.alias;
+}
+
+FrameGraph::Resource FrameGraph::import(const std::string & name, const FrameGraphTextureDesc & desc)
+{
+    Resource r = create(name, desc);
+    _resources[r].imported = true;
+    return r;
+}
+
+FrameGraph::Pass FrameGraph::add_pass(const std::string & name, std::function<void(const PassInfo&)> execute, bool enabled)
+{
+    PassInfo info;
+    info.name = name;
+    info.execute = execute;
+    info.enabled = enabled;
+    info.culled = false;
+    info.bypass_from = info.bypass_to = -1;
+    info.batch = 0;
+    _passes.push_back(info);
+    return (Pass)_passes.size() - 1;
+}
+
+void FrameGraph::read(Pass pass, Resource resource)
+{
+    _passes[pass].reads.push_back(resource);
+}
+
+void FrameGraph::write(Pass pass, Resource resource, FrameGraphLoadAction load)
+{
+    Attachment a = { resource, load, FrameGraphStoreStore, false };
+    _passes[pass].writes.push_back(a);
+}
+
+void FrameGraph::write_storage(Pass pass, Resource resource)
+{
+    Attachment a = { resource, FrameGraphLoadDontCare, FrameGraphStoreStore, true };
+    _passes[pass].writes.push_back(a);
+}
+
+void FrameGraph::bypass(Pass pass, Resource from, Resource to)
+{
+    _passes[pass].bypass_from = from;
+    _passes[pass].bypass_to = to;
+}
+
+void FrameGraph::set_output(Resource resource)
+{
+    _resources[resource].output = true;
+}
+
+bool FrameGraph::uses(const PassInfo & pass, Resource resource) const
+{
+    for (Resource r : pass.reads)
+    {
+        if (resolve(r) == resource)
+            return true;
+    }
+    for (const Attachment & a : pass.writes)
+    {
+        if (resolve(a.resource) == resource)
+            return true;
+    }
+    return false;
+}
+
+// pass reads what resource holds, or draws over it
+bool FrameGraph::needs_content(const PassInfo & pass, Resource resource) const
+{
+    for (Resource r : pass.reads)
+    {
+        if (resolve(r) == resource)
+            return true;
+    }
+    for (const Attachment & a : pass.writes)
+    {
+        if (resolve(a.resource) == resource && a.load == FrameGraphLoadLoad)
+            return true;
+    }
+    return false;
+}
+
+bool FrameGraph::compile(RenderTargetPool & pool, std::string* error)
+{
+    assert(!_compiled && "a graph compiles once, clear() and declare it again");
+    _compiled = true;
+    _pool = &pool;
+    _schedule.clear();
+    for (size_t r = 0; r < _resources.size(); r++)
+    {
+        _resources[r].alias = (Resource)r;
+        _resources[r].physical = -1;
+        _resources[r].first_pass = _resources[r].last_pass = -1;
+        _resources[r].desc.usage = 0;
+    }
+
+    // disabled passes hand their input on
+    for (PassInfo & pass : _passes)
+    {
+        pass.culled = !pass.enabled;
+        if (!pass.enabled && pass.bypass_to >= 0)
+            _resources[pass.bypass_to].alias = resolve(pass.bypass_from);
+    }
+
+    // from the outputs back: a pass lives if a later live pass (or the
+    // output) needs something it writes
+    std::vector<bool> needed(_resources.size(), false);
+    for (size_t r = 0; r < _resources.size(); r++)
+    {
+        if (_resources[r].output)
+            needed[resolve((Resource)r)] = true;
+    }
+    for (int p = (int)_passes.size() - 1; p >= 0; p--)
+    {
+        PassInfo & pass = _passes[p];
+        if (pass.culled)
+            continue;
+        bool live = false;
+        for (const Attachment & a : pass.writes)
+            live = live || needed[resolve(a.resource)];
+        if (!live)
+        {
+            pass.culled = true;
+            continue;
+        }
+        // what it overwrites is not needed before it, what it reads is
+        for (const Attachment & a : pass.writes)
+            needed[resolve(a.resource)] = a.load == FrameGraphLoadLoad;
+        for (Resource r : pass.reads)
+            needed[resolve(r)] = true;
+    }
+    for (Pass p = 0; p < (Pass)_passes.size(); p++)
+    {
+        if (!_passes[p].culled)
+            _schedule.push_back(p);
+    }
+
+    // attachment actions and lifetimes
+    for (int i = 0; i < (int)_schedule.size(); i++)
+    {
+        PassInfo & pass = _passes[_schedule[i]];
+        for (Resource read : pass.reads)
+        {
+            Resource r = resolve(read);
+            if (!_resources[r].imported && _resources[r].first_pass < 0)
+            {
+                if (error)
+                    *error = "pass " + pass.name + " reads " + _resources[r].name + " before anything writes it";
+                return false;
+            }
+        }
+        for (Attachment & a : pass.writes)
+        {
+            Resource r = resolve(a.resource);
+            const ResourceInfo & info = _resources[r];
+            // nothing to load from a transient target nobody wrote yet
+            if (a.load == FrameGraphLoadLoad && !info.imported && info.first_pass < 0)
+                a.load = FrameGraphLoadDontCare;
+
+            // stored only if the next pass that touches it wants the content
+            a.store = info.imported || info.output ? FrameGraphStoreStore : FrameGraphStoreDontCare;
+            for (int j = i + 1; j < (int)_schedule.size() && a.store == FrameGraphStoreDontCare; j++)
+            {
+                const PassInfo & next = _passes[_schedule[j]];
+                if (uses(next, r))
+                {
+                    if (needs_content(next, r))
+                        a.store = FrameGraphStoreStore;
+                    break;
+                }
+            }
+        }
+        for (size_t r = 0; r < _resources.size(); r++)
+        {
+            if (uses(pass, (Resource)r))
+            {
+                if (_resources[r].first_pass < 0)
+                    _resources[r].first_pass = i;
+                _resources[r].last_pass = i;
+            }
+        }
+        for (Resource r : pass.reads)
+            _resources[resolve(r)].desc.usage |= FrameGraphUsageShaderRead;
+        for (const Attachment & a : pass.writes)
+            _resources[resolve(a.resource)].desc.usage |= a.storage ? FrameGraphUsageShaderWrite : FrameGraphUsageRenderTarget;
+    }
+
+    // walk the schedule: a transient target is taken from the pool at its
+    // first pass and goes back after its last, for the ones starting later
+    for (int i = 0; i < (int)_schedule.size(); i++)
+    {
+        for (ResourceInfo & info : _resources)
+        {
+            if (!info.imported && info.first_pass == i)
+                info.physical = pool.acquire(info.desc);
+        }
+        for (ResourceInfo & info : _resources)
+        {
+            if (!info.imported && info.last_pass == i)
+                pool.release(info.physical);
+        }
+    }
+    return true;
+}
+
+void FrameGraph::execute() const
+{
+    for (Pass p : _schedule)
+        _passes[p].execute(_passes[p]);
+}
+
+size_t FrameGraph::transient_bytes() const
+{
+    size_t bytes = 0;
+    for (const ResourceInfo & info : _resources)
+    {
+        if (info.physical >= 0)
+            bytes += info.desc.bytes();
+    }
+    return bytes;
+}
+
+size_t FrameGraph::physical_bytes() const
+{
+    std::set<int> counted;
+    size_t bytes = 0;
+    for (const ResourceInfo & info : _resources)
+    {
+        if (info.physical >= 0 && counted.insert(info.physical).second)
+            bytes += info.desc.bytes();
+    }
+    return bytes;
+}
+
+int FrameGraph::physical_count() const
+{
+    std::set<int> counted;
+    for (const ResourceInfo & info : _resources)
+    {
+        if (info.physical >= 0)
+            counted.insert(info.physical);
+    }
+    return (int)counted.size();
+}
+
+size_t FrameGraph::pass_bytes(Pass pass) const
+{
+    const PassInfo & info = _passes[pass];
+    if (info.culled)
+        return 0;
+    size_t bytes = 0;
+    for (Resource r : info.reads)
+        bytes += _resources[resolve(r)].desc.bytes();
+    for (const Attachment & a : info.writes)
+    {
+        size_t size = _resources[resolve(a.resource)].desc.bytes();
+        if (a.load == FrameGraphLoadLoad)
+            bytes += size;
+        if (a.store == FrameGraphStoreStore)
+            bytes += size;
+    }
+    return bytes;
+}
+
+std::string FrameGraph::report() const
+{
+    static const char* load_names[] = { "dontcare", "clear", "load" };
+    static const char* store_names[] = { "dontcare", "store" };
+
+    char line[256];
+    snprintf(line, sizeof(line), "%d of %d passes:\n", (int)_schedule.size(), pass_count());
+    std::string text = line;
+    for (const PassInfo & pass : _passes)
+    {
+        snprintf(line, sizeof(line), "  %-24s %s\n", pass.name.c_str(),
+                 !pass.enabled ? "(disabled)" : pass.culled ? "(unused)" : "");
+        text += line;
+        if (pass.culled)
+            continue;
+        for (Resource r : pass.reads)
+        {
+            snprintf(line, sizeof(line), "      read  %s\n", _resources[resolve(r)].name.c_str());
+            text += line;
+        }
+        for (const Attachment & a : pass.writes)
+        {
+            if (a.storage)
+                snprintf(line, sizeof(line), "      write %-22s storage\n", _resources[resolve(a.resource)].name.c_str());
+            else
+                snprintf(line, sizeof(line), "      write %-22s load %-9s store %s\n", _resources[resolve(a.resource)].name.c_str(),
+                         load_names[a.load], store_names[a.store]);
+            text += line;
+        }
+    }
+
+    text += "resources:\n";
+    for (Resource r = 0; r < resource_count(); r++)
+    {
+        const ResourceInfo & info = _resources[r];
+        std::string where;
+        if (info.imported)
+            where = "imported";
+        else if (info.alias != r)
+            where = "-> " + _resources[info.alias].name;
+        else if (info.physical < 0)
+            where = "unused";
+        else
+            where = "target " + std::to_string(info.physical);
+        std::string lifetime = info.first_pass < 0 ? "-" : std::to_string(info.first_pass) + "-" + std::to_string(info.last_pass);
+        snprintf(line, sizeof(line), "  %-22s %5dx%-5d %-16s %8.2f MB  passes %-6s %s\n", info.name.c_str(),
+                 info.desc.width, info.desc.height, format_name(info.desc.format), info.desc.bytes() / (1024.0 * 1024.0),
+                 lifetime.c_str(), where.c_str());
+        text += line;
+    }
+
+    size_t transient = transient_bytes();
+    size_t physical = physical_bytes();
+    snprintf(line, sizeof(line), "transient targets: %.2f MB in %d textures, %.2f MB without aliasing (%.2f MB, %.0f%% saved)\n",
+             physical / (1024.0 * 1024.0), physical_count(), transient / (1024.0 * 1024.0),
+             (transient - physical) / (1024.0 * 1024.0), transient ? 100.0 * (transient - physical) / transient : 0.0);
+    text += line;
+    if (_pool)
+        text += "pool: " + _pool->report() + "\n";
+    return text;
+}
+
+const char* FrameGraph::format_name(FrameGraphFormat format)
+{
+    switch (format)
+    {
+        case FrameGraphFormatRGBA8Unorm:        return "RGBA8Unorm";
+        case FrameGraphFormatBGRA8Unorm_sRGB:   return "BGRA8Unorm_sRGB";
+        case FrameGraphFormatR8Unorm:           return "R8Unorm";
+        case FrameGraphFormatR32Float:          return "R32Float";
+        case FrameGraphFormatDepth32Float:      return "Depth32Float";
+        case FrameGraphFormatStencil8:          return "Stencil8";
+        case FrameGraphFormatRG32Float:         return "RG32Float";
+        case FrameGraphFormatRGBA16Float:       return "RGBA16Float";
+        case FrameGraphFormatRG11B10Float:      return "RG11B10Float";
+        default:                                return "unknown";
+    }
+}
@@ -0,0 +1,219 @@
+//
+//  FrameGraph.h
+//  SSSS_Metal
+//
+//  Per-frame graph of render passes. Passes declare the targets they read
+//  and write; compile() drops the disabled ones and the ones nothing uses,
+//  picks the load / store action of every attachment and takes transient
+//  targets from a RenderTargetPool as their lifetimes start, handing them
+//  back as they end, so targets that don't overlap share a texture.
+//
+//  The graph knows nothing of the GPU: FrameGraphTargets creates the Metal
+//  textures and CPUFrameGraph runs the same graph on CPUImages.
+//
+
+#ifndef SSSS_Metal_FrameGraph_h
+#define SSSS_Metal_FrameGraph_h
+
+#include <cstddef>
+#include <functional>
+#include <string>
+#include <vector>
+
+enum FrameGraphFormat
+{
+    FrameGraphFormatRGBA8Unorm,
+    FrameGraphFormatBGRA8Unorm_sRGB,
+    FrameGraphFormatR8Unorm,
+    FrameGraphFormatR32Float,
+    FrameGraphFormatDepth32Float,
+    FrameGraphFormatStencil8,
+    FrameGraphFormatRG32Float,
+    FrameGraphFormatRGBA16Float,
+    FrameGraphFormatRG11B10Float,
+};
+
+enum FrameGraphLoadAction
+{
+    FrameGraphLoadDontCare,     // the pass writes every texel
+    FrameGraphLoadClear,
+    FrameGraphLoadLoad,         // the pass draws over what is there
+};
+
+enum FrameGraphStoreAction
+{
+    FrameGraphStoreDontCare,
+    FrameGraphStoreStore,
+};
+
+enum FrameGraphUsage
+{
+    FrameGraphUsageRenderTarget = 1 << 0,
+    FrameGraphUsageShaderRead   = 1 << 1,
+    FrameGraphUsageShaderWrite  = 1 << 2,
+};
+
+struct FrameGraphTextureDesc
+{
+    int width;
+    int height;
+    FrameGraphFormat format;
+    unsigned usage;     // FrameGraphUsage flags, filled in by FrameGraph::compile()
+
+    FrameGraphTextureDesc() : width(0), height(0), format(FrameGraphFormatRGBA8Unorm), usage(0) {}
+    FrameGraphTextureDesc(int width, int height, FrameGraphFormat format)
+        : width(width), height(height), format(format), usage(0) {}
+
+    size_t bytes() const { return (size_t)width * height * bytes_per_pixel(format); }
+
+    bool operator==(const FrameGraphTextureDesc & d) const
+    {
+        return width == d.width && height == d.height && format == d.format && usage == d.usage;
+    }
+
+    static int bytes_per_pixel(FrameGraphFormat format)
+    {
+        if (format == FrameGraphFormatR8Unorm || format == FrameGraphFormatStencil8)
+            return 1;
+        return format == FrameGraphFormatRG32Float || format == FrameGraphFormatRGBA16Float ? 8 : 4;
+    }
+
+    // color formats with an alpha channel, which the main pass puts the SSS strength in
+    static bool has_alpha(FrameGraphFormat format)
+    {
+        return format == FrameGraphFormatRGBA8Unorm || format == FrameGraphFormatBGRA8Unorm_sRGB ||
+               format == FrameGraphFormatRGBA16Float;
+    }
+};
+
+class RenderTargetPool;
+
+class FrameGraph
+{
+public:
+    typedef int Resource;
+    typedef int Pass;
+
+    struct Attachment
+    {
+        Resource resource;
+        FrameGraphLoadAction load;
+        FrameGraphStoreAction store;
+        bool storage;           // written by a compute kernel, see write_storage()
+    };
+
+    struct PassInfo
+    {
+        std::string name;
+        std::function<void(const PassInfo&)> execute;
+        std::vector<Resource> reads;
+        std::vector<Attachment> writes;     // load is what was asked until compile()
+        bool enabled;
+        bool culled;                        // after compile(): disabled or unused
+        Resource bypass_from;               // see bypass()
+        Resource bypass_to;
+        int batch;                          // the command buffer it is encoded into, see ParallelEncoder
+
+        // the attachment of a written resource
+        const Attachment & attachment(Resource resource) const;
+    };
+
+    struct ResourceInfo
+    {
+        std::string name;
+        FrameGraphTextureDesc desc;
+        bool imported;
+        bool output;
+        Resource alias;         // after compile(): the resource it stands for, itself if none
+        int physical;           // after compile(): pool target, -1 if imported or unused
+        int first_pass;         // lifetime in schedule() positions, -1 if unused
+        int last_pass;
+    };
+
+    FrameGraph() : _pool(nullptr), _compiled(false) {}
+
+    // Empties the graph, to be declared again for the next frame.
+    void clear();
+
+    // A target that only lives during the frame, allocated by the graph.
+    Resource create(const std::string & name, const FrameGraphTextureDesc & desc);
+
+    // A target owned outside the graph (drawable, shadow maps): never
+    // aliased and always stored, whoever reads it later.
+    Resource import(const std::string & name, const FrameGraphTextureDesc & desc);
+
+    // Passes are scheduled in the order they are added.
+    Pass add_pass(const std::string & name, std::function<void(const PassInfo&)> execute, bool enabled = true);
+
+    void read(Pass pass, Resource resource);
+    void write(Pass pass, Resource resource, FrameGraphLoadAction load = FrameGraphLoadDontCare);
+    
+    // Written by a compute kernel rather than as an attachment, every texel of it.
+    void write_storage(Pass pass, Resource resource);
+
+    /**
+     * When pass is disabled, later readers of `to` read `from` instead:
+     * an effect that is turned off passes its input through.
+     */
+    void bypass(Pass pass, Resource from, Resource to);
+
+    // Must be produced: passes that only lead elsewhere are culled.
+    void set_output(Resource resource);
+
+    /**
+     * Culls, then picks the attachment actions and the targets of pool the
+     * transient resources live in (each acquired at its first pass and
+     * released after its last). Returns false, with the reason in error if
+     * given, when a live pass reads something nothing wrote.
+     */
+    bool compile(RenderTargetPool & pool, std::string* error = nullptr);
+
+    // Runs the live passes in order.
+    void execute() const;
+
+    // Encodes pass into command buffer batch of the frame, 0 unless set (ParallelEncoder::plan()).
+    void set_batch(Pass pass, int batch) { _passes[pass].batch = batch; }
+
+    const std::vector<Pass>& schedule() const { return _schedule; }
+    const PassInfo & pass(Pass pass) const { return _passes[pass]; }
+    const ResourceInfo & resource(Resource resource) const { return _resources[resource]; }
+    int pass_count() const { return (int)_passes.size(); }
+    int resource_count() const { return (int)_resources.size(); }
+
+    // the resource that actually holds r's content this frame
+    Resource resolve(Resource r) const { return _resources[r].alias; }
+
+    // the pool of the last compile()
+    const RenderTargetPool & pool() const { return *_pool; }
+
+    // transient bytes if every resource had its own texture, and in the
+    // pool targets this frame uses
+    size_t transient_bytes() const;
+    size_t physical_bytes() const;
+    int physical_count() const;
+
+    // Bytes a live pass moves after compile(): each resource it reads or
+    // loads once, each one it stores once. Taps that land on a texel again
+    // are taken to hit the texture cache.
+    size_t pass_bytes(Pass pass) const;
+
+    // passes, attachments with their actions, resources and their textures
+    std::string report() const;
+
+    static const char* format_name(FrameGraphFormat format);
+
+private:
+    FrameGraph(const FrameGraph&);
+    FrameGraph& operator=(const FrameGraph&);
+
+    bool uses(const PassInfo & pass, Resource resource) const;
+    bool needs_content(const PassInfo & pass, Resource resource) const;
+
+    std::vector<PassInfo> _passes;
+    std::vector<ResourceInfo> _resources;
+    std::vector<Pass> _schedule;
+    RenderTargetPool* _pool;
+    bool _compiled;
+};
+
+#endif
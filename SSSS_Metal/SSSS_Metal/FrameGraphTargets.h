@@ -0,0 +1,122 @@
+//
+//  FrameGraphTargets.h
+//  SSSS_Metal
+//
+//  The Metal textures behind a compiled FrameGraph: one RenderTexture per
+//  live target of the graph's RenderTargetPool, kept from frame to frame
+//  like the pool keeps its targets, and the textures imported into it.
+//
+
+#ifndef SSSS_Metal_FrameGraphTargets_h
+#define SSSS_Metal_FrameGraphTargets_h
+
+#import <Metal/Metal.h>
+
+#include <memory>
+#include <vector>
+
+#include "FrameGraph.h"
+#include "RenderTarget.h"
+#include "RenderTargetPool.h"
+
+class FrameGraphTargets
+{
+public:
+    FrameGraphTargets() : _graph(nullptr) {}
+
+    // Backs an imported resource, before allocate().
+    void import(FrameGraph::Resource resource, id <MTLTexture> texture)
+    {
+        if ((int)_imported.size() <= resource)
+            _imported.resize(resource + 1);
+        _imported[resource] = texture;
+    }
+
+    // After compile(): creates the textures of new pool targets, frees the ones of dropped targets.
+    void allocate(id <MTLDevice> device, const FrameGraph & graph)
+    {
+        _graph = &graph;
+        const RenderTargetPool & pool = graph.pool();
+        _textures.resize(pool.target_count());
+        _descs.resize(pool.target_count());
+        for (int t = 0; t < pool.target_count(); t++)
+        {
+            if (!pool.live(t))
+            {
+                _textures[t].reset();
+                continue;
+            }
+            const FrameGraphTextureDesc & desc = pool.desc(t);
+            if (_textures[t] && _descs[t] == desc)
+                continue;
+            if (_textures[t] && _descs[t].format == desc.format && _descs[t].usage == desc.usage)
+                _textures[t]->resize(device, desc.width, desc.height);
+            else
+            {
+                _textures[t].reset(new RenderTexture);
+                _textures[t]->init(device, pixel_format(desc.format), desc.width, desc.height, texture_usage(desc.usage));
+            }
+            _descs[t] = desc;
+        }
+    }
+
+    id <MTLTexture> texture(FrameGraph::Resource resource) const
+    {
+        FrameGraph::Resource r = _graph->resolve(resource);
+        const FrameGraph::ResourceInfo & info = _graph->resource(r);
+        if (info.imported)
+            return _imported[r];
+        return _textures[info.physical]->texture();
+    }
+
+    // Drops the imported textures (the drawable's among them) once the frame is encoded.
+    void release_imported() { _imported.clear(); }
+    
+    // Points attachment at what pass writes to resource, with the graph's actions.
+    void bind(MTLRenderPassAttachmentDescriptor* attachment, const FrameGraph::PassInfo & pass, FrameGraph::Resource resource) const
+    {
+        const FrameGraph::Attachment & a = pass.attachment(resource);
+        attachment.texture = texture(resource);
+        attachment.loadAction = a.load == FrameGraphLoadClear ? MTLLoadActionClear :
+                                a.load == FrameGraphLoadLoad ? MTLLoadActionLoad : MTLLoadActionDontCare;
+        attachment.storeAction = a.store == FrameGraphStoreStore ? MTLStoreActionStore : MTLStoreActionDontCare;
+    }
+
+    static MTLPixelFormat pixel_format(FrameGraphFormat format)
+    {
+        switch (format)
+        {
+            case FrameGraphFormatBGRA8Unorm_sRGB:   return MTLPixelFormatBGRA8Unorm_sRGB;
+            case FrameGraphFormatR8Unorm:           return MTLPixelFormatR8Unorm;
+            case FrameGraphFormatR32Float:          return MTLPixelFormatR32Float;
+            case FrameGraphFormatDepth32Float:      return MTLPixelFormatDepth32Float;
+            case FrameGraphFormatStencil8:          return MTLPixelFormatStencil8;
+            case FrameGraphFormatRG32Float:         return MTLPixelFormatRG32Float;
+            case FrameGraphFormatRGBA16Float:       return MTLPixelFormatRGBA16Float;
+            case FrameGraphFormatRG11B10Float:      return MTLPixelFormatRG11B10Float;
+            default:                                return MTLPixelFormatRGBA8Unorm;
+        }
+    }
+    
+    static MTLTextureUsage texture_usage(unsigned usage)
+    {
+        MTLTextureUsage u = MTLTextureUsageUnknown;
+        if (usage & FrameGraphUsageRenderTarget)
+            u |= MTLTextureUsageRenderTarget;
+        if (usage & FrameGraphUsageShaderRead)
+            u |= MTLTextureUsageShaderRead;
+        if (usage & FrameGraphUsageShaderWrite)
+            u |= MTLTextureUsageShaderWrite;
+        return u;
+    }
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(FrameGraphTargets)
+
+    const FrameGraph* _graph;
+    std::vector<std::unique_ptr<RenderTexture>> _textures;
+    std::vector<FrameGraphTextureDesc> _descs;
+    std::vector<id <MTLTexture>> _imported;
+};
+
+#endif
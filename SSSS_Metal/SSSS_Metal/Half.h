@@ -0,0 +1,106 @@
+//
+//  Half.h
+//  SSSS_Metal
+//
+//  IEEE 754 half precision conversions for data the CPU prepares for
+//  half float textures and vertex attributes, and the rounding of the
+//  packed unsigned floats of RG11B10Float.
+//
+
+#ifndef SSSS_Metal_Half_h
+#define SSSS_Metal_Half_h
+
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+
+// round to nearest even, overflow goes to infinity, NaN stays NaN
+static inline uint16_t float_to_half(float f)
+{
+    uint32_t x;
+    memcpy(&x, &f, sizeof(x));
+    uint32_t sign = (x >> 16) & 0x8000;
+    uint32_t abs = x & 0x7fffffff;
+    
+    if (abs >= 0x7f800000)                          // inf / NaN
+        return (uint16_t)(sign | 0x7c00 | (abs > 0x7f800000 ? 0x200 : 0));
+    if (abs >= 0x477ff000)                          // rounds to >= 65520
+        return (uint16_t)(sign | 0x7c00);
+    if (abs < 0x38800000)                           // subnormal half or zero
+    {
+        if (abs < 0x33000000)
+            return (uint16_t)sign;
+        uint32_t mantissa = (abs & 0x007fffff) | 0x00800000;
+        int shift = 126 - (int)(abs >> 23);         // 14..24
+        uint32_t h = mantissa >> (shift - 1);
+        uint32_t rest = mantissa & ((1u << (shift - 1)) - 1);
+        uint32_t half_bit = h & 1;
+        h >>= 1;
+        if (half_bit && (rest || (h & 1)))
+            h++;
+        return (uint16_t)(sign | h);
+    }
+    
+    uint32_t h = ((abs - 0x38000000) >> 13);
+    uint32_t rest = abs & 0x1fff;
+    if (rest > 0x1000 || (rest == 0x1000 && (h & 1)))
+        h++;
+    return (uint16_t)(sign | h);
+}
+
+static inline float half_to_float(uint16_t h)
+{
+    uint32_t sign = (uint32_t)(h & 0x8000) << 16;
+    uint32_t exponent = (h >> 10) & 0x1f;
+    uint32_t mantissa = h & 0x3ff;
+    uint32_t x;
+    
+    if (exponent == 0x1f)
+        x = sign | 0x7f800000 | (mantissa << 13);
+    else if (exponent != 0)
+        x = sign | ((exponent + 112) << 23) | (mantissa << 13);
+    else if (mantissa == 0)
+        x = sign;
+    else
+    {
+        // subnormal: normalize it
+        exponent = 113;
+        while (!(mantissa & 0x400))
+        {
+            mantissa <<= 1;
+            exponent--;
+        }
+        x = sign | (exponent << 23) | ((mantissa & 0x3ff) << 13);
+    }
+    
+    float f;
+    memcpy(&f, &x, sizeof(f));
+    return f;
+}
+
+static inline float quantize_half(float f)
+{
+    return half_to_float(float_to_half(f));
+}
+
+/**
+ * The value of f in an unsigned float with a 5 bit exponent and
+ * mantissa_bits of mantissa (6 for the 11 bit channels of RG11B10Float,
+ * 5 for the 10 bit one): negatives and NaN go to 0, overflow to the
+ * largest finite value, the rest rounds to nearest even.
+ */
+static inline float quantize_unsigned_float(float f, int mantissa_bits)
+{
+    if (!(f > 0.0f))
+        return 0.0f;
+    const float largest = ldexpf(2.0f - ldexpf(1.0f, -mantissa_bits), 15);
+    if (f >= largest)
+        return largest;
+    int exponent;
+    frexpf(f, &exponent);                           // f = m * 2^exponent, 0.5 <= m < 1
+    exponent = exponent - 1 < -14 ? -14 : exponent - 1;     // below 2^-14 the step stays that of the subnormals
+    const float step = ldexpf(1.0f, exponent - mantissa_bits);
+    return nearbyintf(f / step) * step;
+}
+
+#endif
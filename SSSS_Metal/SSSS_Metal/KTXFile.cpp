@@ -0,0 +1,209 @@
+//
+//  KTXFile.cpp
+//  SSSS_Metal
+//
+
+#include "KTXFile.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+
+namespace
+{
+    const uint8_t KTX_IDENTIFIER[12] = { 0xab, 'K', 'T', 'X', ' ', '1', '1', 0xbb, '\r', '\n', 0x1a, '\n' };
+    const uint32_t KTX_ENDIANNESS = 0x04030201;
+    const size_t   KTX_HEADER_SIZE = 64;
+    
+    const uint32_t GL_RED  = 0x1903;
+    const uint32_t GL_RGB  = 0x1907;
+    const uint32_t GL_RGBA = 0x1908;
+    const uint32_t GL_RG   = 0x8227;
+    
+    struct KTXHeader
+    {
+        uint8_t  identifier[12];
+        uint32_t endianness;
+        uint32_t gl_type;
+        uint32_t gl_type_size;
+        uint32_t gl_format;
+        uint32_t gl_internal_format;
+        uint32_t gl_base_internal_format;
+        uint32_t pixel_width;
+        uint32_t pixel_height;
+        uint32_t pixel_depth;
+        uint32_t array_elements;
+        uint32_t faces;
+        uint32_t mip_levels;
+        uint32_t key_value_bytes;
+    };
+    
+    static_assert(sizeof(KTXHeader) == KTX_HEADER_SIZE, "KTX header layout");
+    
+    uint32_t base_internal_format(KTXFormat format)
+    {
+        switch (format)
+        {
+            case KTXFormatEAC_R11:          return GL_RED;
+            case KTXFormatEAC_RG11:         return GL_RG;
+            case KTXFormatETC2_RGB8:
+            case KTXFormatETC2_RGB8_sRGB:   return GL_RGB;
+            default:                        return GL_RGBA;
+        }
+    }
+    
+    inline size_t pad4(size_t n) { return (n + 3) & ~(size_t)3; }
+}
+
+bool KTXFile::fail(std::string* error, const std::string & reason)
+{
+    if (error)
+        *error = reason;
+    close();
+    return false;
+}
+
+bool KTXFile::open(const std::string & path, std::string* error)
+{
+    close();
+    if (!_file.open(path))
+        return fail(error, "can not open " + path);
+    
+    const uint8_t* p = _file.data();
+    const size_t file_size = _file.size();
+    if (file_size < KTX_HEADER_SIZE)
+        return fail(error, "file too small for a KTX header");
+    KTXHeader header;
+    memcpy(&header, p, sizeof(header));
+    if (memcmp(header.identifier, KTX_IDENTIFIER, sizeof(KTX_IDENTIFIER)) != 0)
+        return fail(error, "not a KTX file");
+    if (header.endianness != KTX_ENDIANNESS)
+        return fail(error, "big endian KTX files are not supported");
+    if (header.gl_type != 0 || header.pixel_depth > 1 || header.array_elements > 1)
+        return fail(error, "only compressed 2D textures and cubemaps are supported");
+    
+    _format = (KTXFormat)header.gl_internal_format;
+    if (ktx_format(etc2_format(_format), is_srgb()) != _format)
+        return fail(error, "unsupported internal format");
+    _width = header.pixel_width;
+    _height = header.pixel_height;
+    _faces = header.faces;
+    _mips = std::max(header.mip_levels, 1u);
+    if (_width == 0 || _height == 0 || _width > 16384 || _height > 16384)
+        return fail(error, "bad dimensions");
+    if (_faces != 1 && _faces != 6)
+        return fail(error, "bad face count");
+    if (_mips > (uint32_t)MAX_MIPS)
+        return fail(error, "too many mip levels");
+    
+    // every level: its size, then the faces, each padded to 4 bytes
+    size_t offset = KTX_HEADER_SIZE + header.key_value_bytes;
+    for (uint32_t mip = 0; mip < _mips; mip++)
+    {
+        if (offset + 4 > file_size)
+            return fail(error, "file shorter than its header says");
+        uint32_t image_size;
+        memcpy(&image_size, p + offset, 4);
+        _mip_offset[mip] = offset + 4;
+        Surface s = surface(0, mip);
+        if (image_size != s.size)
+            return fail(error, "level size does not match the format");
+        offset += 4 + pad4(s.size) * _faces;
+        if (offset > file_size)
+            return fail(error, "file shorter than its header says");
+    }
+    return true;
+}
+
+void KTXFile::close()
+{
+    _file.close();
+    _format = KTXFormatUnknown;
+    _width = _height = _mips = _faces = 0;
+}
+
+KTXFile::Surface KTXFile::surface(uint32_t face, uint32_t mip) const
+{
+    Surface s;
+    s.width = std::max(_width >> mip, 1u);
+    s.height = std::max(_height >> mip, 1u);
+    s.row_pitch = (s.width + 3) / 4 * ETC2Codec::bytes_per_block(etc2_format());
+    s.size = ETC2Codec::encoded_size(etc2_format(), s.width, s.height);
+    s.offset = _mip_offset[mip] + pad4(s.size) * face;
+    s.data = _file.data() + s.offset;
+    return s;
+}
+
+bool KTXFile::save(const std::string & path, KTXFormat format, uint32_t width, uint32_t height,
+                   const std::vector<std::vector<uint8_t>> & mips, std::string* error)
+{
+    KTXHeader header = {};
+    memcpy(header.identifier, KTX_IDENTIFIER, sizeof(KTX_IDENTIFIER));
+    header.endianness = KTX_ENDIANNESS;
+    header.gl_type_size = 1;
+    header.gl_internal_format = format;
+    header.gl_base_internal_format = base_internal_format(format);
+    header.pixel_width = width;
+    header.pixel_height = height;
+    header.faces = 1;
+    header.mip_levels = (uint32_t)mips.size();
+    
+    FILE* fp = fopen(path.c_str(), "wb");
+    if (!fp)
+    {
+        if (error)
+            *error = "can not create " + path;
+        return false;
+    }
+    bool ok = fwrite(&header, sizeof(header), 1, fp) == 1;
+    const uint8_t padding[4] = {};
+    for (size_t mip = 0; mip < mips.size() && ok; mip++)
+    {
+        uint32_t image_size = (uint32_t)mips[mip].size();
+        ok = fwrite(&image_size, 4, 1, fp) == 1 &&
+             fwrite(mips[mip].data(), 1, image_size, fp) == image_size &&
+             fwrite(padding, 1, pad4(image_size) - image_size, fp) == pad4(image_size) - image_size;
+    }
+    ok = fclose(fp) == 0 && ok;
+    if (!ok && error)
+        *error = "error writing " + path;
+    return ok;
+}
+
+KTXFormat KTXFile::ktx_format(ETC2Format format, bool srgb)
+{
+    switch (format)
+    {
+        case ETC2FormatRGB8:    return srgb ? KTXFormatETC2_RGB8_sRGB : KTXFormatETC2_RGB8;
+        case ETC2FormatRGBA8:   return srgb ? KTXFormatETC2_RGBA8_sRGB : KTXFormatETC2_RGBA8;
+        case ETC2FormatR11:     return KTXFormatEAC_R11;
+        case ETC2FormatRG11:    return KTXFormatEAC_RG11;
+        default:                return KTXFormatUnknown;
+    }
+}
+
+ETC2Format KTXFile::etc2_format(KTXFormat format)
+{
+    switch (format)
+    {
+        case KTXFormatEAC_R11:          return ETC2FormatR11;
+        case KTXFormatEAC_RG11:         return ETC2FormatRG11;
+        case KTXFormatETC2_RGB8:
+        case KTXFormatETC2_RGB8_sRGB:   return ETC2FormatRGB8;
+        default:                        return ETC2FormatRGBA8;
+    }
+}
+
+const char* KTXFile::format_name(KTXFormat format)
+{
+    switch (format)
+    {
+        case KTXFormatEAC_R11:          return "EAC_R11";
+        case KTXFormatEAC_RG11:         return "EAC_RG11";
+        case KTXFormatETC2_RGB8:        return "ETC2_RGB8";
+        case KTXFormatETC2_RGB8_sRGB:   return "ETC2_RGB8_sRGB";
+        case KTXFormatETC2_RGBA8:       return "ETC2_RGBA8";
+        case KTXFormatETC2_RGBA8_sRGB:  return "ETC2_RGBA8_sRGB";
+        default:                        return "unknown";
+    }
+}
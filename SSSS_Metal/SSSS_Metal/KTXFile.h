@@ -0,0 +1,104 @@
+//
+//  KTXFile.h
+//  SSSS_Metal
+//
+//  KTX (version 1) container for the ETC2 / EAC textures, read in place
+//  on a memory mapping like DDSFile. save() writes the files the offline
+//  encoder produces.
+//
+
+#ifndef SSSS_Metal_KTXFile_h
+#define SSSS_Metal_KTXFile_h
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "ETC2Codec.h"
+#include "MappedFile.h"
+
+// the glInternalFormat values this reader understands
+enum KTXFormat
+{
+    KTXFormatUnknown        = 0,
+    KTXFormatEAC_R11        = 0x9270,
+    KTXFormatEAC_RG11       = 0x9272,
+    KTXFormatETC2_RGB8      = 0x9274,
+    KTXFormatETC2_RGB8_sRGB = 0x9275,
+    KTXFormatETC2_RGBA8     = 0x9278,
+    KTXFormatETC2_RGBA8_sRGB = 0x9279,
+};
+
+class KTXFile
+{
+public:
+    static const int MAX_MIPS = 16;
+    
+    // one mip level of one face, pointing into the mapping
+    struct Surface
+    {
+        const uint8_t* data;
+        size_t   size;
+        size_t   offset;        // of data from the start of the file
+        uint32_t width;
+        uint32_t height;
+        uint32_t row_pitch;     // bytes per row of 4x4 blocks
+    };
+    
+    KTXFile() : _format(KTXFormatUnknown), _width(0), _height(0), _mips(0), _faces(0) {}
+    
+    /**
+     * Maps and validates the file. Returns false, with the reason in
+     * error() if given, when it is not a KTX this reader supports or is
+     * shorter than its header says.
+     */
+    bool open(const std::string & path, std::string* error = nullptr);
+    void close();
+    
+    bool is_open() const { return _file.is_open(); }
+    KTXFormat format() const { return _format; }
+    ETC2Format etc2_format() const { return etc2_format(_format); }
+    bool is_srgb() const { return _format == KTXFormatETC2_RGB8_sRGB || _format == KTXFormatETC2_RGBA8_sRGB; }
+    uint32_t width() const { return _width; }
+    uint32_t height() const { return _height; }
+    uint32_t mip_count() const { return _mips; }
+    uint32_t face_count() const { return _faces; }     // 6 for a cubemap
+    bool is_cubemap() const { return _faces == 6; }
+    
+    Surface surface(uint32_t face, uint32_t mip) const;
+    
+    // see DDSFile::release
+    void release(const Surface & s) const { _file.release(s.offset, s.size); }
+    
+    // Reads a surface's pages in ahead of the upload.
+    void prefetch(const Surface & s) const { _file.prefetch(s.offset, s.size); }
+    
+    size_t file_size() const { return _file.size(); }
+    
+    /**
+     * Writes a 2D texture, mips[i] holding the blocks of level i (as
+     * ETC2Codec::encode returns them).
+     */
+    static bool save(const std::string & path, KTXFormat format, uint32_t width, uint32_t height,
+                     const std::vector<std::vector<uint8_t>> & mips, std::string* error = nullptr);
+    
+    static KTXFormat ktx_format(ETC2Format format, bool srgb);
+    static ETC2Format etc2_format(KTXFormat format);
+    static const char* format_name(KTXFormat format);
+
+private:
+    KTXFile(const KTXFile&);
+    KTXFile& operator=(const KTXFile&);
+    
+    bool fail(std::string* error, const std::string & reason);
+    
+    MappedFile _file;
+    KTXFormat _format;
+    uint32_t _width;
+    uint32_t _height;
+    uint32_t _mips;
+    uint32_t _faces;
+    size_t   _mip_offset[MAX_MIPS];     // of the first face of each level
+};
+
+#endif
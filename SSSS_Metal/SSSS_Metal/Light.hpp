@@ -17,7 +17,8 @@ class Camera;
 class Light 
 {
 public:
-	void init(id <MTLDevice> device)
+	// the shadow map is a rect of the renderer's ShadowAtlas
+	void init()
 	{
 		fov = 45.0f * PI / 180.f;
 		falloffWidth = 0.05f;
@@ -30,7 +31,6 @@ public:
         camera.build();
 		color = vec3(0.0f, 0.0f, 0.0f);
 		intensity = 0.0f;
-		shadowMap.init(device);
 		camera.setViewportSize(ShadowMap::SHADOW_MAP_SIZE, ShadowMap::SHADOW_MAP_SIZE);
 	}
 
@@ -65,7 +65,6 @@ public:
 	float attenuation;
 	float farPlane;
 	float bias;
-	ShadowMap shadowMap;
 };
 
 #endif
\ No newline at end of file
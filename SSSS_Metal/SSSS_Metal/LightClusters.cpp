@@ -0,0 +1,208 @@
+//
+//  LightClusters.cpp
+//  SSSS_Metal
+//
+
+#include "LightClusters.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+
+#include "ThreadPool.h"
+
+// squared distance from p to the box [lo, hi]
+static float distance_sq(const glm::vec3 & p, const glm::vec3 & lo, const glm::vec3 & hi)
+{
+    glm::vec3 d = glm::max(lo - p, glm::vec3(0.0f)) + glm::max(p - hi, glm::vec3(0.0f));
+    return glm::dot(d, d);
+}
+
+// The view space box of the ndc rect [x0, x1] x [y0, y1] between view depths d0 and d1:
+// a point at ndc x and depth d is at x * tan_x * d, the extremes are at the corners.
+static void frustum_box(float x0, float x1, float y0, float y1, float d0, float d1, float tan_x, float tan_y,
+                        glm::vec3 & lo, glm::vec3 & hi)
+{
+    lo = glm::vec3(tan_x * std::min(x0 * d0, x0 * d1), tan_y * std::min(y0 * d0, y0 * d1), -d1);
+    hi = glm::vec3(tan_x * std::max(x1 * d0, x1 * d1), tan_y * std::max(y1 * d0, y1 * d1), -d0);
+}
+
+LightClusters::LightClusters()
+    : _slice_scale(0.0f), _slice_bias(0.0f), _light_count(0), _dropped(0)
+{
+}
+
+void LightClusters::build(const std::vector<Light> & lights, const glm::mat4 & view, float fov, float aspect, float near_plane,
+                          float far_plane, ThreadPool* pool)
+{
+    _light_count = std::min((int)lights.size(), MAX_LIGHTS);
+    _slice_scale = SLICES / log2f(far_plane / near_plane);
+    _slice_bias = -log2f(near_plane) * _slice_scale;
+    
+    _view_lights.clear();
+    for (int i = 0; i < _light_count; i++)
+    {
+        const Light & light = lights[i];
+        float length = glm::length(light.direction);
+        // dot(direction, -L) > falloff_start: the cone of the unit direction at falloff_start / length
+        float cos_angle = length > 0.0f ? light.falloff_start / length : (light.falloff_start < 0.0f ? -1.0f : 1.0f);
+        if (cos_angle >= 1.0f || light.range <= 0.0f)
+            continue;
+        cos_angle = std::max(cos_angle, -1.0f);
+        
+        ViewLight v;
+        v.position = glm::vec3(view * glm::vec4(light.position, 1.0f));
+        v.direction = length > 0.0f ? glm::normalize(glm::vec3(view * glm::vec4(light.direction, 0.0f))) : glm::vec3(0.0f, 0.0f, -1.0f);
+        v.cos_angle = cos_angle;
+        v.sin_angle = sqrtf(std::max(0.0f, 1.0f - cos_angle * cos_angle));
+        v.range = light.range;
+        // the smallest sphere around the cone up to 45 degrees, the one around its cap up to 90, else the range
+        if (cos_angle >= sqrtf(0.5f))
+            v.radius = light.range / (2.0f * cos_angle);
+        else if (cos_angle > 0.0f)
+            v.radius = light.range * v.sin_angle;
+        else
+            v.radius = light.range;
+        v.center = v.position + v.direction * (cos_angle >= sqrtf(0.5f) ? v.radius : std::max(cos_angle, 0.0f) * light.range);
+        v.index = (uint16_t)i;
+        _view_lights.push_back(v);
+    }
+    
+    _slices.resize(SLICES);
+    float tan_y = tanf(0.5f * fov);
+    float tan_x = tan_y * aspect;
+    if (pool)
+        pool->parallel_for(SLICES, [&](int z) { build_slice(z, tan_y, tan_x, near_plane, far_plane); });
+    else
+    {
+        for (int z = 0; z < SLICES; z++)
+            build_slice(z, tan_y, tan_x, near_plane, far_plane);
+    }
+    
+    // the slices in cluster order, as long as the index list has room
+    _clusters.resize(COUNT);
+    _indices.resize(MAX_INDICES);
+    _dropped = 0;
+    uint32_t offset = 0;
+    for (int z = 0; z < SLICES; z++)
+    {
+        const Slice & slice = _slices[z];
+        const uint16_t* src = slice.indices.data();
+        for (int t = 0; t < TILES_X * TILES_Y; t++)
+        {
+            uint32_t count = std::min(slice.counts[t], (uint32_t)MAX_INDICES - offset);
+            _dropped += slice.counts[t] - count;
+            if (count > 0)
+                memcpy(&_indices[offset], src, count * sizeof(uint16_t));
+            _clusters[z * TILES_X * TILES_Y + t] = Cluster{ offset, count };
+            offset += count;
+            src += slice.counts[t];
+        }
+    }
+    _indices.resize(offset);
+}
+
+// the tiles [first, last] of TILES across the ndc extent of [lo, hi] between depths d0 and d1
+static void tile_range(float lo, float hi, float d0, float d1, float tan, int tiles, int & first, int & last)
+{
+    float ndc0 = std::min(lo / d0, lo / d1) / tan;
+    float ndc1 = std::max(hi / d0, hi / d1) / tan;
+    first = std::max(0, (int)floorf((ndc0 + 1.0f) * 0.5f * tiles));
+    last = std::min(tiles - 1, (int)floorf((ndc1 + 1.0f) * 0.5f * tiles));
+}
+
+void LightClusters::build_slice(int z, float tan_y, float tan_x, float near_plane, float far_plane)
+{
+    Slice & slice = _slices[z];
+    slice.indices.clear();
+    slice.candidates.clear();
+    float d0 = near_plane * powf(far_plane / near_plane, (float)z / SLICES);
+    float d1 = near_plane * powf(far_plane / near_plane, (float)(z + 1) / SLICES);
+    
+    // the lights whose sphere touches the slice at all, and the tiles its extent
+    // can be in between the slice's depths (tile y goes down, ndc y up)
+    glm::vec3 lo, hi;
+    frustum_box(-1.0f, 1.0f, -1.0f, 1.0f, d0, d1, tan_x, tan_y, lo, hi);
+    for (int i = 0; i < (int)_view_lights.size(); i++)
+    {
+        const ViewLight & v = _view_lights[i];
+        if (distance_sq(v.center, lo, hi) > v.radius * v.radius)
+            continue;
+        Candidate c;
+        c.light = i;
+        tile_range(v.center.x - v.radius, v.center.x + v.radius, d0, d1, tan_x, TILES_X, c.x0, c.x1);
+        int y0, y1;
+        tile_range(v.center.y - v.radius, v.center.y + v.radius, d0, d1, tan_y, TILES_Y, y0, y1);
+        c.y0 = TILES_Y - 1 - y1;
+        c.y1 = TILES_Y - 1 - y0;
+        slice.candidates.push_back(c);
+    }
+    
+    for (int y = 0; y < TILES_Y; y++)
+    {
+        float y0 = 1.0f - 2.0f * (y + 1) / TILES_Y;
+        float y1 = 1.0f - 2.0f * y / TILES_Y;
+        for (int x = 0; x < TILES_X; x++)
+        {
+            size_t first = slice.indices.size();
+            frustum_box(-1.0f + 2.0f * x / TILES_X, -1.0f + 2.0f * (x + 1) / TILES_X, y0, y1, d0, d1, tan_x, tan_y, lo, hi);
+            glm::vec3 center = 0.5f * (lo + hi);
+            float radius = 0.5f * glm::length(hi - lo);
+            for (const Candidate & c : slice.candidates)
+            {
+                if (x < c.x0 || x > c.x1 || y < c.y0 || y > c.y1)
+                    continue;
+                const ViewLight & v = _view_lights[c.light];
+                if (distance_sq(v.center, lo, hi) > v.radius * v.radius)
+                    continue;
+                // the cone against the cluster's bounding sphere: in range, and within the angle plus the radius
+                glm::vec3 to_center = center - v.position;
+                float d_sq = glm::dot(to_center, to_center);
+                if (d_sq > (v.range + radius) * (v.range + radius))
+                    continue;
+                if (v.cos_angle > 0.0f)
+                {
+                    float along = glm::dot(to_center, v.direction);
+                    float across = sqrtf(std::max(0.0f, d_sq - along * along));
+                    if (v.cos_angle * across - along * v.sin_angle > radius || along < -radius)
+                        continue;
+                }
+                slice.indices.push_back(v.index);
+            }
+            slice.counts[y * TILES_X + x] = (uint32_t)(slice.indices.size() - first);
+        }
+    }
+}
+
+int LightClusters::find(glm::vec2 uv, float depth) const
+{
+    int x = std::max(0, std::min(TILES_X - 1, (int)(uv.x * TILES_X)));
+    int y = std::max(0, std::min(TILES_Y - 1, (int)(uv.y * TILES_Y)));
+    int z = std::max(0, std::min(SLICES - 1, (int)floorf(log2f(depth) * _slice_scale + _slice_bias)));
+    return (z * TILES_Y + y) * TILES_X + x;
+}
+
+int LightClusters::max_count() const
+{
+    uint32_t count = 0;
+    for (const Cluster & c : _clusters)
+        count = std::max(count, c.count);
+    return (int)count;
+}
+
+float LightClusters::average_count() const
+{
+    int lit = 0;
+    for (const Cluster & c : _clusters)
+        lit += c.count > 0;
+    return lit > 0 ? (float)_indices.size() / lit : 0.0f;
+}
+
+std::string LightClusters::report() const
+{
+    char text[160];
+    snprintf(text, sizeof(text), "%d lights, %d x %d x %d clusters, %d entries, %.1f lights per lit cluster, %d at most, %d dropped",
+             _light_count, TILES_X, TILES_Y, SLICES, (int)_indices.size(), average_count(), max_count(), _dropped);
+    return text;
+}
@@ -0,0 +1,134 @@
+//
+//  LightClusters.h
+//  SSSS_Metal
+//
+//  Clustered light culling for the main pass. The view frustum is cut into
+//  TILES_X x TILES_Y screen tiles and SLICES depth slices, spaced
+//  exponentially from the near to the far plane, and every cluster (froxel)
+//  gets the list of the lights that can reach it. main_pass_frag finds the
+//  cluster of its fragment from the pixel position and the view depth and
+//  shades only those lights.
+//
+//  A spot light reaches as far as its far plane, where the shader's
+//  attenuation curve gets to 0, and only inside the cone where its spot
+//  term is positive. The depth slices are built in parallel on a ThreadPool,
+//  then joined into one index list.
+//
+//  Plain C++: ssss_tool light-cluster-bench times the build and checks
+//  every list against the main pass's range and cone test.
+//
+
+#ifndef SSSS_Metal_LightClusters_h
+#define SSSS_Metal_LightClusters_h
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+class ThreadPool;
+
+class LightClusters
+{
+public:
+    static const int TILES_X = 16;              // LIGHT_CLUSTERS_X in AAPLSharedTypes.h
+    static const int TILES_Y = 16;              // LIGHT_CLUSTERS_Y
+    static const int SLICES = 16;               // LIGHT_CLUSTERS_Z
+    static const int COUNT = TILES_X * TILES_Y * SLICES;
+    static const int MAX_LIGHTS = 256;          // MAX_LIGHTS, the lights the shadow atlas has maps for
+    static const int MAX_INDICES = 65536;       // LIGHT_CLUSTER_MAX_INDICES
+    
+    // what the culling needs to know of a spot light, in world space
+    struct Light
+    {
+        glm::vec3 position;
+        glm::vec3 direction;        // as main_pass_frag gets it, not necessarily normalized
+        float falloff_start;        // lit where dot(direction, -L) > falloff_start, L the unit vector to the light
+        float range;                // its far plane
+    };
+    
+    // the lights of a cluster are indices()[offset .. offset + count), AAPL::light_cluster
+    struct Cluster
+    {
+        uint32_t offset;
+        uint32_t count;
+    };
+    
+    LightClusters();
+    
+    /**
+     * Assigns the lights to the clusters of the frustum of a camera with
+     * view matrix view, a vertical fov (radians), aspect, near and far
+     * planes. The depth slices are built on pool when given one. A light that
+     * doesn't fit in the MAX_INDICES entries of the index list is left out
+     * of the cluster, dropped() counts them.
+     */
+    void build(const std::vector<Light> & lights, const glm::mat4 & view, float fov, float aspect, float near_plane,
+               float far_plane, ThreadPool* pool = nullptr);
+    
+    // The cluster of a fragment at uv (0 to 1 from the top left) and view depth, like main_pass_frag finds it.
+    int find(glm::vec2 uv, float depth) const;
+    
+    // the slice of a view depth d is log2(d) * slice_scale() + slice_bias()
+    float slice_scale() const { return _slice_scale; }
+    float slice_bias() const { return _slice_bias; }
+    
+    const std::vector<Cluster> & clusters() const { return _clusters; }
+    const std::vector<uint16_t> & indices() const { return _indices; }
+    
+    int light_count() const { return _light_count; }
+    int dropped() const { return _dropped; }
+    
+    // the longest list, and the average over the clusters with a light
+    int max_count() const;
+    float average_count() const;
+    
+    // lights, entries, lights per cluster
+    std::string report() const;
+
+private:
+    LightClusters(const LightClusters&);
+    LightClusters& operator=(const LightClusters&);
+    
+    // a light in view space, with the sphere around its cone
+    struct ViewLight
+    {
+        glm::vec3 position;
+        glm::vec3 direction;        // normalized
+        float cos_angle, sin_angle; // of the half angle of the cone the shader lights
+        float range;
+        glm::vec3 center;
+        float radius;
+        uint16_t index;
+    };
+    
+    // a light that touches a slice, in the tiles x0 to x1, y0 to y1 at most
+    struct Candidate
+    {
+        int light;
+        int x0, x1;
+        int y0, y1;
+    };
+    
+    // the lights of the clusters of a depth slice, one per job
+    struct Slice
+    {
+        std::vector<uint16_t> indices;
+        uint32_t counts[TILES_X * TILES_Y];
+        std::vector<Candidate> candidates;
+    };
+    
+    void build_slice(int z, float tan_y, float tan_x, float near_plane, float far_plane);
+    
+    std::vector<ViewLight> _view_lights;
+    std::vector<Slice> _slices;
+    std::vector<Cluster> _clusters;
+    std::vector<uint16_t> _indices;
+    float _slice_scale;
+    float _slice_bias;
+    int _light_count;
+    int _dropped;
+};
+
+#endif
@@ -0,0 +1,79 @@
+//
+//  MappedFile.cpp
+//  SSSS_Metal
+//
+
+#include "MappedFile.h"
+
+#include <algorithm>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+bool MappedFile::open(const std::string & path)
+{
+    close();
+    
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        return false;
+    
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size <= 0)
+    {
+        ::close(fd);
+        return false;
+    }
+    
+    void* p = mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);    // the mapping keeps its own reference
+    if (p == MAP_FAILED)
+        return false;
+    
+    _data = static_cast<const uint8_t*>(p);
+    _size = (size_t)st.st_size;
+    return true;
+}
+
+void MappedFile::close()
+{
+    if (_data)
+        munmap(const_cast<uint8_t*>(_data), _size);
+    _data = nullptr;
+    _size = 0;
+}
+
+void MappedFile::release(size_t offset, size_t size) const
+{
+    if (!_data || offset >= _size)
+        return;
+    const size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t begin = (offset + page - 1) / page * page;
+    size_t end = std::min(offset + size, _size) / page * page;
+    if (end > begin)
+        madvise(const_cast<uint8_t*>(_data) + begin, end - begin, MADV_DONTNEED);
+}
+
+void MappedFile::prefetch(size_t offset, size_t size) const
+{
+    if (!_data || offset >= _size)
+        return;
+    const size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t end = std::min(offset + size, _size);
+    size_t begin = offset / page * page;
+    madvise(const_cast<uint8_t*>(_data) + begin, end - begin, MADV_WILLNEED);
+    
+    // the hint is asynchronous, touching a byte per page is not
+    volatile uint8_t sink = 0;
+    for (size_t i = offset; i < end; i += page)
+        sink ^= _data[i];
+    (void)sink;
+}
+
+bool MappedFile::exists(const std::string & path)
+{
+    struct stat st;
+    return stat(path.c_str(), &st) == 0 && S_ISREG(st.st_mode);
+}
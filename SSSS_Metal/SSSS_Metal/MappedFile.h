@@ -0,0 +1,48 @@
+//
+//  MappedFile.h
+//  SSSS_Metal
+//
+//  Read-only memory mapping of a whole file (POSIX mmap). Pages are only
+//  brought in when touched, so opening is constant time whatever the size.
+//
+
+#ifndef SSSS_Metal_MappedFile_h
+#define SSSS_Metal_MappedFile_h
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+class MappedFile
+{
+public:
+    MappedFile() : _data(nullptr), _size(0) {}
+    ~MappedFile() { close(); }
+    
+    // Maps the file, returns false if it can not be opened or is empty.
+    bool open(const std::string & path);
+    void close();
+    
+    bool is_open() const { return _data != nullptr; }
+    const uint8_t* data() const { return _data; }
+    size_t size() const { return _size; }
+    
+    // Hints that [offset, offset + size) will not be needed again, its
+    // pages can leave the resident set (whole pages inside the range only).
+    void release(size_t offset, size_t size) const;
+    
+    // Reads the pages of [offset, offset + size) in now, so that copying
+    // out of the range later does not wait on the disk.
+    void prefetch(size_t offset, size_t size) const;
+    
+    static bool exists(const std::string & path);
+    
+private:
+    MappedFile(const MappedFile&);
+    MappedFile& operator=(const MappedFile&);
+    
+    const uint8_t* _data;
+    size_t _size;
+};
+
+#endif
@@ -0,0 +1,156 @@
+//
+//  MeshData.cpp
+//  SSSS_Metal
+//
+
+#include "MeshData.h"
+
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+
+static_assert(sizeof(glm::vec3) == 12 && sizeof(glm::vec2) == 8, "mesh streams are tightly packed");
+static_assert(sizeof(MeshCacheHeader) <= MeshCache::HEADER_SIZE, "header does not fit");
+
+static const char MESH_CACHE_MAGIC[4] = { 'S', 'S', 'M', 'C' };
+
+static size_t element_size(MeshStream s)
+{
+    switch (s)
+    {
+        case MeshStreamUV:      return sizeof(glm::vec2);
+        case MeshStreamIndex:   return sizeof(uint32_t);
+        default:                return sizeof(glm::vec3);
+    }
+}
+
+void MeshData::clear()
+{
+    positions.clear();
+    normals.clear();
+    tangents.clear();
+    uvs.clear();
+    indices.clear();
+}
+
+std::string MeshCache::path_for(const std::string & source_path)
+{
+    size_t dot = source_path.find_last_of('.');
+    size_t slash = source_path.find_last_of('/');
+    if (dot == std::string::npos || (slash != std::string::npos && dot < slash))
+        return source_path + ".mesh";
+    return source_path.substr(0, dot) + ".mesh";
+}
+
+bool MeshCache::save(const std::string & path, const MeshData & mesh, uint32_t flags)
+{
+    const void* data[MeshStreamCount] = {
+        mesh.positions.data(), mesh.normals.data(), mesh.tangents.data(), mesh.uvs.data(), mesh.indices.data()
+    };
+    const size_t count[MeshStreamCount] = {
+        mesh.positions.size(), mesh.normals.size(), mesh.tangents.size(), mesh.uvs.size(), mesh.indices.size()
+    };
+    
+    MeshCacheHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, MESH_CACHE_MAGIC, 4);
+    header.version = VERSION;
+    header.vertex_count = (uint32_t)mesh.vertex_count();
+    header.index_count = (uint32_t)mesh.index_count();
+    header.flags = flags;
+    
+    uint32_t offset = HEADER_SIZE;
+    for (int s = 0; s < MeshStreamCount; s++)
+    {
+        if (count[s] == 0)
+            continue;
+        offset = (offset + STREAM_ALIGNMENT - 1) & ~(STREAM_ALIGNMENT - 1);
+        header.offset[s] = offset;
+        header.size[s] = (uint32_t)(count[s] * element_size((MeshStream)s));
+        offset += header.size[s];
+    }
+    
+    glm::vec3 lo(0.0f), hi(0.0f);
+    if (!mesh.positions.empty())
+    {
+        lo = hi = mesh.positions[0];
+        for (const glm::vec3& p : mesh.positions)
+        {
+            lo = glm::min(lo, p);
+            hi = glm::max(hi, p);
+        }
+    }
+    memcpy(header.bounds_min, &lo, sizeof(header.bounds_min));
+    memcpy(header.bounds_max, &hi, sizeof(header.bounds_max));
+    
+    FILE* fp = fopen(path.c_str(), "wb");
+    if (!fp)
+        return false;
+    const uint8_t padding[HEADER_SIZE] = {};
+    bool ok = fwrite(&header, sizeof(header), 1, fp) == 1 &&
+              fwrite(padding, HEADER_SIZE - sizeof(header), 1, fp) == 1;
+    uint32_t written = HEADER_SIZE;
+    for (int s = 0; s < MeshStreamCount && ok; s++)
+    {
+        if (header.size[s] == 0)
+            continue;
+        ok = fwrite(padding, 1, header.offset[s] - written, fp) == header.offset[s] - written &&
+             fwrite(data[s], header.size[s], 1, fp) == 1;
+        written = header.offset[s] + header.size[s];
+    }
+    return fclose(fp) == 0 && ok;
+}
+
+bool MeshCache::open(const std::string & path)
+{
+    close();
+    if (!_file.open(path))
+        return false;
+    
+    const MeshCacheHeader* header = reinterpret_cast<const MeshCacheHeader*>(_file.data());
+    bool valid = _file.size() >= HEADER_SIZE &&
+                 memcmp(header->magic, MESH_CACHE_MAGIC, 4) == 0 &&
+                 header->version == VERSION;
+    for (int s = 0; s < MeshStreamCount && valid; s++)
+    {
+        size_t expected = (s == MeshStreamIndex ? header->index_count : header->vertex_count) * element_size((MeshStream)s);
+        valid = (header->size[s] == 0 || header->size[s] == expected) &&
+                header->offset[s] % STREAM_ALIGNMENT == 0 &&
+                (size_t)header->offset[s] + header->size[s] <= _file.size();
+    }
+    valid = valid && header->size[MeshStreamPosition] != 0 && header->index_count % 3 == 0;
+    
+    // Model uploads the index stream as is: an index past the vertices would reach the GPU
+    if (valid && header->size[MeshStreamIndex] != 0)
+    {
+        const uint32_t* indices = reinterpret_cast<const uint32_t*>(_file.data() + header->offset[MeshStreamIndex]);
+        uint32_t largest = 0;
+        for (uint32_t i = 0; i < header->index_count; i++)
+            largest = std::max(largest, indices[i]);
+        valid = header->index_count == 0 || largest < header->vertex_count;
+    }
+    if (!valid)
+    {
+        _file.close();
+        return false;
+    }
+    _header = header;
+    return true;
+}
+
+void MeshCache::close()
+{
+    _file.close();
+    _header = nullptr;
+}
+
+void MeshCache::read(MeshData & mesh) const
+{
+    mesh.clear();
+    const uint32_t nv = vertex_count();
+    if (has(MeshStreamPosition)) mesh.positions.assign(positions(), positions() + nv);
+    if (has(MeshStreamNormal))   mesh.normals.assign(normals(), normals() + nv);
+    if (has(MeshStreamTangent))  mesh.tangents.assign(tangents(), tangents() + nv);
+    if (has(MeshStreamUV))       mesh.uvs.assign(uvs(), uvs() + nv);
+    if (has(MeshStreamIndex))    mesh.indices.assign(indices(), indices() + index_count());
+}
@@ -0,0 +1,123 @@
+//
+//  MeshData.h
+//  SSSS_Metal
+//
+//  Vertex streams of a mesh, and the binary cache they are stored in so the
+//  app does not have to go through Assimp at startup.
+//
+//  Cache layout (little endian, version MeshCache::VERSION):
+//
+//      MeshCacheHeader                 padded to 128 bytes
+//      stream 0 .. MeshStreamCount-1   each at a 16 byte aligned offset
+//
+//  Positions, normals and tangents are float3 (12 bytes, like the
+//  packed_float3 the vertex shaders read), uvs float2 and indices uint32.
+//  A stream that is not present has offset and size 0.
+//  MeshCacheOptimized in flags means the triangle and vertex order went
+//  through MeshOptimizer already.
+//
+
+#ifndef SSSS_Metal_MeshData_h
+#define SSSS_Metal_MeshData_h
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <glm/glm.hpp>
+
+#include "MappedFile.h"
+
+enum MeshStream
+{
+    MeshStreamPosition,
+    MeshStreamNormal,
+    MeshStreamTangent,
+    MeshStreamUV,
+    MeshStreamIndex,
+    MeshStreamCount
+};
+
+struct MeshData
+{
+    std::vector<glm::vec3> positions;
+    std::vector<glm::vec3> normals;     // empty if not imported
+    std::vector<glm::vec3> tangents;    // empty if not imported
+    std::vector<glm::vec2> uvs;         // empty if not imported
+    std::vector<uint32_t> indices;      // triangle list
+    
+    size_t vertex_count() const { return positions.size(); }
+    size_t index_count() const { return indices.size(); }
+    void clear();
+};
+
+enum MeshCacheFlags
+{
+    MeshCacheOptimized = 1 << 0,
+};
+
+struct MeshCacheHeader
+{
+    char     magic[4];                      // "SSMC"
+    uint32_t version;
+    uint32_t vertex_count;
+    uint32_t index_count;
+    uint32_t offset[MeshStreamCount];       // from the start of the file
+    uint32_t size[MeshStreamCount];         // in bytes
+    float    bounds_min[3];
+    float    bounds_max[3];
+    uint32_t flags;                         // MeshCacheFlags
+};
+
+class MeshCache
+{
+public:
+    static const uint32_t VERSION = 1;
+    static const uint32_t HEADER_SIZE = 128;
+    static const uint32_t STREAM_ALIGNMENT = 16;
+    
+    MeshCache() : _header(nullptr) {}
+    
+    // Writes mesh to path, returns false on I/O error.
+    static bool save(const std::string & path, const MeshData & mesh, uint32_t flags = 0);
+    
+    // The cache path used next to a source mesh: same name, .mesh extension.
+    static std::string path_for(const std::string & source_path);
+    
+    /**
+     * Maps the file and checks the header, and that the indices make
+     * whole triangles of existing vertices; false for a cache that fails,
+     * so the caller imports the source instead. Nothing is copied: the
+     * stream accessors point straight into the mapping, which stays valid
+     * until close() or the cache is destroyed.
+     */
+    bool open(const std::string & path);
+    void close();
+    
+    bool is_open() const { return _header != nullptr; }
+    uint32_t vertex_count() const { return _header->vertex_count; }
+    uint32_t index_count() const { return _header->index_count; }
+    const MeshCacheHeader & header() const { return *_header; }
+    bool optimized() const { return (_header->flags & MeshCacheOptimized) != 0; }
+    
+    bool has(MeshStream s) const { return _header->size[s] != 0; }
+    const void* stream(MeshStream s) const { return has(s) ? _file.data() + _header->offset[s] : nullptr; }
+    size_t stream_size(MeshStream s) const { return _header->size[s]; }
+    
+    const glm::vec3* positions() const { return static_cast<const glm::vec3*>(stream(MeshStreamPosition)); }
+    const glm::vec3* normals() const { return static_cast<const glm::vec3*>(stream(MeshStreamNormal)); }
+    const glm::vec3* tangents() const { return static_cast<const glm::vec3*>(stream(MeshStreamTangent)); }
+    const glm::vec2* uvs() const { return static_cast<const glm::vec2*>(stream(MeshStreamUV)); }
+    const uint32_t* indices() const { return static_cast<const uint32_t*>(stream(MeshStreamIndex)); }
+    
+    // Copies the streams out of the mapping.
+    void read(MeshData & mesh) const;
+    
+private:
+    MeshCache(const MeshCache&);
+    MeshCache& operator=(const MeshCache&);
+    
+    MappedFile _file;
+    const MeshCacheHeader* _header;
+};
+
+#endif
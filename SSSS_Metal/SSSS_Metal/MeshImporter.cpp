@@ -0,0 +1,91 @@
+//
+//  MeshImporter.cpp
+//  SSSS_Metal
+//
+
+#include "MeshImporter.h"
+
+#include <cassert>
+
+#include <assimp/Importer.hpp>
+#include <assimp/scene.h>
+#include <assimp/postprocess.h>
+
+using glm::vec2;
+using glm::vec3;
+
+bool MeshImporter::load(const std::string & path, MeshData & mesh, unsigned flags)
+{
+    mesh.clear();
+    
+    const bool use_normal = (flags & MeshImportNormals) != 0;
+    const bool use_uv = (flags & MeshImportUVs) != 0;
+    const bool use_tangent = (flags & MeshImportTangents) != 0;
+    
+    Assimp::Importer importer;
+    unsigned int load_option =
+    aiProcess_Triangulate |
+    aiProcess_JoinIdenticalVertices |
+    aiProcess_SortByPType;
+    if (use_normal) load_option |= aiProcess_GenSmoothNormals;
+    if (use_tangent) load_option |= aiProcess_CalcTangentSpace;
+    const aiScene* scene = importer.ReadFile(path.c_str(), load_option);
+    if (!scene)
+        return false;
+    
+    size_t nvertices = 0;
+    size_t ntriangles = 0;
+    for (unsigned int i = 0; i < scene->mNumMeshes; i++)
+    {
+        nvertices += scene->mMeshes[i]->mNumVertices;
+        ntriangles += scene->mMeshes[i]->mNumFaces;
+    }
+    
+    // sized once and written in place, no per-vertex push_back
+    mesh.positions.resize(nvertices);
+    if (use_normal) mesh.normals.resize(nvertices);
+    if (use_uv) mesh.uvs.resize(nvertices);
+    if (use_tangent) mesh.tangents.resize(nvertices);
+    mesh.indices.resize(ntriangles * 3);
+    
+    size_t base = 0;
+    size_t idx = 0;
+    for (unsigned int i = 0; i < scene->mNumMeshes; i++)
+    {
+        const aiMesh* m = scene->mMeshes[i];
+        if (use_uv)
+            assert(m->HasTextureCoords(0));
+        
+        for (unsigned int j = 0; j < m->mNumVertices; j++)
+        {
+            const aiVector3D& v = m->mVertices[j];
+            mesh.positions[base + j] = vec3(v.x, v.y, v.z);
+            if (use_normal)
+            {
+                const aiVector3D& n = m->mNormals[j];
+                mesh.normals[base + j] = vec3(n.x, n.y, n.z);
+            }
+            if (use_uv)
+            {
+                const aiVector3D& u = m->mTextureCoords[0][j];
+                mesh.uvs[base + j] = vec2(u.x, u.y);
+            }
+            if (use_tangent)
+            {
+                const aiVector3D& t = m->mTangents[j];
+                mesh.tangents[base + j] = vec3(t.x, t.y, t.z);
+            }
+        }
+        
+        for (unsigned int j = 0; j < m->mNumFaces; j++)
+        {
+            const aiFace& face = m->mFaces[j];
+            assert(face.mNumIndices == 3);
+            mesh.indices[idx++] = face.mIndices[0] + (uint32_t)base;
+            mesh.indices[idx++] = face.mIndices[1] + (uint32_t)base;
+            mesh.indices[idx++] = face.mIndices[2] + (uint32_t)base;
+        }
+        base += m->mNumVertices;
+    }
+    return true;
+}
@@ -0,0 +1,38 @@
+//
+//  MeshImporter.h
+//  SSSS_Metal
+//
+//  Loads a source mesh (.obj, ...) through Assimp into MeshData. This is
+//  the slow path: the app uses it only when there is no MeshCache next to
+//  the source, ssss_tool uses it to build the caches offline.
+//
+
+#ifndef SSSS_Metal_MeshImporter_h
+#define SSSS_Metal_MeshImporter_h
+
+#include <string>
+
+#include "MeshData.h"
+
+enum MeshImportFlags
+{
+    MeshImportNormals   = 1 << 0,
+    MeshImportUVs       = 1 << 1,
+    MeshImportTangents  = 1 << 2,
+};
+
+class MeshImporter
+{
+public:
+    /**
+     * Imports every mesh of the file as a single triangle list.
+     * Normals are generated (smooth) and tangents computed when requested
+     * and missing from the file. Returns false if the file can not be read.
+     */
+    static bool load(const std::string & path, MeshData & mesh, unsigned flags);
+    
+private:
+    MeshImporter() {}
+};
+
+#endif
@@ -0,0 +1,463 @@
+//
+//  MeshOptimizer.cpp
+//  SSSS_Metal
+//
+
+#include "MeshOptimizer.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <limits>
+
+using glm::vec2;
+using glm::vec3;
+
+void MeshOptimizer::optimize(MeshData & mesh, float overdraw_threshold)
+{
+    optimize_vertex_cache(mesh.indices, mesh.vertex_count());
+    optimize_overdraw(mesh.indices, mesh.positions, overdraw_threshold);
+    optimize_vertex_fetch(mesh);
+}
+
+// vertex cache
+//******************************************************************
+namespace
+{
+    const int MAX_VALENCE_SCORE = 32;
+    
+    struct ForsythScores
+    {
+        float cache[MeshOptimizer::FORSYTH_CACHE_SIZE];
+        float valence[MAX_VALENCE_SCORE];
+        
+        ForsythScores()
+        {
+            const int n = MeshOptimizer::FORSYTH_CACHE_SIZE;
+            for (int i = 0; i < n; i++)
+            {
+                // the last triangle's vertices get a fixed score so the
+                // strip-like order does not keep reusing them
+                cache[i] = i < 3 ? 0.75f : powf(1.0f - (i - 3) / float(n - 3), 1.5f);
+            }
+            for (int i = 0; i < MAX_VALENCE_SCORE; i++)
+                valence[i] = i == 0 ? 0.0f : 2.0f * powf((float)i, -0.5f);
+        }
+        
+        float vertex(int cache_position, uint32_t remaining) const
+        {
+            if (remaining == 0)
+                return -1.0f;
+            float score = cache_position >= 0 ? cache[cache_position] : 0.0f;
+            return score + valence[std::min<uint32_t>(remaining, MAX_VALENCE_SCORE - 1)];
+        }
+    };
+}
+
+void MeshOptimizer::optimize_vertex_cache(std::vector<uint32_t> & indices, size_t vertex_count)
+{
+    static const ForsythScores scores;
+    const size_t nt = indices.size() / 3;
+    if (nt == 0)
+        return;
+    
+    // triangles of each vertex, the first remaining[v] are not emitted yet
+    std::vector<uint32_t> remaining(vertex_count, 0);
+    for (uint32_t i : indices)
+        remaining[i]++;
+    std::vector<uint32_t> offset(vertex_count + 1, 0);
+    for (size_t v = 0; v < vertex_count; v++)
+        offset[v + 1] = offset[v] + remaining[v];
+    std::vector<uint32_t> adjacency(indices.size());
+    {
+        std::vector<uint32_t> fill(offset.begin(), offset.end() - 1);
+        for (size_t t = 0; t < nt; t++)
+            for (int k = 0; k < 3; k++)
+                adjacency[fill[indices[t * 3 + k]]++] = (uint32_t)t;
+    }
+    
+    std::vector<int> cache_position(vertex_count, -1);
+    std::vector<float> vertex_score(vertex_count);
+    for (size_t v = 0; v < vertex_count; v++)
+        vertex_score[v] = scores.vertex(-1, remaining[v]);
+    std::vector<float> triangle_score(nt);
+    for (size_t t = 0; t < nt; t++)
+        triangle_score[t] = vertex_score[indices[t * 3]] + vertex_score[indices[t * 3 + 1]] + vertex_score[indices[t * 3 + 2]];
+    std::vector<bool> emitted(nt, false);
+    
+    std::vector<uint32_t> cache, next_cache;
+    cache.reserve(FORSYTH_CACHE_SIZE + 3);
+    next_cache.reserve(FORSYTH_CACHE_SIZE + 3);
+    std::vector<uint32_t> result;
+    result.reserve(indices.size());
+    
+    size_t cursor = 0;  // for when nothing in the cache has a triangle left
+    int64_t best = (int64_t)(std::max_element(triangle_score.begin(), triangle_score.end()) - triangle_score.begin());
+    while (result.size() < indices.size())
+    {
+        if (best < 0)
+        {
+            while (emitted[cursor])
+                cursor++;
+            best = (int64_t)cursor;
+        }
+        const uint32_t* tri = &indices[best * 3];
+        emitted[best] = true;
+        result.insert(result.end(), tri, tri + 3);
+        
+        // take the triangle off its vertices' lists
+        for (int k = 0; k < 3; k++)
+        {
+            uint32_t v = tri[k];
+            uint32_t* list = &adjacency[offset[v]];
+            for (uint32_t i = 0; i < remaining[v]; i++)
+            {
+                if (list[i] == (uint32_t)best)
+                {
+                    std::swap(list[i], list[remaining[v] - 1]);
+                    break;
+                }
+            }
+            remaining[v]--;
+        }
+        
+        // LRU: the triangle's vertices move to the front
+        next_cache.assign(tri, tri + 3);
+        for (uint32_t v : cache)
+            if (v != tri[0] && v != tri[1] && v != tri[2])
+                next_cache.push_back(v);
+        
+        for (size_t i = 0; i < next_cache.size(); i++)
+        {
+            uint32_t v = next_cache[i];
+            cache_position[v] = i < (size_t)FORSYTH_CACHE_SIZE ? (int)i : -1;
+            vertex_score[v] = scores.vertex(cache_position[v], remaining[v]);
+        }
+        
+        // rescore the triangles touching the cache and pick the next one
+        best = -1;
+        float best_score = -1.0f;
+        for (uint32_t v : next_cache)
+        {
+            const uint32_t* list = &adjacency[offset[v]];
+            for (uint32_t i = 0; i < remaining[v]; i++)
+            {
+                uint32_t t = list[i];
+                const uint32_t* tv = &indices[t * 3];
+                float s = vertex_score[tv[0]] + vertex_score[tv[1]] + vertex_score[tv[2]];
+                triangle_score[t] = s;
+                if (s > best_score)
+                {
+                    best_score = s;
+                    best = t;
+                }
+            }
+        }
+        
+        if (next_cache.size() > (size_t)FORSYTH_CACHE_SIZE)
+            next_cache.resize(FORSYTH_CACHE_SIZE);
+        cache.swap(next_cache);
+    }
+    indices.swap(result);
+}
+
+// overdraw
+//******************************************************************
+// misses of the triangles [begin, end) with a FIFO starting empty
+static uint32_t fifo_misses(const uint32_t* indices, size_t begin, size_t end, std::vector<uint32_t> & stamp,
+                            uint32_t & time, int fifo_size)
+{
+    // a vertex is cached if fewer than fifo_size misses happened since its
+    // own, start well past every stamp so the cache starts empty
+    time += fifo_size + 1;
+    uint32_t misses = 0;
+    for (size_t i = begin * 3; i < end * 3; i++)
+    {
+        uint32_t v = indices[i];
+        if (time - stamp[v] > (uint32_t)fifo_size)
+        {
+            stamp[v] = ++time;
+            misses++;
+        }
+    }
+    return misses;
+}
+
+void MeshOptimizer::optimize_overdraw(std::vector<uint32_t> & indices, const std::vector<vec3> & positions,
+                                      float threshold, int fifo_size)
+{
+    const size_t nt = indices.size() / 3;
+    if (nt == 0)
+        return;
+    std::vector<uint32_t> stamp(positions.size(), 0);
+    uint32_t time = 0;
+    
+    // hard boundaries: triangles whose three vertices all miss, the cache
+    // starts over there whatever the order of the clusters is
+    std::vector<size_t> hard;
+    time += fifo_size + 1;
+    for (size_t t = 0; t < nt; t++)
+    {
+        int misses = 0;
+        for (int k = 0; k < 3; k++)
+        {
+            uint32_t v = indices[t * 3 + k];
+            if (time - stamp[v] > (uint32_t)fifo_size)
+            {
+                stamp[v] = ++time;
+                misses++;
+            }
+        }
+        if (misses == 3 || t == 0)
+            hard.push_back(t);
+    }
+    hard.push_back(nt);
+    
+    // soft boundaries: split a hard cluster further wherever the part
+    // before the split caches well enough on its own
+    std::vector<size_t> clusters;
+    for (size_t h = 0; h + 1 < hard.size(); h++)
+    {
+        size_t begin = hard[h], end = hard[h + 1];
+        float cluster_acmr = fifo_misses(indices.data(), begin, end, stamp, time, fifo_size) / float(end - begin);
+        
+        clusters.push_back(begin);
+        time += fifo_size + 1;
+        uint32_t misses = 0;
+        size_t start = begin;
+        for (size_t t = begin; t < end; t++)
+        {
+            for (int k = 0; k < 3; k++)
+            {
+                uint32_t v = indices[t * 3 + k];
+                if (time - stamp[v] > (uint32_t)fifo_size)
+                {
+                    stamp[v] = ++time;
+                    misses++;
+                }
+            }
+            if (t + 1 < end && misses / float(t + 1 - start) <= threshold * cluster_acmr && t + 1 - start >= 8)
+            {
+                clusters.push_back(t + 1);
+                time += fifo_size + 1;
+                misses = 0;
+                start = t + 1;
+            }
+        }
+    }
+    clusters.push_back(nt);
+    
+    // sort the clusters by how much they face away from the centroid
+    vec3 mesh_centroid(0.0f);
+    float mesh_area = 0.0f;
+    const size_t nc = clusters.size() - 1;
+    std::vector<float> key(nc);
+    std::vector<vec3> cluster_centroid(nc, vec3(0.0f));
+    std::vector<vec3> cluster_normal(nc, vec3(0.0f));
+    std::vector<float> cluster_area(nc, 0.0f);
+    for (size_t c = 0; c < nc; c++)
+    {
+        for (size_t t = clusters[c]; t < clusters[c + 1]; t++)
+        {
+            const vec3& a = positions[indices[t * 3]];
+            const vec3& b = positions[indices[t * 3 + 1]];
+            const vec3& d = positions[indices[t * 3 + 2]];
+            vec3 n = glm::cross(b - a, d - a);
+            float area = glm::length(n);
+            cluster_centroid[c] += (a + b + d) * (area / 3.0f);
+            cluster_normal[c] += n;
+            cluster_area[c] += area;
+        }
+        mesh_centroid += cluster_centroid[c];
+        mesh_area += cluster_area[c];
+        if (cluster_area[c] > 0.0f)
+            cluster_centroid[c] /= cluster_area[c];
+    }
+    if (mesh_area > 0.0f)
+        mesh_centroid /= mesh_area;
+    
+    std::vector<uint32_t> order(nc);
+    for (size_t c = 0; c < nc; c++)
+    {
+        order[c] = (uint32_t)c;
+        float l = glm::length(cluster_normal[c]);
+        key[c] = l > 0.0f ? glm::dot(cluster_centroid[c] - mesh_centroid, cluster_normal[c] / l) : 0.0f;
+    }
+    std::stable_sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) { return key[a] > key[b]; });
+    
+    std::vector<uint32_t> result;
+    result.reserve(indices.size());
+    for (uint32_t c : order)
+        result.insert(result.end(), indices.begin() + clusters[c] * 3, indices.begin() + clusters[c + 1] * 3);
+    indices.swap(result);
+}
+
+// vertex fetch
+//******************************************************************
+template <typename T>
+static void remap_stream(std::vector<T> & stream, const std::vector<uint32_t> & remap, size_t new_count)
+{
+    if (stream.empty())
+        return;
+    std::vector<T> result(new_count);
+    for (size_t v = 0; v < stream.size(); v++)
+        if (remap[v] != UINT32_MAX)
+            result[remap[v]] = stream[v];
+    stream.swap(result);
+}
+
+void MeshOptimizer::optimize_vertex_fetch(MeshData & mesh)
+{
+    std::vector<uint32_t> remap(mesh.vertex_count(), UINT32_MAX);
+    uint32_t next = 0;
+    for (uint32_t& i : mesh.indices)
+    {
+        if (remap[i] == UINT32_MAX)
+            remap[i] = next++;
+        i = remap[i];
+    }
+    remap_stream(mesh.positions, remap, next);
+    remap_stream(mesh.normals, remap, next);
+    remap_stream(mesh.tangents, remap, next);
+    remap_stream(mesh.uvs, remap, next);
+}
+
+// measures
+//******************************************************************
+static MeshOptimizer::CacheStats cache_stats(uint32_t misses, size_t index_count, size_t vertex_count)
+{
+    MeshOptimizer::CacheStats stats;
+    stats.acmr = index_count ? misses / (index_count / 3.0f) : 0.0f;
+    stats.atvr = vertex_count ? misses / (float)vertex_count : 0.0f;
+    return stats;
+}
+
+MeshOptimizer::CacheStats MeshOptimizer::simulate_fifo(const std::vector<uint32_t> & indices, size_t vertex_count, int cache_size)
+{
+    std::vector<uint32_t> stamp(vertex_count, 0);
+    uint32_t time = 0;
+    uint32_t misses = fifo_misses(indices.data(), 0, indices.size() / 3, stamp, time, cache_size);
+    return cache_stats(misses, indices.size(), vertex_count);
+}
+
+MeshOptimizer::CacheStats MeshOptimizer::simulate_lru(const std::vector<uint32_t> & indices, size_t vertex_count, int cache_size)
+{
+    std::vector<uint32_t> cache;
+    uint32_t misses = 0;
+    for (uint32_t v : indices)
+    {
+        auto it = std::find(cache.begin(), cache.end(), v);
+        if (it == cache.end())
+        {
+            misses++;
+            if (cache.size() == (size_t)cache_size)
+                cache.pop_back();
+        }
+        else
+        {
+            cache.erase(it);
+        }
+        cache.insert(cache.begin(), v);
+    }
+    return cache_stats(misses, indices.size(), vertex_count);
+}
+
+float MeshOptimizer::simulate_fetch(const std::vector<uint32_t> & indices, size_t vertex_count, size_t vertex_stride,
+                                    size_t line_size, int cache_lines)
+{
+    std::vector<size_t> cache;
+    size_t loaded = 0;
+    for (uint32_t v : indices)
+    {
+        // a vertex may straddle two lines
+        size_t first = v * vertex_stride / line_size;
+        size_t last = ((v + 1) * vertex_stride - 1) / line_size;
+        for (size_t line = first; line <= last; line++)
+        {
+            auto it = std::find(cache.begin(), cache.end(), line);
+            if (it == cache.end())
+            {
+                loaded++;
+                if (cache.size() == (size_t)cache_lines)
+                    cache.pop_back();
+            }
+            else
+            {
+                cache.erase(it);
+            }
+            cache.insert(cache.begin(), line);
+        }
+    }
+    return vertex_count ? loaded * line_size / float(vertex_count * vertex_stride) : 0.0f;
+}
+
+float MeshOptimizer::overdraw(const std::vector<uint32_t> & indices, const std::vector<vec3> & positions, int resolution)
+{
+    if (indices.empty())
+        return 0.0f;
+    
+    std::vector<vec3> directions;
+    for (int x = -1; x <= 1; x++)
+        for (int y = -1; y <= 1; y++)
+            for (int z = -1; z <= 1; z++)
+                if (abs(x) + abs(y) + abs(z) == 1 || abs(x) + abs(y) + abs(z) == 3)
+                    directions.push_back(glm::normalize(vec3(x, y, z)));
+    
+    uint64_t shaded = 0, covered = 0;
+    std::vector<float> depth((size_t)resolution * resolution);
+    std::vector<vec3> projected(positions.size());
+    for (const vec3& dir : directions)
+    {
+        // camera on the +dir side looking down -dir, depth grows away from it
+        vec3 up = fabsf(dir.y) < 0.9f ? vec3(0, 1, 0) : vec3(1, 0, 0);
+        vec3 u = glm::normalize(glm::cross(up, dir));
+        vec3 v = glm::cross(dir, u);
+        vec2 lo(std::numeric_limits<float>::max()), hi(-std::numeric_limits<float>::max());
+        for (size_t i = 0; i < positions.size(); i++)
+        {
+            projected[i] = vec3(glm::dot(positions[i], u), glm::dot(positions[i], v), -glm::dot(positions[i], dir));
+            lo = glm::min(lo, vec2(projected[i]));
+            hi = glm::max(hi, vec2(projected[i]));
+        }
+        float extent = std::max(hi.x - lo.x, hi.y - lo.y);
+        float scale = extent > 0.0f ? (resolution - 1) / extent : 0.0f;
+        for (vec3& p : projected)
+            p = vec3((p.x - lo.x) * scale, (p.y - lo.y) * scale, p.z);
+        
+        std::fill(depth.begin(), depth.end(), std::numeric_limits<float>::max());
+        for (size_t t = 0; t < indices.size() / 3; t++)
+        {
+            vec3 a = projected[indices[t * 3]], b = projected[indices[t * 3 + 1]], c = projected[indices[t * 3 + 2]];
+            float area = (b.x - a.x) * (c.y - a.y) - (b.y - a.y) * (c.x - a.x);
+            if (area <= 0.0f)
+                continue;   // back facing or degenerate
+            
+            int x0 = std::max(0, (int)floorf(std::min(a.x, std::min(b.x, c.x))));
+            int x1 = std::min(resolution - 1, (int)ceilf(std::max(a.x, std::max(b.x, c.x))));
+            int y0 = std::max(0, (int)floorf(std::min(a.y, std::min(b.y, c.y))));
+            int y1 = std::min(resolution - 1, (int)ceilf(std::max(a.y, std::max(b.y, c.y))));
+            for (int y = y0; y <= y1; y++)
+            {
+                for (int x = x0; x <= x1; x++)
+                {
+                    float px = x + 0.5f, py = y + 0.5f;
+                    float w0 = (c.x - b.x) * (py - b.y) - (c.y - b.y) * (px - b.x);
+                    float w1 = (a.x - c.x) * (py - c.y) - (a.y - c.y) * (px - c.x);
+                    float w2 = (b.x - a.x) * (py - a.y) - (b.y - a.y) * (px - a.x);
+                    if (w0 < 0.0f || w1 < 0.0f || w2 < 0.0f)
+                        continue;
+                    float z = (w0 * a.z + w1 * b.z + w2 * c.z) / area;
+                    float& d = depth[(size_t)y * resolution + x];
+                    if (z < d)
+                    {
+                        if (d == std::numeric_limits<float>::max())
+                            covered++;
+                        d = z;
+                        shaded++;
+                    }
+                }
+            }
+        }
+    }
+    return covered ? shaded / (float)covered : 0.0f;
+}
@@ -0,0 +1,79 @@
+//
+//  MeshOptimizer.h
+//  SSSS_Metal
+//
+//  Reorders a triangle list for the GPU, in three steps run by optimize():
+//
+//  1. post-transform vertex cache: Forsyth's greedy ordering ("Linear-Speed
+//     Vertex Cache Optimisation", 2006) with a 32 entry LRU model
+//  2. overdraw: the cache ordered list is cut into clusters where the
+//     cache starts over anyway, and the clusters are sorted so the ones
+//     facing out of the mesh centroid come first (Sander et al., "Fast
+//     Triangle Reordering for Vertex Locality and Reduced Overdraw", 2007)
+//  3. vertex fetch: vertices are renumbered in order of first use, which
+//     makes the fetches of a draw walk the buffers mostly linearly
+//
+//  Also has the measures to compare orderings: ACMR / ATVR of a FIFO or
+//  LRU cache, and the overdraw of a small software rasterizer.
+//
+
+#ifndef SSSS_Metal_MeshOptimizer_h
+#define SSSS_Metal_MeshOptimizer_h
+
+#include <cstdint>
+#include <vector>
+#include <glm/glm.hpp>
+
+#include "MeshData.h"
+
+class MeshOptimizer
+{
+public:
+    static const int FORSYTH_CACHE_SIZE = 32;
+    
+    struct CacheStats
+    {
+        float acmr;     // average cache miss ratio: transformed vertices per triangle
+        float atvr;     // average transformed vertex ratio: transformed vertices per vertex
+    };
+    
+    // Runs the three steps on mesh, every stream is permuted along.
+    static void optimize(MeshData & mesh, float overdraw_threshold = 1.05f);
+    
+    static void optimize_vertex_cache(std::vector<uint32_t> & indices, size_t vertex_count);
+    
+    /**
+     * Reorders clusters of a cache optimized list. A cluster boundary is kept
+     * only if the ACMR of the result stays under threshold times the ACMR
+     * of the input (simulated with a FIFO of fifo_size entries).
+     */
+    static void optimize_overdraw(std::vector<uint32_t> & indices, const std::vector<glm::vec3> & positions,
+                                  float threshold = 1.05f, int fifo_size = 16);
+    
+    // Renumbers the vertices by first use, drops the unreferenced ones.
+    static void optimize_vertex_fetch(MeshData & mesh);
+    
+    static CacheStats simulate_fifo(const std::vector<uint32_t> & indices, size_t vertex_count, int cache_size);
+    static CacheStats simulate_lru(const std::vector<uint32_t> & indices, size_t vertex_count, int cache_size);
+    
+    /**
+     * Bytes of a vertex_stride stream read through a memory cache of
+     * cache_lines lines of line_size bytes (LRU), over the stream's size.
+     * 1 means every line is read once.
+     */
+    static float simulate_fetch(const std::vector<uint32_t> & indices, size_t vertex_count, size_t vertex_stride,
+                                size_t line_size = 64, int cache_lines = 64);
+    
+    /**
+     * Shaded fragments / covered pixels with a depth test before shading,
+     * averaged over orthographic views from the 14 directions of a cube's
+     * faces and corners, back faces culled (counter clockwise front).
+     */
+    static float overdraw(const std::vector<uint32_t> & indices, const std::vector<glm::vec3> & positions,
+                          int resolution = 256);
+    
+private:
+    MeshOptimizer() {}
+};
+
+#endif
@@ -9,12 +9,15 @@
 #ifndef MetalBasic3D_Model_h
 #define MetalBasic3D_Model_h
 
+#include <memory>
 #include <vector>
 #import <Metal/Metal.h>
 #include <glm/glm.hpp>
 
 #include "Debug.h"
+#include "MeshData.h"
 #include "Utilities.h"
+#include "VertexPacking.h"
 
 using glm::vec3;
 using glm::vec2;
@@ -23,98 +26,155 @@ typedef std::vector<uint32_t> UIntArray;
 typedef std::vector<vec3> Vec3Array;
 typedef std::vector<vec2> Vec2Array;
 
+// Separate: one float buffer per attribute, uint32 indices.
+// Packed*: see VertexPacking.h, needs the *_packed vertex functions.
+enum ModelVertexLayout
+{
+    ModelVertexLayoutSeparate,
+    ModelVertexLayoutPacked,
+    ModelVertexLayoutPackedHalfPosition,
+};
+
+struct ModelStaging;
+
 class Model
 {
 private:
-    UIntArray _indices;
-    Vec3Array _vertices;
-    Vec3Array _normals;
-    Vec2Array _uv;
-    Vec3Array _tangent;
-    Vec3Array _bitangent;
+    uint32_t _index_count = 0;
+    MTLIndexType _index_type = MTLIndexTypeUInt32;
+    ModelVertexLayout _layout = ModelVertexLayoutSeparate;
     
     bool _use_normal = true;
     bool _use_uv = true;
     bool _use_tangent = false;
-    bool _use_bitangent = false;
+    
+    // of the positions, in model space
+    vec3 _bounds_min = vec3(0.0f);
+    vec3 _bounds_max = vec3(0.0f);
     
     id <MTLBuffer> _vertexBuffer;
     id <MTLBuffer> _indexBuffer;
     id <MTLBuffer> _normalBuffer;
     id <MTLBuffer> _tangentBuffer;
     id <MTLBuffer> _uvBuffer;
+    id <MTLBuffer> _attributeBuffer;    // packed layouts: normal, tangent and uv interleaved
+    
+    std::shared_ptr<ModelStaging> _staging;     // between load() and upload()
     
 public:
     
-    void init(id <MTLDevice> device, const std::string& str_path, bool use_normal = true, bool use_uv = true, bool use_tangent = false, bool use_bitangent = false)
+    // Loads str_path's MeshCache (same name, .mesh) if there is one with the
+    // requested streams, and falls back to importing str_path with Assimp.
+    void init(id <MTLDevice> device, const std::string& str_path, bool use_normal = true, bool use_uv = true, bool use_tangent = false,
+              ModelVertexLayout layout = ModelVertexLayoutSeparate)
     {
-        _use_normal  = use_normal;
-        _use_uv		 = use_uv;
-        _use_tangent = use_tangent;
-        _use_bitangent = use_bitangent;
-        _loadMeshFromFile(str_path);
-        _bindBuffer(device);
+        if (load(str_path, use_normal, use_uv, use_tangent, layout))
+            upload(device);
     }
     
+    /**
+     * init() in two steps for the startup task graph: load() maps or
+     * imports the mesh, optimizes and packs it, on any thread; upload()
+     * creates the buffers and drops the CPU side copy.
+     */
+    bool load(const std::string& str_path, bool use_normal = true, bool use_uv = true, bool use_tangent = false,
+              ModelVertexLayout layout = ModelVertexLayoutSeparate);
+    void upload(id <MTLDevice> device);
+    
+    ModelVertexLayout vertex_layout() const { return _layout; }
+    
+    // known after load()
+    const vec3 & bounds_min() const { return _bounds_min; }
+    const vec3 & bounds_max() const { return _bounds_max; }
+    
     void render(id <MTLRenderCommandEncoder> renderEncoder, bool disable_normal = false, bool disable_uv = false, bool disable_tangent = false)
     {
         int buffer_index = 1;
         [renderEncoder setVertexBuffer:_vertexBuffer offset:0 atIndex: buffer_index];
         buffer_index++;
-        if (_use_normal && !disable_normal) {
-            [renderEncoder setVertexBuffer:_normalBuffer offset:0 atIndex: buffer_index];
-            buffer_index++;
-        }
-        if (_use_tangent && !disable_tangent) {
-            [renderEncoder setVertexBuffer:_tangentBuffer offset:0 atIndex:buffer_index];
-            buffer_index++;
+        if (_layout != ModelVertexLayoutSeparate) {
+            // one interleaved stream for everything but the positions
+            if ((_use_normal && !disable_normal) || (_use_tangent && !disable_tangent) || (_use_uv && !disable_uv))
+                [renderEncoder setVertexBuffer:_attributeBuffer offset:0 atIndex: buffer_index];
         }
-        if (_use_uv && !disable_uv) {
-            [renderEncoder setVertexBuffer:_uvBuffer offset:0 atIndex:buffer_index];
-            buffer_index++;
+        else {
+            if (_use_normal && !disable_normal) {
+                [renderEncoder setVertexBuffer:_normalBuffer offset:0 atIndex: buffer_index];
+                buffer_index++;
+            }
+            if (_use_tangent && !disable_tangent) {
+                [renderEncoder setVertexBuffer:_tangentBuffer offset:0 atIndex:buffer_index];
+                buffer_index++;
+            }
+            if (_use_uv && !disable_uv) {
+                [renderEncoder setVertexBuffer:_uvBuffer offset:0 atIndex:buffer_index];
+                buffer_index++;
+            }
         }
         // tell the render context we want to draw our primitives
         //[renderEncoder drawPrimitives:MTLPrimitiveTypeTriangle vertexStart:0 vertexCount:36];
         [renderEncoder drawIndexedPrimitives: MTLPrimitiveTypeTriangle
-                                  indexCount: _indices.size()
-                                   indexType: MTLIndexTypeUInt32
+                                  indexCount: _index_count
+                                   indexType: _index_type
                                  indexBuffer: _indexBuffer
                            indexBufferOffset: 0];
     }
     
 private:
     
-    void _loadMeshFromFile(const std::string& str_path);
-
-    void _bindBuffer(id <MTLDevice> device)
+    // data/size are indexed by MeshStream, streams the model does not use are ignored
+    void _bindBuffer(id <MTLDevice> device, const void* const data[MeshStreamCount], const size_t size[MeshStreamCount])
     {
-        _indexBuffer = [device newBufferWithBytes: reinterpret_cast<const void*>(_indices.data())
-                                           length: _indices.size() * sizeof(_indices[0])
+        _index_count = (uint32_t)(size[MeshStreamIndex] / sizeof(uint32_t));
+        _indexBuffer = [device newBufferWithBytes: data[MeshStreamIndex]
+                                           length: size[MeshStreamIndex]
                                           options: MTLResourceOptionCPUCacheModeDefault];
         _indexBuffer.label = @"Indices";
         
         // setup the vertex buffers
-        _vertexBuffer = [device newBufferWithBytes: reinterpret_cast<const void*>(_vertices.data())
-                                             length: _vertices.size() * sizeof(_vertices[0])
+        _vertexBuffer = [device newBufferWithBytes: data[MeshStreamPosition]
+                                             length: size[MeshStreamPosition]
                                             options: MTLResourceOptionCPUCacheModeDefault];
         if (_use_normal) {
-            _normalBuffer = [device newBufferWithBytes: reinterpret_cast<const void*>(_normals.data())
-                                                length: _normals.size() * sizeof(_normals[0])
+            _normalBuffer = [device newBufferWithBytes: data[MeshStreamNormal]
+                                                length: size[MeshStreamNormal]
                                                options: MTLResourceOptionCPUCacheModeDefault];
         }
         if (_use_tangent) {
-            _tangentBuffer = [device newBufferWithBytes: reinterpret_cast<const void*>(_tangent.data())
-                                                length: _tangent.size() * sizeof(_tangent[0])
+            _tangentBuffer = [device newBufferWithBytes: data[MeshStreamTangent]
+                                                length: size[MeshStreamTangent]
                                                options: MTLResourceOptionCPUCacheModeDefault];
         }
         if (_use_uv) {
-            _uvBuffer = [device newBufferWithBytes: reinterpret_cast<const void*>(_uv.data())
-                                                 length: _uv.size() * sizeof(_uv[0])
+            _uvBuffer = [device newBufferWithBytes: data[MeshStreamUV]
+                                                 length: size[MeshStreamUV]
                                                 options: MTLResourceOptionCPUCacheModeDefault];
         }
         
         _vertexBuffer.label = @"Vertices";
     }
+    
+    void _bindBuffer(id <MTLDevice> device, const PackedMesh& packed)
+    {
+        _index_count = packed.index_count;
+        _index_type = packed.index_size() == 2 ? MTLIndexTypeUInt16 : MTLIndexTypeUInt32;
+        _indexBuffer = [device newBufferWithBytes: packed.indices.data()
+                                           length: packed.indices.size()
+                                          options: MTLResourceOptionCPUCacheModeDefault];
+        _indexBuffer.label = @"Indices";
+        
+        _vertexBuffer = [device newBufferWithBytes: packed.positions.data()
+                                            length: packed.positions.size()
+                                           options: MTLResourceOptionCPUCacheModeDefault];
+        _vertexBuffer.label = @"Vertices";
+        
+        if (!packed.attributes.empty()) {
+            _attributeBuffer = [device newBufferWithBytes: packed.attributes.data()
+                                                   length: packed.attributes.size() * sizeof(PackedAttributes)
+                                                  options: MTLResourceOptionCPUCacheModeDefault];
+            _attributeBuffer.label = @"Packed Attributes";
+        }
+    }
 };
 
 class ModelManager
@@ -123,8 +183,7 @@ public:
     
     static void static_init(id <MTLDevice> device)
     {
-        //screen_aligned_quad.init("media/quad.obj", false, false, false);
-        screen_aligned_quad.init(device, IOS_PATH("Models", "Quad", "obj"), false, false, false, false);
+                screen_aligned_quad.init(device, IOS_PATH("Models", "Quad", "obj"), false, false, false);
     }
     
     static Model triangle;
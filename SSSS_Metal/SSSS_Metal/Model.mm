@@ -7,103 +7,129 @@
 //
 
 #include "Model.h"
-
-#include <assimp/Importer.hpp>
-#include <assimp/scene.h>
-#include <assimp/postprocess.h>
+#include "MeshImporter.h"
+#include "MeshOptimizer.h"
 
 
 Model ModelManager::screen_aligned_quad;
 Model ModelManager::triangle;
 
-void Model::_loadMeshFromFile(const std::string& str_path)
+// what load() leaves for upload()
+struct ModelStaging
 {
-    _vertices.clear();
-    _normals.clear();
-    _uv.clear();
-    _indices.clear();
-    _bitangent.clear();
-    
-    Assimp::Importer importer;
-    const char* path = str_path.c_str();
-    unsigned int load_option =
-    //aiProcess_CalcTangentSpace |
-    aiProcess_Triangulate |
-    aiProcess_JoinIdenticalVertices |
-    aiProcess_SortByPType;
-    if (_use_normal) load_option |= aiProcess_GenSmoothNormals;
-    if (_use_tangent || _use_bitangent) load_option |= aiProcess_CalcTangentSpace;
-    const aiScene* scene = importer.ReadFile(path, load_option);
+    MeshCache cache;        // mapped, uploaded as is when optimized and unpacked
+    bool from_cache = false;
+    MeshData mesh;
+    PackedMesh packed;
+};
+
+bool Model::load(const std::string& str_path, bool use_normal, bool use_uv, bool use_tangent, ModelVertexLayout layout)
+{
+    _use_normal  = use_normal;
+    _use_uv      = use_uv;
+    _use_tangent = use_tangent;
+    _layout      = layout;
+    _staging = std::make_shared<ModelStaging>();
     
-    if (!scene) {
-        Debug::LogError("Can not open model " + str_path + ". This file may not exist or is not supported");
-        return; // TODO
+    // fast path: map the binary cache written by ssss_tool mesh-convert
+    MeshCache& cache = _staging->cache;
+    bool cached = cache.open(MeshCache::path_for(str_path));
+    if (cached &&
+        ((_use_normal && !cache.has(MeshStreamNormal)) ||
+         (_use_uv && !cache.has(MeshStreamUV)) ||
+         (_use_tangent && !cache.has(MeshStreamTangent))))
+    {
+        Debug::LogWarning(("Mesh cache of " + str_path + " lacks some streams, importing the source instead").c_str());
+        cached = false;
+    }
+    if (cached)
+    {
+        const MeshCacheHeader & header = cache.header();
+        _bounds_min = vec3(header.bounds_min[0], header.bounds_min[1], header.bounds_min[2]);
+        _bounds_max = vec3(header.bounds_max[0], header.bounds_max[1], header.bounds_max[2]);
     }
     
-    // get each mesh
-    int nvertices = 0;
-    int ntriangles = 0;
-    
-    for (unsigned int i = 0; i < scene->mNumMeshes; i++) {
-        aiMesh* mesh = scene->mMeshes[i];
-        nvertices += mesh->mNumVertices;
-        ntriangles += mesh->mNumFaces;
+    if (cached && cache.optimized() && _layout == ModelVertexLayoutSeparate)
+    {
+        // upload the streams as they are
+        _staging->from_cache = true;
+        return true;
     }
     
-    _vertices.reserve(nvertices);
-    if (_use_normal) _normals.reserve(nvertices);
-    if (_use_uv) _uv.reserve(nvertices);
-    if (_use_tangent) _tangent.reserve(nvertices);
-    if (_use_bitangent) _bitangent.reserve(nvertices);
-    _indices.resize(ntriangles * 3);	// TODO, *3?
-    int idx = 0;
-    int idx2 = 0;
-    for (unsigned int i = 0; i < scene->mNumMeshes; i++)
+    const bool optimized = cached && cache.optimized();
+    MeshData& mesh = _staging->mesh;
+    if (cached)
+    {
+        cache.read(mesh);
+    }
+    else
     {
-        aiMesh* mesh = scene->mMeshes[i];
-        if (_use_uv)
-            assert(mesh->HasTextureCoords(0) == true);
-        
-        for (unsigned int j = 0; j < mesh->mNumVertices; j++)
+        unsigned flags = 0;
+        if (_use_normal) flags |= MeshImportNormals;
+        if (_use_uv) flags |= MeshImportUVs;
+        if (_use_tangent) flags |= MeshImportTangents;
+        if (!MeshImporter::load(str_path, mesh, flags)) {
+            Debug::LogError("Can not open model " + str_path + ". This file may not exist or is not supported");
+            _staging.reset();
+            return false;
+        }
+        _bounds_min = _bounds_max = mesh.positions.empty() ? vec3(0.0f) : mesh.positions[0];
+        for (const vec3 & p : mesh.positions)
         {
-            aiVector3D& v = mesh->mVertices[j];
-            _vertices.push_back(vec3(v.x, v.y, v.z));
-            
-            if (_use_normal)
-            {
-                aiVector3D& n = mesh->mNormals[j];
-                _normals.push_back(vec3(n.x, n.y, n.z));
-            }
-            
-            if (_use_uv)
-            {
-                aiVector3D& u = mesh->mTextureCoords[0][j];
-                _uv.push_back(vec2(u.x, u.y));
-            }
-            
-            if (_use_tangent)
-            {
-                auto& t = mesh->mTangents[j];
-                _tangent.push_back(vec3(t.x, t.y, t.z));
-            }
-            if (_use_bitangent)
-            {
-                auto& t = mesh->mBitangents[j];
-                _bitangent.push_back(vec3(t.x, t.y, t.z));
-            }
-            
-            //aabb.expand(glm::vec3(v.x, v.y, v.z));
+            _bounds_min = glm::min(_bounds_min, p);
+            _bounds_max = glm::max(_bounds_max, p);
         }
-        
-        //int temp_idx = idx/3;
-        for (unsigned int j = 0; j < mesh->mNumFaces; j++)
+    }
+    cache.close();
+    
+    // Assimp's triangle order is whatever the file had, mesh-convert does
+    // this offline for the caches
+    if (!optimized)
+        MeshOptimizer::optimize(mesh);
+    
+    if (_layout != ModelVertexLayoutSeparate)
+    {
+        VertexPacking::pack(mesh, _layout == ModelVertexLayoutPackedHalfPosition ? VertexPositionHalf4 : VertexPositionFloat3, _staging->packed);
+        mesh.clear();
+    }
+    return true;
+}
+
+void Model::upload(id <MTLDevice> device)
+{
+    if (!_staging)
+        return;
+    
+    if (_staging->from_cache)
+    {
+        const MeshCache& cache = _staging->cache;
+        const void* data[MeshStreamCount];
+        size_t size[MeshStreamCount];
+        for (int s = 0; s < MeshStreamCount; s++)
         {
-            const aiFace& Face = mesh->mFaces[j];
-            assert(Face.mNumIndices == 3);
-            _indices[idx++] = Face.mIndices[0] + idx2;
-            _indices[idx++] = Face.mIndices[1] + idx2;
-            _indices[idx++] = Face.mIndices[2] + idx2;
+            data[s] = cache.stream((MeshStream)s);
+            size[s] = cache.stream_size((MeshStream)s);
         }
-        idx2 += mesh->mNumVertices;
+        _bindBuffer(device, data, size);
+    }
+    else if (_layout != ModelVertexLayoutSeparate)
+    {
+        _bindBuffer(device, _staging->packed);
+    }
+    else
+    {
+        const MeshData& mesh = _staging->mesh;
+        const void* data[MeshStreamCount] = {
+            mesh.positions.data(), mesh.normals.data(), mesh.tangents.data(), mesh.uvs.data(), mesh.indices.data()
+        };
+        const size_t size[MeshStreamCount] = {
+            mesh.positions.size() * sizeof(mesh.positions[0]),
+            mesh.normals.size() * sizeof(mesh.normals[0]),
+            mesh.tangents.size() * sizeof(mesh.tangents[0]),
+            mesh.uvs.size() * sizeof(mesh.uvs[0]),
+            mesh.indices.size() * sizeof(mesh.indices[0]),
+        };
+        _bindBuffer(device, data, size);
     }
+    _staging.reset();
 }
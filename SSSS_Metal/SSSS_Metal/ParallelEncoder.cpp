@@ -0,0 +1,160 @@
+//
+//  ParallelEncoder.cpp
+//  SSSS_Metal
+//
+
+#include "ParallelEncoder.h"
+
+#include <algorithm>
+#include <cassert>
+#include <chrono>
+#include <cstdio>
+
+const double ParallelEncoder::DEFAULT_PASS_MS = 0.05;
+
+static double now_ms()
+{
+    using namespace std::chrono;
+    return duration<double, std::milli>(steady_clock::now().time_since_epoch()).count();
+}
+
+ParallelEncoder::ParallelEncoder(int max_batches, double min_batch_ms)
+    : _max_batches(max_batches), _min_batch_ms(min_batch_ms), _wall_ms(0.0), _critical_ms(0.0), _serial_ms(0.0)
+{
+}
+
+std::vector<ParallelEncoder::Batch> ParallelEncoder::partition(const std::vector<double> & ms, int max_batches,
+                                                               double min_batch_ms)
+{
+    std::vector<Batch> batches;
+    if (ms.empty())
+        return batches;
+    double total = 0.0, largest = 0.0;
+    for (double t : ms)
+    {
+        total += t;
+        largest = std::max(largest, t);
+    }
+    int k = std::max(1, std::min(max_batches, (int)ms.size()));
+    if (min_batch_ms > 0.0)
+        k = std::max(1, std::min(k, (int)(total / min_batch_ms)));
+    
+    // the smallest bound on a batch that packs into k batches, front to back
+    auto pack = [&](double bound, std::vector<Batch>* out) -> int
+    {
+        Batch batch = { 0, 0, 0.0 };
+        int count = 1;
+        for (int i = 0; i < (int)ms.size(); i++)
+        {
+            if (batch.count > 0 && batch.ms + ms[i] > bound)
+            {
+                if (out)
+                    out->push_back(batch);
+                batch.first = i;
+                batch.count = 0;
+                batch.ms = 0.0;
+                count++;
+            }
+            batch.count++;
+            batch.ms += ms[i];
+        }
+        if (out)
+            out->push_back(batch);
+        return count;
+    };
+    double lo = largest, hi = total;
+    for (int i = 0; i < 50 && hi - lo > 1e-6 * total; i++)
+    {
+        double mid = 0.5 * (lo + hi);
+        if (pack(mid, nullptr) <= k)
+            hi = mid;
+        else
+            lo = mid;
+    }
+    pack(hi, &batches);
+    return batches;
+}
+
+double ParallelEncoder::pass_ms(const std::string & name) const
+{
+    auto it = _pass_ms.find(name);
+    return it != _pass_ms.end() ? it->second : DEFAULT_PASS_MS;
+}
+
+int ParallelEncoder::plan(FrameGraph & graph)
+{
+    const std::vector<FrameGraph::Pass> & schedule = graph.schedule();
+    std::vector<double> ms(schedule.size());
+    for (size_t i = 0; i < schedule.size(); i++)
+        ms[i] = pass_ms(graph.pass(schedule[i]).name);
+    _batches = partition(ms, _max_batches, _min_batch_ms);
+    for (int b = 0; b < (int)_batches.size(); b++)
+    {
+        for (int i = _batches[b].first; i < _batches[b].first + _batches[b].count; i++)
+            graph.set_batch(schedule[i], b);
+    }
+    return std::max((int)_batches.size(), 1);
+}
+
+void ParallelEncoder::execute(const FrameGraph & graph, ThreadPool & pool,
+                              const std::function<void(int batch, const std::function<void()> & encode)> & run)
+{
+    const std::vector<FrameGraph::Pass> & schedule = graph.schedule();
+    int covered = _batches.empty() ? 0 : _batches.back().first + _batches.back().count;
+    assert(covered == (int)schedule.size() && "plan() the graph after compile(), before execute()");
+    (void)covered;
+    
+    std::vector<double> ms(schedule.size());
+    double start = now_ms();
+    pool.parallel_for((int)_batches.size(), [&](int b)
+    {
+        run(b, [&]()
+        {
+            for (int i = _batches[b].first; i < _batches[b].first + _batches[b].count; i++)
+            {
+                double t = now_ms();
+                const FrameGraph::PassInfo & pass = graph.pass(schedule[i]);
+                pass.execute(pass);
+                ms[i] = now_ms() - t;
+            }
+        });
+    });
+    _wall_ms = now_ms() - start;
+    
+    // averaged over frames, so a slow frame doesn't move the cuts around
+    _critical_ms = _serial_ms = 0.0;
+    for (const Batch & batch : _batches)
+    {
+        double batch_ms = 0.0;
+        for (int i = batch.first; i < batch.first + batch.count; i++)
+        {
+            const std::string & name = graph.pass(schedule[i]).name;
+            auto it = _pass_ms.find(name);
+            if (it == _pass_ms.end())
+                _pass_ms[name] = ms[i];
+            else
+                it->second = 0.8 * it->second + 0.2 * ms[i];
+            batch_ms += ms[i];
+        }
+        _critical_ms = std::max(_critical_ms, batch_ms);
+        _serial_ms += batch_ms;
+    }
+}
+
+std::string ParallelEncoder::report(const FrameGraph & graph) const
+{
+    const std::vector<FrameGraph::Pass> & schedule = graph.schedule();
+    char line[256];
+    snprintf(line, sizeof(line), "%d batches, %.3f ms wall, %.3f ms largest batch, %.3f ms serial:", (int)_batches.size(),
+             _wall_ms, _critical_ms, _serial_ms);
+    std::string text = line;
+    for (const Batch & batch : _batches)
+    {
+        snprintf(line, sizeof(line), " [%s .. %s] %d passes %.3f ms,", graph.pass(schedule[batch.first]).name.c_str(),
+                 graph.pass(schedule[batch.first + batch.count - 1]).name.c_str(), batch.count, batch.ms);
+        text += line;
+    }
+    if (!_batches.empty())
+        text.pop_back();
+    return text;
+}
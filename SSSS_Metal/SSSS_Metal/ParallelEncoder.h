@@ -0,0 +1,99 @@
+//
+//  ParallelEncoder.h
+//  SSSS_Metal
+//
+//  Records the passes of a compiled FrameGraph on several threads. The
+//  schedule is cut into contiguous batches of about equal encoding time
+//  (measured on the previous frames), each batch is encoded in order into
+//  its own command buffer on a ThreadPool worker, and the command buffers
+//  reach the GPU in schedule order whichever batch finishes first: the
+//  backend reserves their order before encoding starts (Metal: enqueue).
+//
+//  Plain C++, the backend only comes in through run(): ssss_tool
+//  encode-bench drives it with mock command buffers and checks their order.
+//
+
+#ifndef SSSS_Metal_ParallelEncoder_h
+#define SSSS_Metal_ParallelEncoder_h
+
+#include <functional>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "FrameGraph.h"
+#include "ThreadPool.h"
+
+class ParallelEncoder
+{
+public:
+    // passes not timed yet, about a full screen draw
+    static const double DEFAULT_PASS_MS;
+    
+    struct Batch
+    {
+        int first;      // in schedule() positions
+        int count;
+        double ms;      // estimated encoding time
+    };
+    
+    /**
+     * max_batches: command buffers per frame, 1 to encode serially.
+     * min_batch_ms: a batch must have this much work, or the command
+     * buffer and the thread hop cost more than they save.
+     */
+    explicit ParallelEncoder(int max_batches = 4, double min_batch_ms = 0.1);
+    
+    void set_max_batches(int max_batches) { _max_batches = max_batches; }
+    int max_batches() const { return _max_batches; }
+    
+    /**
+     * At most max_batches contiguous runs of ms with the largest total as
+     * small as it can be; fewer when a batch would get less than
+     * min_batch_ms.
+     */
+    static std::vector<Batch> partition(const std::vector<double> & ms, int max_batches, double min_batch_ms);
+    
+    /**
+     * After compile(): cuts the schedule by the encoding times of the last
+     * frames and sets every live pass' batch. Returns the batch count,
+     * which the backend makes command buffers for before execute().
+     */
+    int plan(FrameGraph & graph);
+    
+    /**
+     * Encodes the batches of plan() on pool and returns when all are done.
+     * run(batch, encode) is called once per batch, on a worker or on the
+     * calling thread, and calls encode(), which executes the batch's passes
+     * in schedule order; the backend wraps it (autorelease pool, commit).
+     * Each pass is timed for the next plan().
+     */
+    void execute(const FrameGraph & graph, ThreadPool & pool,
+                 const std::function<void(int batch, const std::function<void()> & encode)> & run);
+    
+    const std::vector<Batch>& batches() const { return _batches; }
+    
+    // of the last execute(): the wall time, and the largest batch (what the wall time can't go below)
+    double wall_ms() const { return _wall_ms; }
+    double critical_ms() const { return _critical_ms; }
+    
+    // the averaged encoding time of a pass, DEFAULT_PASS_MS if never timed
+    double pass_ms(const std::string & name) const;
+    
+    // batches with their first and last pass and time, then wall and serial time
+    std::string report(const FrameGraph & graph) const;
+
+private:
+    ParallelEncoder(const ParallelEncoder&);
+    ParallelEncoder& operator=(const ParallelEncoder&);
+    
+    int _max_batches;
+    double _min_batch_ms;
+    std::vector<Batch> _batches;
+    std::map<std::string, double> _pass_ms;     // by pass name, which stays from frame to frame
+    double _wall_ms;
+    double _critical_ms;
+    double _serial_ms;
+};
+
+#endif
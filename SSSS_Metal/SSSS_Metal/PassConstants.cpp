@@ -0,0 +1,45 @@
+//
+//  PassConstants.cpp
+//  SSSS_Metal
+//
+
+#include "PassConstants.h"
+
+#include <algorithm>
+
+using glm::vec2;
+
+vec2 PassConstants::pixel_size(int width, int height)
+{
+    return vec2(1.0f / width, 1.0f / height);
+}
+
+vec2 PassConstants::ssss_direction(int width, int height, bool vertical)
+{
+    return vertical ? vec2(0.0f, 1.0f) : vec2((float)height / width, 0.0f);
+}
+
+vec2 PassConstants::bloom_glare_pixel_size(int width, int height)
+{
+    return bloom_texel(width, height, 0);
+}
+
+vec2 PassConstants::bloom_texel(int width, int height, int level)
+{
+    int base = 2 << level;
+    return vec2(1.0f / std::max(width / base, 1), 1.0f / std::max(height / base, 1));
+}
+
+vec2 PassConstants::bloom_up_weight(int level, int levels)
+{
+    // level i weighs 2^(levels - i), the sum of the weights from level i down is 2^(levels - i + 1) - 2
+    float below = (float)(1 << (levels - level)) - 2.0f;
+    float total = (float)(1 << (levels - level + 1)) - 2.0f;
+    return vec2(below / total, (float)(levels - 1 - level) / (levels - level));
+}
+
+vec2 PassConstants::dof_step(int width, int height, float blur_width, bool vertical)
+{
+    vec2 step = pixel_size(width, height) * blur_width;
+    return vertical ? vec2(0.0f, step.y) : vec2(step.x, 0.0f);
+}
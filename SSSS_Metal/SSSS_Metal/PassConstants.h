@@ -0,0 +1,51 @@
+//
+//  PassConstants.h
+//  SSSS_Metal
+//
+//  The constants of the post-process passes that depend on the window
+//  size. The Metal effects write them into their constant buffers in
+//  resize(), CPUPostProcess computes them from the size of its input.
+//  Filter steps are in uv units of the full size target, also for passes
+//  DynamicResolution runs smaller.
+//
+
+#ifndef SSSS_Metal_PassConstants_h
+#define SSSS_Metal_PassConstants_h
+
+#include <glm/glm.hpp>
+
+class PassConstants
+{
+public:
+    static glm::vec2 pixel_size(int width, int height);
+    
+    /**
+     * SeparableSSS blur direction in uv. The horizontal one is scaled by
+     * height / width: sssWidth is relative to the window height (the
+     * vertical fov), so the blur covers as many pixels along both axes and
+     * doesn't change with the orientation.
+     */
+    static glm::vec2 ssss_direction(int width, int height, bool vertical);
+    
+    // Bloom glare detection, in texels of the half size glare target.
+    static glm::vec2 bloom_glare_pixel_size(int width, int height);
+    
+    // A texel of bloom pyramid level (0 is the half size glare target, each
+    // next one half the size). The tent step of the upsample is bloom_width
+    // texels of the level it samples.
+    static glm::vec2 bloom_texel(int width, int height, int level);
+    
+    /**
+     * Share of the upsampled level below in the upsample into level (of
+     * levels): rgb weights the levels 64, 32, ... 2 out of 126 in the top
+     * of the chain, alpha is their mean.
+     */
+    static glm::vec2 bloom_up_weight(int level, int levels);
+    
+    static glm::vec2 dof_step(int width, int height, float blur_width, bool vertical);
+
+private:
+    PassConstants();
+};
+
+#endif
@@ -30,6 +30,7 @@ protected:
     id <MTLTexture> _texture;
     //id <MTLTexture> _msaa_texture;
     MTLPixelFormat _format;
+    MTLTextureUsage _usage;
     
     
 public:
@@ -43,18 +44,23 @@ public:
     id <MTLTexture> texture() const { return _texture; }
     //id <MTLTexture> msaa_texture() const { return _msaa_texture; };
     
-    virtual void init(id <MTLDevice> device, MTLPixelFormat format = MTLPixelFormatRGBA8Unorm, int width = 0, int height = 0)
+    // usage is left to Metal's default when unknown
+    virtual void init(id <MTLDevice> device, MTLPixelFormat format = MTLPixelFormatRGBA8Unorm, int width = 0, int height = 0,
+                      MTLTextureUsage usage = MTLTextureUsageUnknown)
     {
         _width = width;
         _height = height;
         if (_width == 0) _width = RenderContext::window_width;
         if (_height == 0) _height = RenderContext::window_height;
         _format = format;
+        _usage = usage;
         
         auto desc = [MTLTextureDescriptor texture2DDescriptorWithPixelFormat: _format
                                                                        width: _width
                                                                       height: _height
                                                                    mipmapped: NO];
+        if (usage != MTLTextureUsageUnknown)
+            desc.usage = usage;
         _texture = [device newTextureWithDescriptor: desc];
         
 //        auto msaa_desc = [MTLTextureDescriptor texture2DDescriptorWithPixelFormat: _format
@@ -65,6 +71,14 @@ public:
 //        msaa_desc.sampleCount = 4;
 //        _msaa_texture = [device newTextureWithDescriptor: msaa_desc];
     }
+    
+    // New texture of the same format and usage, only if the size changed. The content is lost.
+    void resize(id <MTLDevice> device, int width, int height)
+    {
+        if (_texture && width == _width && height == _height)
+            return;
+        init(device, _format, width, height, _usage);
+    }
 };
 
 class DepthStencil
@@ -135,9 +149,10 @@ public:
         return _render_pass_desc;
     }
     
+    // SHADOW_MAP_SIZE square unless given a size (the shadow atlas)
     virtual void init(id <MTLDevice> device, int width = 0, int height = 0) override
     {
-        DepthStencil::init(device, SHADOW_MAP_SIZE, SHADOW_MAP_SIZE);
+        DepthStencil::init(device, width > 0 ? width : SHADOW_MAP_SIZE, height > 0 ? height : SHADOW_MAP_SIZE);
         
         _render_pass_desc = [MTLRenderPassDescriptor new];
         auto attachment = _render_pass_desc.depthAttachment;
@@ -0,0 +1,99 @@
+//
+//  RenderTargetPool.cpp
+//  SSSS_Metal
+//
+
+#include "RenderTargetPool.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstdio>
+
+RenderTargetPool::RenderTargetPool(int max_idle_frames)
+    : _max_idle_frames(max_idle_frames), _frame(0), _current_bytes(0), _in_use_bytes(0), _peak_bytes(0)
+{
+}
+
+RenderTargetPool::Target RenderTargetPool::acquire(const FrameGraphTextureDesc & desc)
+{
+    Target target = -1;
+    for (Target t = 0; t < target_count() && target < 0; t++)
+    {
+        if (_targets[t].live && !_targets[t].in_use && _targets[t].desc == desc)
+            target = t;
+    }
+    if (target < 0)
+    {
+        for (Target t = 0; t < target_count() && target < 0; t++)
+        {
+            if (!_targets[t].live)
+                target = t;
+        }
+        if (target < 0)
+        {
+            target = target_count();
+            _targets.push_back(Entry());
+        }
+        Entry & e = _targets[target];
+        e.desc = desc;
+        e.live = true;
+        _current_bytes += desc.bytes();
+        _peak_bytes = std::max(_peak_bytes, _current_bytes);
+    }
+    Entry & e = _targets[target];
+    e.in_use = true;
+    e.last_frame = _frame;
+    _in_use_bytes += desc.bytes();
+    return target;
+}
+
+void RenderTargetPool::release(Target target)
+{
+    Entry & e = _targets[target];
+    assert(e.live && e.in_use && "released twice");
+    e.in_use = false;
+    _in_use_bytes -= e.desc.bytes();
+}
+
+void RenderTargetPool::drop(Target target)
+{
+    Entry & e = _targets[target];
+    e.live = false;
+    _current_bytes -= e.desc.bytes();
+}
+
+void RenderTargetPool::end_frame()
+{
+    assert(_in_use_bytes == 0 && "a target is still acquired at the end of the frame");
+    for (Target t = 0; t < target_count(); t++)
+    {
+        if (_targets[t].live && !_targets[t].in_use && _frame - _targets[t].last_frame >= _max_idle_frames)
+            drop(t);
+    }
+    _frame++;
+}
+
+void RenderTargetPool::purge()
+{
+    for (Target t = 0; t < target_count(); t++)
+    {
+        if (_targets[t].live && !_targets[t].in_use)
+            drop(t);
+    }
+}
+
+int RenderTargetPool::live_count() const
+{
+    int count = 0;
+    for (const Entry & e : _targets)
+        count += e.live ? 1 : 0;
+    return count;
+}
+
+std::string RenderTargetPool::report() const
+{
+    char line[160];
+    snprintf(line, sizeof(line), "%d targets, %.2f MB (%.2f MB in use), peak %.2f MB", live_count(),
+             _current_bytes / (1024.0 * 1024.0), _in_use_bytes / (1024.0 * 1024.0), _peak_bytes / (1024.0 * 1024.0));
+    return line;
+}
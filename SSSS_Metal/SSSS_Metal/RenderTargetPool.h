@@ -0,0 +1,83 @@
+//
+//  RenderTargetPool.h
+//  SSSS_Metal
+//
+//  Transient render targets handed out by description (size, format,
+//  usage). A released target goes back to the pool and is given to the
+//  next acquire() of the same description, in the same frame or a later
+//  one; targets nobody acquired for a few frames are dropped.
+//
+//  The pool only does the bookkeeping and the byte accounting: the backend
+//  (FrameGraphTargets, CPUFrameGraph) keeps one texture per live target.
+//
+
+#ifndef SSSS_Metal_RenderTargetPool_h
+#define SSSS_Metal_RenderTargetPool_h
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+#include "FrameGraph.h"
+
+class RenderTargetPool
+{
+public:
+    typedef int Target;
+    
+    // max_idle_frames: end_frame() calls a free target may sit through before it is dropped
+    explicit RenderTargetPool(int max_idle_frames = 3);
+    
+    // The first free target of this description, a new one if there is none.
+    Target acquire(const FrameGraphTextureDesc & desc);
+    
+    // Hands target back; its content is not kept.
+    void release(Target target);
+    
+    /**
+     * Once per frame, when every target has been released: drops the
+     * targets that stayed free for more than max_idle_frames frames.
+     */
+    void end_frame();
+    
+    // Drops every free target (memory warning, resize).
+    void purge();
+    
+    // Targets are numbered from 0; the numbers of dropped ones are reused.
+    int target_count() const { return (int)_targets.size(); }
+    bool live(Target target) const { return _targets[target].live; }
+    bool in_use(Target target) const { return _targets[target].in_use; }
+    const FrameGraphTextureDesc & desc(Target target) const { return _targets[target].desc; }
+    int live_count() const;
+    
+    size_t current_bytes() const { return _current_bytes; }     // every live target, free or not
+    size_t in_use_bytes() const { return _in_use_bytes; }
+    size_t peak_bytes() const { return _peak_bytes; }
+    int frame() const { return _frame; }
+    
+    // one line: targets, current / in use / peak bytes
+    std::string report() const;
+
+private:
+    RenderTargetPool(const RenderTargetPool&);
+    RenderTargetPool& operator=(const RenderTargetPool&);
+    
+    struct Entry
+    {
+        FrameGraphTextureDesc desc;
+        bool live;
+        bool in_use;
+        int last_frame;     // frame it was last acquired in
+    };
+    
+    void drop(Target target);
+    
+    std::vector<Entry> _targets;
+    int _max_idle_frames;
+    int _frame;
+    size_t _current_bytes;
+    size_t _in_use_bytes;
+    size_t _peak_bytes;
+};
+
+#endif
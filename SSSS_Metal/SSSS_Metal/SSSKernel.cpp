@@ -0,0 +1,114 @@
+//
+//  SSSKernel.cpp
+//  SSSS_Metal
+//
+
+#include "SSSKernel.h"
+
+#include <cmath>
+#include <cassert>
+
+using glm::vec3;
+using glm::vec4;
+
+bool SSSKernel::update(int nSamples, const vec3 & strength, const vec3 & falloff)
+{
+    if (nSamples == _n_samples && strength == _strength && falloff == _falloff)
+        return false;
+    
+    _n_samples = nSamples;
+    _strength = strength;
+    _falloff = falloff;
+    calculate(_kernel, nSamples, strength, falloff);
+    return true;
+}
+
+vec3 SSSKernel::gaussian(float variance, float r, const vec3 & falloff)
+{
+    /**
+     * We use a falloff to modulate the shape of the profile. Big falloffs
+     * spreads the shape making it wider, while small falloffs make it
+     * narrower.
+     */
+    vec3 g;
+    for (int i = 0; i < 3; i++)
+    {
+        float rr = r / (0.001f + falloff[i]);
+        g[i] = expf((-(rr * rr)) / (2.0f * variance)) / (2.0f * 3.14f * variance);
+    }
+    return g;
+}
+
+vec3 SSSKernel::profile(float r, const vec3 & falloff)
+{
+    // 0.233 * gaussian(0.0064) is directly bounced light, it is accounted
+    // for by the strength parameter.
+    return 0.100f * gaussian(0.0484f, r, falloff) +
+           0.118f * gaussian( 0.187f, r, falloff) +
+           0.113f * gaussian( 0.567f, r, falloff) +
+           0.358f * gaussian(  1.99f, r, falloff) +
+           0.078f * gaussian(  7.41f, r, falloff);
+}
+
+void SSSKernel::calculate(std::vector<vec4> & kernel, int nSamples, const vec3 & strength, const vec3 & falloff)
+{
+    assert(nSamples >= 3 && nSamples % 2 == 1);
+    
+    const float RANGE = range(nSamples);
+    const float EXPONENT = 2.0f;
+    
+    kernel.resize(nSamples);
+    
+    // Calculate the offsets, denser around the center:
+    float step = 2.0f * RANGE / (nSamples - 1);
+    for (int i = 0; i < nSamples; i++)
+    {
+        float o = -RANGE + float(i) * step;
+        float sign = o < 0.0f ? -1.0f : 1.0f;
+        kernel[i].w = RANGE * sign * fabsf(powf(o, EXPONENT)) / powf(RANGE, EXPONENT);
+    }
+    
+    // Calculate the weights:
+    for (int i = 0; i < nSamples; i++)
+    {
+        float w0 = i > 0 ? fabsf(kernel[i].w - kernel[i - 1].w) : 0.0f;
+        float w1 = i < nSamples - 1 ? fabsf(kernel[i].w - kernel[i + 1].w) : 0.0f;
+        float area = (w0 + w1) / 2.0f;
+        vec3 t = area * profile(kernel[i].w, falloff);
+        kernel[i].x = t.x;
+        kernel[i].y = t.y;
+        kernel[i].z = t.z;
+    }
+    
+    // We want the offset 0.0 to come first:
+    vec4 t = kernel[nSamples / 2];
+    for (int i = nSamples / 2; i > 0; i--)
+        kernel[i] = kernel[i - 1];
+    kernel[0] = t;
+    
+    // Normalize the weights:
+    vec3 sum(0.0f);
+    for (int i = 0; i < nSamples; i++)
+        sum += vec3(kernel[i]);
+    for (int i = 0; i < nSamples; i++)
+    {
+        kernel[i].x /= sum.x;
+        kernel[i].y /= sum.y;
+        kernel[i].z /= sum.z;
+    }
+    
+    // Tweak them using the desired strength. The first one is:
+    //     lerp(1.0, kernel[0].rgb, strength)
+    kernel[0].x = (1.0f - strength.x) * 1.0f + strength.x * kernel[0].x;
+    kernel[0].y = (1.0f - strength.y) * 1.0f + strength.y * kernel[0].y;
+    kernel[0].z = (1.0f - strength.z) * 1.0f + strength.z * kernel[0].z;
+    
+    // The others:
+    //     lerp(0.0, kernel[i].rgb, strength)
+    for (int i = 1; i < nSamples; i++)
+    {
+        kernel[i].x *= strength.x;
+        kernel[i].y *= strength.y;
+        kernel[i].z *= strength.z;
+    }
+}
@@ -0,0 +1,54 @@
+//
+//  SSSKernel.h
+//  SSSS_Metal
+//
+//  Separable SSS kernel generator.
+//  Plain C++: SeparableSSS uploads the samples, CPUPostProcess blurs with
+//  the same ones, and ssss_tool kernel-bench times the rebuild.
+//
+
+#ifndef SSSS_Metal_SSSKernel_h
+#define SSSS_Metal_SSSKernel_h
+
+#include <vector>
+#include <glm/glm.hpp>
+
+class SSSKernel
+{
+public:
+    SSSKernel() : _n_samples(0), _strength(-1.0f), _falloff(-1.0f) {}
+    
+    /**
+     * Rebuilds the kernel if any of the parameters changed since the last
+     * call. Returns true if the kernel was rebuilt, so the caller knows it
+     * has to upload it again.
+     */
+    bool update(int nSamples, const glm::vec3 & strength, const glm::vec3 & falloff);
+    
+    /**
+     * Kernel entries are (weight.rgb, offset). The center sample comes
+     * first, the offsets of the others are in [-range(), range()].
+     */
+    const std::vector<glm::vec4>& samples() const { return _kernel; }
+    int size() const { return (int)_kernel.size(); }
+    
+    static float range(int nSamples) { return nSamples > 20 ? 3.0f : 2.0f; }
+    
+    static void calculate(std::vector<glm::vec4> & kernel, int nSamples, const glm::vec3 & strength, const glm::vec3 & falloff);
+    
+    /**
+     * Sum-of-Gaussians skin profile from [d'Eon07], red channel used for all
+     * three channels and shaped per channel by the falloff.
+     */
+    static glm::vec3 profile(float r, const glm::vec3 & falloff);
+    
+private:
+    static glm::vec3 gaussian(float variance, float r, const glm::vec3 & falloff);
+    
+    std::vector<glm::vec4> _kernel;
+    int _n_samples;
+    glm::vec3 _strength;
+    glm::vec3 _falloff;
+};
+
+#endif
@@ -0,0 +1,504 @@
+//
+//  SSSSBlurSIMD.cpp
+//  SSSS_Metal
+//
+
+#include "SSSSBlurSIMD.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstring>
+
+#if defined(__AVX512F__)
+#include <immintrin.h>
+#define SSSS_SIMD_AVX512 1
+#elif defined(__AVX2__)
+#include <immintrin.h>
+#define SSSS_SIMD_AVX2 1
+#elif defined(__SSE4_1__)
+#include <smmintrin.h>
+#define SSSS_SIMD_SSE 1
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#define SSSS_SIMD_NEON 1
+#endif
+
+// Vector backends
+//******************************************************************
+// Every backend provides the same static interface over N float lanes (F)
+// and N int lanes (I). The blur below is written once against it.
+
+struct ScalarV
+{
+    enum { N = 1 };
+    typedef float F;
+    typedef int I;
+    
+    static F set1(float x) { return x; }
+    static F load(const float* p) { return *p; }
+    static F add(F a, F b) { return a + b; }
+    static F sub(F a, F b) { return a - b; }
+    static F mul(F a, F b) { return a * b; }
+    static F div(F a, F b) { return a / b; }
+    static F min(F a, F b) { return a < b ? a : b; }
+    static F max(F a, F b) { return a > b ? a : b; }
+    static F abs(F a) { return fabsf(a); }
+    static F floor(F a) { return floorf(a); }
+    
+    static I set1i(int x) { return x; }
+    static I iota() { return 0; }
+    static I addi(I a, I b) { return a + b; }
+    static I muli(I a, int b) { return a * b; }
+    static I clampi(I a, int lo, int hi) { return a < lo ? lo : (a > hi ? hi : a); }
+    static I to_int(F a) { return (int)a; }
+    static F to_float(I a) { return (float)a; }
+    
+    static F gather(const float* base, I idx) { return base[idx]; }
+    static void gather_rgb(const float* rgba, I idx, F & r, F & g, F & b)
+    {
+        const float* p = rgba + idx * 4;
+        r = p[0]; g = p[1]; b = p[2];
+    }
+    static void load_rgba(const float* p, F & r, F & g, F & b, F & a)
+    {
+        r = p[0]; g = p[1]; b = p[2]; a = p[3];
+    }
+    static void store_rgba(float* p, F r, F g, F b, F a)
+    {
+        p[0] = r; p[1] = g; p[2] = b; p[3] = a;
+    }
+};
+
+#if SSSS_SIMD_SSE
+struct SSEV
+{
+    enum { N = 4 };
+    typedef __m128 F;
+    typedef __m128i I;
+    
+    static F set1(float x) { return _mm_set1_ps(x); }
+    static F load(const float* p) { return _mm_loadu_ps(p); }
+    static F add(F a, F b) { return _mm_add_ps(a, b); }
+    static F sub(F a, F b) { return _mm_sub_ps(a, b); }
+    static F mul(F a, F b) { return _mm_mul_ps(a, b); }
+    static F div(F a, F b) { return _mm_div_ps(a, b); }
+    static F min(F a, F b) { return _mm_min_ps(a, b); }
+    static F max(F a, F b) { return _mm_max_ps(a, b); }
+    static F abs(F a) { return _mm_andnot_ps(_mm_set1_ps(-0.0f), a); }
+    static F floor(F a) { return _mm_floor_ps(a); }
+    
+    static I set1i(int x) { return _mm_set1_epi32(x); }
+    static I iota() { return _mm_setr_epi32(0, 1, 2, 3); }
+    static I addi(I a, I b) { return _mm_add_epi32(a, b); }
+    static I muli(I a, int b) { return _mm_mullo_epi32(a, _mm_set1_epi32(b)); }
+    static I clampi(I a, int lo, int hi) { return _mm_min_epi32(_mm_max_epi32(a, _mm_set1_epi32(lo)), _mm_set1_epi32(hi)); }
+    static I to_int(F a) { return _mm_cvttps_epi32(a); }
+    static F to_float(I a) { return _mm_cvtepi32_ps(a); }
+    
+    static F gather(const float* base, I idx)
+    {
+        alignas(16) int i[4];
+        _mm_store_si128((__m128i*)i, idx);
+        return _mm_setr_ps(base[i[0]], base[i[1]], base[i[2]], base[i[3]]);
+    }
+    static void gather_rgb(const float* rgba, I idx, F & r, F & g, F & b)
+    {
+        alignas(16) int i[4];
+        _mm_store_si128((__m128i*)i, idx);
+        __m128 p0 = _mm_loadu_ps(rgba + i[0] * 4);
+        __m128 p1 = _mm_loadu_ps(rgba + i[1] * 4);
+        __m128 p2 = _mm_loadu_ps(rgba + i[2] * 4);
+        __m128 p3 = _mm_loadu_ps(rgba + i[3] * 4);
+        _MM_TRANSPOSE4_PS(p0, p1, p2, p3);
+        r = p0; g = p1; b = p2;
+    }
+    static void load_rgba(const float* p, F & r, F & g, F & b, F & a)
+    {
+        __m128 p0 = _mm_loadu_ps(p);
+        __m128 p1 = _mm_loadu_ps(p + 4);
+        __m128 p2 = _mm_loadu_ps(p + 8);
+        __m128 p3 = _mm_loadu_ps(p + 12);
+        _MM_TRANSPOSE4_PS(p0, p1, p2, p3);
+        r = p0; g = p1; b = p2; a = p3;
+    }
+    static void store_rgba(float* p, F r, F g, F b, F a)
+    {
+        _MM_TRANSPOSE4_PS(r, g, b, a);
+        _mm_storeu_ps(p, r);
+        _mm_storeu_ps(p + 4, g);
+        _mm_storeu_ps(p + 8, b);
+        _mm_storeu_ps(p + 12, a);
+    }
+};
+typedef SSEV NativeV;
+#endif
+
+#if SSSS_SIMD_AVX2
+struct AVX2V
+{
+    enum { N = 8 };
+    typedef __m256 F;
+    typedef __m256i I;
+    
+    static F set1(float x) { return _mm256_set1_ps(x); }
+    static F load(const float* p) { return _mm256_loadu_ps(p); }
+    static F add(F a, F b) { return _mm256_add_ps(a, b); }
+    static F sub(F a, F b) { return _mm256_sub_ps(a, b); }
+    static F mul(F a, F b) { return _mm256_mul_ps(a, b); }
+    static F div(F a, F b) { return _mm256_div_ps(a, b); }
+    static F min(F a, F b) { return _mm256_min_ps(a, b); }
+    static F max(F a, F b) { return _mm256_max_ps(a, b); }
+    static F abs(F a) { return _mm256_andnot_ps(_mm256_set1_ps(-0.0f), a); }
+    static F floor(F a) { return _mm256_floor_ps(a); }
+    
+    static I set1i(int x) { return _mm256_set1_epi32(x); }
+    static I iota() { return _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7); }
+    static I addi(I a, I b) { return _mm256_add_epi32(a, b); }
+    static I muli(I a, int b) { return _mm256_mullo_epi32(a, _mm256_set1_epi32(b)); }
+    static I clampi(I a, int lo, int hi) { return _mm256_min_epi32(_mm256_max_epi32(a, _mm256_set1_epi32(lo)), _mm256_set1_epi32(hi)); }
+    static I to_int(F a) { return _mm256_cvttps_epi32(a); }
+    static F to_float(I a) { return _mm256_cvtepi32_ps(a); }
+    
+    static F gather(const float* base, I idx) { return _mm256_i32gather_ps(base, idx, 4); }
+    static void gather_rgb(const float* rgba, I idx, F & r, F & g, F & b)
+    {
+        I i4 = _mm256_slli_epi32(idx, 2);
+        r = _mm256_i32gather_ps(rgba,     i4, 4);
+        g = _mm256_i32gather_ps(rgba + 1, i4, 4);
+        b = _mm256_i32gather_ps(rgba + 2, i4, 4);
+    }
+    static void load_rgba(const float* p, F & r, F & g, F & b, F & a)
+    {
+        I i4 = _mm256_slli_epi32(iota(), 2);
+        r = _mm256_i32gather_ps(p,     i4, 4);
+        g = _mm256_i32gather_ps(p + 1, i4, 4);
+        b = _mm256_i32gather_ps(p + 2, i4, 4);
+        a = _mm256_i32gather_ps(p + 3, i4, 4);
+    }
+    static void store_rgba(float* p, F r, F g, F b, F a)
+    {
+        // 4x4 transposes within each 128 bit half, then write the halves
+        __m256 t0 = _mm256_unpacklo_ps(r, g);
+        __m256 t1 = _mm256_unpackhi_ps(r, g);
+        __m256 t2 = _mm256_unpacklo_ps(b, a);
+        __m256 t3 = _mm256_unpackhi_ps(b, a);
+        __m256 p0 = _mm256_shuffle_ps(t0, t2, _MM_SHUFFLE(1, 0, 1, 0));
+        __m256 p1 = _mm256_shuffle_ps(t0, t2, _MM_SHUFFLE(3, 2, 3, 2));
+        __m256 p2 = _mm256_shuffle_ps(t1, t3, _MM_SHUFFLE(1, 0, 1, 0));
+        __m256 p3 = _mm256_shuffle_ps(t1, t3, _MM_SHUFFLE(3, 2, 3, 2));
+        _mm256_storeu_ps(p,      _mm256_permute2f128_ps(p0, p1, 0x20));
+        _mm256_storeu_ps(p + 8,  _mm256_permute2f128_ps(p2, p3, 0x20));
+        _mm256_storeu_ps(p + 16, _mm256_permute2f128_ps(p0, p1, 0x31));
+        _mm256_storeu_ps(p + 24, _mm256_permute2f128_ps(p2, p3, 0x31));
+    }
+};
+typedef AVX2V NativeV;
+#endif
+
+#if SSSS_SIMD_AVX512
+struct AVX512V
+{
+    enum { N = 16 };
+    typedef __m512 F;
+    typedef __m512i I;
+    
+    static F set1(float x) { return _mm512_set1_ps(x); }
+    static F load(const float* p) { return _mm512_loadu_ps(p); }
+    static F add(F a, F b) { return _mm512_add_ps(a, b); }
+    static F sub(F a, F b) { return _mm512_sub_ps(a, b); }
+    static F mul(F a, F b) { return _mm512_mul_ps(a, b); }
+    static F div(F a, F b) { return _mm512_div_ps(a, b); }
+    static F min(F a, F b) { return _mm512_min_ps(a, b); }
+    static F max(F a, F b) { return _mm512_max_ps(a, b); }
+    static F abs(F a) { return _mm512_abs_ps(a); }
+    static F floor(F a) { return _mm512_roundscale_ps(a, _MM_FROUND_TO_NEG_INF | _MM_FROUND_NO_EXC); }
+    
+    static I set1i(int x) { return _mm512_set1_epi32(x); }
+    static I iota() { return _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15); }
+    static I addi(I a, I b) { return _mm512_add_epi32(a, b); }
+    static I muli(I a, int b) { return _mm512_mullo_epi32(a, _mm512_set1_epi32(b)); }
+    static I clampi(I a, int lo, int hi) { return _mm512_min_epi32(_mm512_max_epi32(a, _mm512_set1_epi32(lo)), _mm512_set1_epi32(hi)); }
+    static I to_int(F a) { return _mm512_cvttps_epi32(a); }
+    static F to_float(I a) { return _mm512_cvtepi32_ps(a); }
+    
+    static F gather(const float* base, I idx) { return _mm512_i32gather_ps(idx, base, 4); }
+    static void gather_rgb(const float* rgba, I idx, F & r, F & g, F & b)
+    {
+        I i4 = _mm512_slli_epi32(idx, 2);
+        r = _mm512_i32gather_ps(i4, rgba,     4);
+        g = _mm512_i32gather_ps(i4, rgba + 1, 4);
+        b = _mm512_i32gather_ps(i4, rgba + 2, 4);
+    }
+    static void load_rgba(const float* p, F & r, F & g, F & b, F & a)
+    {
+        I i4 = _mm512_slli_epi32(iota(), 2);
+        r = _mm512_i32gather_ps(i4, p,     4);
+        g = _mm512_i32gather_ps(i4, p + 1, 4);
+        b = _mm512_i32gather_ps(i4, p + 2, 4);
+        a = _mm512_i32gather_ps(i4, p + 3, 4);
+    }
+    static void store_rgba(float* p, F r, F g, F b, F a)
+    {
+        I i4 = _mm512_slli_epi32(iota(), 2);
+        _mm512_i32scatter_ps(p,     i4, r, 4);
+        _mm512_i32scatter_ps(p + 1, i4, g, 4);
+        _mm512_i32scatter_ps(p + 2, i4, b, 4);
+        _mm512_i32scatter_ps(p + 3, i4, a, 4);
+    }
+};
+typedef AVX512V NativeV;
+#endif
+
+#if SSSS_SIMD_NEON
+struct NEONV
+{
+    enum { N = 4 };
+    typedef float32x4_t F;
+    typedef int32x4_t I;
+    
+    static F set1(float x) { return vdupq_n_f32(x); }
+    static F load(const float* p) { return vld1q_f32(p); }
+    static F add(F a, F b) { return vaddq_f32(a, b); }
+    static F sub(F a, F b) { return vsubq_f32(a, b); }
+    static F mul(F a, F b) { return vmulq_f32(a, b); }
+    static F div(F a, F b) { return vdivq_f32(a, b); }
+    static F min(F a, F b) { return vminq_f32(a, b); }
+    static F max(F a, F b) { return vmaxq_f32(a, b); }
+    static F abs(F a) { return vabsq_f32(a); }
+    static F floor(F a) { return vrndmq_f32(a); }
+    
+    static I set1i(int x) { return vdupq_n_s32(x); }
+    static I iota() { const int32_t i[4] = { 0, 1, 2, 3 }; return vld1q_s32(i); }
+    static I addi(I a, I b) { return vaddq_s32(a, b); }
+    static I muli(I a, int b) { return vmulq_n_s32(a, b); }
+    static I clampi(I a, int lo, int hi) { return vminq_s32(vmaxq_s32(a, vdupq_n_s32(lo)), vdupq_n_s32(hi)); }
+    static I to_int(F a) { return vcvtq_s32_f32(a); }
+    static F to_float(I a) { return vcvtq_f32_s32(a); }
+    
+    static F gather(const float* base, I idx)
+    {
+        int32_t i[4];
+        vst1q_s32(i, idx);
+        float v[4] = { base[i[0]], base[i[1]], base[i[2]], base[i[3]] };
+        return vld1q_f32(v);
+    }
+    static void gather_rgb(const float* rgba, I idx, F & r, F & g, F & b)
+    {
+        int32_t i[4];
+        vst1q_s32(i, idx);
+        float32x4x4_t t;
+        t.val[0] = vld1q_f32(rgba + i[0] * 4);
+        t.val[1] = vld1q_f32(rgba + i[1] * 4);
+        t.val[2] = vld1q_f32(rgba + i[2] * 4);
+        t.val[3] = vld1q_f32(rgba + i[3] * 4);
+        float tmp[16];
+        vst1q_f32(tmp,      t.val[0]);
+        vst1q_f32(tmp + 4,  t.val[1]);
+        vst1q_f32(tmp + 8,  t.val[2]);
+        vst1q_f32(tmp + 12, t.val[3]);
+        float32x4x4_t s = vld4q_f32(tmp);   // deinterleave
+        r = s.val[0]; g = s.val[1]; b = s.val[2];
+    }
+    static void load_rgba(const float* p, F & r, F & g, F & b, F & a)
+    {
+        float32x4x4_t s = vld4q_f32(p);
+        r = s.val[0]; g = s.val[1]; b = s.val[2]; a = s.val[3];
+    }
+    static void store_rgba(float* p, F r, F g, F b, F a)
+    {
+        float32x4x4_t s;
+        s.val[0] = r; s.val[1] = g; s.val[2] = b; s.val[3] = a;
+        vst4q_f32(p, s);
+    }
+};
+typedef NEONV NativeV;
+#endif
+
+#if !defined(SSSS_SIMD_SSE) && !defined(SSSS_SIMD_AVX2) && !defined(SSSS_SIMD_AVX512) && !defined(SSSS_SIMD_NEON)
+typedef ScalarV NativeV;
+#endif
+
+// Blur
+//******************************************************************
+template<typename V>
+static typename V::F lerp(typename V::F a, typename V::F b, typename V::F t)
+{
+    // a * (1 - t) + b * t, the same rounding as glm::mix in the reference
+    return V::add(V::mul(a, V::sub(V::set1(1.0f), t)), V::mul(b, t));
+}
+
+template<typename V>
+static typename V::F quantize(typename V::F v, bool unorm8)
+{
+    if (!unorm8)
+        return v;
+    v = V::min(V::max(v, V::set1(0.0f)), V::set1(1.0f));
+    return V::div(V::floor(V::add(V::mul(v, V::set1(255.0f)), V::set1(0.5f))), V::set1(255.0f));
+}
+
+/**
+ * Blurs pixels [x0, x0 + V::N) of row y. Along the blur axis a pixel sits at
+ * texel coordinate `pos` and a tap at pos + offset * step lands between
+ * texels i0 and i0 + 1 (linear filter, clamp to edge).
+ */
+template<typename V>
+static void blur_pixels(const float* src, float* dst, const float* depth,
+                        int width, int height, int x0, int y, bool vertical, bool unorm8,
+                        const SSSSBlurSIMD::Params & p)
+{
+    typedef typename V::F F;
+    typedef typename V::I I;
+    
+    const int pixel = y * width + x0;
+    const int length = vertical ? height : width;
+    
+    F r, g, b, a;
+    V::load_rgba(src + pixel * 4, r, g, b, a);
+    F depth_raw = V::load(depth + pixel);
+    
+    // scale = distanceToProjectionWindow / depthM with depthM = 1 / depth
+    F scale = V::mul(V::set1(p.distance_to_projection_window), depth_raw);
+    // finalStep in texels along the axis, modulated by the strength (alpha);
+    // the horizontal direction is scaled by height / width (PassConstants::ssss_direction)
+    F step = V::mul(V::mul(scale, a), V::set1(p.sss_width * height / 3.0f));
+    
+    I lane_x = V::addi(V::set1i(x0), V::iota());
+    F pos = vertical ? V::set1((float)y) : V::to_float(lane_x);
+    // texel index = base + i * stride
+    I base = vertical ? lane_x : V::set1i(y * width);
+    const int stride = vertical ? width : 1;
+    
+    F depthM = V::div(V::set1(1.0f), depth_raw);
+    F follow_scale = V::set1(300.0f * p.distance_to_projection_window * p.sss_width);
+    
+    const glm::vec4* kernel = p.kernel;
+    F out_r = V::mul(r, V::set1(kernel[0].x));
+    F out_g = V::mul(g, V::set1(kernel[0].y));
+    F out_b = V::mul(b, V::set1(kernel[0].z));
+    
+    for (int i = 1; i < p.n_samples; i++)
+    {
+        F coord = V::add(pos, V::mul(V::set1(kernel[i].w), step));
+        F fl = V::floor(coord);
+        F t = V::sub(coord, fl);
+        I c0 = V::to_int(fl);
+        I i0 = V::addi(base, V::muli(V::clampi(c0, 0, length - 1), stride));
+        I i1 = V::addi(base, V::muli(V::clampi(V::addi(c0, V::set1i(1)), 0, length - 1), stride));
+        
+        F r0, g0, b0, r1, g1, b1;
+        V::gather_rgb(src, i0, r0, g0, b0);
+        V::gather_rgb(src, i1, r1, g1, b1);
+        F tr = lerp<V>(r0, r1, t);
+        F tg = lerp<V>(g0, g1, t);
+        F tb = lerp<V>(b0, b1, t);
+        
+        if (p.follow_surface)
+        {
+            // If the difference in depth is huge, we lerp color back to colorM
+            F d = lerp<V>(V::gather(depth, i0), V::gather(depth, i1), t);
+            F s = V::mul(follow_scale, V::abs(V::sub(depthM, V::div(V::set1(1.0f), d))));
+            s = V::min(V::max(s, V::set1(0.0f)), V::set1(1.0f));
+            tr = lerp<V>(tr, r, s);
+            tg = lerp<V>(tg, g, s);
+            tb = lerp<V>(tb, b, s);
+        }
+        
+        out_r = V::add(out_r, V::mul(V::set1(kernel[i].x), tr));
+        out_g = V::add(out_g, V::mul(V::set1(kernel[i].y), tg));
+        out_b = V::add(out_b, V::mul(V::set1(kernel[i].z), tb));
+    }
+    
+    V::store_rgba(dst + pixel * 4,
+                  quantize<V>(out_r, unorm8), quantize<V>(out_g, unorm8),
+                  quantize<V>(out_b, unorm8), quantize<V>(a, unorm8));
+}
+
+const char* SSSSBlurSIMD::isa()
+{
+#if SSSS_SIMD_AVX512
+    return "AVX-512";
+#elif SSSS_SIMD_AVX2
+    return "AVX2";
+#elif SSSS_SIMD_SSE
+    return "SSE4.1";
+#elif SSSS_SIMD_NEON
+    return "NEON";
+#else
+    return "scalar";
+#endif
+}
+
+const float SSSSBlurSIMD::MASK_MAX_COVERAGE = 0.75f;
+
+int SSSSBlurSIMD::lanes()
+{
+    return NativeV::N;
+}
+
+void SSSSBlurSIMD::blur(const CPUImage & src, CPUImage & dst, const CPUImage & depth,
+                        bool vertical, const Params & params, int y0, int y1)
+{
+    assert(src.channels() == 4 && dst.channels() == 4 && depth.channels() == 1);
+    assert(src.width() == dst.width() && src.height() == dst.height());
+    assert(src.width() == depth.width() && src.height() == depth.height());
+    
+    const int width = src.width();
+    const int height = src.height();
+    const bool unorm8 = dst.pixel_format() == CPUPixelFormatRGBA8Unorm;
+    const int n = NativeV::N;
+    
+    // mostly marked rows go dense
+    const float* mask = params.stencil;
+    if (mask)
+    {
+        const float* first = mask + (size_t)y0 * width;
+        const float* last = mask + (size_t)y1 * width;
+        size_t marked = std::count_if(first, last, [](float s) { return s != 0.0f; });
+        if (marked > MASK_MAX_COVERAGE * (last - first))
+            mask = nullptr;
+    }
+    
+    // a texel outside the mask keeps its value: src is already quantized like dst when they share a format
+    const bool raw_copy = src.pixel_format() == dst.pixel_format();
+    auto copy = [&](int x, int y, int count) {
+        if (raw_copy)
+            memcpy(dst.data() + ((size_t)y * width + x) * 4, src.data() + ((size_t)y * width + x) * 4, count * 4 * sizeof(float));
+        else
+        {
+            for (int i = 0; i < count; i++)
+                dst.store(x + i, y, src.texel(x + i, y));
+        }
+    };
+    
+    for (int y = y0; y < y1; y++)
+    {
+        const float* stencil = mask ? mask + (size_t)y * width : nullptr;
+        int x = 0;
+        for (; x + n <= width; x += n)
+        {
+            // lanes outside the mask are copied, over the blur if some other lane needs it
+            int marked = n;
+            if (stencil)
+                marked = (int)std::count_if(stencil + x, stencil + x + n, [](float s) { return s != 0.0f; });
+            if (marked == 0)
+            {
+                copy(x, y, n);
+                continue;
+            }
+            blur_pixels<NativeV>(src.data(), dst.data(), depth.data(), width, height, x, y, vertical, unorm8, params);
+            for (int i = 0; i < n && marked < n; i++)
+            {
+                if (stencil[x + i] == 0.0f)
+                    copy(x + i, y, 1);
+            }
+        }
+        for (; x < width; x++)
+        {
+            if (stencil && stencil[x] == 0.0f)
+                copy(x, y, 1);
+            else
+                blur_pixels<ScalarV>(src.data(), dst.data(), depth.data(), width, height, x, y, vertical, unorm8, params);
+        }
+    }
+}
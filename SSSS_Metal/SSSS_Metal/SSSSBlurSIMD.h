@@ -0,0 +1,54 @@
+//
+//  SSSSBlurSIMD.h
+//  SSSS_Metal
+//
+//  Vectorized CPU version of ssss_pass_frag (one blur direction).
+//  Lanes always run along a row, for the vertical pass too, so every
+//  instruction works on 4 (SSE, NEON), 8 (AVX2) or 16 (AVX-512) pixels.
+//  The instruction set is chosen at compile time (-mavx2, -mavx512f, ...).
+//
+
+#ifndef SSSS_Metal_SSSSBlurSIMD_h
+#define SSSS_Metal_SSSSBlurSIMD_h
+
+#include <glm/glm.hpp>
+
+#include "CPUImage.h"
+
+class SSSSBlurSIMD
+{
+public:
+    struct Params
+    {
+        const glm::vec4* kernel;    // SSSKernel::samples()
+        int n_samples;
+        float sss_width;
+        float distance_to_projection_window;
+        bool follow_surface;        // lerp taps back to the center color across depth edges
+        const float* stencil;       // skin mask of dst's size, texels at 0 are copied; nullptr blurs all
+    };
+    
+    // With a stencil, bands of rows marked over this share run the dense loop:
+    // the per-vector mask checks cost more than the few lanes they skip there.
+    static const float MASK_MAX_COVERAGE;
+    
+    // name and width of the instruction set this file was compiled for
+    static const char* isa();
+    static int lanes();
+    
+    /**
+     * Blurs rows [y0, y1) of src into dst along x (vertical == false) or
+     * y (vertical == true). src and dst are RGBA, depth is the linear depth
+     * target, all of the same size. dst is quantized like its format. The
+     * texels outside params.stencil are copied, unless the rows are mostly
+     * marked, then every texel is blurred (a texel without strength blurs
+     * to itself up to the rounding of the kernel weights).
+     */
+    static void blur(const CPUImage & src, CPUImage & dst, const CPUImage & depth,
+                     bool vertical, const Params & params, int y0, int y1);
+    
+private:
+    SSSSBlurSIMD();
+};
+
+#endif
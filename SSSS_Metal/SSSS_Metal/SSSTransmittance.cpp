@@ -0,0 +1,73 @@
+//
+//  SSSTransmittance.cpp
+//  SSSS_Metal
+//
+
+#include "SSSTransmittance.h"
+
+#include <algorithm>
+#include <cmath>
+
+#include "Half.h"
+
+using glm::vec3;
+
+vec3 SSSTransmittance::profile(float d, const vec3 & falloff)
+{
+    vec3 profile;
+    for (int c = 0; c < 3; c++)
+    {
+        float dc = d / falloff[c];
+        float dd = -dc * dc;
+        profile[c] = vec3(0.233f, 0.455f, 0.649f)[c] * expf(dd / 0.0064f) +
+                     vec3(0.1f,   0.336f, 0.344f)[c] * expf(dd / 0.0484f) +
+                     vec3(0.118f, 0.198f, 0.0f)[c]   * expf(dd / 0.187f)  +
+                     vec3(0.113f, 0.007f, 0.007f)[c] * expf(dd / 0.567f)  +
+                     vec3(0.358f, 0.004f, 0.0f)[c]   * expf(dd / 1.99f)   +
+                     vec3(0.078f, 0.0f,   0.0f)[c]   * expf(dd / 7.41f);
+    }
+    return profile;
+}
+
+void SSSTransmittance::bake(int resolution, const vec3 & falloff)
+{
+    // The widest Gaussian (7.41) is below 1/2000 at d = 6
+    float widest = std::max(std::max(falloff.x, falloff.y), falloff.z);
+    _range = 6.0f * std::max(widest, 1.0f);
+    
+    _falloff = falloff;
+    _table.resize(resolution);
+    _texels.resize(resolution * 4);
+    for (int i = 0; i < resolution; i++)
+    {
+        float u = float(i) / float(resolution - 1);
+        vec3 p = profile(_range * u * u, falloff);
+        for (int c = 0; c < 3; c++)
+        {
+            _texels[i * 4 + c] = float_to_half(p[c]);
+            _table[i][c] = half_to_float(_texels[i * 4 + c]);
+        }
+        _texels[i * 4 + 3] = float_to_half(1.0f);
+    }
+}
+
+bool SSSTransmittance::update(const vec3 & falloff, int resolution)
+{
+    if (falloff == _falloff && resolution == this->resolution())
+        return false;
+    bake(resolution, falloff);
+    return true;
+}
+
+vec3 SSSTransmittance::sample(float d) const
+{
+    // u = sqrt(d / range), remapped so u = 0 and u = 1 hit the first and
+    // last texel centers
+    int n = resolution();
+    float u = sqrtf(std::min(std::max(d / _range, 0.0f), 1.0f));
+    float x = u * (n - 1);
+    int i0 = std::min((int)x, n - 1);
+    int i1 = std::min(i0 + 1, n - 1);
+    float t = x - i0;
+    return _table[i0] * (1.0f - t) + _table[i1] * t;
+}
@@ -0,0 +1,64 @@
+//
+//  SSSTransmittance.h
+//  SSSS_Metal
+//
+//  Transmittance profile used by SSSSTransmittance in the main pass,
+//  precomputed into a 1D lookup table. Plain C++, the table is uploaded
+//  as an RGBA16Float texture and sampled the same way by the CPU path.
+//
+
+#ifndef SSSS_Metal_SSSTransmittance_h
+#define SSSS_Metal_SSSTransmittance_h
+
+#include <cstdint>
+#include <vector>
+#include <glm/glm.hpp>
+
+class SSSTransmittance
+{
+public:
+    static const int DEFAULT_RESOLUTION = 128;
+    
+    SSSTransmittance() : _falloff(0.0f), _range(0.0f) {}
+    
+    /**
+     * Bakes the table for the given falloff (a falloff of 1 gives the
+     * analytic profile of the shader). Entry i holds the profile at
+     * thickness range() * (i / (resolution - 1))^2, spending most of the
+     * entries on the narrow Gaussians near zero. The values are rounded to
+     * half precision like the texture stores them.
+     */
+    void bake(int resolution = DEFAULT_RESOLUTION, const glm::vec3 & falloff = glm::vec3(1.0f));
+    
+    /**
+     * Bakes the table again if the falloff (the SSS falloff, so the
+     * transmittance widens and narrows with the blur) or the resolution
+     * changed since the last bake. Returns true if it did, so the caller
+     * knows it has to upload it again.
+     */
+    bool update(const glm::vec3 & falloff, int resolution = DEFAULT_RESOLUTION);
+    
+    /**
+     * Thickness at which the profile has died off, clamp_to_edge keeps
+     * returning the last entry past it.
+     */
+    float range() const { return _range; }
+    int resolution() const { return (int)_table.size(); }
+    
+    // RGBA16Float texels, ready for replaceRegion
+    const std::vector<uint16_t>& texels() const { return _texels; }
+    
+    // Same lookup as the shader: linear filter, clamp to edge.
+    glm::vec3 sample(float d) const;
+    
+    // The sum of six Gaussians the shader used to evaluate per light.
+    static glm::vec3 profile(float d, const glm::vec3 & falloff = glm::vec3(1.0f));
+    
+private:
+    std::vector<glm::vec3> _table;      // half precision values as float
+    std::vector<uint16_t> _texels;
+    glm::vec3 _falloff;
+    float _range;
+};
+
+#endif
@@ -12,55 +12,73 @@
 #import <Metal/Metal.h>
 #include <glm/glm.hpp>
 
+#include "DynamicResolution.h"
+#include "FrameCommandBuffers.h"
+#include "FrameConstants.h"
+#include "FrameGraph.h"
+#include "FrameGraphTargets.h"
 #include "Model.h"
+#include "PassConstants.h"
 #include "RenderTarget.h"
 #include "Utilities.h"
 #include "AAPLSharedTypes.h"
+#include "SSSKernel.h"
+#include "TileCompute.h"
 
 #define SSS_N_SAMPLES 17
 
 class SeparableSSS
 {
 public:
-    SeparableSSS() {};
+    SeparableSSS() : _width(0), _height(0), _tile_compute(nullptr), _frame_constants(nullptr) {};
     
+    // frame_constants: where the passes copy their constants when they are encoded
     void init(
               //int width, int height,
-              id<MTLDevice> device,
-              float fovy, float sssWidth, int nSamples = 17, bool stencilInitialized = true,
+              FrameConstants* frame_constants,
+              float fovy, float sssWidth, int nSamples = 17, bool skinMask = true,
               bool followShape = true, bool separateStrengthSource = false)
     {
         //_width = width;
         //_height = height;
+        assert(nSamples <= SSSS_MAX_N_SAMPLES);
         this->sssWidth = sssWidth;
         this->nSamples = nSamples;
-        this->stencilInitialized = stencilInitialized;
+        this->skinMask = skinMask;
         this->strength = glm::vec3(0.48f, 0.41f, 0.28f);
         this->falloff = glm::vec3(1.0f, 0.37f, 0.3f);
-        
-        _rt_temp.init(device, MTLPixelFormatRGBA8Unorm, RenderContext::window_width, RenderContext::window_height);
-        //calculate_kernel();
+        _frame_constants = frame_constants;
         
         for (int i = 0; i < 2; i++)
         {
-            _constants_buffer[i] = [device newBufferWithLength: sizeof(AAPL::constant_ssss_pass) options:0];
-            _constants_buffer[i].label = [NSString stringWithFormat: @"ssss_pass_constant_buffer%i", i];
-            auto buffer = (AAPL::constant_ssss_pass*)[_constants_buffer[i] contents];
+            auto buffer = &_constants[i];
+            memset(buffer, 0, sizeof(*buffer));
             buffer->sssWidth = this->sssWidth;
             //buffer->dir = {1.0f, 0.0f};
-            buffer->initStencil = false;
+            // the horizontal pass marks the skin in the stencil
+            buffer->initStencil = skinMask && i == 0;
         }
-        auto buffer = (AAPL::constant_ssss_pass*)[_constants_buffer[0] contents];
-        buffer->dir = {1.0f, 0.0f};
-        buffer = (AAPL::constant_ssss_pass*)[_constants_buffer[1] contents];
-        buffer->dir = {0.0f, 1.0f};
+        _width = _height = 0;
+        resize(RenderContext::window_width, RenderContext::window_height);
         
+        calculate_kernel();
     }
     
+    /**
+     * Window size changed: rewrites the blur directions (the horizontal
+     * one follows the aspect ratio), from the next frame encoded. The targets come from the
+     * frame graph at the size it asks for, so nothing is reallocated.
+     */
     void resize(int width, int height)
     {
-        // TODO
-        //_tmpRT.resize(width, height);
+        if (width == _width && height == _height)
+            return;
+        _width = width;
+        _height = height;
+        for (int i = 0; i < 2; i++)
+        {
+            _constants[i].dir = to_simd_type(PassConstants::ssss_direction(width, height, i == 1));
+        }
     }
     
     static void static_init()
@@ -68,43 +86,84 @@ public:
         //shader.init(IOS_PATH("shader", "Quad", "vert"), IOS_PATH("shader", "SSSS", "frag"));
     }
     
-    void render(id <MTLCommandBuffer> commandBuffer, RenderTexture & colorTex, RenderTexture & depthTex, DepthStencil & depthStencilRT) const
+    /**
+     * Declares the horizontal and vertical passes, color and depth (the
+     * main pass' linear depth) in, the blurred color out, scale times the
+     * size of color. When disabled the graph culls both and hands color on.
+     *
+     * With the skin mask, the horizontal pass marks the pixels with SSS
+     * strength in a stencil target, and both passes run the blur only
+     * there; the other pixels are copied (a blur of zero width).
+     *
+     * With a TileCompute, both passes are ssss_tile_kernel instead, which
+     * copies the tiles without SSS strength; no stencil is needed then.
+     *
+     * The passes may be encoded on different threads: each has its own
+     * render pass descriptor.
+     */
+    FrameGraph::Resource add_passes(FrameGraph & graph, const FrameGraphTargets & targets, const FrameCommandBuffers & commandBuffers,
+                                    FrameGraph::Resource color, FrameGraph::Resource depth, bool enabled, float scale = 1.0f)
     {
-        {
-            auto encoder = [commandBuffer renderCommandEncoderWithDescriptor: _render_pass_desc[0]];
-            [encoder pushDebugGroup:@"SSSSPass0"];
-            encoder.label = @"ssss pass0";
-            [encoder setDepthStencilState: _depth_state];
-            [encoder setRenderPipelineState: _pipeline_state];
-            [encoder setCullMode: MTLCullModeNone];
-            
-            [encoder setFragmentBuffer:_constants_buffer[0] offset:0 atIndex:0];
-            [encoder setFragmentTexture: colorTex.texture() atIndex:0];
-            [encoder setFragmentTexture: depthTex.texture() atIndex:1];
-            ModelManager::screen_aligned_quad.render(encoder);
-            
-            [encoder popDebugGroup];
-            [encoder endEncoding];
-        }
-        {
-            auto encoder = [commandBuffer renderCommandEncoderWithDescriptor: _render_pass_desc[1]];
-            [encoder pushDebugGroup:@"SSSSPass1"];
-            encoder.label = @"ssss pass1";
-            [encoder setDepthStencilState: _depth_state];
-            [encoder setRenderPipelineState: _pipeline_state];
-            [encoder setCullMode: MTLCullModeNone];
-            
-            [encoder setFragmentBuffer:_constants_buffer[1] offset:0 atIndex:0];
-            [encoder setFragmentTexture: _rt_temp.texture() atIndex:0];
-            [encoder setFragmentTexture: depthTex.texture() atIndex:1];
-            ModelManager::screen_aligned_quad.render(encoder);
-            
-            [encoder popDebugGroup];
-            [encoder endEncoding];
-        }
+        FrameGraphTextureDesc desc = graph.resource(color).desc;
+        desc.width = DynamicResolution::scaled_size(desc.width, scale);
+        desc.height = DynamicResolution::scaled_size(desc.height, scale);
+        FrameGraph::Resource temp = graph.create("ssss temp", desc);
+        FrameGraph::Resource output = graph.create("ssss", desc);
+        const bool tiles = _tile_compute != nullptr;
+        FrameGraph::Resource stencil = -1;
+        if (skinMask && !tiles)
+            stencil = graph.create("ssss stencil", { desc.width, desc.height, FrameGraphFormatStencil8 });
+        const FrameGraphTargets* t = &targets;
+        const FrameCommandBuffers* c = &commandBuffers;
         
+        FrameGraph::Pass pass = graph.add_pass("ssss horizontal", [=](const FrameGraph::PassInfo & info) {
+            id <MTLCommandBuffer> commandBuffer = c->get(info);
+            if (tiles)
+            {
+                encode_tiles(commandBuffer, 0, t->texture(color), t->texture(depth), t->texture(temp));
+                return;
+            }
+            t->bind(_render_pass_desc[0].colorAttachments[0], info, temp);
+            if (stencil >= 0)
+                t->bind(_render_pass_desc[0].stencilAttachment, info, stencil);
+            encode(commandBuffer, 0, t->texture(color), t->texture(depth));
+        }, enabled);
+        graph.read(pass, color);
+        graph.read(pass, depth);
+        if (tiles)
+            graph.write_storage(pass, temp);
+        else
+            graph.write(pass, temp);
+        if (stencil >= 0)
+            graph.write(pass, stencil, FrameGraphLoadClear);
+        
+        pass = graph.add_pass("ssss vertical", [=](const FrameGraph::PassInfo & info) {
+            id <MTLCommandBuffer> commandBuffer = c->get(info);
+            if (tiles)
+            {
+                encode_tiles(commandBuffer, 1, t->texture(temp), t->texture(depth), t->texture(output));
+                return;
+            }
+            t->bind(_render_pass_desc[1].colorAttachments[0], info, output);
+            if (stencil >= 0)
+                t->bind(_render_pass_desc[1].stencilAttachment, info, stencil);
+            encode(commandBuffer, 1, t->texture(temp), t->texture(depth));
+        }, enabled);
+        graph.read(pass, temp);
+        graph.read(pass, depth);
+        if (tiles)
+            graph.write_storage(pass, output);
+        else
+            graph.write(pass, output);
+        if (stencil >= 0)
+            graph.write(pass, stencil, FrameGraphLoadLoad);
+        graph.bypass(pass, color, output);
+        return output;
     }
     
+    // Runs the passes as tile compute kernels from now on, the fragment passes again when nullptr.
+    void setTileCompute(TileCompute* tiles) { _tile_compute = tiles; }
+    
     /**
      * This parameter specifies the global level of subsurface scattering,
      * or in other words, the width of the filter.
@@ -112,11 +171,8 @@ public:
     void setWidth(float width)
     {
         this->sssWidth = width;
-        auto buffer = (AAPL::constant_ssss_pass*)[_constants_buffer[0] contents];
-        buffer->sssWidth = this->sssWidth;
-        buffer = (AAPL::constant_ssss_pass*)[_constants_buffer[1] contents];
-        buffer->sssWidth = this->sssWidth;
-
+        _constants[0].sssWidth = this->sssWidth;
+        _constants[1].sssWidth = this->sssWidth;
     }
     float getWidth() const { return sssWidth; }
     
@@ -131,12 +187,8 @@ public:
      */
     void setStrength(vec3 strength)
     {
-        if (glm::distance(strength, this->strength) > 0.1f)
-        {
-            this->strength = strength;
-            //calculate_kernel();
-        }
-        
+        this->strength = strength;
+        calculate_kernel();
     }
     vec3 getStrength() const { return strength; }
     
@@ -148,53 +200,73 @@ public:
      */
     void setFalloff(vec3 falloff)
     {
-        if (glm::distance(falloff, this->falloff) > 0.1f)
-        {
-            this->falloff = falloff;
-            //calculate_kernel();
-        }
-        
+        this->falloff = falloff;
+        calculate_kernel();
     }
     vec3 getFalloff() const { return falloff; }
     
-    bool prepare_pipeline_state(id <MTLDevice> _device, id <MTLLibrary> _defaultLibrary, RenderTexture& _rt_main)
+    bool prepare_pipeline_state(id <MTLDevice> _device, id <MTLLibrary> _defaultLibrary, FrameGraphFormat color_format)
     {
+        // without alpha in the color target the main pass leaves the strength in the linear depth's green
+        for (int i = 0; i < 2; i++)
+            _constants[i].strengthInDepth = !FrameGraphTextureDesc::has_alpha(color_format);
+        
         {
             MTLDepthStencilDescriptor *desc = [[MTLDepthStencilDescriptor alloc] init];
             desc.depthWriteEnabled = NO;
             desc.depthCompareFunction = MTLCompareFunctionAlways;
             _depth_state = [_device newDepthStencilStateWithDescriptor: desc];
+            
+            // mark: every fragment the horizontal pass doesn't discard
+            MTLStencilDescriptor *stencil_desc = [[MTLStencilDescriptor alloc] init];
+            stencil_desc.stencilCompareFunction = MTLCompareFunctionAlways;
+            stencil_desc.depthStencilPassOperation = MTLStencilOperationReplace;
+            desc.frontFaceStencil = stencil_desc;
+            desc.backFaceStencil = stencil_desc;
+            _stencil_state[StencilMark] = [_device newDepthStencilStateWithDescriptor: desc];
+            
+            stencil_desc.depthStencilPassOperation = MTLStencilOperationKeep;
+            stencil_desc.stencilCompareFunction = MTLCompareFunctionEqual;
+            _stencil_state[StencilSkin] = [_device newDepthStencilStateWithDescriptor: desc];
+            
+            stencil_desc.stencilCompareFunction = MTLCompareFunctionNotEqual;
+            _stencil_state[StencilOther] = [_device newDepthStencilStateWithDescriptor: desc];
         }
         
         auto vert      = _newFunctionFromLibrary(_defaultLibrary, @"quad_vert");
         auto frag      = _newFunctionFromLibrary(_defaultLibrary, @"ssss_pass_frag");
+        auto copy_frag = _newFunctionFromLibrary(_defaultLibrary, @"ssss_copy_frag");
         
         MTLRenderPipelineDescriptor *desc = [MTLRenderPipelineDescriptor new];
         NSError *err = nil;
         desc.label = @"SSSS Pass";
         desc.vertexFunction = vert;
         desc.fragmentFunction = frag;
-        desc.colorAttachments[0].pixelFormat = _rt_main.pixel_format();
+        desc.colorAttachments[0].pixelFormat = FrameGraphTargets::pixel_format(color_format);
         //desc.depthAttachmentPixelFormat = MTLPixelFormatDepth32Float;
+        if (skinMask)
+            desc.stencilAttachmentPixelFormat = MTLPixelFormatStencil8;
         _pipeline_state = [_device newRenderPipelineStateWithDescriptor: desc error: &err];
         CheckPipelineError(_pipeline_state, err);
         
-        //Render Pass Desc
-        //*********************************************************************
+        if (skinMask)
         {
-            _render_pass_desc[0] = [MTLRenderPassDescriptor renderPassDescriptor];
-            auto color_attachment = _render_pass_desc[0].colorAttachments[0];
-            color_attachment.texture = _rt_temp.texture();
-            color_attachment.loadAction = MTLLoadActionClear;
-            color_attachment.storeAction = MTLStoreActionStore;
-            color_attachment.clearColor = MTLClearColorMake(1, 0, 0, 1);
+            err = nil;
+            desc.label = @"SSSS Copy";
+            desc.fragmentFunction = copy_frag;
+            _pipeline_copy = [_device newRenderPipelineStateWithDescriptor: desc error: &err];
+            CheckPipelineError(_pipeline_copy, err);
         }
+        
+        _pipeline_tiles = TileCompute::new_pipeline(_device, _defaultLibrary, @"ssss_tile_kernel");
+        
+        //Render Pass Desc
+        //*********************************************************************
+        // targets and actions are bound by the frame graph
+        for (int i = 0; i < 2; i++)
         {
-            _render_pass_desc[1] = [MTLRenderPassDescriptor renderPassDescriptor];
-            auto color_attachment = _render_pass_desc[1].colorAttachments[0];
-            color_attachment.texture = _rt_main.texture();
-            color_attachment.loadAction = MTLLoadActionClear;
-            color_attachment.storeAction = MTLStoreActionStore;
+            _render_pass_desc[i] = [MTLRenderPassDescriptor renderPassDescriptor];
+            auto color_attachment = _render_pass_desc[i].colorAttachments[0];
             color_attachment.clearColor = MTLClearColorMake(1, 0, 0, 1);
         }
         
@@ -205,20 +277,94 @@ public:
     
 private:
     
+    void encode(id <MTLCommandBuffer> commandBuffer, int i, id <MTLTexture> src, id <MTLTexture> depth) const
+    {
+        auto encoder = [commandBuffer renderCommandEncoderWithDescriptor: _render_pass_desc[i]];
+        [encoder pushDebugGroup: i == 0 ? @"SSSSPass0" : @"SSSSPass1"];
+        encoder.label = i == 0 ? @"ssss pass0" : @"ssss pass1";
+        [encoder setRenderPipelineState: _pipeline_state];
+        [encoder setCullMode: MTLCullModeNone];
+        
+        _frame_constants->set_fragment(encoder, _constants[i], 0);
+        [encoder setFragmentTexture: src atIndex:0];
+        [encoder setFragmentTexture: depth atIndex:1];
+        if (skinMask)
+        {
+            // the horizontal pass blurs (and marks) the pixels with SSS
+            // strength, the vertical one only the marked pixels; both copy
+            // the rest
+            [encoder setStencilReferenceValue: 1];
+            [encoder setDepthStencilState: _stencil_state[i == 0 ? StencilMark : StencilSkin]];
+            ModelManager::screen_aligned_quad.render(encoder);
+            
+            [encoder setDepthStencilState: _stencil_state[StencilOther]];
+            [encoder setRenderPipelineState: _pipeline_copy];
+            ModelManager::screen_aligned_quad.render(encoder);
+        }
+        else
+        {
+            [encoder setDepthStencilState: _depth_state];
+            ModelManager::screen_aligned_quad.render(encoder);
+        }
+        
+        [encoder popDebugGroup];
+        [encoder endEncoding];
+    }
+    
+    void encode_tiles(id <MTLCommandBuffer> commandBuffer, int i, id <MTLTexture> src, id <MTLTexture> depth,
+                      id <MTLTexture> dst) const
+    {
+        auto encoder = [commandBuffer computeCommandEncoder];
+        [encoder pushDebugGroup: i == 0 ? @"SSSSTiles0" : @"SSSSTiles1"];
+        encoder.label = i == 0 ? @"ssss tiles0" : @"ssss tiles1";
+        [encoder setComputePipelineState: _pipeline_tiles];
+        _frame_constants->set_compute(encoder, _constants[i], 0);
+        [encoder setTexture: src atIndex:0];
+        [encoder setTexture: depth atIndex:1];
+        _tile_compute->dispatch(encoder, i == 0 ? AAPL::TileKernelSSSSHorizontal : AAPL::TileKernelSSSSVertical, dst);
+        [encoder popDebugGroup];
+        [encoder endEncoding];
+    }
+    
+    /**
+     * Regenerates the kernel and copies it to both pass constants. This is
+     * a no-op unless nSamples, strength or falloff actually changed.
+     */
+    void calculate_kernel()
+    {
+        if (!_kernel.update(nSamples, strength, falloff))
+            return;
+        
+        auto& samples = _kernel.samples();
+        for (int i = 0; i < 2; i++)
+        {
+            _constants[i].nSamples = _kernel.size();
+            for (int j = 0; j < _kernel.size(); j++)
+                _constants[i].ssss_kernel[j] = to_simd_type(samples[j]);
+        }
+    }
+    
     float sssWidth;
     int nSamples;
-    bool stencilInitialized;
+    int _width, _height;
+    bool skinMask;
     glm::vec3 strength;
     glm::vec3 falloff;
+    SSSKernel _kernel;
     
-    RenderTexture _rt_temp;
+    enum StencilState { StencilMark, StencilSkin, StencilOther, STENCIL_STATE_COUNT };
     
     id <MTLRenderPipelineState> _pipeline_state;
+    id <MTLRenderPipelineState> _pipeline_copy;
+    id <MTLComputePipelineState> _pipeline_tiles;
+    TileCompute*                _tile_compute;
+    id <MTLDepthStencilState>   _stencil_state[STENCIL_STATE_COUNT];
     MTLRenderPassDescriptor*    _render_pass_desc[2];
     
     id <MTLDepthStencilState>   _depth_state;
     
-    id <MTLBuffer>              _constants_buffer[2];
+    FrameConstants*             _frame_constants;
+    AAPL::constant_ssss_pass    _constants[2];     // horizontal, vertical
     
 };
 
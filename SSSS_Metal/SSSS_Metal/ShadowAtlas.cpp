@@ -0,0 +1,237 @@
+//
+//  ShadowAtlas.cpp
+//  SSSS_Metal
+//
+
+#include "ShadowAtlas.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+
+static int power_of_two_at_least(float x)
+{
+    int p = 1;
+    while (p < x && p < (1 << 30))
+        p *= 2;
+    return p;
+}
+
+// halving (or dropping) the map of light from size frees freed texels, at ratio importance / size
+struct Step
+{
+    float ratio;
+    int light;
+    int size;
+    double freed;
+    
+    // by ratio, the steps of a light largest first
+    bool operator<(const Step & o) const
+    {
+        return ratio != o.ratio ? ratio < o.ratio : light != o.light ? light < o.light : size > o.size;
+    }
+};
+
+// Moves the shortest prefix of steps in sorted order that frees at least
+// texels to the front, in no particular order, and returns its length (all
+// of them when that's not enough). A weighted quickselect, linear on average.
+static size_t first_steps_freeing(std::vector<Step> & steps, double texels)
+{
+    double total = 0.0;
+    for (const Step & s : steps)
+        total += s.freed;
+    if (total < texels)
+        return steps.size();
+    
+    size_t lo = 0, hi = steps.size();
+    while (hi - lo > 1)
+    {
+        size_t mid = lo + (hi - lo) / 2;
+        std::nth_element(steps.begin() + lo, steps.begin() + mid, steps.begin() + hi);
+        double freed = 0.0;
+        for (size_t k = lo; k < mid; k++)
+            freed += steps[k].freed;
+        if (freed >= texels)
+            hi = mid;
+        else
+        {
+            texels -= freed;
+            lo = mid;
+        }
+    }
+    return lo + 1;
+}
+
+float ShadowAtlas::importance(const Light & light, const glm::vec3 & center, float radius, const glm::vec3 & camera_position,
+                              float camera_fov, int viewport_height)
+{
+    glm::vec3 to_center = center - light.position;
+    float d = glm::length(to_center);
+    if (d - radius > light.far_plane)
+        return 0.0f;
+    // the light is inside the receiver: it covers the whole map
+    if (d <= radius)
+        return (float)MAX_SIZE;
+    float cos_angle = glm::dot(to_center / d, light.direction);
+    float angle = acosf(std::max(-1.0f, std::min(1.0f, cos_angle)));
+    if (angle - asinf(radius / d) > 0.5f * light.fov)
+        return 0.0f;
+    
+    // pixels across the receiver's radius on screen, all of them when the camera is inside it
+    float camera_d = glm::length(center - camera_position);
+    float screen_radius = camera_d > radius ? radius / (camera_d * tanf(0.5f * camera_fov)) * 0.5f * viewport_height :
+                                              0.5f * viewport_height;
+    
+    // the receiver's share of the map's side at its distance, wanted at screen_radius texels
+    float map_radius = d * tanf(0.5f * light.fov);
+    float texels = screen_radius * map_radius / radius;
+    
+    float received = light.intensity / (1.0f + light.attenuation * d * d);
+    return texels * std::min(received, 1.0f);
+}
+
+bool ShadowAtlas::pack(const std::vector<int> & sizes, int size, std::vector<Rect> & rects)
+{
+    rects.assign(sizes.size(), Rect{ 0, 0, 0 });
+    double area = 0.0;
+    for (int s : sizes)
+        area += (double)s * s;
+    if (area > (double)size * size)
+        return false;
+    
+    // largest first, in the order of sizes among equals: a pass per power of two
+    int largest = 0, smallest = 0;
+    for (int s : sizes)
+    {
+        largest = std::max(largest, s);
+        if (s > 0)
+            smallest = smallest > 0 ? std::min(smallest, s) : s;
+    }
+    std::vector<int> order;
+    order.reserve(sizes.size());
+    for (int s = largest; s >= smallest && s > 0; s /= 2)
+    {
+        for (int i = 0; i < (int)sizes.size(); i++)
+        {
+            if (sizes[i] == s)
+                order.push_back(i);
+        }
+    }
+    
+    // Largest first, every offset along the curve is a multiple of the
+    // area of the square that goes there, so the square is a cell of the
+    // Z-order grid at its size: cells of one size tile those of the next.
+    long long offset = 0;
+    for (int i : order)
+    {
+        long long s = sizes[i];
+        long long cell = offset / (s * s);
+        int cx = 0, cy = 0;
+        for (int bit = 0; cell >> (2 * bit); bit++)
+        {
+            cx |= (int)((cell >> (2 * bit)) & 1) << bit;
+            cy |= (int)((cell >> (2 * bit + 1)) & 1) << bit;
+        }
+        rects[i] = Rect{ cx * (int)s, cy * (int)s, (int)s };
+        offset += s * s;
+    }
+    return true;
+}
+
+ShadowAtlas::ShadowAtlas(int size, int min_size, int max_size)
+    : _size(size), _min_size(min_size), _max_size(std::min(max_size, size)), _changes(0)
+{
+}
+
+bool ShadowAtlas::update(const std::vector<float> & importance)
+{
+    const int n = (int)importance.size();
+    bool resized = n != (int)_rects.size();
+    if (resized)
+        _wanted.assign(n, 0);
+    
+    for (int i = 0; i < n; i++)
+    {
+        int want = std::max(_min_size, std::min(_max_size, power_of_two_at_least(importance[i])));
+        if (want > _wanted[i] || importance[i] < _wanted[i] / 3.0f)
+            _wanted[i] = want;
+    }
+    
+    // halve the map with the fewest wanted texels per texel it has until they fit,
+    // maps at the min size go only once none is larger. A map's ratio doubles with
+    // every halving, so the halvings come in the order of the ratio of each step,
+    // and the ones taken are the shortest prefix of that order that frees enough.
+    std::vector<int> sizes = _wanted;
+    double area = 0.0;
+    for (int s : sizes)
+        area += (double)s * s;
+    const double capacity = (double)_size * _size;
+    if (area > capacity)
+    {
+        std::vector<Step> steps;
+        steps.reserve(4 * n);
+        for (int i = 0; i < n; i++)
+        {
+            for (int s = sizes[i]; s > _min_size; s /= 2)
+                steps.push_back(Step{ importance[i] / s, i, s, 0.75 * s * s });
+        }
+        size_t taken = first_steps_freeing(steps, area - capacity);
+        for (size_t k = 0; k < taken; k++)
+        {
+            sizes[steps[k].light] /= 2;
+            area -= steps[k].freed;
+        }
+        if (area > capacity)
+        {
+            steps.clear();
+            for (int i = 0; i < n; i++)
+                steps.push_back(Step{ importance[i] / sizes[i], i, sizes[i], (double)sizes[i] * sizes[i] });
+            taken = first_steps_freeing(steps, area - capacity);
+            for (size_t k = 0; k < taken; k++)
+                sizes[steps[k].light] = 0;
+        }
+    }
+    
+    std::vector<Rect> rects;
+    pack(sizes, _size, rects);
+    _moved.assign(n, 0);
+    bool changed = false;
+    for (int i = 0; i < n; i++)
+    {
+        const Rect & a = rects[i];
+        _moved[i] = resized || a.x != _rects[i].x || a.y != _rects[i].y || a.size != _rects[i].size;
+        changed = changed || _moved[i];
+    }
+    _rects = rects;
+    _changes += changed;
+    return changed;
+}
+
+glm::vec4 ShadowAtlas::scale_offset(int light) const
+{
+    const Rect & r = _rects[light];
+    float inv = 1.0f / _size;
+    return glm::vec4(r.size * inv, r.size * inv, r.x * inv, r.y * inv);
+}
+
+float ShadowAtlas::used() const
+{
+    double area = 0.0;
+    for (const Rect & r : _rects)
+        area += (double)r.size * r.size;
+    return (float)(area / ((double)_size * _size));
+}
+
+std::string ShadowAtlas::report() const
+{
+    char text[128];
+    snprintf(text, sizeof(text), "%d x %d, %d lights, %.0f%% used, %d layout changes:", _size, _size, light_count(),
+             100.0 * used(), _changes);
+    std::string report = text;
+    for (int i = 0; i < light_count(); i++)
+    {
+        snprintf(text, sizeof(text), " %d at (%d, %d)", _rects[i].size, _rects[i].x, _rects[i].y);
+        report += text;
+    }
+    return report;
+}
@@ -0,0 +1,112 @@
+//
+//  ShadowAtlas.h
+//  SSSS_Metal
+//
+//  Lays out the shadow maps of every light in one depth texture. Each light
+//  gets a square of a power of two size from its importance: how many
+//  texels its map needs across the receiver (the head) to match the pixels
+//  the receiver covers on screen, scaled down for lights that barely reach
+//  it. The squares are packed largest first along a Z-order curve, which
+//  leaves no holes, so they fit whenever their area does; when it doesn't,
+//  the least important maps are halved. All maps render in one pass, a
+//  viewport each, and the main pass samples them through a scale and
+//  offset per light.
+//
+//  Plain C++: ssss_tool shadow-atlas-report checks the packing and times
+//  the sizing.
+//
+
+#ifndef SSSS_Metal_ShadowAtlas_h
+#define SSSS_Metal_ShadowAtlas_h
+
+#include <string>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+class ShadowAtlas
+{
+public:
+    static const int DEFAULT_SIZE = 2048;       // room for four maps of the former fixed size
+    static const int MIN_SIZE = 128;            // (DEFAULT_SIZE / MIN_SIZE)^2 = 256 lights at most
+    static const int MAX_SIZE = 1024;           // ShadowMap::SHADOW_MAP_SIZE, what every light used to get
+    
+    struct Rect
+    {
+        int x, y;       // top left, in texels
+        int size;       // 0 if the light didn't fit
+    };
+    
+    // what the importance heuristic needs to know of a spot light
+    struct Light
+    {
+        glm::vec3 position;
+        glm::vec3 direction;    // normalized
+        float fov;              // full cone angle, radians
+        float far_plane;
+        float attenuation;      // the light falls off as 1 / (1 + attenuation * d^2)
+        float intensity;        // brightest channel of its color
+    };
+    
+    /**
+     * Texels the light's map wants along a side: as many across the
+     * receiver (a bounding sphere) as it covers pixels on screen, seen by a
+     * camera at camera_position with a vertical fov of camera_fov, scaled by
+     * how much of the light reaches it (up to 1). 0 when the receiver is
+     * out of the cone or past the far plane.
+     */
+    static float importance(const Light & light, const glm::vec3 & center, float radius, const glm::vec3 & camera_position,
+                            float camera_fov, int viewport_height);
+    
+    /**
+     * Packs squares of power of two sizes into an atlas of size texels,
+     * largest first, each at the next free place of a Z-order curve. rects
+     * is in the order of sizes. Returns false, placing nothing, if the
+     * total area is larger than the atlas.
+     */
+    static bool pack(const std::vector<int> & sizes, int size, std::vector<Rect> & rects);
+    
+    explicit ShadowAtlas(int size = DEFAULT_SIZE, int min_size = MIN_SIZE, int max_size = MAX_SIZE);
+    
+    /**
+     * Sizes the maps from the importance of each light and packs them. A map
+     * takes the power of two at or above its importance, between the min
+     * and max size, and shrinks only once the importance drops below a third
+     * of its size, so a camera moving around doesn't resize the maps every
+     * frame. While they don't fit the least important map is halved (down
+     * to the min size, past that the least important lights get none).
+     * Returns true when a rect changed, moved() tells which.
+     */
+    bool update(const std::vector<float> & importance);
+    
+    int size() const { return _size; }
+    int light_count() const { return (int)_rects.size(); }
+    const Rect & rect(int light) const { return _rects[light]; }
+    bool moved(int light) const { return _moved[light] != 0; }
+    
+    // uv in the light's own map to uv in the atlas, as uv * xy + zw
+    glm::vec4 scale_offset(int light) const;
+    
+    // update()s that changed a rect
+    int changes() const { return _changes; }
+    
+    // share of the atlas the maps take
+    float used() const;
+    
+    // the rects of the last update(), and changes so far
+    std::string report() const;
+
+private:
+    ShadowAtlas(const ShadowAtlas&);
+    ShadowAtlas& operator=(const ShadowAtlas&);
+    
+    int _size;
+    int _min_size;
+    int _max_size;
+    std::vector<int> _wanted;       // per light, before fitting: what the hysteresis works on
+    std::vector<Rect> _rects;
+    std::vector<char> _moved;
+    int _changes;
+};
+
+#endif
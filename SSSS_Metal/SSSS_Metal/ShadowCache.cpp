@@ -0,0 +1,126 @@
+//
+//  ShadowCache.cpp
+//  SSSS_Metal
+//
+
+#include "ShadowCache.h"
+
+#include <algorithm>
+#include <cstdio>
+
+ShadowCache::ShadowCache(int lights, int max_updates)
+{
+    init(lights, max_updates);
+}
+
+void ShadowCache::init(int lights, int max_updates)
+{
+    LightState state;
+    state.view_projection = state.model = glm::mat4(1.0f);
+    state.frame_view_projection = state.frame_model = glm::mat4(1.0f);
+    state.has_contents = false;
+    state.invalidated = false;
+    state.dirty = true;
+    state.update = false;
+    state.stale_frames = 0;
+    _lights.assign(lights, state);
+    _max_updates = max_updates;
+    _next = 0;
+    _frames = _rendered = _skipped = _deferred = 0;
+    _max_stale_frames = 0;
+}
+
+void ShadowCache::invalidate(int light)
+{
+    _lights[light].invalidated = true;
+}
+
+void ShadowCache::invalidate_all()
+{
+    for (LightState & light : _lights)
+        light.invalidated = true;
+}
+
+void ShadowCache::begin_frame(const glm::mat4* view_projection, const glm::mat4 & model)
+{
+    const int n = (int)_lights.size();
+    int budget = _max_updates > 0 ? _max_updates : n;
+    for (int i = 0; i < n; i++)
+    {
+        LightState & light = _lights[i];
+        light.frame_view_projection = view_projection[i];
+        light.frame_model = model;
+        light.dirty = !light.has_contents || light.invalidated || light.view_projection != view_projection[i] ||
+                      light.model != model;
+        light.update = false;
+        // garbage would show, the budget can't hold these back
+        if (!light.has_contents)
+        {
+            light.update = true;
+            budget--;
+        }
+    }
+    // in turn from where the last frame stopped, so no light waits forever
+    int last = -1;
+    for (int k = 0; k < n && budget > 0; k++)
+    {
+        int i = (_next + k) % n;
+        LightState & light = _lights[i];
+        if (light.dirty && !light.update)
+        {
+            light.update = true;
+            budget--;
+            last = i;
+        }
+    }
+    if (last >= 0)
+        _next = (last + 1) % n;
+    
+    _frames++;
+    for (LightState & light : _lights)
+    {
+        if (light.update)
+            _rendered++;
+        else if (light.dirty)
+            _deferred++;
+        else
+            _skipped++;
+    }
+}
+
+void ShadowCache::end_frame()
+{
+    for (LightState & light : _lights)
+    {
+        if (light.update)
+        {
+            light.view_projection = light.frame_view_projection;
+            light.model = light.frame_model;
+            light.has_contents = true;
+            light.invalidated = false;
+            light.stale_frames = 0;
+        }
+        else if (light.dirty)
+        {
+            light.stale_frames++;
+            _max_stale_frames = std::max(_max_stale_frames, light.stale_frames);
+        }
+        light.update = false;
+    }
+}
+
+std::string ShadowCache::report() const
+{
+    int passes = _rendered + _skipped + _deferred;
+    char text[256];
+    snprintf(text, sizeof(text), "%d frames, %d shadow maps rendered, %d skipped (%.1f%%)", _frames, _rendered,
+             _skipped + _deferred, passes > 0 ? 100.0 * (_skipped + _deferred) / passes : 0.0);
+    std::string report = text;
+    if (_max_updates > 0)
+    {
+        snprintf(text, sizeof(text), ", %d of them dirty but over the budget of %d per frame (at most %d frames stale)",
+                 _deferred, _max_updates, _max_stale_frames);
+        report += text;
+    }
+    return report;
+}
@@ -0,0 +1,102 @@
+//
+//  ShadowCache.h
+//  SSSS_Metal
+//
+//  Decides which shadow maps are rendered in a frame. A map keeps the
+//  light's view projection and the model transform it was last rendered
+//  with, and is rendered again only when one of them changed or it was
+//  invalidated: the lights of a preset and the head stay put while the main
+//  camera orbits, so the maps usually carry over from frame to frame.
+//  Optionally at most max_updates maps are refreshed per frame, the dirty
+//  ones in turn; the others keep their old contents a little longer.
+//
+//  Plain C++: ssss_tool shadow-cache-report replays scripted frames of the
+//  renderer's lights through it.
+//
+
+#ifndef SSSS_Metal_ShadowCache_h
+#define SSSS_Metal_ShadowCache_h
+
+#include <string>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+class ShadowCache
+{
+public:
+    // max_updates: maps rendered per frame at most, 0 for every dirty one
+    explicit ShadowCache(int lights = 0, int max_updates = 0);
+    
+    void init(int lights, int max_updates = 0);
+    
+    void set_max_updates(int max_updates) { _max_updates = max_updates; }
+    int max_updates() const { return _max_updates; }
+    
+    // Renders the map again next frame whatever its transforms (lost contents, bias or mesh changed).
+    void invalidate(int light);
+    void invalidate_all();
+    
+    /**
+     * Compares view_projection[i] of every light and model with what its map
+     * holds and picks the maps to render this frame: the dirty ones, up to
+     * max_updates of them starting after the last one refreshed. A map that
+     * was never rendered is picked regardless of the budget.
+     */
+    void begin_frame(const glm::mat4* view_projection, const glm::mat4 & model);
+    
+    // after begin_frame(): the light's shadow pass runs this frame
+    bool needs_update(int light) const { return _lights[light].update; }
+    
+    // dirty after begin_frame(), whether picked or not
+    bool dirty(int light) const { return _lights[light].dirty; }
+    
+    /**
+     * The maps picked by begin_frame() were encoded and now hold the new
+     * transforms. A frame that never gets here (the graph didn't compile)
+     * leaves them dirty for the next one.
+     */
+    void end_frame();
+    
+    int light_count() const { return (int)_lights.size(); }
+    
+    // over all frames: maps rendered, carried over clean, and left dirty by the budget
+    int frames() const { return _frames; }
+    int rendered() const { return _rendered; }
+    int skipped() const { return _skipped; }
+    int deferred() const { return _deferred; }
+    
+    // the most frames in a row a dirty map waited for the budget
+    int max_stale_frames() const { return _max_stale_frames; }
+    
+    // counters, and the share of shadow passes skipped
+    std::string report() const;
+
+private:
+    ShadowCache(const ShadowCache&);
+    ShadowCache& operator=(const ShadowCache&);
+    
+    struct LightState
+    {
+        glm::mat4 view_projection;      // of the map's contents
+        glm::mat4 model;
+        glm::mat4 frame_view_projection;    // of the frame in begin_frame(), stored by end_frame()
+        glm::mat4 frame_model;
+        bool has_contents;              // rendered once since init()
+        bool invalidated;
+        bool dirty;
+        bool update;
+        int stale_frames;               // dirty and not picked, in a row
+    };
+    
+    std::vector<LightState> _lights;
+    int _max_updates;
+    int _next;                          // where the round robin starts
+    int _frames;
+    int _rendered;
+    int _skipped;
+    int _deferred;
+    int _max_stale_frames;
+};
+
+#endif
@@ -0,0 +1,210 @@
+//
+//  TaskGraph.cpp
+//  SSSS_Metal
+//
+
+#include "TaskGraph.h"
+
+#include <algorithm>
+#include <cassert>
+#include <chrono>
+#include <cstdio>
+
+#include "ThreadPool.h"
+
+TaskGraph::Task TaskGraph::add(const std::string & name, std::function<void()> fn,
+                               std::initializer_list<Task> deps, TaskQueue queue)
+{
+    Task task = (Task)_tasks.size();
+    Node node;
+    node.name = name;
+    node.fn = fn;
+    node.queue = queue;
+    node.waiting = 0;
+    for (Task dep : deps)
+    {
+        assert(dep >= 0 && dep < task);
+        node.deps.push_back(dep);
+        _tasks[dep].dependents.push_back(task);
+    }
+    _tasks.push_back(node);
+    return task;
+}
+
+double TaskGraph::now_ms() const
+{
+    using namespace std::chrono;
+    return duration<double, std::milli>(steady_clock::now().time_since_epoch()).count();
+}
+
+int TaskGraph::thread_index()
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    std::thread::id id = std::this_thread::get_id();
+    auto it = std::find(_threads.begin(), _threads.end(), id);
+    if (it != _threads.end())
+        return (int)(it - _threads.begin());
+    _threads.push_back(id);
+    return (int)_threads.size() - 1;
+}
+
+void TaskGraph::schedule(Task task)
+{
+    if (_tasks[task].queue == TaskQueueSubmit)
+    {
+        _submit_queue.push_back(task);
+        _cv.notify_all();
+    }
+    else
+    {
+        _pool.enqueue([this, task]() { execute(task); });
+    }
+}
+
+void TaskGraph::execute(Task task)
+{
+    TaskTrace& trace = _trace[task];
+    trace.thread = thread_index();
+    trace.start_ms = now_ms() - _start_ms;
+    _tasks[task].fn();
+    trace.end_ms = now_ms() - _start_ms;
+    
+    std::lock_guard<std::mutex> lock(_mutex);
+    for (Task dependent : _tasks[task].dependents)
+    {
+        if (--_tasks[dependent].waiting == 0)
+            schedule(dependent);
+    }
+    _done++;
+    _cv.notify_all();
+}
+
+void TaskGraph::run()
+{
+    _start_ms = now_ms();
+    _trace.assign(_tasks.size(), TaskTrace());
+    _threads.assign(1, std::this_thread::get_id());
+    _done = 0;
+    
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        for (size_t i = 0; i < _tasks.size(); i++)
+        {
+            _trace[i].name = _tasks[i].name;
+            _trace[i].critical = false;
+            _tasks[i].waiting = (int)_tasks[i].deps.size();
+        }
+        for (Task task = 0; task < (Task)_tasks.size(); task++)
+        {
+            if (_tasks[task].waiting == 0)
+                schedule(task);
+        }
+    }
+    
+    // run the submit tasks here until everything is done
+    for (;;)
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _cv.wait(lock, [this]() { return !_submit_queue.empty() || _done == (int)_tasks.size(); });
+        if (_submit_queue.empty())
+            break;
+        Task task = _submit_queue.front();
+        _submit_queue.pop_front();
+        lock.unlock();
+        execute(task);
+    }
+    _elapsed_ms = now_ms() - _start_ms;
+    
+    for (Task task : critical_path())
+        _trace[task].critical = true;
+}
+
+std::vector<TaskGraph::Task> TaskGraph::critical_path() const
+{
+    std::vector<Task> path;
+    if (_trace.empty())
+        return path;
+    Task task = 0;
+    for (Task t = 1; t < (Task)_trace.size(); t++)
+    {
+        if (_trace[t].end_ms > _trace[task].end_ms)
+            task = t;
+    }
+    for (;;)
+    {
+        path.push_back(task);
+        // what it waited for: a dependency, or the thread it ran on
+        std::vector<Task> waited_for = _tasks[task].deps;
+        Task previous = -1;
+        for (Task t = 0; t < (Task)_trace.size(); t++)
+        {
+            if (_trace[t].thread == _trace[task].thread && _trace[t].end_ms <= _trace[task].start_ms &&
+                t != task && (previous < 0 || _trace[t].end_ms > _trace[previous].end_ms))
+                previous = t;
+        }
+        if (previous >= 0)
+            waited_for.push_back(previous);
+        if (waited_for.empty())
+            break;
+        task = *std::max_element(waited_for.begin(), waited_for.end(),
+            [this](Task a, Task b) { return _trace[a].end_ms < _trace[b].end_ms; });
+    }
+    std::reverse(path.begin(), path.end());
+    return path;
+}
+
+std::string TaskGraph::report() const
+{
+    std::vector<Task> order(_trace.size());
+    for (size_t i = 0; i < order.size(); i++)
+        order[i] = (Task)i;
+    std::stable_sort(order.begin(), order.end(),
+        [this](Task a, Task b) { return _trace[a].start_ms < _trace[b].start_ms; });
+    
+    char line[256];
+    snprintf(line, sizeof(line), "%d tasks, %.1f ms on %d threads (* critical path)\n",
+             task_count(), _elapsed_ms, (int)_threads.size());
+    std::string text = line;
+    snprintf(line, sizeof(line), "  %9s %9s %9s  %-6s  %s\n", "start", "end", "ms", "thread", "task");
+    text += line;
+    double busy = 0.0;
+    for (Task task : order)
+    {
+        const TaskTrace& t = _trace[task];
+        snprintf(line, sizeof(line), "%c %9.1f %9.1f %9.1f  %-6s  %s\n", t.critical ? '*' : ' ',
+                 t.start_ms, t.end_ms, t.end_ms - t.start_ms,
+                 t.thread == 0 ? "submit" : std::to_string(t.thread).c_str(), t.name.c_str());
+        text += line;
+        busy += t.end_ms - t.start_ms;
+    }
+    double critical = 0.0;
+    for (Task task : critical_path())
+        critical += _trace[task].end_ms - _trace[task].start_ms;
+    snprintf(line, sizeof(line), "critical path %.1f ms of work, %.1f ms of work in total\n", critical, busy);
+    text += line;
+    return text;
+}
+
+bool TaskGraph::write_trace(const std::string & path) const
+{
+    FILE* fp = fopen(path.c_str(), "w");
+    if (!fp)
+        return false;
+    fprintf(fp, "{\"traceEvents\":[\n");
+    for (size_t i = 0; i < _trace.size(); i++)
+    {
+        const TaskTrace& t = _trace[i];
+        std::string name;
+        for (char c : t.name)
+        {
+            if (c == '"' || c == '\\')
+                name += '\\';
+            name += c;
+        }
+        fprintf(fp, "{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"pid\":0,\"tid\":%d,\"ts\":%.0f,\"dur\":%.0f}%s\n",
+                name.c_str(), t.critical ? "critical" : "task", t.thread, t.start_ms * 1000.0,
+                (t.end_ms - t.start_ms) * 1000.0, i + 1 < _trace.size() ? "," : "");
+    }
+    fprintf(fp, "]}\n");
+    return fclose(fp) == 0;
+}
@@ -0,0 +1,119 @@
+//
+//  TaskGraph.h
+//  SSSS_Metal
+//
+//  One-shot graph of jobs with dependencies, used to load the renderer's
+//  assets in parallel at startup. Worker tasks run on a ThreadPool, submit
+//  tasks (the ones that talk to the GPU) run one at a time on the thread
+//  that calls run(), so resource creation goes through a single point.
+//  Every task is timed, the trace shows the critical path of the load.
+//
+
+#ifndef SSSS_Metal_TaskGraph_h
+#define SSSS_Metal_TaskGraph_h
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <initializer_list>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+class ThreadPool;
+
+enum TaskQueue
+{
+    TaskQueueWorker,    // any worker of the pool
+    TaskQueueSubmit,    // the thread running run(), one task at a time
+};
+
+class TaskGraph
+{
+public:
+    typedef int Task;
+    
+    struct TaskTrace
+    {
+        std::string name;
+        double start_ms;        // from the start of run()
+        double end_ms;
+        int thread;             // 0 is the submit thread, workers from 1
+        bool critical;          // on the critical path
+    };
+    
+    explicit TaskGraph(ThreadPool & pool) : _pool(pool), _done(0), _start_ms(0.0), _elapsed_ms(0.0) {}
+    
+    /**
+     * Adds a task that runs once all of deps are done. deps must have
+     * been added before, so the graph can not have cycles.
+     */
+    Task add(const std::string & name, std::function<void()> fn,
+             std::initializer_list<Task> deps = {}, TaskQueue queue = TaskQueueWorker);
+    
+    // Same, on the submit queue.
+    Task add_submit(const std::string & name, std::function<void()> fn, std::initializer_list<Task> deps = {})
+    {
+        return add(name, fn, deps, TaskQueueSubmit);
+    }
+    
+    /**
+     * Runs every task and blocks until the last one is done. The calling
+     * thread runs the submit tasks as they become ready, in that order.
+     * A graph runs once.
+     */
+    void run();
+    
+    int task_count() const { return (int)_tasks.size(); }
+    double elapsed_ms() const { return _elapsed_ms; }
+    
+    // After run(), indexed by Task.
+    const std::vector<TaskTrace>& trace() const { return _trace; }
+    
+    /**
+     * Chain of tasks, first to last, that ends with the last task to
+     * finish and goes back at each step through whatever finished last of
+     * its dependencies and the task before it on the same thread: shortening
+     * anything else does not load faster.
+     */
+    std::vector<Task> critical_path() const;
+    
+    // One line per task in start order, the critical path marked with *.
+    std::string report() const;
+    
+    // Chrome trace event format (chrome://tracing, Perfetto).
+    bool write_trace(const std::string & path) const;
+
+private:
+    TaskGraph(const TaskGraph&);
+    TaskGraph& operator=(const TaskGraph&);
+    
+    struct Node
+    {
+        std::string name;
+        std::function<void()> fn;
+        std::vector<Task> deps;
+        std::vector<Task> dependents;
+        TaskQueue queue;
+        int waiting;            // dependencies not done yet
+    };
+    
+    void schedule(Task task);   // _mutex held
+    void execute(Task task);
+    int thread_index();
+    double now_ms() const;
+    
+    ThreadPool & _pool;
+    std::vector<Node> _tasks;
+    std::vector<TaskTrace> _trace;
+    std::deque<Task> _submit_queue;
+    std::vector<std::thread::id> _threads;
+    std::mutex _mutex;
+    std::condition_variable _cv;
+    int _done;
+    double _start_ms;
+    double _elapsed_ms;
+};
+
+#endif
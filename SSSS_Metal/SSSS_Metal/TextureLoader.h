@@ -1,26 +1,46 @@
 #ifndef TEXTURELOADER_H
 #define TEXTURELOADER_H
 
+#include <memory>
 #include <vector>
 #include <Metal/Metal.h>
 #include "Debug.h"
 
+struct TextureFile;
+
 class TextureLoader
 {
 public:
-    static id <MTLTexture> CreateTextureCubemap(id <MTLDevice> device, const char* path, MTLPixelFormat format);
-    static id <MTLTexture> CreateTexture(       id <MTLDevice> device, const char* path, MTLPixelFormat format, bool srgb);
+    // DDS files. The texels are uploaded from a mapping of the file, in the
+    // background when a group is given: wait on it before using the texture.
+    // On iOS, CreateTexture loads file.ktx (ETC2 / EAC) instead of file.dds
+    // when there is one, the pixel format then comes from the KTX.
+    static id <MTLTexture> CreateTextureCubemap(id <MTLDevice> device, const char* path, MTLPixelFormat format, dispatch_group_t group = nil);
+    static id <MTLTexture> CreateTexture(       id <MTLDevice> device, const char* path, MTLPixelFormat format, bool srgb, dispatch_group_t group = nil);
     static id <MTLTexture> CreateTextureArray(  id <MTLDevice> device, const char* path);
     static id <MTLTexture> CreateTexture3D(     id <MTLDevice> device, const char* path);
     
-    static id <MTLTexture> CreateTextureCubemap(id <MTLDevice> device, const std::string path, MTLPixelFormat format)
+    // CreateTexture / CreateTextureCubemap in two steps for the startup task
+    // graph: Open* maps and checks the file and reads its pages in, on any
+    // thread; UploadTexture creates the texture and copies the texels on the
+    // calling thread. nil / nullptr on errors, which are logged.
+    static std::shared_ptr<TextureFile> OpenTexture(const char* path, MTLPixelFormat format, bool srgb = false);
+    static std::shared_ptr<TextureFile> OpenTextureCubemap(const char* path, MTLPixelFormat format);
+    static id <MTLTexture> UploadTexture(id <MTLDevice> device, std::shared_ptr<TextureFile> file);
+    
+    // 2D texture without mipmaps from data prepared on the CPU (LUTs etc.)
+    static id <MTLTexture> CreateTexture(       id <MTLDevice> device, const void* bytes, uint32_t width, uint32_t height, MTLPixelFormat format, uint32_t bytes_per_row);
+    static id <MTLTexture> CreateTexture3D(     id <MTLDevice> device, const void* bytes, uint32_t width, uint32_t height, uint32_t depth,
+                                                MTLPixelFormat format, uint32_t bytes_per_row);
+    
+    static id <MTLTexture> CreateTextureCubemap(id <MTLDevice> device, const std::string path, MTLPixelFormat format, dispatch_group_t group = nil)
     {
-        return CreateTextureCubemap(device, path.c_str(), format);
+        return CreateTextureCubemap(device, path.c_str(), format, group);
     }
     
-    static id <MTLTexture> CreateTexture(       id <MTLDevice> device, const std::string path, MTLPixelFormat format,  bool srgb = false)
+    static id <MTLTexture> CreateTexture(       id <MTLDevice> device, const std::string path, MTLPixelFormat format,  bool srgb = false, dispatch_group_t group = nil)
     {
-        return CreateTexture(device, path.c_str(), format, srgb);
+        return CreateTexture(device, path.c_str(), format, srgb, group);
     }
     
 private:
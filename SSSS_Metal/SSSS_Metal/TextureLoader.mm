@@ -1,155 +1,255 @@
 #include "TextureLoader.h"
-#include <gli/gli.hpp>
+#include "DDSFile.h"
+#include "KTXFile.h"
 
-//std::vector<GLuint> TextureLoader::_textures;
+#include <memory>
+#include <TargetConditionals.h>
 
-id <MTLTexture> TextureLoader::CreateTextureCubemap(id <MTLDevice> device, const char* path, MTLPixelFormat format)
-{
-    gli::textureCube texture(gli::load_dds(path));
-    assert(!texture.empty());
-    //printf("%d %d\n", texture.levels(), texture.layers());
-    //gli::gl GL;
-    //gli::gl::format const glformat = GL.translate(texture.format());
-    //printf("%s\n\t%X %X %X\n", path, format.Internal, format.External, format.Type);
-    
-    assert(!gli::is_compressed(texture.format()));
-    
-    uint32_t w = (uint32_t)texture[0][0].dimensions().x;
-    uint32_t h = (uint32_t)texture[0][0].dimensions().y;
-    
-    uint32_t bytes_pet_pixel = 4 * 2; // MTLPixelFormatRGBA16Float
-    if (format == MTLPixelFormatRGBA32Float)
-    {
-        bytes_pet_pixel = 4 * 4;
-    }
-    
-    if (format != MTLPixelFormatRGBA32Float && format != MTLPixelFormatRGBA16Float)
-    {
-        Debug::LogError("CreateTextureCubemap format error!");
-        exit(1);
-    }
-    
-    auto desc = [MTLTextureDescriptor textureCubeDescriptorWithPixelFormat: format size: w mipmapped: NO];
-    id<MTLTexture> mtltexture = [device newTextureWithDescriptor: desc];
-    
-    for (int face = 0; face < 6; face++)
-    {
-        auto t = texture[face][0];
-        //unsigned long w = t.dimensions().x;
-        //unsigned long h = t.dimensions().y;
-        [mtltexture replaceRegion: MTLRegionMake2D(0, 0, w, h)
-                      mipmapLevel: 0
-                            slice: face
-                        withBytes: t.data()
-                      bytesPerRow: bytes_pet_pixel * w
-                    bytesPerImage: bytes_pet_pixel * w * h];
-    }
-    return mtltexture;
-}
+// ETC2 / EAC are only sampled by iOS GPUs
+#if TARGET_OS_IPHONE
+#define LOAD_KTX_TEXTURES 1
+#else
+#define LOAD_KTX_TEXTURES 0
+#endif
+
+//std::vector<GLuint> TextureLoader::_textures;
 
-id <MTLTexture> TextureLoader::CreateTexture(id <MTLDevice> device, const char* path, MTLPixelFormat format, bool srgb)
+static uint32_t _bytes_per_pixel(MTLPixelFormat format)
 {
-    //Debug::LogInfo(path);
-    
-    gli::texture2D texture(gli::load_dds(path));
-    assert(!texture.empty());
-    //printf("%d %d\n", Texture.levels(), Texture.layers());
-    //gli::gl GL;
-    //gli::gl::format const format = GL.translate(texture.format());
-    //printf("%s\n\t%X %X %X\n", path, format.Internal, format.External, format.Type);
-    
-    uint32_t w = (uint32_t)texture.dimensions().x;
-    uint32_t h = (uint32_t)texture.dimensions().y;
-    
-    //MTLPixelFormat mtl_format = MTLPixelFormatRGBA8Unorm;
-    
-    // hack
-//    int f = format.Internal;
-//    uint32_t bytes_per_row = 0;
-//    if (srgb && f == gli::gl::INTERNAL_RGBA8_UNORM)
-//    {
-//        //f = 0x8C4F;
-//        //f = gli::gl::INTERNAL_SRGB8_ALPHA8;
-//        mtl_format = MTLPixelFormatRGBA8Unorm_sRGB;
-//        bytes_per_row = 4 * w;
-//    }
-    
-    // for beckman
-//    if (f == gli::gl::INTERNAL_RG8_UNORM)
-//    {
-//        //f = gli::gl::INTERNAL_R8_UNORM;
-//        mtl_format = MTLPixelFormatR8Unorm;
-//        bytes_per_row = w;
-//    }
-    
-    uint32_t bytes_per_pixel = 0;
     switch (format) {
         case MTLPixelFormatRGBA8Unorm:
         case MTLPixelFormatRGBA8Unorm_sRGB:
+        case MTLPixelFormatBGRA8Unorm:
         case MTLPixelFormatRG16Float:
-            bytes_per_pixel = 4;
-            break;
+        case MTLPixelFormatR32Float:
+            return 4;
         case MTLPixelFormatRGBA16Float:
-            bytes_per_pixel = 4 * 2;
-            break;
+        case MTLPixelFormatRG32Float:
+            return 4 * 2;
         case MTLPixelFormatRGBA32Float:
-            bytes_per_pixel = 4 * 4;
-            break;
+            return 4 * 4;
         case MTLPixelFormatRG8Unorm:
-            bytes_per_pixel = 2;
-            break;
+        case MTLPixelFormatR16Float:
+            return 2;
         case MTLPixelFormatR8Unorm:
-            bytes_per_pixel = 1;
-            break;
+            return 1;
         default:
-            break;
+            return 0;
     }
-    //auto bpp = texture.size() / w / h;
-    //assert(bytes_per_row * h == texture.size());
-    MTLTextureDescriptor* desc = [MTLTextureDescriptor texture2DDescriptorWithPixelFormat:format width:w height:h mipmapped: YES];
-    //desc.mipmapLevelCount = texture.levels();
-    id<MTLTexture> mtltexture = [device newTextureWithDescriptor: desc];
-    
-    assert(!gli::is_compressed(texture.format()));
-    
+}
+
+// Maps the file and checks its texels can be copied as they are into a
+// texture of the given format.
+static std::shared_ptr<DDSFile> _openDDS(const char* path, MTLPixelFormat format)
+{
+    std::shared_ptr<DDSFile> dds(new DDSFile);
+    std::string error;
+    if (!dds->open(path, &error)) {
+        Debug::LogError(std::string(path) + ": " + error);
+        return nullptr;
+    }
+    if (dds->is_compressed() || dds->bytes_per_block() != _bytes_per_pixel(format)) {
+        Debug::LogError(std::string(path) + ": " + DDSFile::format_name(dds->format()) + " data does not match the requested pixel format");
+        return nullptr;
+    }
+    return dds;
+}
+
+// The ETC2 / EAC copy of a DDS that ssss_tool texture-compress writes next
+// to it, file.dds -> file.ktx
+static std::string _ktx_path_for(const char* path)
+{
+    std::string ktx = path;
+    size_t dot = ktx.find_last_of('.');
+    return (dot == std::string::npos ? ktx : ktx.substr(0, dot)) + ".ktx";
+}
+
+static MTLPixelFormat _pixel_format(const KTXFile & ktx, bool srgb)
+{
+    switch (ktx.format()) {
+        case KTXFormatEAC_R11:
+            return MTLPixelFormatEAC_R11Unorm;
+        case KTXFormatEAC_RG11:
+            return MTLPixelFormatEAC_RG11Unorm;
+        case KTXFormatETC2_RGB8:
+        case KTXFormatETC2_RGB8_sRGB:
+            return srgb ? MTLPixelFormatETC2_RGB8_sRGB : MTLPixelFormatETC2_RGB8;
+        default:
+            return srgb ? MTLPixelFormatEAC_RGBA8_sRGB : MTLPixelFormatEAC_RGBA8;
+    }
+}
+
+// Copies every surface straight from the mapping into the texture, one job
+// per (face, mip) on a global queue when group is given. The jobs keep the
+// file mapped until the last one is done, and each drops the pages it read
+// so the file does not stay resident next to the texture. Compressed
+// surfaces go the same way, a row being a row of blocks.
+template <typename File>
+static void _upload(id <MTLTexture> texture, std::shared_ptr<File> file, dispatch_group_t group)
+{
+    for (uint32_t face = 0; face < file->face_count(); face++)
+    {
+        for (uint32_t mip = 0; mip < file->mip_count(); mip++)
+        {
+            void (^upload)(void) = ^{
+                typename File::Surface s = file->surface(face, mip);
+                [texture replaceRegion: MTLRegionMake2D(0, 0, s.width, s.height)
+                           mipmapLevel: mip
+                                 slice: face
+                             withBytes: s.data
+                           bytesPerRow: s.row_pitch
+                         bytesPerImage: file->is_cubemap() ? s.size : 0];
+                file->release(s);
+            };
+            if (group)
+                dispatch_group_async(group, dispatch_get_global_queue(QOS_CLASS_USER_INITIATED, 0), upload);
+            else
+                upload();
+        }
+    }
+}
+
+// A DDS, or the KTX standing in for it, mapped and checked
+struct TextureFile
+{
+    std::shared_ptr<DDSFile> dds;
+    std::shared_ptr<KTXFile> ktx;
+    MTLPixelFormat format;
     
-    if (gli::is_compressed(texture.format()))
+    template <typename File>
+    static void prefetch(const File & file)
     {
-//        for (std::size_t level = 0; level < texture.levels(); ++level)
-//        {
-//            glCompressedTexSubImage2D(GL_TEXTURE_2D, static_cast<GLint>(level),
-//                                      0, 0,
-//                                      static_cast<GLsizei>(texture[level].dimensions().x),
-//                                      static_cast<GLsizei>(texture[level].dimensions().y),
-//                                      f,
-//                                      static_cast<GLsizei>(texture[level].size()),
-//                                      texture[level].data());
-//        }
+        for (uint32_t face = 0; face < file.face_count(); face++)
+            for (uint32_t mip = 0; mip < file.mip_count(); mip++)
+                file.prefetch(file.surface(face, mip));
     }
-    else
+};
+
+static std::shared_ptr<TextureFile> _openTexture(const char* path, MTLPixelFormat format, bool srgb, bool cubemap)
+{
+    std::shared_ptr<TextureFile> file(new TextureFile);
+#if LOAD_KTX_TEXTURES
+    std::string ktx_path = _ktx_path_for(path);
+    if (!cubemap && MappedFile::exists(ktx_path))
     {
-        for (std::size_t Level = 0; Level < texture.levels(); ++Level)
+        std::shared_ptr<KTXFile> ktx(new KTXFile);
+        std::string error;
+        if (ktx->open(ktx_path, &error))
         {
-            auto t = texture[Level];
-            w = (uint32_t)t.dimensions().x;
-            h = (uint32_t)t.dimensions().y;
-            [mtltexture replaceRegion: MTLRegionMake2D(0, 0, w, h)
-                          mipmapLevel: Level
-                            withBytes: t.data()
-                          bytesPerRow: bytes_per_pixel * w];
+            file->ktx = ktx;
+            file->format = _pixel_format(*ktx, srgb || ktx->is_srgb() || format == MTLPixelFormatRGBA8Unorm_sRGB);
+            return file;
         }
-//        auto t = texture[0];
-//        //unsigned long w = t.dimensions().x;
-//        //unsigned long h = t.dimensions().y;
-//        [mtltexture replaceRegion: MTLRegionMake2D(0, 0, w, h)
-//                      mipmapLevel: 0
-//                            slice: 0
-//                        withBytes: t.data()
-//                      bytesPerRow: bytes_per_pixel * w
-//                    bytesPerImage: bytes_per_pixel * w * h];
-        
+        Debug::LogWarning((ktx_path + ": " + error + ", loading the DDS").c_str());
+    }
+#endif
+
+    file->dds = _openDDS(path, format);
+    if (!file->dds)
+        return nullptr;
+    if (file->dds->is_cubemap() != cubemap) {
+        Debug::LogError(std::string(path) + (cubemap ? " is not a cubemap" : " is a cubemap"));
+        return nullptr;
+    }
+    file->format = format;
+    return file;
+}
+
+template <typename File>
+static id <MTLTexture> _newTexture(id <MTLDevice> device, std::shared_ptr<File> file, MTLPixelFormat format, dispatch_group_t group)
+{
+    MTLTextureDescriptor* desc = file->is_cubemap() ?
+        [MTLTextureDescriptor textureCubeDescriptorWithPixelFormat: format size: file->width() mipmapped: NO] :
+        [MTLTextureDescriptor texture2DDescriptorWithPixelFormat: format width: file->width() height: file->height() mipmapped: NO];
+    // only the levels the file has, the samplers do not use the others
+    desc.mipmapLevelCount = file->mip_count();
+    id<MTLTexture> mtltexture = [device newTextureWithDescriptor: desc];
+    _upload(mtltexture, file, group);
+    return mtltexture;
+}
+
+static id <MTLTexture> _newTexture(id <MTLDevice> device, const TextureFile & file, dispatch_group_t group)
+{
+    if (file.ktx)
+        return _newTexture(device, file.ktx, file.format, group);
+    return _newTexture(device, file.dds, file.format, group);
+}
+
+static void _checkCubemapFormat(MTLPixelFormat format)
+{
+    if (format != MTLPixelFormatRGBA32Float && format != MTLPixelFormatRGBA16Float)
+    {
+        Debug::LogError("CreateTextureCubemap format error!");
+        exit(1);
     }
+}
+    
+id <MTLTexture> TextureLoader::CreateTextureCubemap(id <MTLDevice> device, const char* path, MTLPixelFormat format, dispatch_group_t group)
+{
+    _checkCubemapFormat(format);
+    std::shared_ptr<TextureFile> file = _openTexture(path, format, false, true);
+    return file ? _newTexture(device, *file, group) : nil;
+}
+
+id <MTLTexture> TextureLoader::CreateTexture(id <MTLDevice> device, const char* path, MTLPixelFormat format, bool srgb, dispatch_group_t group)
+{
+    //Debug::LogInfo(path);
+    
+    std::shared_ptr<TextureFile> file = _openTexture(path, format, srgb, false);
+    return file ? _newTexture(device, *file, group) : nil;
+}
+    
+std::shared_ptr<TextureFile> TextureLoader::OpenTexture(const char* path, MTLPixelFormat format, bool srgb)
+{
+    std::shared_ptr<TextureFile> file = _openTexture(path, format, srgb, false);
+    if (file && file->ktx)
+        TextureFile::prefetch(*file->ktx);
+    else if (file)
+        TextureFile::prefetch(*file->dds);
+    return file;
+}
     
+std::shared_ptr<TextureFile> TextureLoader::OpenTextureCubemap(const char* path, MTLPixelFormat format)
+{
+    _checkCubemapFormat(format);
+    std::shared_ptr<TextureFile> file = _openTexture(path, format, false, true);
+    if (file)
+        TextureFile::prefetch(*file->dds);
+    return file;
+}
+
+id <MTLTexture> TextureLoader::UploadTexture(id <MTLDevice> device, std::shared_ptr<TextureFile> file)
+{
+    return file ? _newTexture(device, *file, nil) : nil;
+}
+
+id <MTLTexture> TextureLoader::CreateTexture(id <MTLDevice> device, const void* bytes, uint32_t width, uint32_t height, MTLPixelFormat format, uint32_t bytes_per_row)
+{
+    MTLTextureDescriptor* desc = [MTLTextureDescriptor texture2DDescriptorWithPixelFormat:format width:width height:height mipmapped: NO];
+    id<MTLTexture> mtltexture = [device newTextureWithDescriptor: desc];
+    [mtltexture replaceRegion: MTLRegionMake2D(0, 0, width, height)
+                  mipmapLevel: 0
+                    withBytes: bytes
+                  bytesPerRow: bytes_per_row];
+    return mtltexture;
+}
+
+id <MTLTexture> TextureLoader::CreateTexture3D(id <MTLDevice> device, const void* bytes, uint32_t width, uint32_t height, uint32_t depth,
+                                               MTLPixelFormat format, uint32_t bytes_per_row)
+{
+    MTLTextureDescriptor* desc = [MTLTextureDescriptor new];
+    desc.textureType = MTLTextureType3D;
+    desc.pixelFormat = format;
+    desc.width = width;
+    desc.height = height;
+    desc.depth = depth;
+    id<MTLTexture> mtltexture = [device newTextureWithDescriptor: desc];
+    [mtltexture replaceRegion: MTLRegionMake3D(0, 0, 0, width, height, depth)
+                  mipmapLevel: 0
+                        slice: 0
+                    withBytes: bytes
+                  bytesPerRow: bytes_per_row
+                bytesPerImage: bytes_per_row * height];
     return mtltexture;
 }
 
@@ -0,0 +1,135 @@
+//
+//  ThreadPool.cpp
+//  SSSS_Metal
+//
+
+#include "ThreadPool.h"
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+
+ThreadPool::ThreadPool(int n_threads) : _stop(false)
+{
+    if (n_threads <= 0)
+        n_threads = std::max(1, (int)std::thread::hardware_concurrency());
+    _workers.reserve(n_threads);
+    for (int i = 0; i < n_threads; i++)
+        _workers.emplace_back(&ThreadPool::worker_main, this);
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _stop = true;
+    }
+    _cv.notify_all();
+    for (auto& t : _workers)
+        t.join();
+}
+
+void ThreadPool::enqueue(std::function<void()> job)
+{
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _jobs.push_back(std::move(job));
+    }
+    _cv.notify_one();
+}
+
+bool ThreadPool::run_one()
+{
+    std::function<void()> job;
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        if (_jobs.empty())
+            return false;
+        job = std::move(_jobs.front());
+        _jobs.pop_front();
+    }
+    job();
+    return true;
+}
+
+void ThreadPool::worker_main()
+{
+    for (;;)
+    {
+        std::function<void()> job;
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            _cv.wait(lock, [this] { return _stop || !_jobs.empty(); });
+            if (_stop && _jobs.empty())
+                return;
+            job = std::move(_jobs.front());
+            _jobs.pop_front();
+        }
+        job();
+    }
+}
+
+void ThreadPool::parallel_for(int count, const std::function<void(int)> & fn)
+{
+    if (count <= 0)
+        return;
+    if (count == 1)
+    {
+        fn(0);
+        return;
+    }
+    
+    struct State
+    {
+        std::atomic<int> next;
+        std::atomic<int> done;
+        std::mutex mutex;
+        std::condition_variable cv;
+    };
+    auto state = std::make_shared<State>();
+    state->next = 0;
+    state->done = 0;
+    
+    // every runner grabs indices until the range is exhausted
+    auto runner = [state, count, &fn]()
+    {
+        int i;
+        while ((i = state->next.fetch_add(1)) < count)
+        {
+            fn(i);
+            if (state->done.fetch_add(1) + 1 == count)
+            {
+                std::lock_guard<std::mutex> lock(state->mutex);
+                state->cv.notify_all();
+            }
+        }
+    };
+    
+    int helpers = std::min(size(), count - 1);
+    for (int i = 0; i < helpers; i++)
+        enqueue(runner);
+    runner();
+    
+    // help with other queued work (e.g. nested parallel_for) while waiting
+    while (state->done.load() < count)
+    {
+        if (run_one())
+            continue;
+        std::unique_lock<std::mutex> lock(state->mutex);
+        state->cv.wait_for(lock, std::chrono::milliseconds(1),
+                           [&] { return state->done.load() >= count; });
+    }
+}
+
+void ThreadPool::parallel_for_tiles(int width, int height, int tile_size,
+                                    const std::function<void(int, int, int, int)> & fn)
+{
+    int tiles_x = (width + tile_size - 1) / tile_size;
+    int tiles_y = (height + tile_size - 1) / tile_size;
+    parallel_for(tiles_x * tiles_y, [&](int i)
+    {
+        int x0 = (i % tiles_x) * tile_size;
+        int y0 = (i / tiles_x) * tile_size;
+        fn(x0, y0, std::min(x0 + tile_size, width), std::min(y0 + tile_size, height));
+    });
+}
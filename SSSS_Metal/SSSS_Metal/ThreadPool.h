@@ -0,0 +1,59 @@
+//
+//  ThreadPool.h
+//  SSSS_Metal
+//
+//  Minimal worker pool for the CPU side of the renderer.
+//  Plain C++11, no platform dependencies.
+//
+
+#ifndef SSSS_Metal_ThreadPool_h
+#define SSSS_Metal_ThreadPool_h
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class ThreadPool
+{
+public:
+    // n_threads == 0 means one worker per hardware thread
+    explicit ThreadPool(int n_threads = 0);
+    ~ThreadPool();
+    
+    int size() const { return (int)_workers.size(); }
+    
+    // Queues a job, it will run on one of the workers.
+    void enqueue(std::function<void()> job);
+    
+    /**
+     * Runs fn(i) for i in [0, count) and blocks until all of them are done.
+     * The calling thread takes part in the work, so it is fine to call it
+     * from inside a job.
+     */
+    void parallel_for(int count, const std::function<void(int)> & fn);
+    
+    /**
+     * Splits a width x height image into tiles and runs
+     * fn(x0, y0, x1, y1) for each of them in parallel (x1/y1 exclusive).
+     */
+    void parallel_for_tiles(int width, int height, int tile_size,
+                            const std::function<void(int, int, int, int)> & fn);
+    
+private:
+    ThreadPool(const ThreadPool&);
+    ThreadPool& operator=(const ThreadPool&);
+    
+    void worker_main();
+    bool run_one();     // runs a queued job if there is one
+    
+    std::vector<std::thread> _workers;
+    std::deque<std::function<void()>> _jobs;
+    std::mutex _mutex;
+    std::condition_variable _cv;
+    bool _stop;
+};
+
+#endif
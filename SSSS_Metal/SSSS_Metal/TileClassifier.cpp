@@ -0,0 +1,99 @@
+//
+//  TileClassifier.cpp
+//  SSSS_Metal
+//
+
+#include "TileClassifier.h"
+
+#include <algorithm>
+
+using glm::vec2;
+using glm::vec4;
+
+const float TileClassifier::SKY_DEPTH = 1.0f;
+
+void TileClassifier::init(int width, int height)
+{
+    _width = width;
+    _height = height;
+    _tiles_x = (width + TILE_SIZE - 1) / TILE_SIZE;
+    _tiles_y = (height + TILE_SIZE - 1) / TILE_SIZE;
+    _flags.assign(_tiles_x * _tiles_y, 0);
+}
+
+void TileClassifier::rect(int tile, int & x0, int & y0, int & x1, int & y1) const
+{
+    x0 = tile % _tiles_x * TILE_SIZE;
+    y0 = tile / _tiles_x * TILE_SIZE;
+    x1 = std::min(x0 + TILE_SIZE, _width);
+    y1 = std::min(y0 + TILE_SIZE, _height);
+}
+
+int TileClassifier::count(unsigned flags) const
+{
+    int n = 0;
+    for (unsigned char f : _flags)
+        n += (f & flags) == flags ? 1 : 0;
+    return n;
+}
+
+void TileClassifier::classify_ssss(int width, int height, const CPUImage & color, const CPUImage & depth)
+{
+    init(width, height);
+    for (int t = 0; t < tile_count(); t++)
+    {
+        int x0, y0, x1, y1;
+        rect(t, x0, y0, x1, y1);
+        bool skin = false;
+        bool sky = true;
+        for (int y = y0; y < y1; y++)
+        {
+            for (int x = x0; x < x1; x++)
+            {
+                vec2 uv((x + 0.5f) / width, (y + 0.5f) / height);
+                skin = skin || strength(color, depth, uv) != 0.0f;
+                sky = sky && depth.sample_point(uv).x == SKY_DEPTH;
+            }
+        }
+        _flags[t] = (skin ? TileSkin : 0) | (!skin && sky ? TileSky : 0);
+    }
+}
+
+void TileClassifier::classify_glare(int width, int height, const CPUImage & src, float exposure, float threshold)
+{
+    init(width, height);
+    const float cut = threshold / (1.0f - threshold);
+    for (int t = 0; t < tile_count(); t++)
+    {
+        int x0, y0, x1, y1;
+        rect(t, x0, y0, x1, y1);
+        bool bright = false;
+        for (int y = y0; y < y1 && !bright; y++)
+        {
+            for (int x = x0; x < x1 && !bright; x++)
+            {
+                vec4 c = src.sample_point(vec2((x + 0.5f) / width, (y + 0.5f) / height));
+                float m = std::max(std::max(c.x * exposure, c.y * exposure), c.z * exposure);
+                bright = m - cut > 0.0f;
+            }
+        }
+        _flags[t] = bright ? TileBright : 0;
+    }
+}
+
+void TileClassifier::classify_dof(const CPUImage & coc)
+{
+    init(coc.width(), coc.height());
+    for (int t = 0; t < tile_count(); t++)
+    {
+        int x0, y0, x1, y1;
+        rect(t, x0, y0, x1, y1);
+        bool in_focus = true;
+        for (int y = y0; y < y1 && in_focus; y++)
+        {
+            for (int x = x0; x < x1 && in_focus; x++)
+                in_focus = coc.texel(x, y).x == 0.0f;
+        }
+        _flags[t] = in_focus ? TileInFocus : 0;
+    }
+}
@@ -0,0 +1,79 @@
+//
+//  TileClassifier.h
+//  SSSS_Metal
+//
+//  Classes of the 16x16 tiles of a post-process target, the way the tile
+//  compute kernels in shaders.metal classify their threadgroup's tile
+//  before picking the full filter or the cheap path:
+//
+//    sky       no SSS strength and the cleared linear depth on every texel
+//    skin      SSS strength on some texel: the SSS blur runs
+//    in focus  CoC 0 on every texel: the DOF blur is a copy
+//    bright    some texel can pass the glare threshold: glare detection runs
+//
+//  Each pass classifies the grid of the target it writes. Plain C++, so
+//  CPUPostProcess runs the same classification.
+//
+
+#ifndef SSSS_Metal_TileClassifier_h
+#define SSSS_Metal_TileClassifier_h
+
+#include <vector>
+
+#include "CPUImage.h"
+
+class TileClassifier
+{
+public:
+    static const int TILE_SIZE = 16;        // TILE_CLASS_SIZE in AAPLSharedTypes.h
+    static const float SKY_DEPTH;           // what the main pass clears linear depth to
+    
+    enum Class
+    {
+        TileSky     = 1 << 0,
+        TileSkin    = 1 << 1,
+        TileInFocus = 1 << 2,
+        TileBright  = 1 << 3,
+    };
+    
+    TileClassifier() : _width(0), _height(0), _tiles_x(0), _tiles_y(0) {}
+    
+    int tiles_x() const { return _tiles_x; }
+    int tiles_y() const { return _tiles_y; }
+    int tile_count() const { return _tiles_x * _tiles_y; }
+    unsigned flags(int tile) const { return _flags[tile]; }
+    
+    // texels of tile, x1/y1 exclusive
+    void rect(int tile, int & x0, int & y0, int & x1, int & y1) const;
+    
+    // tiles with all the bits of flags
+    int count(unsigned flags) const;
+    
+    // SSSS_STREGTH_SOURCE at uv: color's alpha, or the green of the linear depth when color has none
+    static float strength(const CPUImage & color, const CPUImage & depth, glm::vec2 uv)
+    {
+        return color.has_alpha() ? color.sample_point(uv).w : depth.sample_point(uv).y;
+    }
+    
+    // A width x height SSS target: color (point sampled) and linear depth, which hold the strength.
+    void classify_ssss(int width, int height, const CPUImage & color, const CPUImage & depth);
+    
+    /**
+     * A width x height glare target: a texel is bright when its center tap
+     * of src is over the threshold, as bloom_glare_detection_frag keeps the
+     * minimum of five taps it can't pass it otherwise.
+     */
+    void classify_glare(int width, int height, const CPUImage & src, float exposure, float threshold);
+    
+    // the DOF targets, which have the size of coc
+    void classify_dof(const CPUImage & coc);
+
+private:
+    void init(int width, int height);
+    
+    int _width, _height;
+    int _tiles_x, _tiles_y;
+    std::vector<unsigned char> _flags;
+};
+
+#endif
@@ -0,0 +1,131 @@
+//
+//  TileCompute.h
+//  SSSS_Metal
+//
+//  The tile compute path of the post-process passes: SeparableSSS, the
+//  bloom glare detection and the DepthOfField blur dispatch a kernel of
+//  shaders.metal with one TILE_CLASS_SIZE threadgroup per tile of their
+//  target instead of drawing their fragment pass, when given a TileCompute.
+//  Each threadgroup classifies its tile (TileClassifier has the classes)
+//  and runs the full filter only if the class needs it.
+//
+//  The kernels count their tiles into a buffer per frame in flight, which
+//  the renderer reads back when the frame completes.
+//
+
+#ifndef SSSS_Metal_TileCompute_h
+#define SSSS_Metal_TileCompute_h
+
+#import <Metal/Metal.h>
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+
+#include "AAPLSharedTypes.h"
+#include "RenderContext.h"
+#include "RenderTarget.h"
+#include "Utilities.h"
+
+class TileCompute
+{
+public:
+    static const int REPORT_FRAMES = 600;
+    
+    TileCompute() : _index(0), _frames(0) { memset(&_totals, 0, sizeof(_totals)); }
+    
+    void init(id <MTLDevice> device)
+    {
+        for (int i = 0; i < kInFlightCommandBuffers; i++)
+        {
+            _stats[i] = [device newBufferWithLength: sizeof(AAPL::tile_stats) options: 0];
+            _stats[i].label = [NSString stringWithFormat: @"tile_stats%i", i];
+        }
+    }
+    
+    // Zeroes the counts of the frame in flight slot index, before the frame is encoded.
+    void begin_frame(NSUInteger index)
+    {
+        _index = index;
+        memset([_stats[index] contents], 0, sizeof(AAPL::tile_stats));
+    }
+    
+    // The counts of slot index, once its frame completed.
+    AAPL::tile_stats frame_stats(NSUInteger index) const
+    {
+        return *(const AAPL::tile_stats*)[_stats[index] contents];
+    }
+    
+    static id <MTLComputePipelineState> new_pipeline(id <MTLDevice> device, id <MTLLibrary> library, NSString* name)
+    {
+        NSError *err = nil;
+        id <MTLComputePipelineState> pipeline = [device newComputePipelineStateWithFunction: _newFunctionFromLibrary(library, name)
+                                                                                      error: &err];
+        CheckPipelineError(pipeline, err);
+        return pipeline;
+    }
+    
+    // Binds the kernel's index, this frame's counts and dst (texture 2), then a threadgroup per tile of dst.
+    void dispatch(id <MTLComputeCommandEncoder> encoder, AAPL::TileKernel kernel, id <MTLTexture> dst) const
+    {
+        uint32_t index = kernel;
+        [encoder setBytes: &index length: sizeof(index) atIndex: 1];
+        [encoder setBuffer: _stats[_index] offset: 0 atIndex: 2];
+        [encoder setTexture: dst atIndex: 2];
+        MTLSize tile = MTLSizeMake(TILE_CLASS_SIZE, TILE_CLASS_SIZE, 1);
+        MTLSize tiles = MTLSizeMake((dst.width + TILE_CLASS_SIZE - 1) / TILE_CLASS_SIZE,
+                                    (dst.height + TILE_CLASS_SIZE - 1) / TILE_CLASS_SIZE, 1);
+        [encoder dispatchThreadgroups: tiles threadsPerThreadgroup: tile];
+    }
+    
+    // Adds a completed frame's counts, true every REPORT_FRAMES frames when report() has new ones.
+    bool add_frame(const AAPL::tile_stats & stats)
+    {
+        for (int k = 0; k < AAPL::TILE_KERNEL_COUNT; k++)
+        {
+            _totals.tiles[k] += stats.tiles[k];
+            _totals.full[k] += stats.full[k];
+        }
+        _totals.sky += stats.sky;
+        return ++_frames % REPORT_FRAMES == 0;
+    }
+    
+    // Share of the tiles that ran the full filter per kernel since the last report, then starts over.
+    std::string report()
+    {
+        static const char* names[] = { "ssss h", "ssss v", "bloom glare", "dof h", "dof v" };
+        std::string text;
+        char line[64];
+        for (int k = 0; k < AAPL::TILE_KERNEL_COUNT; k++)
+        {
+            if (_totals.tiles[k] == 0)
+                continue;
+            snprintf(line, sizeof(line), "%s%s %.1f%%", text.empty() ? "" : ", ", names[k], 100.0 * _totals.full[k] / _totals.tiles[k]);
+            text += line;
+        }
+        if (_totals.tiles[AAPL::TileKernelSSSSHorizontal])
+        {
+            snprintf(line, sizeof(line), ", sky %.1f%%", 100.0 * _totals.sky / _totals.tiles[AAPL::TileKernelSSSSHorizontal]);
+            text += line;
+        }
+        memset(&_totals, 0, sizeof(_totals));
+        return text;
+    }
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(TileCompute)
+    
+    id <MTLBuffer> _stats[kInFlightCommandBuffers];
+    NSUInteger _index;
+    // added up over the frames since the last report
+    struct
+    {
+        uint64_t tiles[AAPL::TILE_KERNEL_COUNT];
+        uint64_t full[AAPL::TILE_KERNEL_COUNT];
+        uint64_t sky;
+    } _totals;
+    int _frames;
+};
+
+#endif
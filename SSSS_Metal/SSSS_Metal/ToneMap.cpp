@@ -0,0 +1,119 @@
+//
+//  ToneMap.cpp
+//  SSSS_Metal
+//
+
+#include "ToneMap.h"
+
+#include <algorithm>
+#include <cmath>
+
+using glm::vec3;
+
+const char* ToneMap::name(ToneMapOperator op)
+{
+    switch (op)
+    {
+        case TONEMAP_LINEAR:            return "linear";
+        case TONEMAP_EXPONENTIAL:       return "exponential";
+        case TONEMAP_EXPONENTIAL_HSV:   return "exponential hsv";
+        case TONEMAP_REINHARD:          return "reinhard";
+        case TONEMAP_FILMIC:            return "filmic";
+        default:                        return "?";
+    }
+}
+
+vec3 ToneMap::apply(ToneMapOperator op, vec3 color, float exposure, float burnout)
+{
+    switch (op)
+    {
+        case TONEMAP_LINEAR:
+            return exposure * color;
+        case TONEMAP_EXPONENTIAL:
+            return vec3(1.0f) - glm::exp2(-exposure * color);
+        case TONEMAP_EXPONENTIAL_HSV:
+            color = rgb2hsv(color);
+            color.z = 1.0f - exp2f(-exposure * color.z);
+            return hsv2rgb(color);
+        case TONEMAP_REINHARD:
+        {
+            color = xyz2Yxy(rgb2xyz(color));
+            float L = color.x * exposure;
+            float LL = 1.0f + L / (burnout * burnout);
+            color.x = L * LL / (1.0f + L);
+            return xyz2rgb(Yxy2xyz(color));
+        }
+        default:
+        {
+            vec3 whiteScale = 1.0f / filmic(vec3(11.2f));
+            return 2.0f * filmic(exposure * color) * whiteScale;
+        }
+    }
+}
+
+vec3 ToneMap::filmic(vec3 x)
+{
+    const float A = 0.15f;
+    const float B = 0.50f;
+    const float C = 0.10f;
+    const float D = 0.20f;
+    const float E = 0.02f;
+    const float F = 0.30f;
+    return ((x * (A * x + C * B) + D * E) / (x * (A * x + B) + D * F)) - E / F;
+}
+
+vec3 ToneMap::rgb2hsv(vec3 rgb)
+{
+    float v = std::max(std::max(rgb.x, rgb.y), rgb.z);
+    float c = v - std::min(std::min(rgb.x, rgb.y), rgb.z);
+    float h = 0.0f;
+    if (c > 0.0f)
+    {
+        if (v == rgb.x)
+            h = (rgb.y - rgb.z) / c;
+        else if (v == rgb.y)
+            h = (rgb.z - rgb.x) / c + 2.0f;
+        else
+            h = (rgb.x - rgb.y) / c + 4.0f;
+        h /= 6.0f;
+        h = h < 0.0f ? h + 1.0f : h;
+    }
+    return vec3(h, v > 0.0f ? c / v : 0.0f, v);
+}
+
+vec3 ToneMap::hsv2rgb(vec3 hsv)
+{
+    vec3 p = glm::abs(glm::fract(vec3(hsv.x) + vec3(1.0f, 2.0f / 3.0f, 1.0f / 3.0f)) * 6.0f - 3.0f);
+    vec3 rgb = glm::clamp(p - 1.0f, 0.0f, 1.0f);
+    return hsv.z * glm::mix(vec3(1.0f), rgb, hsv.y);
+}
+
+// linear sRGB primaries, D65 white
+vec3 ToneMap::rgb2xyz(vec3 rgb)
+{
+    return vec3(glm::dot(vec3(0.4124f, 0.3576f, 0.1805f), rgb),
+                glm::dot(vec3(0.2126f, 0.7152f, 0.0722f), rgb),
+                glm::dot(vec3(0.0193f, 0.1192f, 0.9505f), rgb));
+}
+
+vec3 ToneMap::xyz2rgb(vec3 xyz)
+{
+    return vec3(glm::dot(vec3( 3.2406f, -1.5372f, -0.4986f), xyz),
+                glm::dot(vec3(-0.9689f,  1.8758f,  0.0415f), xyz),
+                glm::dot(vec3( 0.0557f, -0.2040f,  1.0570f), xyz));
+}
+
+vec3 ToneMap::xyz2Yxy(vec3 xyz)
+{
+    float w = xyz.x + xyz.y + xyz.z;
+    if (w > 0.0f)
+        return vec3(xyz.y, xyz.x / w, xyz.y / w);
+    return vec3(0.0f);
+}
+
+vec3 ToneMap::Yxy2xyz(vec3 Yxy)
+{
+    if (Yxy.z > 0.0f)
+        return vec3(Yxy.x * Yxy.y / Yxy.z, Yxy.x, Yxy.x * (1.0f - Yxy.y - Yxy.z) / Yxy.z);
+    return vec3(0.0f, Yxy.x, 0.0f);
+}
@@ -0,0 +1,58 @@
+//
+//  ToneMap.h
+//  SSSS_Metal
+//
+//  The tone mapping operators of bloom_combine_frag, and the color space
+//  conversions they go through, as shaders.metal evaluates them. Bloom
+//  picks the operator at run time (a specialization of the combine pass
+//  per operator), CPUPostProcess runs the same one.
+//
+//  Plain C++: ssss_tool tonemap-report checks the color conversions round
+//  trip and prints the curve of every operator.
+//
+
+#ifndef SSSS_Metal_ToneMap_h
+#define SSSS_Metal_ToneMap_h
+
+#include <glm/glm.hpp>
+
+// the values of TONEMAP_* in shaders.metal
+enum ToneMapOperator
+{
+    TONEMAP_LINEAR = 0,
+    TONEMAP_EXPONENTIAL = 1,
+    TONEMAP_EXPONENTIAL_HSV = 2,
+    TONEMAP_REINHARD = 3,
+    TONEMAP_FILMIC = 4,
+    TONEMAP_OPERATOR_COUNT
+};
+
+class ToneMap
+{
+public:
+    static const char* name(ToneMapOperator op);
+    
+    /**
+     * DoToneMap: color, linear, times exposure through op. burnout is the
+     * luminance Reinhard maps to white, infinity for the plain L / (1 + L);
+     * the other operators ignore it.
+     */
+    static glm::vec3 apply(ToneMapOperator op, glm::vec3 color, float exposure, float burnout);
+    
+    // 2 * FilmicTonemap(11.2) / FilmicTonemap(11.2) is white
+    static glm::vec3 filmic(glm::vec3 x);
+    
+    // hue, saturation and value, all in [0, 1]
+    static glm::vec3 rgb2hsv(glm::vec3 rgb);
+    static glm::vec3 hsv2rgb(glm::vec3 hsv);
+    // CIE XYZ of linear rgb, and the luminance and chromaticity Yxy of XYZ
+    static glm::vec3 rgb2xyz(glm::vec3 rgb);
+    static glm::vec3 xyz2rgb(glm::vec3 xyz);
+    static glm::vec3 xyz2Yxy(glm::vec3 xyz);
+    static glm::vec3 Yxy2xyz(glm::vec3 Yxy);
+
+private:
+    ToneMap();
+};
+
+#endif
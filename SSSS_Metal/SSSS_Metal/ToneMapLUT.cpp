@@ -0,0 +1,99 @@
+//
+//  ToneMapLUT.cpp
+//  SSSS_Metal
+//
+
+#include "ToneMapLUT.h"
+
+#include <algorithm>
+#include <cmath>
+
+#include "Half.h"
+
+using glm::vec3;
+
+const float ToneMapLUT::RANGE = 64.0f;
+const float ToneMapLUT::TOLERANCE = 0.005f;
+
+bool ToneMapLUT::reproduces(ToneMapOperator op)
+{
+    return op == TONEMAP_FILMIC || op == TONEMAP_EXPONENTIAL;
+}
+
+ToneMapLUT::Grade::Grade() :
+    lift(0.0f),
+    gamma(1.0f),
+    gain(1.0f),
+    saturation(1.0f)
+{
+}
+
+vec3 ToneMapLUT::Grade::apply(vec3 color) const
+{
+    color = color * gain + lift * (vec3(1.0f) - color);
+    for (int c = 0; c < 3; c++)
+        color[c] = powf(std::max(color[c], 0.0f), 1.0f / gamma[c]);
+    float luma = glm::dot(color, vec3(0.2126f, 0.7152f, 0.0722f));
+    return glm::mix(vec3(luma), color, saturation);
+}
+
+float ToneMapLUT::shaper(float x)
+{
+    x = std::min(std::max(x, 0.0f), RANGE);
+    return x / (x + 1.0f) * ((RANGE + 1.0f) / RANGE);
+}
+
+float ToneMapLUT::inverse_shaper(float u)
+{
+    u *= RANGE / (RANGE + 1.0f);
+    return u / (1.0f - u);
+}
+
+void ToneMapLUT::bake(ThreadPool & pool, int size, ToneMapOperator op, float exposure, float burnout, const Grade & grade)
+{
+    _size = size;
+    _table.resize((size_t)size * size * size);
+    _texels.resize(_table.size() * 4);
+    std::vector<float> inputs(size);
+    for (int i = 0; i < size; i++)
+        inputs[i] = inverse_shaper(float(i) / float(size - 1));
+    
+    pool.parallel_for(size, [&](int b)
+    {
+        for (int g = 0; g < size; g++)
+        {
+            for (int r = 0; r < size; r++)
+            {
+                size_t i = ((size_t)b * size + g) * size + r;
+                vec3 c = grade.apply(ToneMap::apply(op, vec3(inputs[r], inputs[g], inputs[b]), exposure, burnout));
+                for (int k = 0; k < 3; k++)
+                {
+                    _texels[i * 4 + k] = float_to_half(c[k]);
+                    _table[i][k] = half_to_float(_texels[i * 4 + k]);
+                }
+                _texels[i * 4 + 3] = float_to_half(1.0f);
+            }
+        }
+    });
+}
+
+vec3 ToneMapLUT::sample(vec3 color) const
+{
+    // u = shaper(x), remapped so u = 0 and u = 1 hit the first and last
+    // texel centers
+    int i0[3], i1[3];
+    float t[3];
+    for (int k = 0; k < 3; k++)
+    {
+        float x = shaper(color[k]) * (_size - 1);
+        i0[k] = std::min((int)x, _size - 1);
+        i1[k] = std::min(i0[k] + 1, _size - 1);
+        t[k] = x - i0[k];
+    }
+    auto at = [&](int r, int g, int b) { return _table[((size_t)b * _size + g) * _size + r]; };
+    vec3 c00 = glm::mix(at(i0[0], i0[1], i0[2]), at(i1[0], i0[1], i0[2]), t[0]);
+    vec3 c10 = glm::mix(at(i0[0], i1[1], i0[2]), at(i1[0], i1[1], i0[2]), t[0]);
+    vec3 c01 = glm::mix(at(i0[0], i0[1], i1[2]), at(i1[0], i0[1], i1[2]), t[0]);
+    vec3 c11 = glm::mix(at(i0[0], i1[1], i1[2]), at(i1[0], i1[1], i1[2]), t[0]);
+    return glm::mix(glm::mix(c00, c10, t[1]), glm::mix(c01, c11, t[1]), t[2]);
+}
@@ -0,0 +1,78 @@
+//
+//  ToneMapLUT.h
+//  SSSS_Metal
+//
+//  The tone mapping of the bloom combine pass, and an optional grade after
+//  it, baked into a size^3 lookup table. Plain C++: the table is uploaded
+//  as an RGBA16Float 3D texture that bloom_combine_frag samples in place of
+//  evaluating the operator per pixel, and CPUPostProcess samples it the
+//  same way.
+//
+
+#ifndef SSSS_Metal_ToneMapLUT_h
+#define SSSS_Metal_ToneMapLUT_h
+
+#include <cstdint>
+#include <vector>
+#include <glm/glm.hpp>
+
+#include "ThreadPool.h"
+#include "ToneMap.h"
+
+class ToneMapLUT
+{
+public:
+    static const int DEFAULT_SIZE = 32;
+    static const float RANGE;       // TONEMAP_LUT_RANGE in shaders.metal: inputs past it clamp
+    static const float TOLERANCE;   // worst error of a 32^3 table for the operators it reproduces
+    
+    // Lift / gamma / gain per channel, then saturation, on the tone mapped color.
+    struct Grade
+    {
+        Grade();
+        
+        glm::vec3 lift;
+        glm::vec3 gamma;
+        glm::vec3 gain;
+        float saturation;
+        
+        glm::vec3 apply(glm::vec3 color) const;
+    };
+    
+    ToneMapLUT() : _size(0) {}
+    
+    /**
+     * Whether a DEFAULT_SIZE table of op stays within TOLERANCE of
+     * ToneMap::apply (ssss_tool tonemap-lut-report checks it): filmic and
+     * exponential. Linear and Reinhard are unbounded and exponential HSV
+     * isn't separable per channel, so their worst cases are large; they
+     * keep being evaluated per pixel.
+     */
+    static bool reproduces(ToneMapOperator op);
+    
+    /**
+     * Bakes ToneMap::apply(op, ..., exposure, burnout) then grade for the
+     * input at every texel center, the z slices in parallel on pool. The
+     * values are rounded to half precision like the texture stores them.
+     */
+    void bake(ThreadPool & pool, int size, ToneMapOperator op, float exposure, float burnout, const Grade & grade = Grade());
+    
+    int size() const { return _size; }
+    
+    // RGBA16Float texels, r fastest then g then b, ready for replaceRegion
+    const std::vector<uint16_t>& texels() const { return _texels; }
+    
+    // Same lookup as the shader: the shaper, then a trilinear filter clamped to the edge.
+    glm::vec3 sample(glm::vec3 color) const;
+    
+    // Input color channel to [0, 1]: x / (1 + x) stretched so RANGE is 1, dense near black.
+    static float shaper(float x);
+    static float inverse_shaper(float u);
+
+private:
+    int _size;
+    std::vector<glm::vec3> _table;      // half precision values as float
+    std::vector<uint16_t> _texels;
+};
+
+#endif
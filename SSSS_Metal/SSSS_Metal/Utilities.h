@@ -52,6 +52,15 @@ static void CheckPipelineError(id<MTLRenderPipelineState> pipeline, NSError *err
     }
 }
 
+static void CheckPipelineError(id<MTLComputePipelineState> pipeline, NSError *error)
+{
+    if (pipeline == nil)
+    {
+        NSLog(@"Failed to create compute pipeline. error is %@", [error description]);
+        assert(0);
+    }
+}
+
 //Shader Loading
 //***************************************************************
 static id<MTLFunction> _newFunctionFromLibrary(id<MTLLibrary> library, NSString *name)
@@ -65,6 +74,19 @@ static id<MTLFunction> _newFunctionFromLibrary(id<MTLLibrary> library, NSString
     return func;
 }
 
+// name specialized with the [[ function_constant ]] values
+static id<MTLFunction> _newFunctionFromLibrary(id<MTLLibrary> library, NSString *name, MTLFunctionConstantValues *values)
+{
+    NSError *err = nil;
+    id<MTLFunction> func = [library newFunctionWithName: name constantValues: values error: &err];
+    if (!func)
+    {
+        NSLog(@"failed to specialize function %@. error is %@", name, [err description]);
+        assert(0);
+    }
+    return func;
+}
+
 
 // T: simd type
 // U: glm type
@@ -0,0 +1,216 @@
+//
+//  VertexPacking.cpp
+//  SSSS_Metal
+//
+
+#include "VertexPacking.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+#include "Half.h"
+
+using glm::vec2;
+using glm::vec3;
+
+static_assert(sizeof(PackedAttributes) == 12, "PackedAttributes must match the shader struct");
+
+static float sign_not_zero(float x)
+{
+    return x >= 0.0f ? 1.0f : -1.0f;
+}
+
+vec2 VertexPacking::oct_encode(const vec3 & v)
+{
+    float l1 = fabsf(v.x) + fabsf(v.y) + fabsf(v.z);
+    if (l1 == 0.0f)
+        return vec2(0.0f);
+    vec3 n = v / l1;
+    if (n.z >= 0.0f)
+        return vec2(n.x, n.y);
+    return vec2((1.0f - fabsf(n.y)) * sign_not_zero(n.x),
+                (1.0f - fabsf(n.x)) * sign_not_zero(n.y));
+}
+
+vec3 VertexPacking::oct_decode(const vec2 & e)
+{
+    vec3 n(e.x, e.y, 1.0f - fabsf(e.x) - fabsf(e.y));
+    float t = std::max(-n.z, 0.0f);
+    n.x += n.x >= 0.0f ? -t : t;
+    n.y += n.y >= 0.0f ? -t : t;
+    return glm::normalize(n);
+}
+
+// same as unpack_snorm2x16_to_float
+static float snorm16_to_float(int16_t s)
+{
+    return std::max(s / 32767.0f, -1.0f);
+}
+
+void VertexPacking::encode_snorm16(const vec3 & v, int16_t out[2])
+{
+    vec2 e = oct_encode(v) * 32767.0f;
+    float best = -2.0f;
+    for (int i = 0; i < 4; i++)
+    {
+        float x = (i & 1) ? ceilf(e.x) : floorf(e.x);
+        float y = (i & 2) ? ceilf(e.y) : floorf(e.y);
+        int16_t c[2] = { (int16_t)std::min(std::max(x, -32767.0f), 32767.0f),
+                         (int16_t)std::min(std::max(y, -32767.0f), 32767.0f) };
+        float cosine = glm::dot(decode_snorm16(c), v);
+        if (cosine > best)
+        {
+            best = cosine;
+            out[0] = c[0];
+            out[1] = c[1];
+        }
+    }
+}
+
+vec3 VertexPacking::decode_snorm16(const int16_t in[2])
+{
+    return oct_decode(vec2(snorm16_to_float(in[0]), snorm16_to_float(in[1])));
+}
+
+void VertexPacking::pack(const MeshData & mesh, VertexPositionFormat position_format, PackedMesh & packed)
+{
+    packed.position_format = position_format;
+    packed.vertex_count = (uint32_t)mesh.vertex_count();
+    packed.index_count = (uint32_t)mesh.index_count();
+    
+    const size_t nv = mesh.vertex_count();
+    packed.positions.resize(nv * packed.position_stride());
+    if (position_format == VertexPositionFloat3)
+    {
+        memcpy(packed.positions.data(), mesh.positions.data(), packed.positions.size());
+    }
+    else
+    {
+        uint16_t* dst = reinterpret_cast<uint16_t*>(packed.positions.data());
+        for (size_t i = 0; i < nv; i++)
+        {
+            dst[i * 4 + 0] = float_to_half(mesh.positions[i].x);
+            dst[i * 4 + 1] = float_to_half(mesh.positions[i].y);
+            dst[i * 4 + 2] = float_to_half(mesh.positions[i].z);
+            dst[i * 4 + 3] = float_to_half(1.0f);
+        }
+    }
+    
+    packed.attributes.clear();
+    if (!mesh.normals.empty())
+    {
+        packed.attributes.resize(nv);
+        for (size_t i = 0; i < nv; i++)
+        {
+            PackedAttributes& a = packed.attributes[i];
+            memset(&a, 0, sizeof(a));
+            encode_snorm16(mesh.normals[i], a.normal);
+            if (!mesh.tangents.empty())
+                encode_snorm16(mesh.tangents[i], a.tangent);
+            if (!mesh.uvs.empty())
+            {
+                a.uv[0] = float_to_half(mesh.uvs[i].x);
+                a.uv[1] = float_to_half(mesh.uvs[i].y);
+            }
+        }
+    }
+    
+    packed.indices.resize(mesh.index_count() * packed.index_size());
+    if (packed.index_size() == 2)
+    {
+        uint16_t* dst = reinterpret_cast<uint16_t*>(packed.indices.data());
+        for (size_t i = 0; i < mesh.index_count(); i++)
+            dst[i] = (uint16_t)mesh.indices[i];
+    }
+    else
+    {
+        memcpy(packed.indices.data(), mesh.indices.data(), packed.indices.size());
+    }
+}
+
+void VertexPacking::unpack(const PackedMesh & packed, MeshData & mesh)
+{
+    mesh.clear();
+    const size_t nv = packed.vertex_count;
+    mesh.positions.resize(nv);
+    if (packed.position_format == VertexPositionFloat3)
+    {
+        memcpy(mesh.positions.data(), packed.positions.data(), nv * sizeof(vec3));
+    }
+    else
+    {
+        const uint16_t* src = reinterpret_cast<const uint16_t*>(packed.positions.data());
+        for (size_t i = 0; i < nv; i++)
+            mesh.positions[i] = vec3(half_to_float(src[i * 4]), half_to_float(src[i * 4 + 1]), half_to_float(src[i * 4 + 2]));
+    }
+    
+    if (!packed.attributes.empty())
+    {
+        mesh.normals.resize(nv);
+        mesh.tangents.resize(nv);
+        mesh.uvs.resize(nv);
+        for (size_t i = 0; i < nv; i++)
+        {
+            const PackedAttributes& a = packed.attributes[i];
+            mesh.normals[i] = decode_snorm16(a.normal);
+            mesh.tangents[i] = decode_snorm16(a.tangent);
+            mesh.uvs[i] = vec2(half_to_float(a.uv[0]), half_to_float(a.uv[1]));
+        }
+    }
+    
+    mesh.indices.resize(packed.index_count);
+    if (packed.index_size() == 2)
+    {
+        const uint16_t* src = reinterpret_cast<const uint16_t*>(packed.indices.data());
+        for (size_t i = 0; i < packed.index_count; i++)
+            mesh.indices[i] = src[i];
+    }
+    else
+    {
+        memcpy(mesh.indices.data(), packed.indices.data(), packed.indices.size());
+    }
+}
+
+// 0 for a degenerate reference vector, nothing can be compared there.
+// atan2 rather than acos, which has no precision left for tiny angles.
+static float angle_degrees(const vec3 & a, const vec3 & b)
+{
+    if (glm::dot(b, b) == 0.0f)
+        return 0.0f;
+    return atan2f(glm::length(glm::cross(a, b)), glm::dot(a, b)) * (180.0f / 3.14159265f);
+}
+
+VertexPacking::Error VertexPacking::measure(const MeshData & reference, const PackedMesh & packed)
+{
+    MeshData decoded;
+    unpack(packed, decoded);
+    
+    Error error;
+    memset(&error, 0, sizeof(error));
+    double squared = 0.0;
+    double normal_sum = 0.0;
+    const size_t nv = reference.vertex_count();
+    for (size_t i = 0; i < nv; i++)
+    {
+        float d = glm::length(decoded.positions[i] - reference.positions[i]);
+        error.position_max = std::max(error.position_max, d);
+        squared += d * d;
+        if (!reference.normals.empty())
+        {
+            float a = angle_degrees(decoded.normals[i], reference.normals[i]);
+            error.normal_max_degrees = std::max(error.normal_max_degrees, a);
+            normal_sum += a;
+        }
+        if (!reference.tangents.empty())
+            error.tangent_max_degrees = std::max(error.tangent_max_degrees, angle_degrees(decoded.tangents[i], reference.tangents[i]));
+        if (!reference.uvs.empty() && !reference.normals.empty())
+        {
+            vec2 e = glm::abs(decoded.uvs[i] - reference.uvs[i]);
+            error.uv_max = std::max(error.uv_max, std::max(e.x, e.y));
+        }
+    }
+    error.position_rms = nv ? (float)sqrt(squared / nv) : 0.0f;
+    error.normal_mean_degrees = nv ? (float)(normal_sum / nv) : 0.0f;
+    return error;
+}
@@ -0,0 +1,92 @@
+//
+//  VertexPacking.h
+//  SSSS_Metal
+//
+//  Quantized vertex layout for Model. Positions stay in their own stream,
+//  as the three shadow passes read nothing else, and the other attributes
+//  are interleaved into a 12 byte PackedAttributes:
+//
+//      positions   packed_float3 (12 bytes) or half4 with w = 1 (8 bytes)
+//      attributes  normal   octahedral, 2 x snorm16
+//                  tangent  octahedral, 2 x snorm16
+//                  uv       2 x half
+//      indices     uint16 when there are at most 65536 vertices, else uint32
+//
+//  against 12 + 12 + 12 + 8 bytes per vertex and uint32 indices for the
+//  separate float streams. The decode in the vertex shaders
+//  (main_pass_vert_packed*) mirrors unpack() below.
+//
+
+#ifndef SSSS_Metal_VertexPacking_h
+#define SSSS_Metal_VertexPacking_h
+
+#include <cstdint>
+#include <vector>
+#include <glm/glm.hpp>
+
+#include "MeshData.h"
+
+enum VertexPositionFormat
+{
+    VertexPositionFloat3,
+    VertexPositionHalf4,
+};
+
+struct PackedAttributes
+{
+    int16_t  normal[2];
+    int16_t  tangent[2];
+    uint16_t uv[2];
+};
+
+struct PackedMesh
+{
+    VertexPositionFormat position_format = VertexPositionFloat3;
+    uint32_t vertex_count = 0;
+    uint32_t index_count = 0;
+    std::vector<uint8_t> positions;             // vertex_count * position_stride()
+    std::vector<PackedAttributes> attributes;   // empty if the mesh has no normals
+    std::vector<uint8_t> indices;               // index_count * index_size()
+    
+    size_t position_stride() const { return position_format == VertexPositionHalf4 ? 8 : 12; }
+    size_t index_size() const { return vertex_count <= 65536 ? 2 : 4; }
+};
+
+class VertexPacking
+{
+public:
+    struct Error
+    {
+        float position_max;         // object space units
+        float position_rms;
+        float normal_max_degrees;
+        float normal_mean_degrees;
+        float tangent_max_degrees;
+        float uv_max;               // in uv units
+    };
+    
+    /**
+     * Packs mesh (which needs normals, tangents and uvs for the attribute
+     * stream to be written, positions and indices are always packed).
+     */
+    static void pack(const MeshData & mesh, VertexPositionFormat position_format, PackedMesh & packed);
+    static void unpack(const PackedMesh & packed, MeshData & mesh);
+    
+    // Decodes packed and compares it with the mesh it was packed from.
+    static Error measure(const MeshData & reference, const PackedMesh & packed);
+    
+    /**
+     * Octahedral mapping of a unit vector to [-1, 1]^2. encode_snorm16()
+     * picks, among the four snorm16 neighbours of the mapped point, the one
+     * that decodes closest to v.
+     */
+    static glm::vec2 oct_encode(const glm::vec3 & v);
+    static glm::vec3 oct_decode(const glm::vec2 & e);
+    static void encode_snorm16(const glm::vec3 & v, int16_t out[2]);
+    static glm::vec3 decode_snorm16(const int16_t in[2]);
+    
+private:
+    VertexPacking() {}
+};
+
+#endif
@@ -1,7 +1,7 @@
 /*
  Copyright (C) 2015 Apple Inc. All Rights Reserved.
  See LICENSE.txt for this sample’s licensing information
- 
+
  Abstract:
  lighting shader for Basic Metal 3D
  */
@@ -12,8 +12,6 @@
 
 using namespace metal;
 
-#define N_LIGHTS 3
-
 typedef float3x3 mat3;
 typedef float4x4 mat4;
 typedef float2 vec2;
@@ -40,6 +38,31 @@ struct v2f_position_uv {
     float2 uv;
 };
 
+// tile compute kernels (TileCompute.h)
+//***********************************************************************
+// One threadgroup per TILE_CLASS_SIZE tile. Every thread ORs the class bits
+// of its texel into the tile's, then the whole threadgroup takes the path
+// of the tile's class. The classes are those of TileClassifier.
+#define TILE_CLASS_SKIN     1u
+#define TILE_CLASS_NOT_SKY  2u      // the sky is the tile where no texel sets it
+#define TILE_CLASS_BRIGHT   4u
+#define TILE_CLASS_DEFOCUS  8u      // not in focus
+#define TILE_SKY_DEPTH      1.0     // the main pass' linear depth clear value
+
+// the tile counts of the frame, see AAPL::tile_stats
+static void tile_count(device atomic_uint* stats, uint kernelIndex, bool full)
+{
+    atomic_fetch_add_explicit(&stats[kernelIndex], 1, memory_order_relaxed);
+    if (full)
+        atomic_fetch_add_explicit(&stats[AAPL::TILE_KERNEL_COUNT + kernelIndex], 1, memory_order_relaxed);
+}
+
+// uv of the texel center a thread writes, the last texel for threads past the edge
+static float2 tile_texcoord(uint2 gid, uint2 size)
+{
+    return (float2(min(gid, size - 1)) + 0.5) / float2(size);
+}
+
 // screen alinged quad pass (draw texutre to screen)
 //***********************************************************************
 vertex v2f_position_uv quad_vert(device packed_float3* positions [[ buffer(1) ]],
@@ -56,7 +79,8 @@ vertex v2f_position_uv quad_vert(device packed_float3* positions [[ buffer(1) ]]
 fragment float4 quad_frag(v2f_position_uv input [[ stage_in ]],
                         texture2d<float> tex [[ texture(0) ]])
 {
-    return float4(tex.sample(point_sampler, input.uv).rgb, 1.0f);
+    // linear: the post-process chain may end below the drawable's size
+    return float4(tex.sample(linear_sampler, input.uv).rgb, 1.0f);
 }
 
 
@@ -73,6 +97,27 @@ vertex v2f_position shadow_pass_vert(constant AAPL::constants_mvp& constants [[
     return output;
 }
 
+// positions of the ModelVertexLayoutPackedHalfPosition layout, w = 1
+vertex v2f_position shadow_pass_vert_half(constant AAPL::constants_mvp& constants [[ buffer(0) ]],
+                                          device half4* positions [[ buffer(1) ]],
+                                          uint vid [[ vertex_id ]])
+{
+    v2f_position output;
+    output.position = constants.MVP * float4(positions[vid]);
+    output.position.z *= output.position.w / 10.0; // We want linear positions
+    return output;
+}
+
+// A full viewport triangle on the far plane: with depth compare always,
+// clears the rect of a shadow map drawn again while the rest of the atlas
+// keeps last frame's maps.
+vertex v2f_position shadow_clear_vert(uint vid [[ vertex_id ]])
+{
+    v2f_position output;
+    output.position = float4(vid == 1 ? 3.0 : -1.0, vid == 2 ? 3.0 : -1.0, 1.0, 1.0);
+    return output;
+}
+
 //fragment float4 shadow_pass_frag(v2f_position input)
 //{
 //    return float4(1.0);
@@ -96,7 +141,8 @@ vertex v2f_position_normal skydome_pass_vert(constant AAPL::constants_mvp& const
 fragment float4 skydome_pass_frag(v2f_position_normal input [[ stage_in ]],
                                   texturecube<float> tex_sky [[ texture(0) ]])
 {
-    return tex_sky.sample(linear_sampler, input.normal);
+    // no SSS strength: the SSS passes skip the sky
+    return float4(tex_sky.sample(linear_sampler, input.normal).rgb, 0.0f);
     //return texture(tex_sky, normalize(input.uv).rgb);
 }
 
@@ -114,29 +160,68 @@ struct v2f_main_pass {
 
 struct frag_out_main_pass {
     float4 color    [[color(0)]];
-    float depth     [[color(1)]];
+    float2 depth    [[color(1)]];   // linear depth, and the SSS strength for color targets without alpha
 };
 
-vertex v2f_main_pass main_pass_vert(constant AAPL::constant_main_pass& constants [[ buffer(0) ]],
-                                             device packed_float3* positions [[ buffer(1) ]],
-                                             device packed_float3* normals [[ buffer(2) ]],
-                                             device packed_float3* tangents [[ buffer(3) ]],
-                                             device packed_float2* uvs [[ buffer(4) ]],
-                                             uint vid [[ vertex_id ]])
+static v2f_main_pass main_pass_transform(constant AAPL::constant_main_pass& constants,
+                                         float4 pos, float3 normal, float3 tangent, float2 uv)
 {
     v2f_main_pass out;
-    float4 pos(positions[vid], 1.0);
     out.position = constants.MVP * pos;
-    out.uv = uvs[vid];
+    out.uv = uv;
     out.world_position = (constants.Model * pos).xyz;
     out.view = constants.camera_position.xyz - out.world_position;
     constant auto& mit = constants.ModelInverseTranspose;
-    out.normal = (mit * float4(normals[vid], 0)).xyz;
-    out.tangent = (mit * float4(tangents[vid], 0)).xyz;
+    out.normal = (mit * float4(normal, 0)).xyz;
+    out.tangent = (mit * float4(tangent, 0)).xyz;
     
     return out;
 }
 
+vertex v2f_main_pass main_pass_vert(constant AAPL::constant_main_pass& constants [[ buffer(0) ]],
+                                             device packed_float3* positions [[ buffer(1) ]],
+                                             device packed_float3* normals [[ buffer(2) ]],
+                                             device packed_float3* tangents [[ buffer(3) ]],
+                                             device packed_float2* uvs [[ buffer(4) ]],
+                                             uint vid [[ vertex_id ]])
+{
+    return main_pass_transform(constants, float4(positions[vid], 1.0), normals[vid], tangents[vid], uvs[vid]);
+}
+
+// packed vertex layouts, see VertexPacking.h
+struct packed_attributes {
+    uint normal;    // octahedral, 2 x snorm16
+    uint tangent;   // octahedral, 2 x snorm16
+    half2 uv;
+};
+
+static float3 oct_decode(uint e)
+{
+    float2 f = unpack_snorm2x16_to_float(e);
+    float3 n = float3(f, 1.0 - abs(f.x) - abs(f.y));
+    float t = saturate(-n.z);
+    n.xy += select(float2(t), float2(-t), n.xy >= 0.0);
+    return normalize(n);
+}
+
+vertex v2f_main_pass main_pass_vert_packed(constant AAPL::constant_main_pass& constants [[ buffer(0) ]],
+                                           device packed_float3* positions [[ buffer(1) ]],
+                                           device packed_attributes* attributes [[ buffer(2) ]],
+                                           uint vid [[ vertex_id ]])
+{
+    packed_attributes a = attributes[vid];
+    return main_pass_transform(constants, float4(positions[vid], 1.0), oct_decode(a.normal), oct_decode(a.tangent), float2(a.uv));
+}
+
+vertex v2f_main_pass main_pass_vert_packed_half(constant AAPL::constant_main_pass& constants [[ buffer(0) ]],
+                                                device half4* positions [[ buffer(1) ]],
+                                                device packed_attributes* attributes [[ buffer(2) ]],
+                                                uint vid [[ vertex_id ]])
+{
+    packed_attributes a = attributes[vid];
+    return main_pass_transform(constants, float4(positions[vid]), oct_decode(a.normal), oct_decode(a.tangent), float2(a.uv));
+}
+
 static float3 BumpMap(texture2d<float> normal_tex, float2 uv)
 {
     float3 bump;
@@ -169,10 +254,27 @@ static float SpecularKSK(texture2d<float> beckmann_tex, float3 normal, float3 li
 }
 
 
+// uv in the light's own shadow map to uv in the shadow atlas, clamped half a
+// texel inside its rect like a texture of its own with clamp_to_edge
+static float2 ShadowAtlasUV(depth2d<float> shadowAtlas, constant AAPL::SLight& light, float2 uv) {
+    float2 half_texel = 0.5 / float2(shadowAtlas.get_width(), shadowAtlas.get_height());
+    float2 lo = light.atlasOffset + half_texel;
+    float2 hi = max(lo, light.atlasOffset + light.atlasScale - half_texel);
+    return clamp(uv * light.atlasScale + light.atlasOffset, lo, hi);
+}
+
+// A light left without a rect this frame (past the lights the atlas has room
+// for) has scale 0: its uv would land on a texel of another light's map, so
+// it gets no shadow and no transmittance instead.
+static bool HasShadowMap(constant AAPL::SLight& light) {
+    return light.atlasScale.x > 0.0;
+}
+
+
 //-----------------------------------------------------------------------------
 // Separable SSS Transmittance Function
 
-static vec3 SSSSTransmittance(float translucency, float sssWidth, vec3 worldPosition, vec3 worldNormal, vec3 light, depth2d<float> shadowMap, mat4 lightViewProjection, float lightFarPlane) {
+static vec3 SSSSTransmittance(float translucency, float sssWidth, vec3 worldPosition, vec3 worldNormal, vec3 light, depth2d<float> shadowAtlas, constant AAPL::SLight& shadowLight, texture2d<float> transmittanceTex, float transmittanceRange) {
     /**
      * Calculate the scale of the effect.
      */
@@ -187,29 +289,24 @@ static vec3 SSSSTransmittance(float translucency, float sssWidth, vec3 worldPosi
     /**
      * Now we calculate the thickness from the light point of view:
      */
-    vec4 shadowPosition = lightViewProjection * shrinkedPos;
+    vec4 shadowPosition = shadowLight.viewProjection * shrinkedPos;
     
     
     shadowPosition.xy /= shadowPosition.w;
-    float d1 = shadowMap.sample(point_sampler, shadowPosition.xy);
+    float d1 = shadowAtlas.sample(point_sampler, ShadowAtlasUV(shadowAtlas, shadowLight, shadowPosition.xy));
     float d2 = shadowPosition.z;
-    d1 *= lightFarPlane;
+    d1 *= shadowLight.farPlane;
     float d = scale * abs(d1 - d2);
     
     /**
      * Armed with the thickness, we can now calculate the color by means of the
-     * precalculated transmittance profile.
-     * (It can be precomputed into a texture, for maximum performance):
+     * precalculated transmittance profile (see SSSTransmittance.h). The
+     * table is indexed by sqrt(d / range), u = 0 and u = 1 map to the centers
+     * of the first and last texels:
      */
-    float dd = -d * d;
-    //vec3 profile = texture(shadowMap, frag_uv).rgb;
-    vec3 profile = vec3(0.233, 0.455, 0.649) * exp(dd / 0.0064) +
-    vec3(0.1,   0.336, 0.344) * exp(dd / 0.0484) +
-    vec3(0.118, 0.198, 0.0)   * exp(dd / 0.187)  +
-    vec3(0.113, 0.007, 0.007) * exp(dd / 0.567)  +
-    vec3(0.358, 0.004, 0.0)   * exp(dd / 1.99)   +
-    vec3(0.078, 0.0,   0.0)   * exp(dd / 7.41);
-    //vec3 profile = vec3(0);
+    float n = transmittanceTex.get_width();
+    float u = sqrt(saturate(d / transmittanceRange));
+    vec3 profile = transmittanceTex.sample(linear_sampler, float2((u * (n - 1.0) + 0.5) / n, 0.5)).rgb;
     
     /**
      * Using the profile, we finally approximate the transmitted lighting from
@@ -218,16 +315,26 @@ static vec3 SSSSTransmittance(float translucency, float sssWidth, vec3 worldPosi
     return profile * saturate(0.3 + dot(light, -worldNormal));
 }
 
+// The cluster of a fragment at pixel position, view depth depth (LightClusters::find).
+static uint LightCluster(constant AAPL::constant_main_pass& constants, float2 position, float depth) {
+    uint2 tile = min(uint2(position * constants.clusterScale), uint2(LIGHT_CLUSTERS_X - 1, LIGHT_CLUSTERS_Y - 1));
+    float slice = floor(log2(depth) * constants.clusterSliceScale + constants.clusterSliceBias);
+    uint z = uint(clamp(slice, 0.0, float(LIGHT_CLUSTERS_Z - 1)));
+    return (z * LIGHT_CLUSTERS_Y + tile.y) * LIGHT_CLUSTERS_X + tile.x;
+}
+
 fragment frag_out_main_pass main_pass_frag(constant AAPL::constant_main_pass& constants [[ buffer(0) ]],
+                               constant AAPL::SLight* lights [[ buffer(1) ]],
+                               const device AAPL::light_cluster* clusters [[ buffer(2) ]],
+                               const device ushort* light_indices [[ buffer(3) ]],
                                v2f_main_pass input [[stage_in]],
                                texture2d<float> diffuse_tex [[ texture(0) ]],
                                texture2d<float> specularAO_tex [[ texture(1) ]],
                                texture2d<float> normal_map_tex [[ texture(2) ]],
                                texture2d<float> beckmann_tex [[ texture(3) ]],
                                texturecube<float> irradiance_tex [[ texture(4) ]],
-                               depth2d<float> shadow_maps_1 [[ texture(5) ]],
-                               depth2d<float> shadow_maps_2 [[ texture(6) ]],
-                               depth2d<float> shadow_maps_3 [[ texture(7) ]]
+                               depth2d<float> shadow_atlas [[ texture(5) ]],
+                               texture2d<float> transmittance_tex [[ texture(8) ]]
                                )
 {
     float3 in_normal = normalize(input.normal);
@@ -250,127 +357,46 @@ fragment frag_out_main_pass main_pass_frag(constant AAPL::constant_main_pass& co
     
     float4 out_color = float4(0, 0, 0, 0);
     
-    float shadow[4];
-    float4 shadow_pos[N_LIGHTS];
-    for (int i = 0; i < N_LIGHTS; i++)
+    // only the lights that can reach the fragment's cluster, input.position.w is 1 / view depth
+    AAPL::light_cluster cluster = clusters[LightCluster(constants, input.position.xy, 1.0 / input.position.w)];
+    for (uint k = 0; k < cluster.count; k++)
     {
-        shadow_pos[i] = constants.lights[i].viewProjection * float4(input.world_position, 1);
-        shadow_pos[i].xy /= shadow_pos[i].w;
-        shadow_pos[i].z /= constants.lights[i].farPlane;
-    }
-    shadow[0] = shadow_maps_1.sample_compare(shadow_sampler, shadow_pos[0].xy, shadow_pos[0].z);
-    shadow[1] = shadow_maps_2.sample_compare(shadow_sampler, shadow_pos[1].xy, shadow_pos[1].z);
-    shadow[2] = shadow_maps_3.sample_compare(shadow_sampler, shadow_pos[2].xy, shadow_pos[2].z);
-    
-    float3 tL[N_LIGHTS];
-    float tSpot[N_LIGHTS];
-    float3 tf2[N_LIGHTS];
-    float3 tColor[N_LIGHTS];
-    
-    //for (int i = 0; i < N_LIGHTS; i++)
-    int i = 0;
-    {
-        constant auto& light = constants.lights[i];
-        float3 L = light.position - input.world_position;
-        float dist = length(L);
-        L /= dist;
-        tL[i] = L;
+        constant auto& light = lights[light_indices[cluster.offset + k]];
         
-        float spot = dot(light.direction, -L);
-        tSpot[i] = spot;
+        float4 shadow_pos = light.viewProjection * float4(input.world_position, 1);
+        shadow_pos.xy /= shadow_pos.w;
+        shadow_pos.z /= light.farPlane;
+        bool mapped = HasShadowMap(light);
+        float shadow = mapped ? shadow_atlas.sample_compare(shadow_sampler, ShadowAtlasUV(shadow_atlas, light, shadow_pos.xy), shadow_pos.z) : 1.0;
         
-        //if (spot > light.falloffStart) // DO NOT USE [if], IT'S VERY SLOW !!!!
-        //{
-            float curve = min(pow(dist / light.farPlane, 6.0), 1.0);
-            float attenuation = mix(1.0 / (1.0 + light.attenuation * dist * dist), 0.0, curve);
-            
-            spot = saturate((spot - light.falloffStart) / light.falloffWidth);
-            
-            float3 f1 = light.color * attenuation * spot;
-            float3 f2 = albedo.rgb * f1;
-            tf2[i] = f2;
-            
-            float3 diffuse = saturate(dot(L, normal));
-            float specular = intensity * SpecularKSK(beckmann_tex, normal, L, view, roughness, constants.specularFresnel);
-            
-            //out_color.rgb += shadow[i] * (f2 * diffuse + f1 * specular);
-            tColor[i] = shadow[i] * (f2 * diffuse + f1 * specular);
-        //}
-    }
-    
-    i = 1;
-    {
-        constant auto& light = constants.lights[i];
         float3 L = light.position - input.world_position;
         float dist = length(L);
         L /= dist;
-        tL[i] = L;
         
-        float spot = dot(light.direction, -L);
-        tSpot[i] = spot;
+        float tSpot = dot(light.direction, -L);
         
         //if (spot > light.falloffStart) // DO NOT USE [if], IT'S VERY SLOW !!!!
         //{
         float curve = min(pow(dist / light.farPlane, 6.0), 1.0);
         float attenuation = mix(1.0 / (1.0 + light.attenuation * dist * dist), 0.0, curve);
         
-        spot = saturate((spot - light.falloffStart) / light.falloffWidth);
+        float spot = saturate((tSpot - light.falloffStart) / light.falloffWidth);
         
         float3 f1 = light.color * attenuation * spot;
         float3 f2 = albedo.rgb * f1;
-        tf2[i] = f2;
         
         float3 diffuse = saturate(dot(L, normal));
         float specular = intensity * SpecularKSK(beckmann_tex, normal, L, view, roughness, constants.specularFresnel);
         
-        //out_color.rgb += shadow[i] * (f2 * diffuse + f1 * specular);
-        tColor[i] = shadow[i] * (f2 * diffuse + f1 * specular);
-        //}
-    }
-
-    i = 2;
-    {
-        constant auto& light = constants.lights[i];
-        float3 L = light.position - input.world_position;
-        float dist = length(L);
-        L /= dist;
-        tL[i] = L;
-        
-        float spot = dot(light.direction, -L);
-        tSpot[i] = spot;
-        
-        //if (spot > light.falloffStart) // DO NOT USE [if], IT'S VERY SLOW !!!!
-        //{
-        float curve = min(pow(dist / light.farPlane, 6.0), 1.0);
-        float attenuation = mix(1.0 / (1.0 + light.attenuation * dist * dist), 0.0, curve);
-        
-        spot = saturate((spot - light.falloffStart) / light.falloffWidth);
+        float3 tColor = shadow * (f2 * diffuse + f1 * specular);
+        if (mapped)
+            tColor += f2 * SSSSTransmittance(constants.translucency, constants.sssWidth, input.world_position.xyz,
+                                             normalize(input.normal), L, shadow_atlas, light,
+                                             transmittance_tex, constants.transmittanceRange);
         
-        float3 f1 = light.color * attenuation * spot;
-        float3 f2 = albedo.rgb * f1;
-        tf2[i] = f2;
-        
-        float3 diffuse = saturate(dot(L, normal));
-        float specular = intensity * SpecularKSK(beckmann_tex, normal, L, view, roughness, constants.specularFresnel);
-        
-        //out_color.rgb += shadow[i] * (f2 * diffuse + f1 * specular);
-        tColor[i] = shadow[i] * (f2 * diffuse + f1 * specular);
+        out_color.rgb += tColor * bool(saturate(tSpot - light.falloffStart));
         //}
     }
-    
-    //if (tSpot[0] > constants.lights[0].falloffStart)
-        tColor[0] += tf2[0] * SSSSTransmittance(constants.translucency, constants.sssWidth, input.world_position.xyz,
-                                                normalize(input.normal), tL[0], shadow_maps_1, constants.lights[0].viewProjection, constants.lights[0].farPlane);
-//    if (tSpot[1] > constants.lights[1].falloffStart)
-        tColor[1] += tf2[1] * SSSSTransmittance(constants.translucency, constants.sssWidth, input.world_position.xyz,
-                                                normalize(input.normal), tL[1], shadow_maps_2, constants.lights[1].viewProjection, constants.lights[1].farPlane);
-//    if (tSpot[2] > constants.lights[2].falloffStart)
-        tColor[2] += tf2[2] * SSSSTransmittance(constants.translucency, constants.sssWidth, input.world_position.xyz,
-                                                normalize(input.normal), tL[2], shadow_maps_3, constants.lights[2].viewProjection, constants.lights[2].farPlane);
-    
-    out_color.rgb += tColor[0] * bool(saturate(tSpot[0] - constants.lights[0].falloffStart));
-    out_color.rgb += tColor[1] * bool(saturate(tSpot[1] - constants.lights[1].falloffStart));
-    out_color.rgb += tColor[2] * bool(saturate(tSpot[2] - constants.lights[2].falloffStart));
 
     out_color.rgb += occlusion * constants.ambient * albedo.rgb * irradiance_tex.sample(linear_sampler, normal).rgb;
     
@@ -380,7 +406,7 @@ fragment frag_out_main_pass main_pass_frag(constant AAPL::constant_main_pass& co
     
     frag_out_main_pass out;
     out.color = out_color;
-    out.depth = input.position.w;
+    out.depth = float2(input.position.w, albedo.a);
     
     return out;
     //return float4(input.normal, 1.0);
@@ -390,29 +416,10 @@ fragment frag_out_main_pass main_pass_frag(constant AAPL::constant_main_pass& co
 // ssss passconstant_ssss_pass
 //***********************************************************************
 #define SSSS_FOVY 20.0
-#define SSSS_STREGTH_SOURCE (colorTex.sample(point_sampler, texcoord).a)
+#define SSSS_STREGTH_SOURCE (constants.strengthInDepth ? depthTex.sample(point_sampler, texcoord).g : colorTex.sample(point_sampler, texcoord).a)
 #define SSSSSamplePoint(tex, coord) tex.sample(point_sampler, coord)
 #define SSSSSample(tex, coord) tex.sample(linear_sampler, coord)
 
-#define SSSS_QUALITY 0
-#if SSSS_QUALITY == 0
-#define SSSS_N_SAMPLES 11
-constant float4 ssss_kernel[] = {
-    float4(0.560479, 0.669086, 0.784728, 0),
-    float4(0.00471691, 0.000184771, 5.07566e-005, -2),
-    float4(0.0192831, 0.00282018, 0.00084214, -1.28),
-    float4(0.03639, 0.0130999, 0.00643685, -0.72),
-    float4(0.0821904, 0.0358608, 0.0209261, -0.32),
-    float4(0.0771802, 0.113491, 0.0793803, -0.08),
-    float4(0.0771802, 0.113491, 0.0793803, 0.08),
-    float4(0.0821904, 0.0358608, 0.0209261, 0.32),
-    float4(0.03639, 0.0130999, 0.00643685, 0.72),
-    float4(0.0192831, 0.00282018, 0.00084214, 1.28),
-    float4(0.00471691, 0.000184771, 5.07565e-005, 2)
-};
-#else
-#endif
-
 #define PI 3.1415926536
 //constant float INV_PI  = 1.0 / PI;
 constant float TO_RADIANS = 1.0 / 180.0 * PI;
@@ -422,7 +429,7 @@ constant float TO_RADIANS = 1.0 / 180.0 * PI;
 fragment float4 ssss_pass_frag(constant AAPL::constant_ssss_pass& constants [[ buffer(0) ]],
                                v2f_position_uv input [[stage_in]],
                                texture2d<float> colorTex [[ texture(0) ]],
-                               depth2d<float> depthTex [[ texture(1) ]]
+                               texture2d<float> depthTex [[ texture(1) ]]
                                //texture2d<float> strengthTex [[ texture(2) ]]
                                )
 {
@@ -434,12 +441,13 @@ fragment float4 ssss_pass_frag(constant AAPL::constant_ssss_pass& constants [[ b
     //float4 colorM = colorTex.sample(point_sampler, texcoord);
     
     // Initialize the stencil buffer in case it was not already available:
-    //if (constants.initStencil) // (Checked in compile time, it's optimized away)
-    //    if (SSSS_STREGTH_SOURCE == 0.0) discard_fragment();
+    // the horizontal pass marks the pixels it doesn't discard
+    if (constants.initStencil)
+        if (SSSS_STREGTH_SOURCE == 0.0) discard_fragment();
     
     // Fetch linear depth of current pixel:
     //float depthM = SSSSSamplePoint(depthTex, texcoord).r;
-    float depthM = 1.0 / SSSSSamplePoint(depthTex, texcoord);
+    float depthM = 1.0 / SSSSSamplePoint(depthTex, texcoord).r;
     
     // Calculate the sssWidth scale (1.0 for a unit plane sitting on the
     // projection window):
@@ -452,13 +460,14 @@ fragment float4 ssss_pass_frag(constant AAPL::constant_ssss_pass& constants [[ b
     finalStep *= 1.0 / 3.0; // Divide by 3 as the kernels range from -3 to 3.
     
     // Accumulate the center sample:
+    constant float4* ssss_kernel = constants.ssss_kernel;
     float4 colorBlurred = colorM;
     colorBlurred.rgb *= ssss_kernel[0].rgb;
     
     // Accumulate the other samples:
     //SSSS_UNROLL
-    for (int i = 1; i < SSSS_N_SAMPLES; i++) {
-        // Fetch color and d    epth for current sample:
+    for (int i = 1; i < constants.nSamples; i++) {
+        // Fetch color and depth for current sample:
         float2 offset = texcoord + ssss_kernel[i].a * finalStep;
         float4 color = SSSSSample(colorTex, offset);
         
@@ -477,28 +486,187 @@ fragment float4 ssss_pass_frag(constant AAPL::constant_ssss_pass& constants [[ b
     return colorBlurred;
 }
 
+// Where the stencil isn't marked: the blur of a pixel without SSS strength
+// is the pixel itself.
+fragment float4 ssss_copy_frag(v2f_position_uv input [[stage_in]],
+                               texture2d<float> colorTex [[ texture(0) ]])
+{
+    return SSSSSamplePoint(colorTex, input.uv);
+}
+
+#define SSSS_TILE_APRON 16
+#define SSSS_TILE_CACHE (TILE_CLASS_SIZE + 2 * SSSS_TILE_APRON)
+
+// ssss_pass_frag per tile. A tile without SSS strength (the sky among them)
+// is copied. The others read their rows (columns in the vertical pass)
+// with SSSS_TILE_APRON texels on either side into threadgroup memory once,
+// and the taps that land there filter the cache instead of the texture.
+// The cache needs color at the size of the target, which it is unless
+// DynamicResolution scales SSS down.
+kernel void ssss_tile_kernel(constant AAPL::constant_ssss_pass& constants [[ buffer(0) ]],
+                             constant uint& tileKernel [[ buffer(1) ]],
+                             device atomic_uint* tileStats [[ buffer(2) ]],
+                             texture2d<float> colorTex [[ texture(0) ]],
+                             texture2d<float> depthTex [[ texture(1) ]],
+                             texture2d<float, access::write> dstTex [[ texture(2) ]],
+                             uint2 gid [[ thread_position_in_grid ]],
+                             uint2 lid [[ thread_position_in_threadgroup ]],
+                             uint2 tile [[ threadgroup_position_in_grid ]])
+{
+    threadgroup atomic_uint tileClass;
+    threadgroup float4 cache[TILE_CLASS_SIZE][SSSS_TILE_CACHE];
+    
+    uint2 size = uint2(dstTex.get_width(), dstTex.get_height());
+    bool inside = gid.x < size.x && gid.y < size.y;
+    float2 texcoord = tile_texcoord(gid, size);
+    float4 colorM = SSSSSamplePoint(colorTex, texcoord);
+    
+    if (lid.x == 0 && lid.y == 0)
+        atomic_store_explicit(&tileClass, 0, memory_order_relaxed);
+    threadgroup_barrier(mem_flags::mem_threadgroup);
+    uint flags = 0;
+    float strength = SSSS_STREGTH_SOURCE;
+    if (inside && strength != 0.0)
+        flags |= TILE_CLASS_SKIN;
+    if (inside && SSSSSamplePoint(depthTex, texcoord).r != TILE_SKY_DEPTH)
+        flags |= TILE_CLASS_NOT_SKY;
+    if (flags != 0)
+        atomic_fetch_or_explicit(&tileClass, flags, memory_order_relaxed);
+    threadgroup_barrier(mem_flags::mem_threadgroup);
+    uint tileFlags = atomic_load_explicit(&tileClass, memory_order_relaxed);
+    bool skin = (tileFlags & TILE_CLASS_SKIN) != 0;
+    if (lid.x == 0 && lid.y == 0)
+    {
+        tile_count(tileStats, tileKernel, skin);
+        if (tileFlags == 0 && tileKernel == AAPL::TileKernelSSSSHorizontal)
+            atomic_fetch_add_explicit(&tileStats[2 * AAPL::TILE_KERNEL_COUNT], 1, memory_order_relaxed);
+    }
+    if (!skin)
+    {
+        if (inside)
+            dstTex.write(colorM, gid);
+        return;
+    }
+    
+    // the line of texels along the blur direction the thread's taps land on
+    bool vertical = constants.dir.y != 0.0;
+    bool cached = colorTex.get_width() == size.x && colorTex.get_height() == size.y;
+    uint line = vertical ? lid.x : lid.y;
+    uint along = vertical ? lid.y : lid.x;
+    int length = int(vertical ? size.y : size.x);
+    int origin = int(vertical ? tile.y : tile.x) * TILE_CLASS_SIZE - SSSS_TILE_APRON;
+    if (cached)
+    {
+        uint2 p = min(gid, size - 1);
+        for (uint i = along; i < SSSS_TILE_CACHE; i += TILE_CLASS_SIZE)
+        {
+            // clamp_to_edge, like the sampler
+            uint c = uint(clamp(origin + int(i), 0, length - 1));
+            cache[line][i] = colorTex.read(vertical ? uint2(p.x, c) : uint2(c, p.y));
+        }
+    }
+    threadgroup_barrier(mem_flags::mem_threadgroup);
+    if (!inside)
+        return;
+    if (strength == 0.0)
+    {
+        // what the stencil would have left out
+        dstTex.write(colorM, gid);
+        return;
+    }
+    
+    float depthM = 1.0 / SSSSSamplePoint(depthTex, texcoord).r;
+    float distanceToProjectionWindow = 1.0 / tan(0.5 * radians(SSSS_FOVY));
+    float scale = distanceToProjectionWindow / depthM;
+    float2 finalStep = constants.sssWidth * scale * constants.dir;
+    finalStep *= strength;
+    finalStep *= 1.0 / 3.0;
+    
+    constant float4* ssss_kernel = constants.ssss_kernel;
+    float4 colorBlurred = colorM;
+    colorBlurred.rgb *= ssss_kernel[0].rgb;
+    for (int i = 1; i < constants.nSamples; i++) {
+        float2 offset = texcoord + ssss_kernel[i].a * finalStep;
+        // the tap is on the thread's line, between two cached texels or out of the cache
+        float p = (vertical ? offset.y * size.y : offset.x * size.x) - 0.5 - origin;
+        float p0 = floor(p);
+        float4 color;
+        if (cached && p0 >= 0.0 && p0 < SSSS_TILE_CACHE - 1)
+            color = mix(cache[line][int(p0)], cache[line][int(p0) + 1], p - p0);
+        else
+            color = SSSSSample(colorTex, offset);
+        colorBlurred.rgb += ssss_kernel[i].rgb * color.rgb;
+    }
+    dstTex.write(colorBlurred, gid);
+}
+
 
 //***********************************************************************
 // ssss passconstant_ssss_pass
 //***********************************************************************
 #define N_PASSES 6
-#define N_SAMPLES 5
 
-fragment float4 bloom_blur_frag(constant AAPL::constant_bloom_pass_blur& constants [[ buffer(0) ]],
-                               v2f_position_uv input [[stage_in]],
-                               texture2d<float> srcTex [[ texture(0) ]]
-                               )
+// The pyramid: each level is a 13 tap downsample of the one above it (the
+// glare target is level 0), then from the smallest level up every level is
+// blended with a tent filtered upsample of the level below it. The blend
+// weights (PassConstants::bloom_up_weight) leave the levels in the top of
+// that chain at 64, 32, ... 2 out of 126, the weights the combine pass
+// used to give the separately blurred levels, and alpha at their mean.
+
+// 13 bilinear taps over a 4x4 texel footprint: the center box and four
+// overlapping corner boxes. step is a texel of srcTex.
+fragment float4 bloom_down_frag(constant AAPL::constant_bloom_pass_blur& constants [[ buffer(0) ]],
+                                v2f_position_uv input [[stage_in]],
+                                texture2d<float> srcTex [[ texture(0) ]])
 {
-    float offsets[] = { -1.282, -0.524, 0.0, 0.524, 1.282 };
-    const float n = 5.0;
+    float2 uv = input.uv;
+    float2 t = constants.step;
     
-    float4 out_color = float4(0, 0, 0, 0);
-    for (int i = 0; i < N_SAMPLES; i++)
-    {
-        out_color += srcTex.sample(point_sampler, input.uv + constants.step * offsets[i]);
-    }
-    out_color /= n;
-    return out_color;
+    float4 a = srcTex.sample(linear_sampler, uv + t * float2(-2.0, -2.0));
+    float4 b = srcTex.sample(linear_sampler, uv + t * float2( 0.0, -2.0));
+    float4 c = srcTex.sample(linear_sampler, uv + t * float2( 2.0, -2.0));
+    float4 d = srcTex.sample(linear_sampler, uv + t * float2(-2.0,  0.0));
+    float4 e = srcTex.sample(linear_sampler, uv);
+    float4 f = srcTex.sample(linear_sampler, uv + t * float2( 2.0,  0.0));
+    float4 g = srcTex.sample(linear_sampler, uv + t * float2(-2.0,  2.0));
+    float4 h = srcTex.sample(linear_sampler, uv + t * float2( 0.0,  2.0));
+    float4 i = srcTex.sample(linear_sampler, uv + t * float2( 2.0,  2.0));
+    float4 j = srcTex.sample(linear_sampler, uv + t * float2(-1.0, -1.0));
+    float4 k = srcTex.sample(linear_sampler, uv + t * float2( 1.0, -1.0));
+    float4 l = srcTex.sample(linear_sampler, uv + t * float2(-1.0,  1.0));
+    float4 m = srcTex.sample(linear_sampler, uv + t * float2( 1.0,  1.0));
+    
+    float4 color = e * 0.125;
+    color += (a + c + g + i) * 0.03125;
+    color += (b + d + f + h) * 0.0625;
+    color += (j + k + l + m) * 0.125;
+    return color;
+}
+
+// 3x3 tent, 9 bilinear taps step apart
+static float4 BloomTent(texture2d<float> tex, float2 uv, float2 step) {
+    float4 color = 4.0 * tex.sample(linear_sampler, uv);
+    color += 2.0 * tex.sample(linear_sampler, uv + step * float2(-1.0,  0.0));
+    color += 2.0 * tex.sample(linear_sampler, uv + step * float2( 1.0,  0.0));
+    color += 2.0 * tex.sample(linear_sampler, uv + step * float2( 0.0, -1.0));
+    color += 2.0 * tex.sample(linear_sampler, uv + step * float2( 0.0,  1.0));
+    color += tex.sample(linear_sampler, uv + step * float2(-1.0, -1.0));
+    color += tex.sample(linear_sampler, uv + step * float2( 1.0, -1.0));
+    color += tex.sample(linear_sampler, uv + step * float2(-1.0,  1.0));
+    color += tex.sample(linear_sampler, uv + step * float2( 1.0,  1.0));
+    return color / 16.0;
+}
+
+// downTex, of this level's size, blended with the tent upsampled level
+// below it (upTex): normalized, so the sum fits the 8 bit targets.
+fragment float4 bloom_up_frag(constant AAPL::constant_bloom_pass_blur& constants [[ buffer(0) ]],
+                              v2f_position_uv input [[stage_in]],
+                              texture2d<float> downTex [[ texture(0) ]],
+                              texture2d<float> upTex [[ texture(1) ]])
+{
+    float4 color = downTex.sample(point_sampler, input.uv);
+    float4 up = BloomTent(upTex, input.uv, constants.step);
+    return mix(color, up, constants.weight.xxxy);
 }
 
 
@@ -515,39 +683,101 @@ static float3 FilmicTonemap(float3 x) {
     return ((x*(A*x+C*B)+D*E) / (x*(A*x+B)+D*F))- E / F;
 }
 
+// ToneMap.h: the values of ToneMapOperator
 #define TONEMAP_LINEAR 0
 #define TONEMAP_EXPONENTIAL 1
 #define TONEMAP_EXPONENTIAL_HSV 2
 #define TONEMAP_REINHARD 3
 #define TONEMAP_FILMIC 4
-#define TONEMAP_OPERATOR TONEMAP_FILMIC
 
-static float3 DoToneMap(float3 color, float exposure) {
-#if TONEMAP_OPERATOR == TONEMAP_LINEAR
-    return exposure * color;
-#elif TONEMAP_OPERATOR == TONEMAP_EXPONENTIAL
-    color = 1.0 - exp2(-exposure * color);
-    return color;
-#elif TONEMAP_OPERATOR == TONEMAP_EXPONENTIAL_HSV
-    color = rgb2hsv(color);
-    color.b = 1.0 - exp2(-exposure * color.b);
-    color = hsv2rgb(color);
-    return color;
-#elif TONEMAP_OPERATOR == TONEMAP_REINHARD
-    color = xyz2Yxy(rgb2xyz(color));
-    float L = color.r;
-    L *= exposure;
-    float LL = 1 + L / (burnout * burnout);
-    float L_d = L * LL / (1 + L);
-    color.r = L_d;
-    color = xyz2rgb(Yxy2xyz(color));
-    return color;
-#else // TONEMAP_FILMIC
-    color = 2.0f * FilmicTonemap(exposure * color);
-    float3 whiteScale = 1.0f / FilmicTonemap(vec3(11.2));
-    color *= whiteScale;
-    return color;
-#endif
+// Bloom builds bloom_combine_frag once per operator, the branches of the others fold away
+constant int tonemap_operator [[ function_constant(AAPL::FunctionConstantToneMapOperator) ]];
+
+static float3 rgb2hsv(float3 rgb) {
+    float v = max(max(rgb.r, rgb.g), rgb.b);
+    float c = v - min(min(rgb.r, rgb.g), rgb.b);
+    float h = 0.0;
+    if (c > 0.0) {
+        if (v == rgb.r)
+            h = (rgb.g - rgb.b) / c;
+        else if (v == rgb.g)
+            h = (rgb.b - rgb.r) / c + 2.0;
+        else
+            h = (rgb.r - rgb.g) / c + 4.0;
+        h /= 6.0;
+        h = h < 0.0 ? h + 1.0 : h;
+    }
+    return float3(h, v > 0.0 ? c / v : 0.0, v);
+}
+
+static float3 hsv2rgb(float3 hsv) {
+    float3 p = abs(fract(hsv.x + float3(1.0, 2.0 / 3.0, 1.0 / 3.0)) * 6.0 - 3.0);
+    return hsv.z * mix(float3(1.0), saturate(p - 1.0), hsv.y);
+}
+
+// linear sRGB primaries, D65 white
+static float3 rgb2xyz(float3 rgb) {
+    return float3(dot(float3(0.4124, 0.3576, 0.1805), rgb),
+                  dot(float3(0.2126, 0.7152, 0.0722), rgb),
+                  dot(float3(0.0193, 0.1192, 0.9505), rgb));
+}
+
+static float3 xyz2rgb(float3 xyz) {
+    return float3(dot(float3( 3.2406, -1.5372, -0.4986), xyz),
+                  dot(float3(-0.9689,  1.8758,  0.0415), xyz),
+                  dot(float3( 0.0557, -0.2040,  1.0570), xyz));
+}
+
+static float3 xyz2Yxy(float3 xyz) {
+    float w = xyz.r + xyz.g + xyz.b;
+    if (w > 0.0)
+        return float3(xyz.g, xyz.r / w, xyz.g / w);
+    return float3(0.0);
+}
+
+static float3 Yxy2xyz(float3 Yxy) {
+    if (Yxy.b > 0.0)
+        return float3(Yxy.r * Yxy.g / Yxy.b, Yxy.r, Yxy.r * (1.0 - Yxy.g - Yxy.b) / Yxy.b);
+    return float3(0.0, Yxy.r, 0.0);
+}
+
+static float3 DoToneMap(float3 color, float exposure, float burnout) {
+    if (tonemap_operator == TONEMAP_LINEAR) {
+        return exposure * color;
+    } else if (tonemap_operator == TONEMAP_EXPONENTIAL) {
+        color = 1.0 - exp2(-exposure * color);
+        return color;
+    } else if (tonemap_operator == TONEMAP_EXPONENTIAL_HSV) {
+        color = rgb2hsv(color);
+        color.b = 1.0 - exp2(-exposure * color.b);
+        color = hsv2rgb(color);
+        return color;
+    } else if (tonemap_operator == TONEMAP_REINHARD) {
+        color = xyz2Yxy(rgb2xyz(color));
+        float L = color.r;
+        L *= exposure;
+        float LL = 1 + L / (burnout * burnout);
+        float L_d = L * LL / (1 + L);
+        color.r = L_d;
+        color = xyz2rgb(Yxy2xyz(color));
+        return color;
+    } else { // TONEMAP_FILMIC
+        color = 2.0f * FilmicTonemap(exposure * color);
+        float3 whiteScale = 1.0f / FilmicTonemap(vec3(11.2));
+        color *= whiteScale;
+        return color;
+    }
+}
+
+// Bloom's LUT specialization samples ToneMapLUT (operator, exposure and grade baked) instead
+constant bool tonemap_lut [[ function_constant(AAPL::FunctionConstantToneMapLUT) ]];
+#define TONEMAP_LUT_RANGE 64.0
+
+// ToneMapLUT::shaper, onto the texel centers of a size^3 table
+static float3 ToneMapLUTCoord(float3 color, float size) {
+    color = clamp(color, 0.0, TONEMAP_LUT_RANGE);
+    float3 u = color / (color + 1.0) * ((TONEMAP_LUT_RANGE + 1.0) / TONEMAP_LUT_RANGE);
+    return u * ((size - 1.0) / size) + 0.5 / size;
 }
 
 #define Texture(tex, uv) tex.sample(point_sampler, (uv))
@@ -560,42 +790,27 @@ static float4 PyramidFilter(texture2d<float> tex, float2 uv, float2 width) {
     return 0.25 * color;
 }
 
-#define PROCESS(index) \
-{\
-    float4 sample = srcTex_##index.sample(linear_sampler, input.uv);  \
-    out_color.rgb += constants.bloomIntensity * w[ index ] * sample.rgb / 127.0; \
-    out_color.a += sample.a / N_PASSES; \
-}
-
-
+// bloomTex is the top of the upsample chain: 126/127 of it gives the levels
+// the weights 64, 32, ... 2 out of 127.
 fragment float4 bloom_combine_frag(constant AAPL::constant_bloom_pass_combine& constants [[ buffer(0) ]],
                                    v2f_position_uv input [[stage_in]],
                                    texture2d<float> finalTex [[ texture(0) ]],
-                                   texture2d<float> srcTex_0 [[ texture(1) ]],
-                                   texture2d<float> srcTex_1 [[ texture(2) ]],
-                                   texture2d<float> srcTex_2 [[ texture(3) ]],
-                                   texture2d<float> srcTex_3 [[ texture(4) ]],
-                                   texture2d<float> srcTex_4 [[ texture(5) ]],
-                                   texture2d<float> srcTex_5 [[ texture(6) ]])
+                                   texture2d<float> bloomTex [[ texture(1) ]],
+                                   texture3d<float> lutTex [[ texture(2), function_constant(tonemap_lut) ]])
 {
-    
-    float w[] = {64.0, 32.0, 16.0, 8.0, 4.0, 2.0, 1.0};
-    
     float4 out_color = PyramidFilter(finalTex, input.uv, constants.pixelSize * constants.defocus);
-    PROCESS(0)
-    PROCESS(1)
-    PROCESS(2)
-    PROCESS(3)
-    PROCESS(4)
-    PROCESS(5)
+    float4 bloom = BloomTent(bloomTex, input.uv, constants.step);
+    out_color.rgb += constants.bloomIntensity * 126.0 * bloom.rgb / 127.0;
+    out_color.a += bloom.a;
     
-    out_color.rgb = DoToneMap(out_color.rgb, constants.exposure);
+    if (tonemap_lut)
+        out_color.rgb = lutTex.sample(linear_sampler, ToneMapLUTCoord(out_color.rgb, lutTex.get_width())).rgb;
+    else
+        out_color.rgb = DoToneMap(out_color.rgb, constants.exposure, constants.burnout);
     
     return out_color;
 }
 
-#undef PROCESS
-
 
 fragment float4 bloom_glare_detection_frag(constant AAPL::constant_bloom_pass_glare& constants [[ buffer(0) ]],
                                    v2f_position_uv input [[stage_in]],
@@ -619,6 +834,82 @@ fragment float4 bloom_glare_detection_frag(constant AAPL::constant_bloom_pass_gl
     return float4(max(color.rgb - constants.bloomThreshold / (1.0 - constants.bloomThreshold), 0.0), color.a);
 }
 
+#define GLARE_TILE_CACHE 40
+
+// a point sampled texel of finalTex, from the cache when it holds it
+static float4 glare_tap(texture2d<float> finalTex, threadgroup float4 (*cache)[GLARE_TILE_CACHE], int2 origin, float2 uv)
+{
+    int2 t = int2(floor(uv * float2(finalTex.get_width(), finalTex.get_height()))) - origin;
+    if (all(t >= 0) && all(t < GLARE_TILE_CACHE))
+        return cache[t.y][t.x];
+    return Texture(finalTex, uv);
+}
+
+// bloom_glare_detection_frag per tile of the half size glare target. The
+// tile's footprint in the source, twice its size plus the reach of the
+// taps, is read into threadgroup memory once and the five taps of every
+// texel come from there. A tile where no center tap passes the threshold
+// has no glare, the minimum of the taps can't pass it either: it only
+// keeps the alpha.
+kernel void bloom_glare_tile_kernel(constant AAPL::constant_bloom_pass_glare& constants [[ buffer(0) ]],
+                                    constant uint& tileKernel [[ buffer(1) ]],
+                                    device atomic_uint* tileStats [[ buffer(2) ]],
+                                    texture2d<float> finalTex [[ texture(0) ]],
+                                    texture2d<float, access::write> dstTex [[ texture(2) ]],
+                                    uint2 gid [[ thread_position_in_grid ]],
+                                    uint2 lid [[ thread_position_in_threadgroup ]],
+                                    uint2 tile [[ threadgroup_position_in_grid ]])
+{
+    threadgroup atomic_uint tileClass;
+    threadgroup float4 cache[GLARE_TILE_CACHE][GLARE_TILE_CACHE];
+    
+    float2 offsets[] = {
+                       float2( 0.0,  0.0),
+                       float2(-1.0,  0.0),
+                       float2( 1.0,  0.0),
+                       float2( 0.0, -1.0),
+                       float2( 0.0,  1.0)
+    };
+    uint2 size = uint2(dstTex.get_width(), dstTex.get_height());
+    int2 srcSize = int2(finalTex.get_width(), finalTex.get_height());
+    bool inside = gid.x < size.x && gid.y < size.y;
+    float2 uv = tile_texcoord(gid, size);
+    
+    // from the texel of the tile's first texel's up / left tap
+    float2 first = tile_texcoord(tile * TILE_CLASS_SIZE, size);
+    int2 origin = int2(floor((first - constants.pixelSize) * float2(srcSize)));
+    uint index = lid.y * TILE_CLASS_SIZE + lid.x;
+    for (uint i = index; i < GLARE_TILE_CACHE * GLARE_TILE_CACHE; i += TILE_CLASS_SIZE * TILE_CLASS_SIZE)
+    {
+        int2 t = clamp(origin + int2(i % GLARE_TILE_CACHE, i / GLARE_TILE_CACHE), int2(0), srcSize - 1);
+        cache[i / GLARE_TILE_CACHE][i % GLARE_TILE_CACHE] = finalTex.read(uint2(t));
+    }
+    if (index == 0)
+        atomic_store_explicit(&tileClass, 0, memory_order_relaxed);
+    threadgroup_barrier(mem_flags::mem_threadgroup);
+    
+    float4 color = glare_tap(finalTex, cache, origin, uv + offsets[0] * constants.pixelSize);
+    float cut = constants.bloomThreshold / (1.0 - constants.bloomThreshold);
+    if (inside && any(color.rgb * constants.exposure - cut > 0.0))
+        atomic_fetch_or_explicit(&tileClass, TILE_CLASS_BRIGHT, memory_order_relaxed);
+    threadgroup_barrier(mem_flags::mem_threadgroup);
+    bool bright = atomic_load_explicit(&tileClass, memory_order_relaxed) != 0;
+    if (index == 0)
+        tile_count(tileStats, tileKernel, bright);
+    if (!inside)
+        return;
+    
+    for (int i = 1; i < 5; i++)
+        color = min(glare_tap(finalTex, cache, origin, uv + offsets[i] * constants.pixelSize), color);
+    if (!bright)
+    {
+        dstTex.write(float4(0.0, 0.0, 0.0, color.a), gid);
+        return;
+    }
+    color.rgb *= constants.exposure;
+    dstTex.write(float4(max(color.rgb - cut, 0.0), color.a), gid);
+}
+
 
 //***********************************************************************
 // ssss passconstant_ssss_pass
@@ -688,3 +979,52 @@ fragment float dof_coc_frag(constant AAPL::constant_dof_pass_coc& constants [[ b
     
     return out_color;
 }
+
+
+// dof_blur_frag per tile. A tile whose CoC is 0 everywhere is in focus:
+// every tap lands on the texel itself, and it is a copy.
+kernel void dof_tile_kernel(constant AAPL::constant_dof_pass_blur& constants [[ buffer(0) ]],
+                            constant uint& tileKernel [[ buffer(1) ]],
+                            device atomic_uint* tileStats [[ buffer(2) ]],
+                            texture2d<float> blurredTex [[ texture(0) ]],
+                            texture2d<float> cocTex [[ texture(1) ]],
+                            texture2d<float, access::write> dstTex [[ texture(2) ]],
+                            uint2 gid [[ thread_position_in_grid ]],
+                            uint2 lid [[ thread_position_in_threadgroup ]])
+{
+    threadgroup atomic_uint tileClass;
+    
+    float offsets[] = { -1.282, -0.524, 0.524, 1.282 };
+    uint2 size = uint2(dstTex.get_width(), dstTex.get_height());
+    bool inside = gid.x < size.x && gid.y < size.y;
+    float2 uv = tile_texcoord(gid, size);
+    float CoC = cocTex.sample(linear_sampler, uv).r;
+    
+    if (lid.x == 0 && lid.y == 0)
+        atomic_store_explicit(&tileClass, 0, memory_order_relaxed);
+    threadgroup_barrier(mem_flags::mem_threadgroup);
+    if (inside && CoC != 0.0)
+        atomic_fetch_or_explicit(&tileClass, TILE_CLASS_DEFOCUS, memory_order_relaxed);
+    threadgroup_barrier(mem_flags::mem_threadgroup);
+    bool defocus = atomic_load_explicit(&tileClass, memory_order_relaxed) != 0;
+    if (lid.x == 0 && lid.y == 0)
+        tile_count(tileStats, tileKernel, defocus);
+    if (!inside)
+        return;
+    
+    float4 color = blurredTex.sample(linear_sampler, uv);
+    float sum = 1.0f;
+    if (defocus)
+    {
+        for (int i = 0; i < 4; i++)
+        {
+            float2 tap_uv = uv + constants.step * offsets[i] * CoC;
+            float tapCoC = cocTex.sample(linear_sampler, tap_uv).r;
+            float4 tap = blurredTex.sample(linear_sampler, tap_uv);
+            float contribution = tapCoC > CoC ? 1.0f : tapCoC;
+            color += contribution * tap;
+            sum += contribution;
+        }
+    }
+    dstTex.write(color / sum, gid);
+}
@@ -0,0 +1,3153 @@
+//
+//  ssss_tool.cpp
+//  SSSS_Metal
+//
+//  Command line companion of the app for the parts of the renderer that are
+//  plain C++: benchmarks and offline processing, runs on Linux as well.
+//
+//  See README.md for how to build it.
+//
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <glm/glm.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "CPUFrameGraph.h"
+#include "CPUPostProcess.h"
+#include "DDSFile.h"
+#include "DynamicResolution.h"
+#include "ETC2Codec.h"
+#include "FrameConstantAllocator.h"
+#include "FrameGraph.h"
+#include "Half.h"
+#include "KTXFile.h"
+#include "LightClusters.h"
+#include "MeshData.h"
+#include "MeshImporter.h"
+#include "MeshOptimizer.h"
+#include "ParallelEncoder.h"
+#include "PassConstants.h"
+#include "RenderTargetPool.h"
+#include "SSSKernel.h"
+#include "SSSSBlurSIMD.h"
+#include "SSSTransmittance.h"
+#include "ShadowAtlas.h"
+#include "ShadowCache.h"
+#include "TaskGraph.h"
+#include "ThreadPool.h"
+#include "TileClassifier.h"
+#include "VertexPacking.h"
+
+using glm::vec2;
+using glm::vec3;
+using glm::vec4;
+
+static double now_ms()
+{
+    using namespace std::chrono;
+    return duration<double, std::milli>(steady_clock::now().time_since_epoch()).count();
+}
+
+// kernel-bench [iterations]
+//******************************************************************
+static int kernel_bench(int argc, char** argv)
+{
+    int iterations = argc > 0 ? atoi(argv[0]) : 10000;
+    const vec3 strength(0.48f, 0.41f, 0.28f);
+    const vec3 falloff(1.0f, 0.37f, 0.3f);
+    const int sample_counts[] = { 7, 11, 17, 25 };
+    
+    printf("%8s %16s %16s\n", "samples", "calculate (us)", "unchanged (ns)");
+    for (int n : sample_counts)
+    {
+        std::vector<vec4> kernel;
+        double t0 = now_ms();
+        for (int i = 0; i < iterations; i++)
+        {
+            // nudge the falloff so the work can not be hoisted out of the loop
+            SSSKernel::calculate(kernel, n, strength, falloff + vec3(i * 1e-7f));
+        }
+        double t1 = now_ms();
+        
+        // the per-frame path: parameters did not change, nothing is rebuilt
+        SSSKernel cached;
+        int rebuilt = 0;
+        for (int i = 0; i < iterations; i++)
+            rebuilt += cached.update(n, strength, falloff);
+        double t2 = now_ms();
+        
+        printf("%8d %16.3f %16.3f   (rebuilt %d time(s))\n", n,
+               (t1 - t0) * 1000.0 / iterations, (t2 - t1) * 1e6 / iterations, rebuilt);
+    }
+    return 0;
+}
+
+// option parsing helpers
+//******************************************************************
+static const char* find_option(int argc, char** argv, const char* name, const char* fallback = nullptr)
+{
+    for (int i = 0; i + 1 < argc; i++)
+    {
+        if (strcmp(argv[i], name) == 0)
+            return argv[i + 1];
+    }
+    return fallback;
+}
+
+static bool has_flag(int argc, char** argv, const char* name)
+{
+    for (int i = 0; i < argc; i++)
+    {
+        if (strcmp(argv[i], name) == 0)
+            return true;
+    }
+    return false;
+}
+
+// postprocess --color c.pfm --depth d.pfm --out o.pfm [options]
+//******************************************************************
+static int postprocess(int argc, char** argv)
+{
+    const char* color_path = find_option(argc, argv, "--color");
+    const char* alpha_path = find_option(argc, argv, "--alpha");
+    const char* depth_path = find_option(argc, argv, "--depth");
+    const char* out_path = find_option(argc, argv, "--out");
+    if (!color_path || !depth_path || !out_path)
+    {
+        printf("postprocess --color main.pfm [--alpha sss_strength.pfm] --depth depth.pfm --out out.pfm\n"
+               "            [--no-ssss] [--no-bloom] [--no-dof] [--focus-distance f] [--threads n] [--repeat n]\n");
+        return 1;
+    }
+    
+    CPUImage color, depth;
+    if (!color.load_pfm(color_path, CPUPixelFormatRGBA8Unorm))
+    {
+        printf("can not read %s\n", color_path);
+        return 1;
+    }
+    if (alpha_path)
+    {
+        CPUImage alpha;
+        if (!alpha.load_pfm(alpha_path, CPUPixelFormatR32Float))
+        {
+            printf("can not read %s\n", alpha_path);
+            return 1;
+        }
+        color.set_alpha(alpha);
+    }
+    if (!depth.load_pfm(depth_path, CPUPixelFormatR32Float))
+    {
+        printf("can not read %s\n", depth_path);
+        return 1;
+    }
+    
+    CPUPostProcess::Settings settings;
+    settings.ssss_enabled = !has_flag(argc, argv, "--no-ssss");
+    settings.bloom_enabled = !has_flag(argc, argv, "--no-bloom");
+    settings.dof_enabled = !has_flag(argc, argv, "--no-dof");
+    settings.focus_distance = (float)atof(find_option(argc, argv, "--focus-distance", "0.66"));
+    
+    ThreadPool pool(atoi(find_option(argc, argv, "--threads", "0")));
+    CPUPostProcess post(pool);
+    post.set_settings(settings);
+    
+    int repeat = std::max(1, atoi(find_option(argc, argv, "--repeat", "1")));
+    CPUImage output;
+    double t0 = now_ms();
+    for (int i = 0; i < repeat; i++)
+        post.render(color, depth, output);
+    double t1 = now_ms();
+    printf("%dx%d, %d thread(s): %.2f ms per frame\n", color.width(), color.height(), pool.size(), (t1 - t0) / repeat);
+    
+    if (!output.save_pfm(out_path))
+    {
+        printf("can not write %s\n", out_path);
+        return 1;
+    }
+    return 0;
+}
+
+// diff a.pfm b.pfm
+//******************************************************************
+static int diff(int argc, char** argv)
+{
+    if (argc < 2)
+    {
+        printf("diff a.pfm b.pfm\n");
+        return 1;
+    }
+    CPUImage a, b;
+    if (!a.load_pfm(argv[0], CPUPixelFormatRGBA32Float) || !b.load_pfm(argv[1], CPUPixelFormatRGBA32Float))
+    {
+        printf("can not read inputs\n");
+        return 1;
+    }
+    if (a.width() != b.width() || a.height() != b.height())
+    {
+        printf("size mismatch: %dx%d vs %dx%d\n", a.width(), a.height(), b.width(), b.height());
+        return 1;
+    }
+    
+    double max_error = 0.0, squared_error = 0.0;
+    for (int y = 0; y < a.height(); y++)
+    {
+        for (int x = 0; x < a.width(); x++)
+        {
+            vec3 d = vec3(a.texel(x, y)) - vec3(b.texel(x, y));
+            for (int c = 0; c < 3; c++)
+            {
+                max_error = std::max(max_error, (double)fabsf(d[c]));
+                squared_error += d[c] * d[c];
+            }
+        }
+    }
+    double mse = squared_error / (3.0 * a.width() * a.height());
+    double psnr = mse > 0.0 ? 10.0 * log10(1.0 / mse) : INFINITY;
+    printf("max abs error %.6f (%.2f/255), rmse %.6f, psnr %.2f dB\n", max_error, max_error * 255.0, sqrt(mse), psnr);
+    return 0;
+}
+
+// Synthetic skin-like frame: a lit disk (the head) of radius head * h with
+// SSS strength 1, in front of a background with strength 0.
+static void make_test_frame(int w, int h, CPUImage & color, CPUImage & depth, float head = 0.4f)
+{
+    color.init(w, h, CPUPixelFormatRGBA8Unorm);
+    depth.init(w, h, CPUPixelFormatR32Float);
+    float radius = head * h;
+    for (int y = 0; y < h; y++)
+    {
+        for (int x = 0; x < w; x++)
+        {
+            float dx = (x - 0.5f * w) / radius;
+            float dy = (y - 0.5f * h) / radius;
+            float r2 = dx * dx + dy * dy;
+            bool skin = r2 < 1.0f;
+            float z = skin ? sqrtf(1.0f - r2) : 0.0f;
+            // high frequency detail so the blur has something to do
+            float detail = 0.5f + 0.5f * sinf(x * 0.7f) * cosf(y * 0.9f);
+            vec4 c = skin ? vec4(0.8f * z, 0.5f * z, 0.4f * z * detail, 1.0f) : vec4(0.2f, 0.3f, 0.5f * detail, 0.0f);
+            color.store(x, y, c);
+            depth.store(x, y, vec4(skin ? 1.5f - 0.2f * z : 10.0f));
+        }
+    }
+}
+
+// blur-bench [--threads n] [--repeat n]
+//******************************************************************
+static int blur_bench(int argc, char** argv)
+{
+    ThreadPool pool(atoi(find_option(argc, argv, "--threads", "0")));
+    int repeat = std::max(1, atoi(find_option(argc, argv, "--repeat", "3")));
+    const int sizes[][2] = { { 1920, 1080 }, { 3840, 2160 } };
+    
+    printf("SSSSBlurSIMD: %s, %d lane(s), %d thread(s)\n", SSSSBlurSIMD::isa(), SSSSBlurSIMD::lanes(), pool.size());
+    printf("%10s %8s %8s %12s %12s %9s %10s\n", "size", "follow", "path", "ms/frame", "MPixel/s", "speedup", "max diff");
+    for (auto& size : sizes)
+    {
+        CPUImage color, depth;
+        make_test_frame(size[0], size[1], color, depth);
+        double mpixels = size[0] * size[1] / 1e6;
+        
+        for (int follow = 0; follow < 2; follow++)
+        {
+            CPUImage results[2];
+            double ms[2];
+            for (int simd = 0; simd < 2; simd++)
+            {
+                CPUPostProcess::Settings settings;
+                settings.sss_follow_surface = follow != 0;
+                settings.sss_simd = simd != 0;
+                CPUPostProcess post(pool);
+                post.set_settings(settings);
+                
+                double t0 = now_ms();
+                for (int i = 0; i < repeat; i++)
+                {
+                    results[simd] = color;
+                    post.ssss(results[simd], depth);
+                }
+                ms[simd] = (now_ms() - t0) / repeat;
+            }
+            
+            float max_diff = 0.0f;
+            for (int y = 0; y < size[1]; y++)
+                for (int x = 0; x < size[0]; x++)
+                    max_diff = std::max(max_diff, glm::length(results[0].texel(x, y) - results[1].texel(x, y)));
+            
+            for (int simd = 0; simd < 2; simd++)
+            {
+                printf("%5dx%-4d %8s %8s %12.2f %12.1f %8.2fx %10s\n", size[0], size[1], follow ? "on" : "off",
+                       simd ? "simd" : "scalar", ms[simd], mpixels / (ms[simd] / 1000.0), ms[0] / ms[simd],
+                       simd ? std::to_string(max_diff * 255.0f).substr(0, 6).c_str() : "-");
+            }
+        }
+    }
+    return 0;
+}
+
+// The frame AAPLRenderer declares, shadow atlas to drawable, for
+// CPUFrameGraph on the synthetic frame of blur-bench: the passes the scene
+// would draw only stand in, the post-process passes are the CPU reference.
+struct TestFrame
+{
+    CPUImage color;
+    CPUImage depth;
+    CPUImage shadow_atlas;
+    CPUImage output;
+};
+
+static void declare_test_frame(FrameGraph & graph, CPUFrameGraph & images, CPUPostProcess & post, TestFrame & frame)
+{
+    typedef FrameGraph::PassInfo PassInfo;
+    int width = frame.color.width();
+    int height = frame.color.height();
+    TestFrame* f = &frame;
+    CPUFrameGraph* im = &images;
+    
+    const int shadow_size = ShadowAtlas::DEFAULT_SIZE;
+    const FrameGraphTextureDesc shadow_desc = { shadow_size, shadow_size, FrameGraphFormatDepth32Float };
+    FrameGraph::Resource shadow_atlas = graph.import("shadow atlas", shadow_desc);
+    if (frame.shadow_atlas.width() == 0)
+        frame.shadow_atlas.init(shadow_size, shadow_size, CPUPixelFormatR32Float);
+    images.import(shadow_atlas, frame.shadow_atlas);
+    FrameGraph::Pass shadow_pass = graph.add_pass("shadow atlas", [](const PassInfo&) {});
+    graph.write(shadow_pass, shadow_atlas, FrameGraphLoadClear);
+    
+    const FrameGraphFormat color_format = post.settings().color_format;
+    const FrameGraphTextureDesc color_desc = { width, height, color_format };
+    const FrameGraphTextureDesc linear_depth_desc = { width, height, CPUPostProcess::depth_format(color_format) };
+    const FrameGraphTextureDesc depth_desc = { width, height, FrameGraphFormatDepth32Float };
+    FrameGraph::Resource scene = graph.create("scene", color_desc);
+    FrameGraph::Resource linear_depth = graph.create("linear depth", linear_depth_desc);
+    FrameGraph::Resource depth_buffer = graph.create("depth", depth_desc);
+    FrameGraph::Pass p = graph.add_pass("main", [=](const PassInfo&) {
+        CPUPostProcess::main_pass(f->color, f->depth, color_format, im->image(scene), im->image(linear_depth));
+    });
+    graph.read(p, shadow_atlas);
+    graph.write(p, scene, FrameGraphLoadClear);
+    graph.write(p, linear_depth, FrameGraphLoadClear);
+    graph.write(p, depth_buffer, FrameGraphLoadClear);
+    p = graph.add_pass("sky", [](const PassInfo&) {});
+    graph.write(p, scene, FrameGraphLoadLoad);
+    graph.write(p, depth_buffer, FrameGraphLoadLoad);
+    
+    FrameGraph::Resource result = post.add_passes(graph, images, scene, linear_depth);
+    
+    frame.output.init(width, height, CPUPixelFormatRGBA8Unorm);
+    FrameGraph::Resource drawable = graph.import("drawable", { width, height, FrameGraphFormatBGRA8Unorm_sRGB });
+    images.import(drawable, frame.output);
+    p = graph.add_pass("present", [=](const PassInfo&) {
+        const CPUImage & src = im->image(result);
+        CPUImage & dst = im->image(drawable);
+        if (src.width() == dst.width() && src.height() == dst.height())
+        {
+            dst = src;
+            return;
+        }
+        // quad_frag samples linearly, the chain may end below the drawable's size
+        for (int y = 0; y < dst.height(); y++)
+            for (int x = 0; x < dst.width(); x++)
+                dst.store(x, y, src.sample_linear(dst.texel_center(x, y)));
+    });
+    graph.read(p, result);
+    graph.write(p, drawable);
+    graph.set_output(drawable);
+}
+
+// largest difference between two images, INFINITY if either has a NaN
+static float max_difference(const CPUImage & a, const CPUImage & b)
+{
+    float max_diff = 0.0f;
+    for (int y = 0; y < a.height(); y++)
+    {
+        for (int x = 0; x < a.width(); x++)
+        {
+            vec4 d = a.texel(x, y) - b.texel(x, y);
+            for (int c = 0; c < 4; c++)
+                max_diff = std::max(max_diff, std::isnan(d[c]) ? INFINITY : fabsf(d[c]));
+        }
+    }
+    return max_diff;
+}
+
+// framegraph-report [--width w] [--height h] [--no-ssss] [--no-bloom] [--no-dof]
+//******************************************************************
+// The renderer's frame run through CPUFrameGraph. The result must match
+// CPUPostProcess::render, which doesn't use the graph.
+static int framegraph_report(int argc, char** argv)
+{
+    int width = atoi(find_option(argc, argv, "--width", "750"));      // iPhone 6 bounds x2
+    int height = atoi(find_option(argc, argv, "--height", "1334"));
+    
+    CPUPostProcess::Settings settings;
+    settings.ssss_enabled = !has_flag(argc, argv, "--no-ssss");
+    settings.bloom_enabled = !has_flag(argc, argv, "--no-bloom");
+    settings.dof_enabled = !has_flag(argc, argv, "--no-dof");
+    ThreadPool pool(atoi(find_option(argc, argv, "--threads", "0")));
+    CPUPostProcess post(pool);
+    post.set_settings(settings);
+    
+    TestFrame frame;
+    CPUImage reference;
+    make_test_frame(width, height, frame.color, frame.depth);
+    post.render(frame.color, frame.depth, reference);
+    
+    FrameGraph graph;
+    CPUFrameGraph images;
+    RenderTargetPool targets;
+    declare_test_frame(graph, images, post, frame);
+    
+    std::string error;
+    if (!graph.compile(targets, &error))
+    {
+        printf("%s\n", error.c_str());
+        return 1;
+    }
+    images.execute(graph);
+    printf("%s", graph.report().c_str());
+    
+    float max_diff = max_difference(frame.output, reference);
+    printf("output vs CPUPostProcess::render: max difference %g\n", max_diff);
+    return max_diff == 0.0f ? 0 : 1;
+}
+
+// the pool's accounting agrees with its targets, and no two resources
+// whose lifetimes overlap share one
+static bool check_pool(const FrameGraph & graph, const RenderTargetPool & targets, std::string & problem)
+{
+    size_t live_bytes = 0;
+    for (int t = 0; t < targets.target_count(); t++)
+    {
+        if (targets.live(t))
+            live_bytes += targets.desc(t).bytes();
+        if (targets.live(t) && targets.in_use(t))
+            problem = "target " + std::to_string(t) + " still in use after compile";
+    }
+    if (live_bytes != targets.current_bytes())
+        problem = "current bytes don't add up";
+    if (targets.in_use_bytes() != 0 || targets.peak_bytes() < targets.current_bytes())
+        problem = "in use / peak bytes off";
+    for (int a = 0; a < graph.resource_count(); a++)
+    {
+        const FrameGraph::ResourceInfo & ra = graph.resource(a);
+        if (ra.physical < 0)
+            continue;
+        if (!targets.live(ra.physical) || !(targets.desc(ra.physical) == ra.desc))
+            problem = ra.name + " is in a target of another description";
+        for (int b = a + 1; b < graph.resource_count(); b++)
+        {
+            const FrameGraph::ResourceInfo & rb = graph.resource(b);
+            if (rb.physical == ra.physical && ra.first_pass <= rb.last_pass && rb.first_pass <= ra.last_pass)
+                problem = ra.name + " and " + rb.name + " overlap in target " + std::to_string(ra.physical);
+        }
+    }
+    return problem.empty();
+}
+
+// rtpool-report [--width w] [--height h] [--frames-per-step n] [--max-idle n]
+//******************************************************************
+// Frames of the renderer's graph through one RenderTargetPool while the
+// effects are toggled and the view rotates (the pool is purged then):
+// targets kept, created and dropped, pool bytes against a texture per
+// resource. Every frame is checked
+// against CPUPostProcess::render and the pool against its own accounting.
+static int rtpool_report(int argc, char** argv)
+{
+    int width = atoi(find_option(argc, argv, "--width", "750"));
+    int height = atoi(find_option(argc, argv, "--height", "1334"));
+    int frames_per_step = atoi(find_option(argc, argv, "--frames-per-step", "4"));
+    int max_idle = atoi(find_option(argc, argv, "--max-idle", "3"));
+    
+    struct Step { const char* name; bool ssss, bloom, dof, rotated; };
+    const Step steps[] = {
+        { "all",         true,  true,  true,  false },
+        { "no bloom",    true,  false, true,  false },
+        { "no dof",      true,  true,  false, false },
+        { "ssss only",   true,  false, false, false },
+        { "all",         true,  true,  true,  false },
+        { "rotated",     true,  true,  true,  true  },
+        { "rot no dof",  true,  true,  false, true  },
+    };
+    
+    ThreadPool pool(atoi(find_option(argc, argv, "--threads", "0")));
+    CPUPostProcess post(pool);
+    RenderTargetPool targets(max_idle);
+    CPUFrameGraph images;
+    FrameGraph graph;
+    TestFrame frames[2];
+    make_test_frame(width, height, frames[0].color, frames[0].depth);
+    make_test_frame(height, width, frames[1].color, frames[1].depth);
+    
+    const double MB = 1024.0 * 1024.0;
+    printf("%5s %-10s %10s %9s %12s %9s %9s %9s %8s\n", "frame", "effects", "size", "passes", "per resource",
+           "frame", "pool", "peak", "diff");
+    int frame_index = 0;
+    bool ok = true;
+    bool rotated = false;
+    for (const Step & step : steps)
+    {
+        // AAPLRenderer purges on reshape, the targets of the old size won't be asked for again
+        if (step.rotated != rotated)
+            targets.purge();
+        rotated = step.rotated;
+        
+        CPUPostProcess::Settings settings;
+        settings.ssss_enabled = step.ssss;
+        settings.bloom_enabled = step.bloom;
+        settings.dof_enabled = step.dof;
+        post.set_settings(settings);
+        TestFrame & frame = frames[step.rotated ? 1 : 0];
+        CPUImage reference;
+        post.render(frame.color, frame.depth, reference);
+        
+        for (int i = 0; i < frames_per_step; i++, frame_index++)
+        {
+            graph.clear();
+            declare_test_frame(graph, images, post, frame);
+            std::string error;
+            if (!graph.compile(targets, &error))
+            {
+                printf("%s\n", error.c_str());
+                return 1;
+            }
+            targets.end_frame();
+            images.execute(graph);
+            
+            std::string problem;
+            float max_diff = max_difference(frame.output, reference);
+            if (!check_pool(graph, targets, problem) || max_diff != 0.0f)
+                ok = false;
+            std::string size = std::to_string(frame.color.width()) + "x" + std::to_string(frame.color.height());
+            printf("%5d %-10s %10s %9d %9.2f MB %6.2f MB %6.2f MB %6.2f MB %8g %s\n", frame_index, step.name, size.c_str(),
+                   (int)graph.schedule().size(), graph.transient_bytes() / MB, graph.physical_bytes() / MB,
+                   targets.current_bytes() / MB, targets.peak_bytes() / MB, max_diff, problem.c_str());
+        }
+    }
+    printf("pool: %s\n", targets.report().c_str());
+    return ok ? 0 : 1;
+}
+
+// frame-constants-report [--frames n] [--threads n] [--frame-kb k]
+//******************************************************************
+// FrameConstantAllocator under the renderer's pattern, three slots and the
+// semaphore handing a slot back once its frame is retired: every frame
+// allocates a random mix of sizes and fills them, and a frame's data is
+// checked when it retires, so a later frame writing into a slot still in
+// flight shows up. Allocations must be aligned and stay in their slot; the
+// frames that ask for more than a slot must fail cleanly and the next one
+// must not notice. Then every worker of the pool allocates from the same
+// frame at once, and the ranges must not overlap. Prints the cost of an
+// allocation.
+static int frame_constants_report(int argc, char** argv)
+{
+    int frames = atoi(find_option(argc, argv, "--frames", "3000"));
+    size_t frame_bytes = atoi(find_option(argc, argv, "--frame-kb", "64")) * 1024;
+    const int SLOTS = 3;    // kInFlightCommandBuffers
+    
+    FrameConstantAllocator allocator;
+    const size_t alignment = FrameConstantAllocator::DEFAULT_ALIGNMENT;
+    std::vector<uint8_t> memory(FrameConstantAllocator::total_bytes(frame_bytes, SLOTS));
+    allocator.init(memory.data(), frame_bytes, SLOTS);
+    
+    struct Allocation { size_t offset, size; uint8_t value; };
+    struct Frame { int index; std::vector<Allocation> allocations; };
+    std::vector<Frame> in_flight;
+    uint32_t seed = 12345;
+    auto random = [&](uint32_t n) { seed = seed * 1664525u + 1013904223u; return (seed >> 8) % n; };
+    
+    int allocations = 0, failed = 0, expected_failed = 0, overflowed_frames = 0;
+    int corrupt = 0, misaligned = 0, outside = 0, miscounted = 0;
+    for (int f = 0; f < frames; f++)
+    {
+        // the semaphore: wait for the oldest frame, which used this slot
+        if ((int)in_flight.size() == SLOTS)
+        {
+            for (const Allocation & a : in_flight[0].allocations)
+            {
+                for (size_t i = 0; i < a.size; i++)
+                    corrupt += memory[a.offset + i] != a.value;
+            }
+            in_flight.erase(in_flight.begin());
+        }
+        const int slot = f % SLOTS;
+        allocator.begin_frame(slot);
+        
+        // mostly pass constants; every 50th frame asks for about twice a slot
+        Frame frame = { f, {} };
+        int count = f % 50 == 49 ? (int)(2 * frame_bytes / 1024) : 1 + (int)random(48);
+        size_t used = 0;
+        bool overflowed = false;
+        for (int k = 0; k < count; k++)
+        {
+            size_t size = 16 + random(f % 50 == 49 ? 2048 : 1536);
+            size_t aligned = (size + alignment - 1) / alignment * alignment;
+            size_t offset = allocator.allocate(size);
+            allocations++;
+            bool fits = used + aligned <= allocator.frame_bytes();
+            if (!fits)
+                expected_failed++;
+            if (offset == FrameConstantAllocator::INVALID_OFFSET)
+            {
+                failed++;
+                overflowed = true;
+                used = allocator.frame_bytes();     // the allocator doesn't take anything after a failure either
+                continue;
+            }
+            used += aligned;
+            misaligned += offset % alignment != 0;
+            outside += offset < slot * allocator.frame_bytes() || offset + size > (slot + 1) * allocator.frame_bytes();
+            Allocation a = { offset, size, (uint8_t)(f * 7 + k) };
+            memset(allocator.pointer(offset), a.value, size);
+            frame.allocations.push_back(a);
+        }
+        overflowed_frames += overflowed;
+        miscounted += overflowed != (allocator.overflows() > 0);
+        in_flight.push_back(frame);
+    }
+    bool ok = corrupt == 0 && misaligned == 0 && outside == 0 && failed == expected_failed &&
+              miscounted == 0 && allocator.overflowed_frames() == overflowed_frames;
+    printf("ring:       %d frames, %d allocations, %d failed (%d expected) in %d frames, "
+           "%d bytes overwritten in flight, %d misaligned, %d outside their slot\n",
+           frames, allocations, failed, expected_failed, overflowed_frames, corrupt, misaligned, outside);
+    printf("            %s\n", allocator.report().c_str());
+    
+    // every worker at once into one frame
+    ThreadPool pool(atoi(find_option(argc, argv, "--threads", "0")));
+    const int PER_JOB = 64;
+    const int jobs = (int)(frame_bytes / alignment / PER_JOB) * 2;
+    int overlaps = 0, concurrent_failed = 0, concurrent_expected = 0;
+    for (int f = 0; f < 20; f++)
+    {
+        allocator.begin_frame(f % SLOTS);
+        std::vector<size_t> offsets(jobs * PER_JOB);
+        pool.parallel_for(jobs, [&](int j) {
+            for (int k = 0; k < PER_JOB; k++)
+                offsets[j * PER_JOB + k] = allocator.allocate(alignment);
+        });
+        std::sort(offsets.begin(), offsets.end());
+        size_t slot_allocations = allocator.frame_bytes() / alignment;
+        concurrent_expected += (int)(offsets.size() - slot_allocations);
+        for (size_t i = 0; i < offsets.size(); i++)
+        {
+            if (offsets[i] == FrameConstantAllocator::INVALID_OFFSET)
+                concurrent_failed++;
+            else if (i > 0 && offsets[i] < offsets[i - 1] + alignment)
+                overlaps++;
+        }
+    }
+    ok = ok && overlaps == 0 && concurrent_failed == concurrent_expected;
+    printf("concurrent: %d workers, %d allocations per frame into %d places, %d overlapping, %d failed (%d expected)\n",
+           pool.size(), jobs * PER_JOB, (int)(allocator.frame_bytes() / alignment), overlaps, concurrent_failed,
+           concurrent_expected);
+    
+    // a frame's worth of pass constants, the renderer's case
+    const int BENCH_FRAMES = 100000;
+    const int PER_FRAME = 24;
+    double t0 = now_ms();
+    for (int f = 0; f < BENCH_FRAMES; f++)
+    {
+        allocator.begin_frame(f % SLOTS);
+        for (int k = 0; k < PER_FRAME; k++)
+            allocator.allocate(64 + k * 16);
+    }
+    double t1 = now_ms();
+    printf("cost:       %.1f ns per allocation (%d per frame)\n", (t1 - t0) * 1e6 / (BENCH_FRAMES * PER_FRAME), PER_FRAME);
+    printf("%s\n", ok ? "ok" : "FAILED");
+    return ok ? 0 : 1;
+}
+
+// encode-bench [--frames n] [--threads n] [--cost-scale s] [--sleep]
+//******************************************************************
+// ParallelEncoder on a mock of the renderer's frame: the same passes in the
+// same order (the shadow atlas, main, sky, SSS, the bloom pyramid, DOF,
+// present), each standing in for its encoding with a busy wait of about
+// what the app measures (--sleep waits instead, like a driver call, which
+// shows the overlap on a machine with fewer cores). Every pass records its
+// name into the mock command buffer of its batch. The frame is declared,
+// compiled, planned and encoded every frame like in render:, serially and
+// with 2 to 4 batches; prints ms per frame and the cuts, and checks that
+// the command buffers read in enqueue order hold the serial order on every
+// frame whichever batch is committed first.
+struct MockPass
+{
+    std::string name;
+    double ms;
+};
+
+static void mock_encode(double ms, bool sleep)
+{
+    if (sleep)
+    {
+        std::this_thread::sleep_for(std::chrono::microseconds((int)(ms * 1000.0)));
+        return;
+    }
+    double start = now_ms();
+    while (now_ms() - start < ms)
+        ;
+}
+
+static int encode_bench(int argc, char** argv)
+{
+    int frames = atoi(find_option(argc, argv, "--frames", "200"));
+    double cost_scale = atof(find_option(argc, argv, "--cost-scale", "1"));
+    bool sleep = has_flag(argc, argv, "--sleep");
+    ThreadPool pool(atoi(find_option(argc, argv, "--threads", "0")));
+    
+    // encoding times of the app's passes, in ms (a draw and its state for
+    // the scene passes, a full screen quad for the post-process)
+    std::vector<MockPass> passes = {
+        { "shadow atlas", 0.45 },
+        { "main", 0.30 }, { "sky", 0.06 },
+        { "ssss horizontal", 0.05 }, { "ssss vertical", 0.05 },
+        { "bloom glare", 0.04 },
+    };
+    for (int i = 1; i < 6; i++)
+        passes.push_back({ "bloom down " + std::to_string(i), 0.03 });
+    for (int i = 4; i >= 0; i--)
+        passes.push_back({ "bloom up " + std::to_string(i), 0.03 });
+    passes.push_back({ "bloom combine", 0.04 });
+    passes.push_back({ "dof coc", 0.03 });
+    passes.push_back({ "dof horizontal", 0.03 });
+    passes.push_back({ "dof vertical", 0.03 });
+    passes.push_back({ "present", 0.02 });
+    double total_ms = 0.0;
+    for (MockPass & p : passes)
+        total_ms += p.ms *= cost_scale;
+    
+    // mock command buffers: the names of the passes encoded into them, in order
+    typedef std::vector<std::string> MockCommandBuffer;
+    
+    // the shadow atlas and the drawable are imported, main reads the atlas,
+    // every later pass the target of the one before
+    auto declare = [&](FrameGraph & graph, std::vector<MockCommandBuffer>* buffers)
+    {
+        const FrameGraphTextureDesc desc = { 750, 1334, FrameGraphFormatRGBA8Unorm };
+        const FrameGraphTextureDesc shadow_desc = { ShadowAtlas::DEFAULT_SIZE, ShadowAtlas::DEFAULT_SIZE,
+                                                    FrameGraphFormatDepth32Float };
+        std::vector<FrameGraph::Resource> shadows;
+        FrameGraph::Resource stage = -1;
+        for (size_t i = 0; i < passes.size(); i++)
+        {
+            const MockPass & p = passes[i];
+            FrameGraph::Pass pass = graph.add_pass(p.name, [=](const FrameGraph::PassInfo & info) {
+                mock_encode(p.ms, sleep);
+                (*buffers)[info.batch].push_back(p.name);
+            });
+            bool shadow = p.name.compare(0, 6, "shadow") == 0;
+            bool present = i + 1 == passes.size();
+            FrameGraph::Resource out = shadow ? graph.import(p.name, shadow_desc) :
+                                       present ? graph.import("drawable", desc) : graph.create(p.name, desc);
+            if (shadow)
+                shadows.push_back(out);
+            else if (stage < 0)
+            {
+                for (FrameGraph::Resource s : shadows)
+                    graph.read(pass, s);
+            }
+            else
+                graph.read(pass, stage);
+            graph.write(pass, out, FrameGraphLoadClear);
+            if (!shadow)
+                stage = out;
+        }
+        graph.set_output(stage);
+    };
+    
+    printf("%d passes, %.3f ms of encoding per frame, %d workers%s\n", (int)passes.size(), total_ms, pool.size(),
+           sleep ? " (sleeping)" : "");
+    bool ok = true;
+    double serial_ms = 0.0;
+    for (int max_batches = 1; max_batches <= 4; max_batches++)
+    {
+        FrameGraph graph;
+        RenderTargetPool targets;
+        ParallelEncoder encoder(max_batches);
+        std::vector<MockCommandBuffer> buffers;
+        std::mutex commit_mutex;
+        std::vector<int> commits;
+        int misordered = 0, out_of_order_commits = 0;
+        double wall = 0.0, critical = 0.0;
+        const int WARMUP = 10;    // the first plans use DEFAULT_PASS_MS
+        for (int f = 0; f < WARMUP + frames; f++)
+        {
+            graph.clear();
+            declare(graph, &buffers);
+            std::string error;
+            if (!graph.compile(targets, &error))
+            {
+                printf("%s\n", error.c_str());
+                return 1;
+            }
+            targets.end_frame();
+            // the backend makes and enqueues the command buffers before encoding
+            buffers.assign(encoder.plan(graph), MockCommandBuffer());
+            commits.clear();
+            double start = now_ms();
+            encoder.execute(graph, pool, [&](int batch, const std::function<void()> & encode) {
+                encode();
+                std::lock_guard<std::mutex> lock(commit_mutex);
+                commits.push_back(batch);
+            });
+            double ms = now_ms() - start;
+            
+            // what the GPU runs: the buffers in enqueue order
+            std::vector<std::string> submitted;
+            for (const MockCommandBuffer & buffer : buffers)
+                submitted.insert(submitted.end(), buffer.begin(), buffer.end());
+            std::vector<std::string> serial;
+            for (FrameGraph::Pass pass : graph.schedule())
+                serial.push_back(graph.pass(pass).name);
+            misordered += submitted != serial;
+            out_of_order_commits += !std::is_sorted(commits.begin(), commits.end());
+            if (f >= WARMUP)
+            {
+                wall += ms;
+                critical += encoder.critical_ms();
+            }
+        }
+        wall /= frames;
+        critical /= frames;
+        if (max_batches == 1)
+            serial_ms = wall;
+        ok = ok && misordered == 0;
+        printf("%d batches: %.3f ms per frame (%.2fx), largest batch %.3f ms, %d frames misordered, "
+               "%d committed out of order\n", (int)encoder.batches().size(), wall, serial_ms / wall, critical, misordered,
+               out_of_order_commits);
+        printf("           %s\n", encoder.report(graph).c_str());
+    }
+    printf("%s\n", ok ? "ok" : "FAILED");
+    return ok ? 0 : 1;
+}
+
+// shadow-cache-report [--frames n]
+//******************************************************************
+// ShadowCache over scripted frames of the renderer's three lights: lights
+// and head still while the camera orbits, one light animated, every light
+// animated under a budget of one and two maps per frame, the head moved
+// once, the preset reloaded, a frame dropped before it was encoded. The
+// shadow maps are simulated by the transforms they were last rendered
+// with: without a budget no map may be left stale after a frame, with one
+// no dirty map may wait longer than its turn, and no map may be rendered
+// again with the transforms it already holds. Prints the
+// maps rendered and skipped against the expected counts, and the shadow
+// map bytes written per frame.
+struct ShadowScenario
+{
+    const char* name;
+    int max_updates;
+    bool animate[3];        // the light turns a little every frame
+    int move_head_at;       // frame, -1 for never
+    int reload_every;       // frames between invalidate_all(), 0 for never
+    int drop_at;            // frame not encoded, -1 for none
+};
+
+static int shadow_cache_report(int argc, char** argv)
+{
+    int frames = atoi(find_option(argc, argv, "--frames", "600"));
+    const int LIGHTS = 3;                   // N_LIGHTS
+    const size_t MAP_BYTES = 1024 * 1024 * 4;     // ShadowMap::SHADOW_MAP_SIZE, Depth32Float
+    
+    ShadowScenario scenarios[] = {
+        { "still, camera orbiting",   0, { false, false, false }, -1,   0,  -1 },
+        { "light 0 animated",         0, { true,  false, false }, -1,   0,  -1 },
+        { "all animated",             0, { true,  true,  true  }, -1,   0,  -1 },
+        { "all animated, budget 1",   1, { true,  true,  true  }, -1,   0,  -1 },
+        { "all animated, budget 2",   2, { true,  true,  true  }, -1,   0,  -1 },
+        { "head moved once",          0, { false, false, false }, frames / 2, 0, -1 },
+        { "preset reloaded",          0, { false, false, false }, -1, 200,  -1 },
+        { "light 1 moved, dropped",   0, { false, false, false }, -1,   0,  10 },
+    };
+    
+    printf("%-24s %9s %8s %8s %6s %10s %10s\n", "", "rendered", "skipped", "deferred", "stale", "expected", "MB/frame");
+    bool ok = true;
+    for (const ShadowScenario & s : scenarios)
+    {
+        ShadowCache cache(LIGHTS, s.max_updates);
+        glm::mat4 model = glm::scale(glm::mat4(1.0f), vec3(0.7f)) * glm::translate(glm::mat4(1.0f), vec3(0.0f, 0.2f, 0.425f));
+        glm::mat4 projection = glm::perspective(45.0f * 3.1415926f / 180.0f, 1.0f, 0.1f, 10.0f);
+        float angle[LIGHTS] = { 0.0f, 2.1f, 4.2f };
+        glm::mat4 map_view_projection[LIGHTS], map_model[LIGHTS];
+        bool map_rendered[LIGHTS] = { false, false, false };
+        int left_stale = 0, rendered_again = 0;
+        int expected = 0;
+        for (int f = 0; f < frames; f++)
+        {
+            bool reload = s.reload_every > 0 && f > 0 && f % s.reload_every == 0;
+            if (reload)
+                cache.invalidate_all();
+            if (f == s.move_head_at)
+                model = glm::translate(glm::mat4(1.0f), vec3(0.0f, 0.01f, 0.0f)) * model;
+            if (s.drop_at >= 0 && f == s.drop_at)
+                angle[1] += 0.5f;
+            
+            glm::mat4 view_projection[LIGHTS];
+            int changed = 0;
+            for (int i = 0; i < LIGHTS; i++)
+            {
+                if (s.animate[i])
+                    angle[i] += 0.01f;
+                vec3 eye(2.0f * cosf(angle[i]), 1.0f, 2.0f * sinf(angle[i]));
+                view_projection[i] = projection * glm::lookAt(eye, vec3(0.0f), vec3(0.0f, 1.0f, 0.0f));
+                changed += !map_rendered[i] || reload || map_view_projection[i] != view_projection[i] || map_model[i] != model;
+            }
+            // what the maps need: the changed ones, as the budget allows; the first frame renders them all
+            expected += f == 0 ? LIGHTS : s.max_updates > 0 ? std::min(changed, s.max_updates) : changed;
+            
+            cache.begin_frame(view_projection, model);
+            bool dropped = f == s.drop_at;
+            for (int i = 0; i < LIGHTS; i++)
+            {
+                if (!cache.needs_update(i) || dropped)
+                    continue;
+                rendered_again += map_rendered[i] && !reload && map_view_projection[i] == view_projection[i] &&
+                                  map_model[i] == model;
+                map_view_projection[i] = view_projection[i];
+                map_model[i] = model;
+                map_rendered[i] = true;
+            }
+            if (dropped)
+                continue;
+            cache.end_frame();
+            for (int i = 0; i < LIGHTS; i++)
+                left_stale += s.max_updates == 0 && (map_view_projection[i] != view_projection[i] || map_model[i] != model);
+        }
+        // in turn, a dirty map waits for the others at most once
+        int max_stale = s.max_updates > 0 ? (LIGHTS + s.max_updates - 1) / s.max_updates - 1 : 0;
+        bool good = left_stale == 0 && rendered_again == 0 && cache.rendered() == expected &&
+                    cache.max_stale_frames() <= max_stale;
+        ok = ok && good;
+        printf("%-24s %9d %8d %8d %6d %10d %10.1f%s\n", s.name, cache.rendered(), cache.skipped(), cache.deferred(),
+               cache.max_stale_frames(), expected, (double)cache.rendered() * MAP_BYTES / frames / (1024.0 * 1024.0),
+               good ? "" : "  FAILED");
+        if (left_stale || rendered_again)
+            printf("    %d maps left stale, %d rendered again unchanged\n", left_stale, rendered_again);
+    }
+    printf("without the cache: %d maps, %.1f MB per frame\n", LIGHTS * frames, LIGHTS * MAP_BYTES / (1024.0 * 1024.0));
+    printf("%s\n", ok ? "ok" : "FAILED");
+    return ok ? 0 : 1;
+}
+
+// shadow-atlas-report [--frames n] [--trials n]
+//******************************************************************
+// ShadowAtlas: random sets of power of two squares packed into the atlas
+// must stay in it, at multiples of their size, without overlapping, and
+// a set larger than the atlas must be refused. The importance of the
+// renderer's three lights while the camera orbits and zooms on the head,
+// with the layout changes the hysteresis saves over sizing every frame
+// from scratch. Then 3 to 300 lights of random importance: every light
+// gets a map up to (size / min size)^2 of them, a more important light
+// never a smaller one, and the update time.
+static int shadow_atlas_report(int argc, char** argv)
+{
+    int frames = atoi(find_option(argc, argv, "--frames", "720"));
+    int trials = atoi(find_option(argc, argv, "--trials", "2000"));
+    const int SIZE = ShadowAtlas::DEFAULT_SIZE;
+    const int MIN = ShadowAtlas::MIN_SIZE;
+    const int MAX = ShadowAtlas::MAX_SIZE;
+    
+    uint32_t seed = 1;
+    auto next = [&]() { seed = seed * 1664525u + 1013904223u; return (seed >> 8) / 16777216.0f; };
+    auto is_pow2 = [](int x) { return x > 0 && (x & (x - 1)) == 0; };
+    
+    // in the atlas, aligned to their size and apart; the mapped ones between min and max
+    auto valid = [&](const std::vector<ShadowAtlas::Rect> & rects, int size, int min_size, int max_size) -> bool
+    {
+        for (size_t i = 0; i < rects.size(); i++)
+        {
+            const ShadowAtlas::Rect & a = rects[i];
+            if (a.size == 0)
+                continue;
+            if (!is_pow2(a.size) || a.size < min_size || a.size > max_size || a.x % a.size || a.y % a.size ||
+                a.x < 0 || a.y < 0 || a.x + a.size > size || a.y + a.size > size)
+                return false;
+            for (size_t j = 0; j < i; j++)
+            {
+                const ShadowAtlas::Rect & b = rects[j];
+                if (b.size > 0 && a.x < b.x + b.size && b.x < a.x + a.size && a.y < b.y + b.size && b.y < a.y + a.size)
+                    return false;
+            }
+        }
+        return true;
+    };
+    
+    bool ok = true;
+    int packed = 0, refused = 0, bad = 0;
+    for (int t = 0; t < trials; t++)
+    {
+        std::vector<int> sizes;
+        double area = 0.0;
+        int n = 1 + (int)(next() * 64);
+        for (int i = 0; i < n; i++)
+        {
+            int s = MIN << (int)(next() * next() * 4);     // mostly small, so most sets fit
+            sizes.push_back(s);
+            area += (double)s * s;
+        }
+        std::vector<ShadowAtlas::Rect> rects;
+        bool fits = ShadowAtlas::pack(sizes, SIZE, rects);
+        bool good = fits == (area <= (double)SIZE * SIZE);
+        if (fits)
+        {
+            for (int i = 0; i < n; i++)
+                good = good && rects[i].size == sizes[i];
+            good = good && valid(rects, SIZE, MIN, MAX);
+        }
+        packed += fits;
+        refused += !fits;
+        bad += !good;
+    }
+    ok = ok && bad == 0;
+    printf("pack: %d sets packed, %d refused as too large, %d wrong%s\n\n", packed, refused, bad, bad ? "  FAILED" : "");
+    
+    // the preset's lights around the head, the camera orbiting it while zooming in and out
+    const int LIGHTS = 3;                   // N_LIGHTS
+    const float PI_F = 3.1415926536f;
+    vec3 head_center(0.0f, 0.14f, 0.3f);
+    float head_radius = 0.35f;
+    ShadowAtlas::Light lights[LIGHTS];
+    for (int i = 0; i < LIGHTS; i++)
+    {
+        float a = 2.1f * i;
+        vec3 eye = head_center + vec3(2.0f * cosf(a), 0.5f + 0.3f * i, 2.0f * sinf(a));
+        lights[i] = { eye, glm::normalize(head_center - eye), 45.0f * PI_F / 180.0f, 10.0f, 1.0f / 128.0f, 1.0f - 0.3f * i };
+    }
+    ShadowAtlas atlas;
+    int naive_changes = 0;
+    std::vector<int> naive_sizes(LIGHTS, 0);
+    float lo[LIGHTS], hi[LIGHTS];
+    for (int i = 0; i < LIGHTS; i++)
+        lo[i] = 1e9f, hi[i] = 0.0f;
+    int invalid_frames = 0;
+    for (int f = 0; f < frames; f++)
+    {
+        float t = f / 60.0f;
+        float distance = 3.5f + 2.5f * sinf(0.7f * t);
+        vec3 camera = head_center + vec3(distance * cosf(0.5f * t), 0.2f, distance * sinf(0.5f * t));
+        std::vector<float> importance(LIGHTS);
+        bool naive_changed = false;
+        for (int i = 0; i < LIGHTS; i++)
+        {
+            importance[i] = ShadowAtlas::importance(lights[i], head_center, head_radius, camera, 20.0f * PI_F / 180.0f, 1334);
+            lo[i] = std::min(lo[i], importance[i]);
+            hi[i] = std::max(hi[i], importance[i]);
+            int s = MIN;
+            while (s < importance[i] && s < MAX)
+                s *= 2;
+            naive_changed = naive_changed || s != naive_sizes[i];
+            naive_sizes[i] = s;
+        }
+        naive_changes += naive_changed;
+        atlas.update(importance);
+        std::vector<ShadowAtlas::Rect> rects;
+        for (int i = 0; i < LIGHTS; i++)
+            rects.push_back(atlas.rect(i));
+        invalid_frames += !valid(rects, SIZE, MIN, MAX);
+    }
+    bool stable = invalid_frames == 0 && atlas.changes() < naive_changes;
+    ok = ok && stable;
+    printf("%d frames orbiting, camera 1 to 6 from the head:\n", frames);
+    for (int i = 0; i < LIGHTS; i++)
+        printf("    light %d importance %.0f to %.0f texels\n", i, lo[i], hi[i]);
+    printf("    layout changes %d, %d sizing every frame from scratch, %d invalid frames%s\n", atlas.changes(),
+           naive_changes, invalid_frames, stable ? "" : "  FAILED");
+    printf("    last frame: %s\n", atlas.report().c_str());
+    
+    // out of the cone, and past the far plane: no map
+    ShadowAtlas::Light away = lights[0];
+    away.direction = -away.direction;
+    ShadowAtlas::Light far = lights[0];
+    far.far_plane = 0.5f;
+    vec3 camera = head_center + vec3(0.0f, 0.0f, 2.0f);
+    float near_importance = ShadowAtlas::importance(lights[0], head_center, head_radius, camera, 0.35f, 1334);
+    float far_importance = ShadowAtlas::importance(lights[0], head_center, head_radius, camera * 3.0f, 0.35f, 1334);
+    bool culled = ShadowAtlas::importance(away, head_center, head_radius, camera, 0.35f, 1334) == 0.0f &&
+                  ShadowAtlas::importance(far, head_center, head_radius, camera, 0.35f, 1334) == 0.0f &&
+                  near_importance > far_importance;
+    ok = ok && culled;
+    printf("    facing away and past the far plane get 0, closer gets more: %s\n\n", culled ? "yes" : "no  FAILED");
+    
+    // many lights of random importance; the ones past the atlas' room get no rect, and a
+    // scale of 0, which main_pass_frag takes for unshadowed rather than sampling another map
+    printf("%8s %8s %8s %8s %8s %10s %10s\n", "lights", "mapped", "no rect", "used", "smallest", "update us", "");
+    for (int n : { 3, 8, 32, 256, 300 })
+    {
+        std::vector<float> importance(n);
+        for (float & v : importance)
+            v = MIN * 0.5f + next() * MAX * 1.5f;
+        ShadowAtlas many;
+        const int REPEAT = 200;
+        double start = now_ms();
+        for (int r = 0; r < REPEAT; r++)
+        {
+            ShadowAtlas fresh;
+            fresh.update(importance);
+        }
+        double us = (now_ms() - start) * 1000.0 / REPEAT;
+        many.update(importance);
+        
+        std::vector<ShadowAtlas::Rect> rects;
+        int mapped = 0, smallest = MAX;
+        bool ordered = true, scaled = true;
+        for (int i = 0; i < n; i++)
+        {
+            const ShadowAtlas::Rect & r = many.rect(i);
+            rects.push_back(r);
+            mapped += r.size > 0;
+            if (r.size > 0)
+                smallest = std::min(smallest, r.size);
+            // uv 0 to 1 covers the rect exactly, or the scale is 0 with no rect
+            vec4 so = many.scale_offset(i);
+            scaled = scaled && (r.size > 0 ? so.x > 0.0f && so.z * SIZE == r.x && so.w * SIZE == r.y &&
+                                             (so.x + so.z) * SIZE == r.x + r.size && (so.y + so.w) * SIZE == r.y + r.size :
+                                             so.x == 0.0f && so.y == 0.0f);
+            for (int j = 0; j < i; j++)
+            {
+                const ShadowAtlas::Rect & a = many.rect(i);
+                const ShadowAtlas::Rect & b = many.rect(j);
+                ordered = ordered && (importance[i] > importance[j] ? a.size >= b.size :
+                                      importance[i] < importance[j] ? a.size <= b.size : true);
+            }
+        }
+        int capacity = (SIZE / MIN) * (SIZE / MIN);
+        bool good = valid(rects, SIZE, MIN, MAX) && ordered && scaled && mapped == std::min(n, capacity);
+        ok = ok && good;
+        printf("%8d %8d %8d %7.0f%% %8d %10.2f %10s\n", n, mapped, n - mapped, 100.0 * many.used(), smallest, us,
+               good ? "" : "FAILED");
+    }
+    printf("%s\n", ok ? "ok" : "FAILED");
+    return ok ? 0 : 1;
+}
+
+// light-cluster-bench [--threads n] [--repeat n] [--points n]
+//******************************************************************
+// LightClusters on the preset's three lights around the head and on 32
+// and 256 spot lights of random range, angle and direction scattered in
+// front of the camera. Every cluster list is checked against points of
+// the frustum: a light that lights a point, by the main pass's range and
+// spot tests, must be in the list of the point's cluster, and the build
+// on one thread must match the build on the pool. Prints the build time
+// on one thread and on the pool, and the lights a fragment loops over
+// against all of them.
+static int light_cluster_bench(int argc, char** argv)
+{
+    int repeat = std::max(1, atoi(find_option(argc, argv, "--repeat", "50")));
+    int points = atoi(find_option(argc, argv, "--points", "200000"));
+    ThreadPool pool(atoi(find_option(argc, argv, "--threads", "0")));
+    const float PI_F = 3.1415926536f;
+    const float FOV = 20.0f * PI_F / 180.0f;    // CAMERA_FOV
+    const float ASPECT = 750.0f / 1334.0f;
+    const float NEAR = 0.1f, FAR = 100.0f;      // CAMERA_NEAR, CAMERA_FAR
+    
+    uint32_t seed = 1;
+    auto next = [&]() { seed = seed * 1664525u + 1013904223u; return (seed >> 8) / 16777216.0f; };
+    
+    // the camera looks down -z at the head from 3 away
+    vec3 head(0.0f, 0.14f, 0.3f);
+    glm::mat4 view = glm::lookAt(head + vec3(0.0f, 0.0f, 3.0f), head, vec3(0.0f, 1.0f, 0.0f));
+    glm::mat4 view_inverse = glm::inverse(view);
+    
+    struct Scene { const char* name; std::vector<LightClusters::Light> lights; };
+    std::vector<Scene> scenes(3);
+    scenes[0].name = "preset";
+    for (int i = 0; i < 3; i++)
+    {
+        // Light::init(): 45 degree cones 2 away, reaching 10; the shader gets lookAt - eye, 2 long
+        float a = 2.1f * i;
+        vec3 eye = head + vec3(2.0f * cosf(a), 0.5f, 2.0f * sinf(a));
+        scenes[0].lights.push_back({ eye, head - eye, cosf(0.5f * 45.0f * PI_F / 180.0f), 10.0f });
+    }
+    for (int k = 1; k < 3; k++)
+    {
+        int n = k == 1 ? 32 : 256;
+        scenes[k].name = k == 1 ? "32 scattered" : "256 scattered";
+        for (int i = 0; i < n; i++)
+        {
+            vec3 position = head + vec3(-4.0f + 8.0f * next(), -2.0f + 4.0f * next(), -12.0f + 14.0f * next());
+            vec3 direction = glm::normalize(vec3(next() - 0.5f, next() - 0.5f, next() - 0.5f) + vec3(1e-3f));
+            float angle = (15.0f + 60.0f * next()) * PI_F / 180.0f;
+            float length = 0.5f + 1.5f * next();
+            scenes[k].lights.push_back({ position, direction * length, cosf(angle), 1.0f + 2.0f * next() });
+        }
+    }
+    
+    printf("%d x %d x %d clusters, %d workers\n", LightClusters::TILES_X, LightClusters::TILES_Y, LightClusters::SLICES,
+           pool.size());
+    printf("%-14s %7s %9s %9s %9s %8s %9s %7s %7s\n", "", "lights", "1 thr ms", "pool ms", "entries", "max", "per frag",
+           "missed", "");
+    bool ok = true;
+    for (const Scene & scene : scenes)
+    {
+        LightClusters serial, parallel;
+        double start = now_ms();
+        for (int r = 0; r < repeat; r++)
+            serial.build(scene.lights, view, FOV, ASPECT, NEAR, FAR);
+        double serial_ms = (now_ms() - start) / repeat;
+        start = now_ms();
+        for (int r = 0; r < repeat; r++)
+            parallel.build(scene.lights, view, FOV, ASPECT, NEAR, FAR, &pool);
+        double pool_ms = (now_ms() - start) / repeat;
+        
+        bool same = serial.indices() == parallel.indices();
+        for (int c = 0; c < LightClusters::COUNT && same; c++)
+            same = serial.clusters()[c].offset == parallel.clusters()[c].offset &&
+                   serial.clusters()[c].count == parallel.clusters()[c].count;
+        
+        // points of the frustum up to 30 away, log spaced in depth like the slices
+        float tan_y = tanf(0.5f * FOV), tan_x = tan_y * ASPECT;
+        int missed = 0;
+        double looped = 0.0;
+        for (int p = 0; p < points; p++)
+        {
+            glm::vec2 uv(next(), next());
+            float depth = NEAR * powf(300.0f, next());
+            vec3 in_view((2.0f * uv.x - 1.0f) * tan_x * depth, (1.0f - 2.0f * uv.y) * tan_y * depth, -depth);
+            vec3 world = vec3(view_inverse * glm::vec4(in_view, 1.0f));
+            const LightClusters::Cluster & cluster = parallel.clusters()[parallel.find(uv, depth)];
+            looped += cluster.count;
+            for (int i = 0; i < (int)scene.lights.size(); i++)
+            {
+                const LightClusters::Light & light = scene.lights[i];
+                vec3 L = light.position - world;
+                float dist = glm::length(L);
+                // main_pass_frag: the attenuation curve is 0 from the far plane on, the spot test is strict
+                bool lit = dist < light.range && glm::dot(light.direction, -L / dist) > light.falloff_start;
+                if (!lit)
+                    continue;
+                const uint16_t* first = parallel.indices().data() + cluster.offset;
+                missed += std::find(first, first + cluster.count, (uint16_t)i) == first + cluster.count;
+            }
+        }
+        bool good = same && missed == 0 && parallel.dropped() == 0;
+        ok = ok && good;
+        printf("%-14s %7d %9.3f %9.3f %9d %8d %9.2f %7d %7s\n", scene.name, parallel.light_count(), serial_ms, pool_ms,
+               (int)parallel.indices().size(), parallel.max_count(), points > 0 ? looped / points : 0.0, missed,
+               good ? "" : "FAILED");
+        if (!same)
+            printf("    the pool's clusters differ from the serial build\n");
+    }
+    printf("%s\n", ok ? "ok" : "FAILED");
+    return ok ? 0 : 1;
+}
+
+// Spread (standard deviation in pixels, along x and y) of the SSS blur of
+// a point on a flat skin plane of size w x h.
+static vec2 ssss_spread(CPUPostProcess & post, int w, int h)
+{
+    CPUImage color(w, h, CPUPixelFormatRGBA32Float);
+    CPUImage depth(w, h, CPUPixelFormatR32Float);
+    for (int y = 0; y < h; y++)
+    {
+        for (int x = 0; x < w; x++)
+        {
+            bool center = x == w / 2 && y == h / 2;
+            color.store(x, y, vec4(center ? 1.0f : 0.0f, 0.0f, 0.0f, 1.0f));
+            depth.store(x, y, vec4(1.0f / 1.5f));     // 1 / linear depth, like the main pass writes it
+        }
+    }
+    post.ssss(color, depth);
+    
+    double sum = 0.0, xx = 0.0, yy = 0.0;
+    for (int y = 0; y < h; y++)
+    {
+        for (int x = 0; x < w; x++)
+        {
+            double v = color.texel(x, y).x;
+            sum += v;
+            xx += v * (x - w / 2) * (x - w / 2);
+            yy += v * (y - h / 2) * (y - h / 2);
+        }
+    }
+    return vec2(sqrt(xx / sum), sqrt(yy / sum));
+}
+
+// resize-report [--width w] [--height h] [--frames n]
+//******************************************************************
+// The renderer's resize protocol over a sequence of drawable sizes
+// (repeated, rotated, a live resize, back): a reshape to the current size
+// does nothing, any other purges the pool. Prints the targets each event
+// creates and the pool bytes; every frame is checked against
+// CPUPostProcess::render at its size, so no pass may keep a stale size.
+// Then the SSS blur of a point along both axes, which must not depend on
+// the orientation.
+static int resize_report(int argc, char** argv)
+{
+    int width = atoi(find_option(argc, argv, "--width", "750"));
+    int height = atoi(find_option(argc, argv, "--height", "1334"));
+    int frames = atoi(find_option(argc, argv, "--frames", "3"));
+    
+    struct Event { const char* name; int width, height; };
+    std::vector<Event> events = {
+        { "start",      width,  height },
+        { "same size",  width,  height },
+        { "rotate",     height, width },
+        { "rotate",     width,  height },
+    };
+    for (int i = 1; i <= 4; i++)    // a live resize, a few steps narrower
+        events.push_back({ "live resize", width - i * width / 8, height });
+    events.push_back({ "back", width, height });
+    
+    ThreadPool pool(atoi(find_option(argc, argv, "--threads", "0")));
+    CPUPostProcess post(pool);
+    RenderTargetPool targets;
+    CPUFrameGraph images;
+    FrameGraph graph;
+    
+    const double MB = 1024.0 * 1024.0;
+    printf("%-12s %10s %8s %8s %10s %10s %8s\n", "event", "size", "resized", "created", "pool", "peak", "diff");
+    int current_width = 0, current_height = 0;
+    bool ok = true;
+    for (const Event & event : events)
+    {
+        // AAPLRenderer reshape:
+        bool resized = event.width != current_width || event.height != current_height;
+        if (resized)
+        {
+            current_width = event.width;
+            current_height = event.height;
+            targets.purge();
+        }
+        
+        TestFrame frame;
+        CPUImage reference;
+        make_test_frame(event.width, event.height, frame.color, frame.depth);
+        post.render(frame.color, frame.depth, reference);
+        
+        // targets live after the event that were not live (with that description) before
+        std::vector<FrameGraphTextureDesc> before(targets.target_count());
+        for (int t = 0; t < targets.target_count(); t++)
+            before[t] = targets.live(t) ? targets.desc(t) : FrameGraphTextureDesc();
+        
+        float max_diff = 0.0f;
+        std::string problem;
+        for (int i = 0; i < frames; i++)
+        {
+            graph.clear();
+            declare_test_frame(graph, images, post, frame);
+            std::string error;
+            if (!graph.compile(targets, &error))
+            {
+                printf("%s\n", error.c_str());
+                return 1;
+            }
+            targets.end_frame();
+            images.execute(graph);
+            max_diff = std::max(max_diff, max_difference(frame.output, reference));
+            check_pool(graph, targets, problem);
+        }
+        int created = 0;
+        for (int t = 0; t < targets.target_count(); t++)
+            created += targets.live(t) && (t >= (int)before.size() || !(before[t] == targets.desc(t))) ? 1 : 0;
+        
+        ok = ok && problem.empty() && max_diff == 0.0f && (resized || created == 0);
+        std::string size = std::to_string(event.width) + "x" + std::to_string(event.height);
+        printf("%-12s %10s %8s %8d %7.2f MB %7.2f MB %8g %s\n", event.name, size.c_str(), resized ? "yes" : "no", created,
+               targets.current_bytes() / MB, targets.peak_bytes() / MB, max_diff, problem.c_str());
+    }
+    printf("pool: %s\n", targets.report().c_str());
+    
+    // small planes: the spread only depends on the height (the fov)
+    printf("\nSSS spread of a point, pixels (x / y):\n");
+    const int w = 192, h = 108;
+    for (int simd = 0; simd < 2; simd++)
+    {
+        CPUPostProcess::Settings settings;
+        settings.sss_simd = simd == 1;
+        settings.sss_width *= 8.0f;     // a few pixels wide, so the spread is measurable at this size
+        post.set_settings(settings);
+        vec2 landscape = ssss_spread(post, w, h);
+        vec2 portrait = ssss_spread(post, h, w);
+        printf("%-10s %dx%d: %.2f / %.2f   %dx%d: %.2f / %.2f\n", simd ? "simd" : "reference",
+               w, h, landscape.x, landscape.y, h, w, portrait.x, portrait.y);
+        // the vertical spread is the reference, both axes and both orientations follow it
+        float tolerance = 0.05f * landscape.y;
+        ok = ok && fabsf(landscape.x - landscape.y) < tolerance;
+        ok = ok && fabsf(portrait.x * h / w - landscape.x) < tolerance;
+    }
+    return ok ? 0 : 1;
+}
+
+// ssss-mask-report [--color c.pfm [--alpha a.pfm] --depth d.pfm] [--repeat n]
+//******************************************************************
+// The SSS passes with and without the skin mask (SeparableSSS's stencil):
+// fraction of the pixels skipped, time of both blur paths, and the largest
+// difference the mask makes. Runs on a captured main pass, or on head
+// disks framed like the presets (far, medium, close up) without one.
+static int ssss_mask_report(int argc, char** argv)
+{
+    int width = atoi(find_option(argc, argv, "--width", "750"));
+    int height = atoi(find_option(argc, argv, "--height", "1334"));
+    int repeat = std::max(1, atoi(find_option(argc, argv, "--repeat", "3")));
+    const char* color_path = find_option(argc, argv, "--color");
+    const char* alpha_path = find_option(argc, argv, "--alpha");
+    const char* depth_path = find_option(argc, argv, "--depth");
+    
+    struct Scene { std::string name; CPUImage color, depth; };
+    std::vector<Scene> scenes;
+    if (color_path && depth_path)
+    {
+        scenes.resize(1);
+        Scene & scene = scenes[0];
+        scene.name = "capture";
+        CPUImage alpha;
+        if (!scene.color.load_pfm(color_path, CPUPixelFormatRGBA8Unorm) || !scene.depth.load_pfm(depth_path, CPUPixelFormatR32Float) ||
+            (alpha_path && !alpha.load_pfm(alpha_path, CPUPixelFormatR32Float)))
+        {
+            printf("can not read the capture\n");
+            return 1;
+        }
+        if (alpha_path)
+            scene.color.set_alpha(alpha);
+    }
+    else
+    {
+        const char* names[] = { "far", "medium", "close up" };
+        const float heads[] = { 0.15f, 0.3f, 0.45f };
+        scenes.resize(3);
+        for (int i = 0; i < 3; i++)
+        {
+            scenes[i].name = names[i];
+            make_test_frame(width, height, scenes[i].color, scenes[i].depth, heads[i]);
+        }
+    }
+    
+    ThreadPool pool(atoi(find_option(argc, argv, "--threads", "0")));
+    CPUPostProcess post(pool);
+    printf("%-10s %10s %8s %-10s %11s %11s %8s\n", "scene", "size", "skipped", "path", "full ms", "masked ms", "diff");
+    bool ok = true;
+    for (Scene & scene : scenes)
+    {
+        std::string size = std::to_string(scene.color.width()) + "x" + std::to_string(scene.color.height());
+        for (int simd = 0; simd < 2; simd++)
+        {
+            CPUImage outputs[2];
+            double ms[2];
+            float skipped = 0.0f;
+            for (int mask = 0; mask < 2; mask++)
+            {
+                CPUPostProcess::Settings settings;
+                settings.sss_simd = simd == 1;
+                settings.sss_mask = mask == 1;
+                post.set_settings(settings);
+                double t0 = now_ms();
+                for (int i = 0; i < repeat; i++)
+                {
+                    outputs[mask] = scene.color;
+                    post.ssss(outputs[mask], scene.depth);
+                }
+                ms[mask] = (now_ms() - t0) / repeat;
+                if (mask)
+                    skipped = post.ssss_skipped();
+            }
+            // a pixel without strength blurs to itself, up to the rounding of the kernel weights
+            float max_diff = max_difference(outputs[0], outputs[1]);
+            ok = ok && max_diff <= 1.0f / 255.0f;
+            printf("%-10s %10s %7.1f%% %-10s %11.2f %11.2f %8g\n", scene.name.c_str(), size.c_str(), 100.0f * skipped,
+                   simd ? "simd" : "reference", ms[0], ms[1], max_diff);
+        }
+    }
+    return ok ? 0 : 1;
+}
+
+// tile-report [--color c.pfm [--alpha a.pfm] --depth d.pfm] [--repeat n]
+//******************************************************************
+// The post-process chain per 16x16 tile, the way the tile compute kernels
+// run it: the tile classes of every classified pass, the time of the
+// chain with and without them, and the check that the cheap paths change
+// nothing (against render() and through the frame graph, where the tiled
+// passes write storage). Without a capture the frames are the head disks
+// of ssss-mask-report with a highlight, the top of the background sky.
+static int tile_report(int argc, char** argv)
+{
+    int width = atoi(find_option(argc, argv, "--width", "750"));
+    int height = atoi(find_option(argc, argv, "--height", "1334"));
+    int repeat = std::max(1, atoi(find_option(argc, argv, "--repeat", "3")));
+    const char* color_path = find_option(argc, argv, "--color");
+    const char* alpha_path = find_option(argc, argv, "--alpha");
+    const char* depth_path = find_option(argc, argv, "--depth");
+    
+    struct Scene { std::string name; CPUImage color, depth; };
+    std::vector<Scene> scenes;
+    if (color_path && depth_path)
+    {
+        scenes.resize(1);
+        Scene & scene = scenes[0];
+        scene.name = "capture";
+        CPUImage alpha;
+        if (!scene.color.load_pfm(color_path, CPUPixelFormatRGBA8Unorm) || !scene.depth.load_pfm(depth_path, CPUPixelFormatR32Float) ||
+            (alpha_path && !alpha.load_pfm(alpha_path, CPUPixelFormatR32Float)))
+        {
+            printf("can not read the capture\n");
+            return 1;
+        }
+        if (alpha_path)
+            scene.color.set_alpha(alpha);
+    }
+    else
+    {
+        const char* names[] = { "far", "medium", "close up" };
+        const float heads[] = { 0.15f, 0.3f, 0.45f };
+        scenes.resize(3);
+        for (int i = 0; i < 3; i++)
+        {
+            Scene & scene = scenes[i];
+            scene.name = names[i];
+            make_test_frame(width, height, scene.color, scene.depth, heads[i]);
+            float radius = heads[i] * height;
+            for (int y = 0; y < height; y++)
+            {
+                for (int x = 0; x < width; x++)
+                {
+                    vec4 c = scene.color.texel(x, y);
+                    float dx = x - 0.5f * width + 0.3f * radius;
+                    float dy = y - 0.5f * height + 0.3f * radius;
+                    if (c.w != 0.0f && dx * dx + dy * dy < 0.01f * radius * radius)
+                        scene.color.store(x, y, vec4(1.0f, 1.0f, 1.0f, c.w));        // specular highlight
+                    else if (c.w == 0.0f && y < height / 3)
+                        scene.depth.store(x, y, vec4(TileClassifier::SKY_DEPTH));
+                }
+            }
+        }
+    }
+    
+    ThreadPool pool(atoi(find_option(argc, argv, "--threads", "0")));
+    CPUPostProcess post(pool);
+    bool ok = true;
+    for (Scene & scene : scenes)
+    {
+        CPUImage outputs[2];
+        double ms[2];
+        for (int tiled = 0; tiled < 2; tiled++)
+        {
+            CPUPostProcess::Settings settings;
+            settings.tiled = tiled == 1;
+            settings.sss_simd = false;      // the tiles run the per-pixel blur
+            post.set_settings(settings);
+            double t0 = now_ms();
+            for (int i = 0; i < repeat; i++)
+            {
+                post.clear_tile_stats();
+                post.render(scene.color, scene.depth, outputs[tiled]);
+            }
+            ms[tiled] = (now_ms() - t0) / repeat;
+        }
+        
+        printf("%s, %dx%d: per pixel %.2f ms, tiled %.2f ms\n", scene.name.c_str(), scene.color.width(), scene.color.height(), ms[0], ms[1]);
+        printf("  %-16s %6s %14s %6s %8s\n", "pass", "tiles", "full", "sky", "ms");
+        for (const CPUTileExecutor::Stats & stats : post.tile_stats())
+        {
+            printf("  %-16s %6d %6d (%4.1f%%) %6d %8.2f\n", stats.pass.c_str(), stats.tiles, stats.full,
+                   stats.tiles ? 100.0f * stats.full / stats.tiles : 0.0f, stats.sky, stats.ms);
+        }
+        
+        // the graph declares the tiled passes as storage writes, with poisoned targets
+        TestFrame frame;
+        frame.color = scene.color;
+        frame.depth = scene.depth;
+        FrameGraph graph;
+        CPUFrameGraph images;
+        RenderTargetPool targets;
+        declare_test_frame(graph, images, post, frame);
+        std::string error;
+        if (!graph.compile(targets, &error))
+        {
+            printf("%s\n", error.c_str());
+            return 1;
+        }
+        images.execute(graph);
+        
+        float max_diff = max_difference(outputs[0], outputs[1]);
+        float graph_diff = max_difference(frame.output, outputs[1]);
+        ok = ok && max_diff == 0.0f && graph_diff == 0.0f;
+        printf("  tiled vs per pixel: max difference %g, frame graph vs render: %g\n", max_diff, graph_diff);
+    }
+    return ok ? 0 : 1;
+}
+
+// bloom-report [--width w] [--height h] [--repeat n]
+//******************************************************************
+// Bytes the bloom passes move per frame (FrameGraph::pass_bytes) for the
+// downsample / upsample pyramid, against the separable chain it replaced:
+// glare detection, a horizontal and a vertical blur per level and a
+// combine reading all six levels. Then the weights the upsample blends
+// leave the levels at, and the CPU reference's time.
+static void declare_separable_bloom(FrameGraph & graph, int width, int height, FrameGraph::Resource src)
+{
+    auto nothing = [](const FrameGraph::PassInfo&) {};
+    const FrameGraphTextureDesc glare_desc = { width / 2, height / 2, FrameGraphFormatRGBA8Unorm };
+    FrameGraph::Resource current = graph.create("bloom glare", glare_desc);
+    FrameGraph::Pass p = graph.add_pass("bloom glare", nothing);
+    graph.read(p, src);
+    graph.write(p, current);
+    
+    std::vector<FrameGraph::Resource> levels;
+    for (int i = 0; i < CPUPostProcess::BLOOM_N_PASSES; i++)
+    {
+        const int base = 2 << i;
+        const FrameGraphTextureDesc desc = { std::max(width / base, 1), std::max(height / base, 1), FrameGraphFormatRGBA8Unorm };
+        FrameGraph::Resource h = graph.create("bloom " + std::to_string(i) + " h", desc);
+        FrameGraph::Resource v = graph.create("bloom " + std::to_string(i) + " v", desc);
+        p = graph.add_pass("bloom blur " + std::to_string(i) + " h", nothing);
+        graph.read(p, current);
+        graph.write(p, h);
+        p = graph.add_pass("bloom blur " + std::to_string(i) + " v", nothing);
+        graph.read(p, h);
+        graph.write(p, v);
+        levels.push_back(current = v);
+    }
+    
+    FrameGraph::Resource dst = graph.create("bloom", { width, height, FrameGraphFormatRGBA8Unorm });
+    p = graph.add_pass("bloom combine", nothing);
+    graph.read(p, src);
+    for (FrameGraph::Resource level : levels)
+        graph.read(p, level);
+    graph.write(p, dst);
+    graph.set_output(dst);
+}
+
+// live bloom passes and the bytes they move
+static size_t bloom_bytes(const FrameGraph & graph, int & passes)
+{
+    size_t bytes = 0;
+    passes = 0;
+    for (FrameGraph::Pass p : graph.schedule())
+    {
+        if (graph.pass(p).name.compare(0, 5, "bloom") != 0)
+            continue;
+        bytes += graph.pass_bytes(p);
+        passes++;
+    }
+    return bytes;
+}
+
+static int bloom_report(int argc, char** argv)
+{
+    int width = atoi(find_option(argc, argv, "--width", "750"));
+    int height = atoi(find_option(argc, argv, "--height", "1334"));
+    int repeat = std::max(1, atoi(find_option(argc, argv, "--repeat", "3")));
+    const int sizes[][2] = { { width, height }, { 1920, 1080 }, { 2048, 1536 }, { 3840, 2160 } };
+    
+    CPUPostProcess::Settings settings;
+    settings.ssss_enabled = false;
+    settings.dof_enabled = false;
+    ThreadPool pool(atoi(find_option(argc, argv, "--threads", "0")));
+    CPUPostProcess post(pool);
+    post.set_settings(settings);
+    
+    printf("bytes moved per frame, each texel read or written once:\n");
+    printf("%11s %12s %7s %12s %7s %8s %16s\n", "size", "separable MB", "passes", "pyramid MB", "passes", "saved", "saved at 60 fps");
+    for (const auto & size : sizes)
+    {
+        const int w = size[0], h = size[1];
+        const FrameGraphTextureDesc color_desc = { w, h, FrameGraphFormatRGBA8Unorm };
+        const FrameGraphTextureDesc depth_desc = { w, h, FrameGraphFormatR32Float };
+        std::string error;
+        
+        FrameGraph separable;
+        RenderTargetPool separable_targets;
+        declare_separable_bloom(separable, w, h, separable.import("scene", color_desc));
+        
+        FrameGraph pyramid;
+        CPUFrameGraph images;
+        RenderTargetPool pyramid_targets;
+        FrameGraph::Resource color = pyramid.import("scene", color_desc);
+        FrameGraph::Resource depth = pyramid.import("linear depth", depth_desc);
+        pyramid.set_output(post.add_passes(pyramid, images, color, depth));
+        
+        if (!separable.compile(separable_targets, &error) || !pyramid.compile(pyramid_targets, &error))
+        {
+            printf("%s\n", error.c_str());
+            return 1;
+        }
+        int separable_passes, pyramid_passes;
+        double before = bloom_bytes(separable, separable_passes) / (1024.0 * 1024.0);
+        double after = bloom_bytes(pyramid, pyramid_passes) / (1024.0 * 1024.0);
+        char label[32];
+        snprintf(label, sizeof(label), "%dx%d", w, h);
+        printf("%11s %12.2f %7d %12.2f %7d %7.1f%% %11.2f GB/s\n", label, before, separable_passes, after, pyramid_passes,
+               100.0 * (before - after) / before, (before - after) * 60.0 / 1024.0);
+    }
+    
+    // level k ends up in the top of the chain at its own share of its upsample
+    // times the share of the levels below in every upsample above it
+    const int n = CPUPostProcess::BLOOM_N_PASSES;
+    bool ok = true;
+    printf("\nlevel weights out of 127 (the separable combine: 64 32 16 8 4 2):");
+    for (int k = 0; k < n; k++)
+    {
+        float weight = k < n - 1 ? 1.0f - PassConstants::bloom_up_weight(k, n).x : 1.0f;
+        for (int j = 0; j < k; j++)
+            weight *= PassConstants::bloom_up_weight(j, n).x;
+        weight *= 126.0f;
+        ok = ok && fabsf(weight - (float)(64 >> k)) < 1e-4f;
+        printf(" %.3f", weight);
+    }
+    printf("\n");
+    
+    TestFrame frame;
+    make_test_frame(width, height, frame.color, frame.depth);
+    CPUImage output;
+    double best = 1e30;
+    for (int i = 0; i < repeat; i++)
+    {
+        double t0 = now_ms();
+        post.bloom(frame.color, output);
+        best = std::min(best, now_ms() - t0);
+    }
+    printf("CPU reference %dx%d: %.2f ms\n", width, height, best);
+    return ok ? 0 : 1;
+}
+
+// tonemap-report [--exposure e] [--burnout b] [--repeat n]
+//******************************************************************
+// The tone mapping operators Bloom switches between at run time, on the
+// CPU (ToneMap, as shaders.metal evaluates them): the round trips of the
+// color conversions they use, a gray ramp through each (monotonic and
+// finite), Reinhard's white at burnout, and the CPU bloom with each.
+static int tonemap_report(int argc, char** argv)
+{
+    float exposure = (float)atof(find_option(argc, argv, "--exposure", "2"));
+    float burnout = (float)atof(find_option(argc, argv, "--burnout", "8"));
+    int repeat = std::max(1, atoi(find_option(argc, argv, "--repeat", "3")));
+    bool ok = true;
+    
+    // HDR colors on a grid, each channel in [0, 16]
+    float hsv_error = 0.0f, yxy_error = 0.0f;
+    const int n = 24;
+    for (int r = 0; r <= n; r++)
+    {
+        for (int g = 0; g <= n; g++)
+        {
+            for (int b = 0; b <= n; b++)
+            {
+                vec3 c = vec3(r, g, b) * (16.0f / n);
+                float scale = std::max(1.0f, std::max(std::max(c.x, c.y), c.z));
+                vec3 d = glm::abs(ToneMap::hsv2rgb(ToneMap::rgb2hsv(c)) - c) / scale;
+                hsv_error = std::max(hsv_error, std::max(std::max(d.x, d.y), d.z));
+                d = glm::abs(ToneMap::xyz2rgb(ToneMap::Yxy2xyz(ToneMap::xyz2Yxy(ToneMap::rgb2xyz(c)))) - c) / scale;
+                yxy_error = std::max(yxy_error, std::max(std::max(d.x, d.y), d.z));
+            }
+        }
+    }
+    ok = ok && hsv_error < 1e-5f && yxy_error < 1e-3f;
+    printf("round trips, relative: rgb-hsv-rgb %.2g, rgb-xyz-Yxy-xyz-rgb %.2g\n", hsv_error, yxy_error);
+    
+    // white: 1 for Reinhard's luminance at burnout
+    vec3 white = ToneMap::apply(TONEMAP_REINHARD, vec3(burnout / exposure), exposure, burnout);
+    float white_y = ToneMap::rgb2xyz(white).y;
+    ok = ok && fabsf(white_y - 1.0f) < 1e-3f;
+    printf("reinhard, burnout %g: luminance %g maps to %.5f\n\n", burnout, burnout / exposure, white_y);
+    
+    TestFrame frame;
+    make_test_frame(750, 1334, frame.color, frame.depth);
+    ThreadPool pool(atoi(find_option(argc, argv, "--threads", "0")));
+    CPUPostProcess post(pool);
+    CPUPostProcess::Settings settings;
+    settings.exposure = exposure;
+    settings.burnout = burnout;
+    settings.tone_map_lut = 0;      // the operators themselves
+    
+    const float grays[] = { 0.05f, 0.18f, 0.5f, 1.0f, 4.0f };
+    printf("%-16s", "gray");
+    for (float gray : grays)
+        printf(" %7g", gray);
+    printf(" %10s %7s %10s\n", "monotonic", "finite", "bloom ms");
+    for (int op = 0; op < TONEMAP_OPERATOR_COUNT; op++)
+    {
+        ToneMapOperator tone_map = (ToneMapOperator)op;
+        printf("%-16s", ToneMap::name(tone_map));
+        for (float gray : grays)
+            printf(" %7.4f", ToneMap::apply(tone_map, vec3(gray), exposure, burnout).y);
+        
+        // gray ramp over [0, 64]
+        bool monotonic = true, finite = true;
+        float last = -INFINITY;
+        for (int i = 0; i <= 4096; i++)
+        {
+            vec3 c = ToneMap::apply(tone_map, vec3(i / 64.0f), exposure, burnout);
+            float y = ToneMap::rgb2xyz(c).y;
+            finite = finite && std::isfinite(c.x) && std::isfinite(c.y) && std::isfinite(c.z);
+            monotonic = monotonic && y >= last - 1e-5f;
+            last = y;
+        }
+        ok = ok && monotonic && finite;
+        
+        settings.tone_map = tone_map;
+        post.set_settings(settings);
+        CPUImage output;
+        double best = 1e30;
+        for (int i = 0; i < repeat; i++)
+        {
+            double t0 = now_ms();
+            post.bloom(frame.color, output);
+            best = std::min(best, now_ms() - t0);
+        }
+        printf(" %10s %7s %10.2f\n", monotonic ? "yes" : "NO", finite ? "yes" : "NO", best);
+    }
+    return ok ? 0 : 1;
+}
+
+// tonemap-lut-report [--exposure e] [--burnout b] [--repeat n]
+//******************************************************************
+// ToneMapLUT against what it bakes, for every operator at 32^3 and 64^3
+// and for filmic with a grade: bake time on one worker and on the pool,
+// error of the lookup over HDR colors (relative to the exact value where
+// it is over 1), and the tone mapping cost per pixel of the CPU combine,
+// operator vs lookup.
+static int tonemap_lut_report(int argc, char** argv)
+{
+    float exposure = (float)atof(find_option(argc, argv, "--exposure", "2"));
+    float burnout = (float)atof(find_option(argc, argv, "--burnout", "8"));
+    int repeat = std::max(1, atoi(find_option(argc, argv, "--repeat", "3")));
+    ThreadPool one(1);
+    ThreadPool pool(atoi(find_option(argc, argv, "--threads", "0")));
+    
+    // channels log uniform over [2^-10, RANGE], a few exact zeros
+    std::vector<vec3> colors(1 << 18);
+    uint32_t seed = 1;
+    auto next = [&]() { seed = seed * 1664525u + 1013904223u; return (seed >> 8) / 16777216.0f; };
+    for (vec3 & c : colors)
+    {
+        for (int k = 0; k < 3; k++)
+        {
+            float u = next();
+            c[k] = u < 0.02f ? 0.0f : exp2f(-10.0f + u * (10.0f + log2f(ToneMapLUT::RANGE)));
+        }
+    }
+    
+    ToneMapLUT::Grade grade;
+    grade.lift = vec3(0.02f, 0.01f, 0.0f);
+    grade.gamma = vec3(1.1f);
+    grade.gain = vec3(1.0f, 0.98f, 0.95f);
+    grade.saturation = 1.2f;
+    struct Case { ToneMapOperator op; bool graded; };
+    std::vector<Case> cases;
+    for (int op = 0; op < TONEMAP_OPERATOR_COUNT; op++)
+        cases.push_back({ (ToneMapOperator)op, false });
+    cases.push_back({ TONEMAP_FILMIC, true });
+    
+    bool ok = true;
+    printf("exposure %g, burnout %g, %d colors, pool of %d\n", exposure, burnout, (int)colors.size(), pool.size());
+    printf("%-22s %5s %11s %11s %10s %10s %14s %11s %9s\n", "", "size", "bake 1 ms", "bake N ms", "max error", "mean error",
+           "operator ns/px", "lut ns/px", "renderer");
+    for (const Case & c : cases)
+    {
+        const ToneMapLUT::Grade g = c.graded ? grade : ToneMapLUT::Grade();
+        std::string label = std::string(ToneMap::name(c.op)) + (c.graded ? " + grade" : "");
+        
+        // the exact values, and the cost of evaluating them
+        std::vector<vec3> exact(colors.size());
+        double operator_ms = 1e30;
+        for (int r = 0; r < repeat; r++)
+        {
+            double t0 = now_ms();
+            for (size_t i = 0; i < colors.size(); i++)
+                exact[i] = g.apply(ToneMap::apply(c.op, colors[i], exposure, burnout));
+            operator_ms = std::min(operator_ms, now_ms() - t0);
+        }
+        
+        const int sizes[] = { 32, 64 };
+        for (int size : sizes)
+        {
+            ToneMapLUT lut;
+            double bake_one = 1e30, bake_pool = 1e30;
+            for (int r = 0; r < repeat; r++)
+            {
+                double t0 = now_ms();
+                lut.bake(one, size, c.op, exposure, burnout, g);
+                double t1 = now_ms();
+                lut.bake(pool, size, c.op, exposure, burnout, g);
+                bake_one = std::min(bake_one, t1 - t0);
+                bake_pool = std::min(bake_pool, now_ms() - t1);
+            }
+            
+            double lut_ms = 1e30;
+            float max_error = 0.0f;
+            double sum_error = 0.0;
+            vec3 sink(0.0f);
+            for (int r = 0; r < repeat; r++)
+            {
+                double t0 = now_ms();
+                for (size_t i = 0; i < colors.size(); i++)
+                    sink += lut.sample(colors[i]);
+                lut_ms = std::min(lut_ms, now_ms() - t0);
+            }
+            for (size_t i = 0; i < colors.size(); i++)
+            {
+                vec3 d = glm::abs(lut.sample(colors[i]) - exact[i]) / glm::max(glm::abs(exact[i]), vec3(1.0f));
+                float e = std::max(std::max(d.x, d.y), d.z);
+                max_error = std::max(max_error, e);
+                sum_error += e;
+            }
+            ok = ok && std::isfinite(max_error) && std::isfinite(sink.x + sink.y + sink.z);
+            // the operators the renderer bakes a table for are the ones it reproduces, and only those
+            bool listed = true;
+            if (size == ToneMapLUT::DEFAULT_SIZE)
+                listed = ToneMapLUT::reproduces(c.op) == (max_error < ToneMapLUT::TOLERANCE);
+            ok = ok && listed;
+            printf("%-22s %5d %11.2f %11.2f %10.5f %10.6f %14.1f %11.1f %9s%s\n", size == sizes[0] ? label.c_str() : "", size,
+                   bake_one, bake_pool, max_error, sum_error / colors.size(), operator_ms * 1e6 / colors.size(),
+                   lut_ms * 1e6 / colors.size(), size != ToneMapLUT::DEFAULT_SIZE ? "" : ToneMapLUT::reproduces(c.op) ? "lut" : "operator",
+                   listed ? "" : "  FAILED");
+        }
+    }
+    
+    // the whole CPU bloom at 750x1334, which the combine is part of
+    TestFrame frame;
+    make_test_frame(750, 1334, frame.color, frame.depth);
+    CPUPostProcess post(pool);
+    CPUPostProcess::Settings settings;
+    settings.exposure = exposure;
+    settings.burnout = burnout;
+    printf("\nCPU bloom, filmic:");
+    for (int size : { 0, 32, 64 })
+    {
+        settings.tone_map_lut = size;
+        post.set_settings(settings);
+        CPUImage output;
+        double best = 1e30;
+        for (int r = 0; r < repeat; r++)
+        {
+            double t0 = now_ms();
+            post.bloom(frame.color, output);
+            best = std::min(best, now_ms() - t0);
+        }
+        printf("  %s %.2f ms", size ? (std::to_string(size) + "^3 lut").c_str() : "operator", best);
+    }
+    printf("\n");
+    
+    // with a table size set, the operators the LUT doesn't reproduce still run per pixel
+    bool fallback = true;
+    settings.tone_map_lut = ToneMapLUT::DEFAULT_SIZE;
+    for (int op = 0; op < TONEMAP_OPERATOR_COUNT; op++)
+    {
+        settings.tone_map = (ToneMapOperator)op;
+        post.set_settings(settings);
+        fallback = fallback && post.uses_tone_map_lut() == ToneMapLUT::reproduces((ToneMapOperator)op);
+    }
+    ok = ok && fallback;
+    printf("CPUPostProcess samples the LUT for exactly those operators: %s\n", fallback ? "yes" : "no  FAILED");
+    return ok ? 0 : 1;
+}
+
+// transmittance-report [--falloff r g b]
+//******************************************************************
+static int transmittance_report(int argc, char** argv)
+{
+    vec3 falloff(1.0f);
+    for (int i = 0; i + 3 < argc; i++)
+    {
+        if (strcmp(argv[i], "--falloff") == 0)
+            falloff = vec3((float)atof(argv[i + 1]), (float)atof(argv[i + 2]), (float)atof(argv[i + 3]));
+    }
+    const int resolutions[] = { 16, 32, 64, 128, 256, 512, 1024 };
+    const int n_points = 200000;
+    
+    printf("falloff (%.3f %.3f %.3f)\n", falloff.x, falloff.y, falloff.z);
+    printf("%10s %8s %14s %14s %12s\n", "texels", "bytes", "max abs error", "rms error", "max/255");
+    for (int n : resolutions)
+    {
+        SSSTransmittance lut;
+        lut.bake(n, falloff);
+        // go a bit past the range to cover the clamped tail too
+        float d_max = lut.range() * 1.25f;
+        double max_error = 0.0, squared_error = 0.0;
+        for (int i = 0; i < n_points; i++)
+        {
+            float d = d_max * i / (n_points - 1);
+            vec3 e = glm::abs(lut.sample(d) - SSSTransmittance::profile(d, falloff));
+            for (int c = 0; c < 3; c++)
+            {
+                max_error = std::max(max_error, (double)e[c]);
+                squared_error += e[c] * e[c];
+            }
+        }
+        printf("%10d %8d %14.6f %14.6f %12.3f%s\n", n, n * 8, max_error, sqrt(squared_error / (3.0 * n_points)),
+               max_error * 255.0, n == SSSTransmittance::DEFAULT_RESOLUTION ? "   <- renderer" : "");
+    }
+    
+    // cost of one evaluation, as done per light per pixel
+    SSSTransmittance lut;
+    lut.bake(SSSTransmittance::DEFAULT_RESOLUTION, falloff);
+    const int iterations = 2000000;
+    vec3 sink(0.0f);
+    double t0 = now_ms();
+    for (int i = 0; i < iterations; i++)
+        sink += SSSTransmittance::profile(8.0f * (i & 1023) / 1023.0f, falloff);
+    double t1 = now_ms();
+    for (int i = 0; i < iterations; i++)
+        sink += lut.sample(8.0f * (i & 1023) / 1023.0f);
+    double t2 = now_ms();
+    
+    printf("\nCPU cost per evaluation: analytic %.1f ns, LUT %.1f ns (%.1fx)   [%g]\n",
+           (t1 - t0) * 1e6 / iterations, (t2 - t1) * 1e6 / iterations, (t1 - t0) / (t2 - t1), sink.x + sink.y + sink.z);
+    printf("GPU per light: analytic 6 exp + 6 vec3 mad, LUT 1 sqrt + 1 filtered fetch (RGBA16F)\n");
+    
+    // the renderer's update() every frame: a bake for a new SSS falloff only, and the table follows it
+    SSSTransmittance follow;
+    vec3 sss_falloff(1.0f, 0.37f, 0.3f);
+    bool baked_first = follow.update(sss_falloff);
+    bool baked_same = follow.update(sss_falloff);
+    bool baked_new = follow.update(falloff);
+    float follow_error = 0.0f;
+    for (int i = 0; i <= 1000; i++)
+    {
+        float d = follow.range() * i / 1000.0f;
+        vec3 e = glm::abs(follow.sample(d) - SSSTransmittance::profile(d, falloff));
+        follow_error = std::max(follow_error, std::max(std::max(e.x, e.y), e.z));
+    }
+    bool ok = baked_first && !baked_same && (baked_new == (falloff != sss_falloff)) && follow_error * 255.0f < 1.0f;
+    printf("update(): bakes for a new falloff only, matches its profile within %.3f/255: %s\n", follow_error * 255.0f,
+           ok ? "yes" : "no  FAILED");
+    return ok ? 0 : 1;
+}
+
+// mesh-convert source [--out file.mesh] [--no-normals] [--no-uvs] [--no-tangents] [--no-optimize]
+//******************************************************************
+static unsigned mesh_import_flags(int argc, char** argv)
+{
+    unsigned flags = MeshImportNormals | MeshImportUVs | MeshImportTangents;
+    if (has_flag(argc, argv, "--no-normals")) flags &= ~MeshImportNormals;
+    if (has_flag(argc, argv, "--no-uvs")) flags &= ~MeshImportUVs;
+    if (has_flag(argc, argv, "--no-tangents")) flags &= ~MeshImportTangents;
+    return flags;
+}
+
+static int mesh_convert(int argc, char** argv)
+{
+    if (argc < 1)
+    {
+        printf("usage: ssss_tool mesh-convert source [--out file.mesh] [--no-normals] [--no-uvs] [--no-tangents] [--no-optimize]\n");
+        return 1;
+    }
+    std::string source = argv[0];
+    std::string out = find_option(argc, argv, "--out", MeshCache::path_for(source).c_str());
+    
+    MeshData mesh;
+    double t0 = now_ms();
+    if (!MeshImporter::load(source, mesh, mesh_import_flags(argc, argv)))
+    {
+        fprintf(stderr, "can not import %s\n", source.c_str());
+        return 1;
+    }
+    double t1 = now_ms();
+    bool optimize = !has_flag(argc, argv, "--no-optimize");
+    if (optimize)
+        MeshOptimizer::optimize(mesh);
+    double t2 = now_ms();
+    if (!MeshCache::save(out, mesh, optimize ? MeshCacheOptimized : 0))
+    {
+        fprintf(stderr, "can not write %s\n", out.c_str());
+        return 1;
+    }
+    printf("%s: %zu vertices, %zu triangles, imported in %.1f ms\n",
+           source.c_str(), mesh.vertex_count(), mesh.index_count() / 3, t1 - t0);
+    if (optimize)
+        printf("  optimized in %.1f ms\n", t2 - t1);
+    printf("  -> %s (normals %s, uvs %s, tangents %s)\n", out.c_str(),
+           mesh.normals.empty() ? "no" : "yes", mesh.uvs.empty() ? "no" : "yes", mesh.tangents.empty() ? "no" : "yes");
+    return 0;
+}
+
+// Caches Model would upload as is must be refused when their indices
+// don't make whole triangles of their vertices.
+static bool cache_rejects_bad_indices(const std::string & path)
+{
+    MeshData quad;
+    quad.positions = { vec3(0.0f), vec3(1.0f, 0.0f, 0.0f), vec3(1.0f, 1.0f, 0.0f), vec3(0.0f, 1.0f, 0.0f) };
+    const std::vector<uint32_t> good = { 0, 1, 2, 0, 2, 3 };
+    const std::vector<uint32_t> out_of_range = { 0, 1, 2, 0, 2, 4 };
+    const std::vector<uint32_t> partial = { 0, 1, 2, 0, 2 };
+    bool ok = true;
+    for (const std::vector<uint32_t>* indices : { &good, &out_of_range, &partial })
+    {
+        quad.indices = *indices;
+        MeshCache cache;
+        ok = ok && MeshCache::save(path, quad, MeshCacheOptimized) && cache.open(path) == (indices == &good);
+    }
+    remove(path.c_str());
+    return ok;
+}
+
+// mesh-load-bench source [--cache file.mesh] [--iterations n]
+//******************************************************************
+static int mesh_load_bench(int argc, char** argv)
+{
+    if (argc < 1)
+    {
+        printf("usage: ssss_tool mesh-load-bench source [--cache file.mesh] [--iterations n]\n");
+        return 1;
+    }
+    std::string source = argv[0];
+    std::string cache_path = find_option(argc, argv, "--cache", MeshCache::path_for(source).c_str());
+    int iterations = atoi(find_option(argc, argv, "--iterations", "5"));
+    unsigned flags = mesh_import_flags(argc, argv);
+    
+    // Assimp, what Model did on every launch
+    MeshData imported;
+    double t0 = now_ms();
+    for (int i = 0; i < iterations; i++)
+    {
+        if (!MeshImporter::load(source, imported, flags))
+        {
+            fprintf(stderr, "can not import %s\n", source.c_str());
+            return 1;
+        }
+    }
+    double t1 = now_ms();
+    
+    // the cache: map, validate, and read every byte once like the buffer
+    // upload does
+    size_t bytes = 0;
+    uint32_t checksum = 0;
+    for (int i = 0; i < iterations; i++)
+    {
+        MeshCache cache;
+        if (!cache.open(cache_path))
+        {
+            fprintf(stderr, "can not open %s, run mesh-convert first\n", cache_path.c_str());
+            return 1;
+        }
+        bytes = 0;
+        for (int s = 0; s < MeshStreamCount; s++)
+        {
+            const uint32_t* words = static_cast<const uint32_t*>(cache.stream((MeshStream)s));
+            for (size_t w = 0; w < cache.stream_size((MeshStream)s) / 4; w++)
+                checksum += words[w];
+            bytes += cache.stream_size((MeshStream)s);
+        }
+    }
+    double t2 = now_ms();
+    
+    // and check it holds what the importer produces
+    MeshCache cache;
+    MeshData cached;
+    cache.open(cache_path);
+    cache.read(cached);
+    double t3 = now_ms();
+    if (cache.optimized())
+        MeshOptimizer::optimize(imported);
+    double optimize_ms = now_ms() - t3;
+    bool same = cached.positions == imported.positions && cached.normals == imported.normals &&
+                cached.tangents == imported.tangents && cached.uvs == imported.uvs && cached.indices == imported.indices;
+    
+    double assimp_ms = (t1 - t0) / iterations;
+    double cache_ms = (t2 - t1) / iterations;
+    printf("%zu vertices, %zu triangles, %.2f MB of streams\n",
+           imported.vertex_count(), imported.index_count() / 3, bytes / (1024.0 * 1024.0));
+    printf("%-24s %10.3f ms\n", "assimp import", assimp_ms);
+    if (cache.optimized())
+    {
+        // the app's fallback also optimizes what it imported
+        printf("%-24s %10.3f ms\n", "+ MeshOptimizer", optimize_ms);
+        assimp_ms += optimize_ms;
+    }
+    printf("%-24s %10.3f ms   (%.0fx)   [%08x]\n", "mapped cache", cache_ms, assimp_ms / cache_ms, checksum);
+    printf("cache matches import: %s\n", same ? "yes" : "NO");
+    bool rejects = cache_rejects_bad_indices(cache_path + ".check");
+    printf("caches with indices out of range or a partial triangle refused: %s\n", rejects ? "yes" : "NO");
+    return same && rejects ? 0 : 1;
+}
+
+// vertex-pack-report mesh (.mesh cache or source)
+//******************************************************************
+static bool load_mesh(const std::string & path, MeshData & mesh)
+{
+    if (path.size() > 5 && path.compare(path.size() - 5, 5, ".mesh") == 0)
+    {
+        MeshCache cache;
+        if (!cache.open(path))
+            return false;
+        cache.read(mesh);
+        return true;
+    }
+    return MeshImporter::load(path, mesh, MeshImportNormals | MeshImportUVs | MeshImportTangents);
+}
+
+static int vertex_pack_report(int argc, char** argv)
+{
+    if (argc < 1)
+    {
+        printf("usage: ssss_tool vertex-pack-report mesh\n");
+        return 1;
+    }
+    MeshData mesh;
+    if (!load_mesh(argv[0], mesh) || mesh.normals.empty() || mesh.tangents.empty() || mesh.uvs.empty())
+    {
+        fprintf(stderr, "can not load %s with normals, tangents and uvs\n", argv[0]);
+        return 1;
+    }
+    const size_t nv = mesh.vertex_count();
+    const size_t ni = mesh.index_count();
+    vec3 lo = mesh.positions[0], hi = mesh.positions[0];
+    for (const vec3& p : mesh.positions)
+    {
+        lo = glm::min(lo, p);
+        hi = glm::max(hi, p);
+    }
+    printf("%zu vertices, %zu triangles, bounds diagonal %.4f\n\n", nv, ni / 3, glm::length(hi - lo));
+    
+    // Bytes read by one draw assuming every vertex is fetched once (ideal
+    // post-transform cache). The head is drawn once per light by the shadow
+    // atlas pass, which only reads positions, and by the main pass.
+    struct Layout { const char* name; size_t position; size_t attributes; size_t index; };
+    PackedMesh packed_float, packed_half;
+    double t0 = now_ms();
+    VertexPacking::pack(mesh, VertexPositionFloat3, packed_float);
+    double t1 = now_ms();
+    VertexPacking::pack(mesh, VertexPositionHalf4, packed_half);
+    const Layout layouts[] = {
+        { "separate float", 12, 12 + 12 + 8, 4 },
+        { "packed",         packed_float.position_stride(), sizeof(PackedAttributes), packed_float.index_size() },
+        { "packed half pos", packed_half.position_stride(), sizeof(PackedAttributes), packed_half.index_size() },
+    };
+    
+    printf("%-16s %8s %8s %10s %10s %12s\n", "layout", "vertex B", "index B", "shadow KB", "main KB", "per frame KB");
+    for (const Layout& l : layouts)
+    {
+        double shadow = (nv * l.position + ni * l.index) / 1024.0;
+        double main = (nv * (l.position + l.attributes) + ni * l.index) / 1024.0;
+        printf("%-16s %8zu %8zu %10.1f %10.1f %12.1f\n", l.name, l.position + l.attributes, l.index,
+               shadow, main, 3.0 * shadow + main);
+    }
+    
+    printf("\n%-16s %12s %12s %12s %12s %12s %14s\n", "error", "pos max", "pos rms", "normal max", "normal mean", "tangent max", "uv max (texel)");
+    const PackedMesh* packed[] = { &packed_float, &packed_half };
+    const char* names[] = { "packed", "packed half pos" };
+    for (int i = 0; i < 2; i++)
+    {
+        VertexPacking::Error e = VertexPacking::measure(mesh, *packed[i]);
+        printf("%-16s %12.2e %12.2e %11.4fd %11.4fd %11.4fd %14.3f\n", names[i], e.position_max, e.position_rms,
+               e.normal_max_degrees, e.normal_mean_degrees, e.tangent_max_degrees, e.uv_max * 1024.0f);
+    }
+    printf("(uv error in texels of the 1024x1024 head maps)\n");
+    
+    MeshData decoded;
+    double t2 = now_ms();
+    VertexPacking::unpack(packed_float, decoded);
+    double t3 = now_ms();
+    printf("\npack %.2f ms, unpack %.2f ms\n", t1 - t0, t3 - t2);
+    return 0;
+}
+
+// mesh-opt-report mesh [--threshold t]
+//******************************************************************
+static void print_mesh_order_stats(const char* name, const MeshData & mesh, double ms)
+{
+    MeshOptimizer::CacheStats fifo16 = MeshOptimizer::simulate_fifo(mesh.indices, mesh.vertex_count(), 16);
+    MeshOptimizer::CacheStats fifo32 = MeshOptimizer::simulate_fifo(mesh.indices, mesh.vertex_count(), 32);
+    MeshOptimizer::CacheStats lru32 = MeshOptimizer::simulate_lru(mesh.indices, mesh.vertex_count(), 32);
+    
+    printf("%-16s %8.3f %8.3f %8.3f %8.3f %8.3f %9.3f %9.3f %9.1f\n", name, fifo16.acmr, fifo32.acmr, lru32.acmr,
+           fifo32.atvr, lru32.atvr, MeshOptimizer::overdraw(mesh.indices, mesh.positions),
+           MeshOptimizer::simulate_fetch(mesh.indices, mesh.vertex_count(), sizeof(vec3)), ms);
+}
+
+static int mesh_opt_report(int argc, char** argv)
+{
+    if (argc < 1)
+    {
+        printf("usage: ssss_tool mesh-opt-report mesh [--threshold t]\n");
+        return 1;
+    }
+    MeshData mesh;
+    if (!load_mesh(argv[0], mesh) || mesh.index_count() == 0)
+    {
+        fprintf(stderr, "can not load %s\n", argv[0]);
+        return 1;
+    }
+    float threshold = (float)atof(find_option(argc, argv, "--threshold", "1.05"));
+    printf("%s: %zu vertices, %zu triangles\n\n", argv[0], mesh.vertex_count(), mesh.index_count() / 3);
+    printf("%-16s %8s %8s %8s %8s %8s %9s %9s %9s\n", "", "ACMR", "ACMR", "ACMR", "ATVR", "ATVR", "", "fetch", "");
+    printf("%-16s %8s %8s %8s %8s %8s %9s %9s %9s\n", "order", "fifo16", "fifo32", "lru32", "fifo32", "lru32", "overdraw", "ratio", "ms");
+    
+    print_mesh_order_stats("input", mesh, 0.0);
+    
+    double t0 = now_ms();
+    MeshOptimizer::optimize_vertex_cache(mesh.indices, mesh.vertex_count());
+    double t1 = now_ms();
+    print_mesh_order_stats("vertex cache", mesh, t1 - t0);
+    
+    t0 = now_ms();
+    MeshOptimizer::optimize_overdraw(mesh.indices, mesh.positions, threshold);
+    t1 = now_ms();
+    print_mesh_order_stats("+ overdraw", mesh, t1 - t0);
+    
+    t0 = now_ms();
+    MeshOptimizer::optimize_vertex_fetch(mesh);
+    t1 = now_ms();
+    print_mesh_order_stats("+ vertex fetch", mesh, t1 - t0);
+    printf("\nfetch ratio: bytes of the position stream read through 64 byte lines and\n"
+           "a 64 line LRU, over the size of the stream (1 is ideal)\n");
+    return 0;
+}
+
+// dds-info file.dds
+//******************************************************************
+static int dds_info(int argc, char** argv)
+{
+    if (argc < 1)
+    {
+        printf("usage: ssss_tool dds-info file.dds\n");
+        return 1;
+    }
+    DDSFile dds;
+    std::string error;
+    if (!dds.open(argv[0], &error))
+    {
+        fprintf(stderr, "%s: %s\n", argv[0], error.c_str());
+        return 1;
+    }
+    printf("%s: %s %ux%u, %u mips, %u face(s), %.2f MB of texels\n", argv[0], DDSFile::format_name(dds.format()),
+           dds.width(), dds.height(), dds.mip_count(), dds.face_count(), dds.data_size() / (1024.0 * 1024.0));
+    for (uint32_t mip = 0; mip < dds.mip_count(); mip++)
+    {
+        DDSFile::Surface s = dds.surface(0, mip);
+        printf("  mip %2u  %5ux%-5u  pitch %6u  %9zu bytes at %zu\n", mip, s.width, s.height, s.row_pitch, s.size, s.offset);
+    }
+    return 0;
+}
+
+// dds-load-bench file.dds
+//******************************************************************
+// The texture is stood in for by a heap buffer of the same size. Each load
+// strategy runs in its own child process so its peak resident memory can
+// be read on its own.
+enum DDSLoadMode { DDSLoadTextureOnly, DDSLoadHeapCopy, DDSLoadMapped, DDSLoadMappedParallel };
+
+static bool dds_load(const char* path, DDSLoadMode mode)
+{
+    DDSFile dds;
+    if (!dds.open(path))
+        return false;
+    std::vector<size_t> offsets;
+    size_t texture_size = 0;
+    for (uint32_t face = 0; face < dds.face_count(); face++)
+    {
+        for (uint32_t mip = 0; mip < dds.mip_count(); mip++)
+        {
+            offsets.push_back(texture_size);
+            texture_size += dds.surface(face, mip).size;
+        }
+    }
+    std::vector<uint8_t> texture(texture_size);
+    memset(texture.data(), 0, texture.size());      // make it resident, like the real texture
+    
+    const uint32_t mips = dds.mip_count();
+    if (mode == DDSLoadHeapCopy)
+    {
+        // what gli::load_dds did: the whole file into a heap buffer first
+        FILE* fp = fopen(path, "rb");
+        if (!fp)
+            return false;
+        std::vector<uint8_t> file(dds.file_size());
+        bool ok = fread(file.data(), 1, file.size(), fp) == file.size();
+        fclose(fp);
+        if (!ok)
+            return false;
+        for (uint32_t face = 0; face < dds.face_count(); face++)
+        {
+            for (uint32_t mip = 0; mip < mips; mip++)
+            {
+                DDSFile::Surface s = dds.surface(face, mip);
+                memcpy(&texture[offsets[face * mips + mip]], &file[s.offset], s.size);
+            }
+        }
+    }
+    else if (mode == DDSLoadMapped || mode == DDSLoadMappedParallel)
+    {
+        auto upload = [&](int i) {
+            DDSFile::Surface s = dds.surface(i / mips, i % mips);
+            memcpy(&texture[offsets[i]], s.data, s.size);
+            dds.release(s);
+        };
+        if (mode == DDSLoadMappedParallel)
+        {
+            ThreadPool pool;
+            pool.parallel_for((int)offsets.size(), upload);
+        }
+        else
+        {
+            for (int i = 0; i < (int)offsets.size(); i++)
+                upload(i);
+        }
+    }
+    return true;
+}
+
+static int dds_load_bench(int argc, char** argv)
+{
+    if (argc < 1)
+    {
+        printf("usage: ssss_tool dds-load-bench file.dds\n");
+        return 1;
+    }
+    const char* path = argv[0];
+    DDSFile dds;
+    std::string error;
+    if (!dds.open(path, &error))
+    {
+        fprintf(stderr, "%s: %s\n", path, error.c_str());
+        return 1;
+    }
+    printf("%s: %s %ux%u, %u mips, %u face(s), %.2f MB\n\n", path, DDSFile::format_name(dds.format()),
+           dds.width(), dds.height(), dds.mip_count(), dds.face_count(), dds.file_size() / (1024.0 * 1024.0));
+    dds.close();
+    
+    const char* names[] = { "texture only", "heap copy (gli)", "mapped", "mapped, parallel" };
+    double baseline_mb = 0.0;
+    printf("%-20s %10s %16s\n", "", "time ms", "peak RSS +MB");
+    for (int mode = DDSLoadTextureOnly; mode <= DDSLoadMappedParallel; mode++)
+    {
+        int fds[2];
+        if (pipe(fds) != 0)
+            return 1;
+        pid_t pid = fork();
+        if (pid == 0)
+        {
+            close(fds[0]);
+            double t0 = now_ms();
+            bool ok = dds_load(path, (DDSLoadMode)mode);
+            double ms = now_ms() - t0;
+            ssize_t written = write(fds[1], &ms, sizeof(ms));
+            _exit(ok && written == sizeof(ms) ? 0 : 1);
+        }
+        close(fds[1]);
+        double ms = 0.0;
+        ssize_t got = read(fds[0], &ms, sizeof(ms));
+        close(fds[0]);
+        int status = 0;
+        struct rusage usage;
+        wait4(pid, &status, 0, &usage);
+        if (got != sizeof(ms) || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        {
+            fprintf(stderr, "%s failed\n", names[mode]);
+            return 1;
+        }
+#ifdef __APPLE__
+        double peak_mb = usage.ru_maxrss / (1024.0 * 1024.0);
+#else
+        double peak_mb = usage.ru_maxrss / 1024.0;
+#endif
+        if (mode == DDSLoadTextureOnly)
+            baseline_mb = peak_mb;
+        printf("%-20s %10.2f %16.2f\n", names[mode], ms, peak_mb - baseline_mb);
+    }
+    printf("\n(peak RSS relative to a process that only allocates the texture)\n");
+    return 0;
+}
+
+// texture-compress file.dds [--out f.ktx] [--format rgb8|rgba8|r11|rg11] [--srgb]
+//******************************************************************
+// One level of an uncompressed DDS as float texels, missing channels read
+// as 0 and alpha as 1 like the GPU does.
+static bool dds_image(const DDSFile & dds, uint32_t mip, CPUImage & image)
+{
+    DDSFile::Surface s = dds.surface(0, mip);
+    image.init(s.width, s.height, CPUPixelFormatRGBA32Float);
+    for (uint32_t y = 0; y < s.height; y++)
+    {
+        const uint8_t* row = s.data + (size_t)y * s.row_pitch;
+        for (uint32_t x = 0; x < s.width; x++)
+        {
+            vec4 t(0.0f, 0.0f, 0.0f, 1.0f);
+            const uint8_t* p = row + x * dds.bytes_per_block();
+            const uint16_t* h = (const uint16_t*)p;
+            const float* f = (const float*)p;
+            switch (dds.format())
+            {
+                case DDSFormatRGBA8Unorm:
+                case DDSFormatRGBA8Unorm_sRGB:
+                    t = vec4(p[0], p[1], p[2], p[3]) / 255.0f; break;
+                case DDSFormatBGRA8Unorm:
+                    t = vec4(p[2], p[1], p[0], p[3]) / 255.0f; break;
+                case DDSFormatRG8Unorm:     t[0] = p[0] / 255.0f; t[1] = p[1] / 255.0f; break;
+                case DDSFormatR8Unorm:      t[0] = p[0] / 255.0f; break;
+                case DDSFormatRGBA16Float:  for (int c = 0; c < 4; c++) t[c] = half_to_float(h[c]); break;
+                case DDSFormatRG16Float:    t[0] = half_to_float(h[0]); t[1] = half_to_float(h[1]); break;
+                case DDSFormatR16Float:     t[0] = half_to_float(h[0]); break;
+                case DDSFormatRGBA32Float:  t = vec4(f[0], f[1], f[2], f[3]); break;
+                case DDSFormatRG32Float:    t[0] = f[0]; t[1] = f[1]; break;
+                case DDSFormatR32Float:     t[0] = f[0]; break;
+                default:                    return false;
+            }
+            image.store(x, y, t);
+        }
+    }
+    return true;
+}
+
+// over the first `channels` channels, values in [0, 1]
+static double image_psnr(const CPUImage & a, const CPUImage & b, int channels)
+{
+    double squared_error = 0.0;
+    for (int y = 0; y < a.height(); y++)
+    {
+        for (int x = 0; x < a.width(); x++)
+        {
+            vec4 d = glm::clamp(a.texel(x, y), 0.0f, 1.0f) - glm::clamp(b.texel(x, y), 0.0f, 1.0f);
+            for (int c = 0; c < channels; c++)
+                squared_error += d[c] * d[c];
+        }
+    }
+    double mse = squared_error / ((double)channels * a.width() * a.height());
+    return mse > 0.0 ? 10.0 * log10(1.0 / mse) : INFINITY;
+}
+
+static int channel_count(ETC2Format format)
+{
+    switch (format)
+    {
+        case ETC2FormatRGB8:    return 3;
+        case ETC2FormatRGBA8:   return 4;
+        case ETC2FormatR11:     return 1;
+        default:                return 2;
+    }
+}
+
+// the .ktx TextureLoader picks up in place of a .dds
+static std::string ktx_path_for(const std::string & dds_path)
+{
+    size_t dot = dds_path.find_last_of('.');
+    size_t slash = dds_path.find_last_of('/');
+    if (dot == std::string::npos || (slash != std::string::npos && dot < slash))
+        return dds_path + ".ktx";
+    return dds_path.substr(0, dot) + ".ktx";
+}
+
+static int texture_compress(int argc, char** argv)
+{
+    if (argc < 1)
+    {
+        printf("usage: ssss_tool texture-compress file.dds [--out f.ktx] [--format rgb8|rgba8|r11|rg11] [--srgb]\n");
+        return 1;
+    }
+    const char* path = argv[0];
+    DDSFile dds;
+    std::string error;
+    if (!dds.open(path, &error))
+    {
+        fprintf(stderr, "%s: %s\n", path, error.c_str());
+        return 1;
+    }
+    if (dds.is_compressed() || dds.is_cubemap())
+    {
+        fprintf(stderr, "%s: only uncompressed 2D textures can be compressed\n", path);
+        return 1;
+    }
+    
+    // by default, as many channels as the source has
+    ETC2Format format;
+    switch (dds.format())
+    {
+        case DDSFormatR8Unorm:
+        case DDSFormatR16Float:
+        case DDSFormatR32Float:     format = ETC2FormatR11; break;
+        case DDSFormatRG8Unorm:
+        case DDSFormatRG16Float:
+        case DDSFormatRG32Float:    format = ETC2FormatRG11; break;
+        default:                    format = ETC2FormatRGBA8; break;
+    }
+    const char* names[] = { "rgb8", "rgba8", "r11", "rg11" };
+    const char* format_option = find_option(argc, argv, "--format");
+    if (format_option)
+    {
+        int i = 0;
+        while (i < 4 && strcmp(format_option, names[i]) != 0)
+            i++;
+        if (i == 4)
+        {
+            fprintf(stderr, "unknown format %s\n", format_option);
+            return 1;
+        }
+        format = (ETC2Format)i;
+    }
+    bool srgb = has_flag(argc, argv, "--srgb") || dds.format() == DDSFormatRGBA8Unorm_sRGB;
+    KTXFormat ktx_format = KTXFile::ktx_format(format, srgb);
+    std::string out = find_option(argc, argv, "--out", ktx_path_for(path).c_str());
+    
+    printf("%s: %s %ux%u, %u mips -> %s\n", path, DDSFile::format_name(dds.format()),
+           dds.width(), dds.height(), dds.mip_count(), KTXFile::format_name(ktx_format));
+    printf("%-5s %11s %12s %12s %10s %10s\n", "mip", "size", "bytes", "compressed", "psnr dB", "ms");
+    
+    ThreadPool pool;
+    std::vector<std::vector<uint8_t>> mips;
+    for (uint32_t mip = 0; mip < dds.mip_count(); mip++)
+    {
+        CPUImage source, decoded;
+        if (!dds_image(dds, mip, source))
+        {
+            fprintf(stderr, "%s: %s can not be read\n", path, DDSFile::format_name(dds.format()));
+            return 1;
+        }
+        double t0 = now_ms();
+        mips.push_back(ETC2Codec::encode(source, format, &pool));
+        double ms = now_ms() - t0;
+        ETC2Codec::decode(mips.back().data(), source.width(), source.height(), format, decoded);
+        printf("%-5u %5dx%-5d %12zu %12zu %10.2f %10.1f\n", mip, source.width(), source.height(),
+               dds.surface(0, mip).size, mips.back().size(), image_psnr(source, decoded, channel_count(format)), ms);
+    }
+    
+    if (!KTXFile::save(out, ktx_format, dds.width(), dds.height(), mips, &error))
+    {
+        fprintf(stderr, "%s\n", error.c_str());
+        return 1;
+    }
+    KTXFile ktx;
+    ktx.open(out);
+    printf("wrote %s: %zu bytes (%.1fx smaller)\n", out.c_str(), ktx.file_size(), (double)dds.file_size() / ktx.file_size());
+    return 0;
+}
+
+// texture-report file.dds [--ktx f.ktx] [--repeat n]
+//******************************************************************
+// Load time is the mapped upload path of TextureLoader (open, then copy
+// every level into a texture-sized buffer), best of n, warm page cache.
+template <typename File>
+static double mapped_load_ms(const std::string & path, int repeat)
+{
+    double best = INFINITY;
+    for (int r = 0; r < repeat; r++)
+    {
+        double t0 = now_ms();
+        File file;
+        if (!file.open(path))
+            return INFINITY;
+        std::vector<uint8_t> texture;
+        for (uint32_t mip = 0; mip < file.mip_count(); mip++)
+        {
+            auto s = file.surface(0, mip);
+            texture.insert(texture.end(), s.data, s.data + s.size);
+        }
+        best = std::min(best, now_ms() - t0);
+    }
+    return best;
+}
+
+static int texture_report(int argc, char** argv)
+{
+    if (argc < 1)
+    {
+        printf("usage: ssss_tool texture-report file.dds [--ktx f.ktx] [--repeat n]\n");
+        return 1;
+    }
+    const char* path = argv[0];
+    std::string ktx_path = find_option(argc, argv, "--ktx", ktx_path_for(path).c_str());
+    int repeat = atoi(find_option(argc, argv, "--repeat", "10"));
+    DDSFile dds;
+    KTXFile ktx;
+    std::string error;
+    if (!dds.open(path, &error) || !ktx.open(ktx_path, &error))
+    {
+        fprintf(stderr, "%s\n", error.c_str());
+        return 1;
+    }
+    if (dds.width() != ktx.width() || dds.height() != ktx.height())
+    {
+        fprintf(stderr, "size mismatch: %ux%u vs %ux%u\n", dds.width(), dds.height(), ktx.width(), ktx.height());
+        return 1;
+    }
+    
+    printf("%-40s %-16s %6s %12s %10s %10s\n", "", "format", "mips", "bytes", "load ms", "psnr dB");
+    printf("%-40s %-16s %6u %12zu %10.2f %10s\n", path, DDSFile::format_name(dds.format()), dds.mip_count(),
+           dds.data_size(), mapped_load_ms<DDSFile>(path, repeat), "-");
+    
+    // error of every level the two files have in common, mip 0 first
+    std::string psnr;
+    for (uint32_t mip = 0; mip < std::min(dds.mip_count(), ktx.mip_count()); mip++)
+    {
+        CPUImage source, decoded;
+        if (!dds_image(dds, mip, source))
+            break;
+        KTXFile::Surface s = ktx.surface(0, mip);
+        ETC2Codec::decode(s.data, s.width, s.height, ktx.etc2_format(), decoded);
+        char value[32];
+        snprintf(value, sizeof(value), "%s%.2f", mip ? " " : "", image_psnr(source, decoded, channel_count(ktx.etc2_format())));
+        psnr += value;
+    }
+    size_t ktx_texels = 0;
+    for (uint32_t mip = 0; mip < ktx.mip_count(); mip++)
+        ktx_texels += ktx.surface(0, mip).size;
+    printf("%-40s %-16s %6u %12zu %10.2f %10s\n", ktx_path.c_str(), KTXFile::format_name(ktx.format()), ktx.mip_count(),
+           ktx_texels, mapped_load_ms<KTXFile>(ktx_path, repeat), psnr.substr(0, psnr.find(' ')).c_str());
+    printf("\n%.1fx less memory; psnr per mip: %s\n", (double)dds.data_size() / ktx_texels, psnr.c_str());
+    return 0;
+}
+
+// startup-bench asset... [--threads n] [--trace f.json]
+//******************************************************************
+// The app's startup load on the CPU: meshes (.obj / .mesh) are imported or
+// mapped, optimized and packed, textures (.dds) mapped and read in, SSS
+// kernels generated; "uploads" copy into buffers standing in for the GPU
+// resources. Run once in order on one thread, then through a TaskGraph.
+struct StartupAsset
+{
+    std::string path;
+    MeshData mesh;
+    PackedMesh packed;
+    DDSFile dds;
+    std::vector<uint8_t> gpu;
+};
+
+static void startup_load(StartupAsset & asset)
+{
+    const std::string & path = asset.path;
+    if (path.size() > 4 && path.compare(path.size() - 4, 4, ".dds") == 0)
+    {
+        if (!asset.dds.open(path))
+            return;
+        for (uint32_t face = 0; face < asset.dds.face_count(); face++)
+            for (uint32_t mip = 0; mip < asset.dds.mip_count(); mip++)
+                asset.dds.prefetch(asset.dds.surface(face, mip));
+        return;
+    }
+    MeshCache cache;
+    bool optimized = cache.open(path) && cache.optimized();
+    cache.close();
+    if (!load_mesh(path, asset.mesh))
+        return;
+    if (!optimized)
+        MeshOptimizer::optimize(asset.mesh);
+    VertexPacking::pack(asset.mesh, VertexPositionFloat3, asset.packed);
+}
+
+static void startup_upload(StartupAsset & asset)
+{
+    if (asset.dds.is_open())
+    {
+        for (uint32_t face = 0; face < asset.dds.face_count(); face++)
+        {
+            for (uint32_t mip = 0; mip < asset.dds.mip_count(); mip++)
+            {
+                DDSFile::Surface s = asset.dds.surface(face, mip);
+                asset.gpu.insert(asset.gpu.end(), s.data, s.data + s.size);
+                asset.dds.release(s);
+            }
+        }
+        asset.dds.close();
+        return;
+    }
+    const PackedMesh & p = asset.packed;
+    const uint8_t* attributes = (const uint8_t*)p.attributes.data();
+    asset.gpu.insert(asset.gpu.end(), p.positions.begin(), p.positions.end());
+    asset.gpu.insert(asset.gpu.end(), attributes, attributes + p.attributes.size() * sizeof(PackedAttributes));
+    asset.gpu.insert(asset.gpu.end(), p.indices.begin(), p.indices.end());
+}
+
+static void startup_kernels()
+{
+    // SeparableSSS::init and the transmittance table
+    std::vector<vec4> kernel;
+    SSSKernel::calculate(kernel, 11, vec3(0.48f, 0.41f, 0.28f), vec3(1.0f, 0.37f, 0.3f));
+    SSSTransmittance transmittance;
+    transmittance.bake();
+}
+
+static int startup_bench(int argc, char** argv)
+{
+    std::vector<std::string> paths;
+    for (int i = 0; i < argc; i++)
+    {
+        if (argv[i][0] == '-')
+            i++;    // option and its value
+        else
+            paths.push_back(argv[i]);
+    }
+    if (paths.empty())
+    {
+        printf("usage: ssss_tool startup-bench asset... [--threads n] [--trace f.json]\n");
+        return 1;
+    }
+    
+    // serial, what preparePipelineState did
+    std::vector<StartupAsset> serial(paths.size());
+    double t0 = now_ms();
+    for (size_t i = 0; i < paths.size(); i++)
+    {
+        serial[i].path = paths[i];
+        startup_load(serial[i]);
+        startup_upload(serial[i]);
+    }
+    startup_kernels();
+    double serial_ms = now_ms() - t0;
+    
+    ThreadPool pool(atoi(find_option(argc, argv, "--threads", "0")));
+    TaskGraph graph(pool);
+    std::vector<StartupAsset> assets(paths.size());
+    for (size_t i = 0; i < paths.size(); i++)
+    {
+        StartupAsset& asset = assets[i];
+        asset.path = paths[i];
+        std::string name = paths[i].substr(paths[i].find_last_of('/') + 1);
+        TaskGraph::Task load = graph.add("load " + name, [&asset]() { startup_load(asset); });
+        graph.add_submit("upload " + name, [&asset]() { startup_upload(asset); }, { load });
+    }
+    graph.add("kernels", startup_kernels);
+    graph.run();
+    
+    size_t bytes = 0;
+    for (size_t i = 0; i < paths.size(); i++)
+    {
+        if (assets[i].gpu != serial[i].gpu)
+        {
+            fprintf(stderr, "%s: graph and serial loads differ\n", paths[i].c_str());
+            return 1;
+        }
+        bytes += assets[i].gpu.size();
+    }
+    
+    printf("%zu assets, %.1f MB uploaded, %d workers\n\n%s\n", paths.size(), bytes / (1024.0 * 1024.0), pool.size(), graph.report().c_str());
+    printf("serial %.1f ms, task graph %.1f ms (%.2fx)\n", serial_ms, graph.elapsed_ms(), serial_ms / graph.elapsed_ms());
+    const char* trace = find_option(argc, argv, "--trace");
+    if (trace && graph.write_trace(trace))
+        printf("trace written to %s\n", trace);
+    return 0;
+}
+
+// precision-report [--width w] [--height h] [--hdr s] [--repeat n]
+//******************************************************************
+// The main pass and post-process targets in each SCENE_COLOR_FORMAT: the
+// memory of the frame's targets, the bytes its passes move, the CPU
+// reference's time and its error against the same chain run in float.
+// The test frame's lighting is scaled by --hdr so that, like the lit
+// head's speculars, it goes past what RGBA8 holds.
+static int precision_report(int argc, char** argv)
+{
+    int width = atoi(find_option(argc, argv, "--width", "750"));
+    int height = atoi(find_option(argc, argv, "--height", "1334"));
+    float hdr = (float)atof(find_option(argc, argv, "--hdr", "4"));
+    int repeat = std::max(1, atoi(find_option(argc, argv, "--repeat", "3")));
+    ThreadPool pool(atoi(find_option(argc, argv, "--threads", "0")));
+    CPUPostProcess post(pool);
+    
+    TestFrame frame;
+    CPUImage ldr;
+    make_test_frame(width, height, ldr, frame.depth);
+    frame.color.init(width, height);
+    for (int y = 0; y < height; y++)
+    {
+        for (int x = 0; x < width; x++)
+        {
+            vec4 c = ldr.texel(x, y);
+            frame.color.store(x, y, vec4(vec3(c) * hdr, c.w));
+        }
+    }
+    
+    // float reference: every target RGBA32Float, the per-pixel SSS blur
+    CPUPostProcess::Settings settings;
+    settings.sss_simd = false;
+    post.set_settings(settings);
+    CPUImage reference = frame.color;
+    CPUImage bloomed;
+    post.ssss(reference, frame.depth);
+    post.bloom(reference, bloomed);
+    post.dof(bloomed, reference, frame.depth);
+    
+    const FrameGraphFormat formats[] = { FrameGraphFormatRGBA8Unorm, FrameGraphFormatRG11B10Float, FrameGraphFormatRGBA16Float };
+    const double MB = 1024.0 * 1024.0;
+    bool ok = true;
+    printf("%dx%d, lighting x%g\n", width, height, hdr);
+    printf("%-14s %-12s %10s %10s %9s %10s %10s\n", "color", "depth", "targets MB", "moved MB", "ms", "max error", "psnr dB");
+    for (FrameGraphFormat format : formats)
+    {
+        settings.color_format = format;
+        post.set_settings(settings);
+        CPUImage output;
+        double best = 1e30;
+        for (int i = 0; i < repeat; i++)
+        {
+            double t0 = now_ms();
+            post.render(frame.color, frame.depth, output);
+            best = std::min(best, now_ms() - t0);
+        }
+        
+        FrameGraph graph;
+        CPUFrameGraph images;
+        RenderTargetPool targets;
+        declare_test_frame(graph, images, post, frame);
+        std::string error;
+        if (!graph.compile(targets, &error))
+        {
+            printf("%s\n", error.c_str());
+            return 1;
+        }
+        images.execute(graph);
+        size_t moved = 0;
+        for (FrameGraph::Pass p : graph.schedule())
+            moved += graph.pass_bytes(p);
+        
+        // rgb only: alpha is 1 in a format without it
+        float max_error = 0.0f;
+        for (int y = 0; y < height; y++)
+        {
+            for (int x = 0; x < width; x++)
+            {
+                vec3 d = glm::abs(vec3(output.texel(x, y)) - vec3(reference.texel(x, y)));
+                max_error = std::max(max_error, std::max(std::max(d.x, d.y), d.z));
+            }
+        }
+        float graph_diff = max_difference(frame.output, output);
+        ok = ok && graph_diff == 0.0f;
+        printf("%-14s %-12s %10.2f %10.2f %9.2f %10.5f %10.2f\n", FrameGraph::format_name(format), FrameGraph::format_name(CPUPostProcess::depth_format(format)),
+               graph.physical_bytes() / MB, moved / MB, best, max_error, image_psnr(reference, output, 3));
+        if (graph_diff != 0.0f)
+            printf("  frame graph vs render: max difference %g\n", graph_diff);
+    }
+    return ok ? 0 : 1;
+}
+
+// dynres-replay [trace.txt] [--synthetic frames] [--target ms] [--cost ssss bloom dof] [--quality]
+//******************************************************************
+// Replays a frame time trace through DynamicResolution: one frame per line,
+// "ms [ssss bloom dof]" with the scales the frame ran at (the trace the
+// renderer writes on pause), or a synthetic one with a heavy stretch in the
+// middle. A frame's time at other scales comes from a simple model: the
+// share --cost of each pass at full size goes with the square of its scale.
+// --quality also renders the test frame with one pass scaled at a time and
+// prints the PSNR against full size.
+struct TraceFrame
+{
+    double ms;
+    float scale[DynamicResolution::PASS_COUNT];
+};
+
+static bool read_frame_trace(const char* path, std::vector<TraceFrame> & trace)
+{
+    FILE* f = fopen(path, "r");
+    if (!f)
+        return false;
+    char line[256];
+    while (fgets(line, sizeof(line), f))
+    {
+        if (line[0] == '#')
+            continue;
+        TraceFrame frame = { 0.0, { 1.0f, 1.0f, 1.0f } };
+        if (sscanf(line, "%lf %f %f %f", &frame.ms, &frame.scale[0], &frame.scale[1], &frame.scale[2]) >= 1)
+            trace.push_back(frame);
+    }
+    fclose(f);
+    return true;
+}
+
+static void synthetic_frame_trace(int frames, double target_ms, std::vector<TraceFrame> & trace)
+{
+    unsigned seed = 1;
+    for (int i = 0; i < frames; i++)
+    {
+        // 80% of the budget, 125% over the middle third (the camera closes
+        // in on the face), a few percent of noise
+        double t = (double)i / frames;
+        double load = t > 0.33 && t < 0.66 ? 1.25 : 0.8;
+        seed = seed * 1664525u + 1013904223u;
+        double noise = ((seed >> 8) / 16777216.0 - 0.5) * 0.1;
+        TraceFrame frame = { target_ms * (load + noise), { 1.0f, 1.0f, 1.0f } };
+        trace.push_back(frame);
+    }
+}
+
+static void dynres_quality(int argc, char** argv)
+{
+    int width = atoi(find_option(argc, argv, "--width", "750"));
+    int height = atoi(find_option(argc, argv, "--height", "1334"));
+    ThreadPool pool(atoi(find_option(argc, argv, "--threads", "0")));
+    CPUPostProcess post(pool);
+    TestFrame frame;
+    make_test_frame(width, height, frame.color, frame.depth);
+    
+    auto render = [&](CPUPostProcess::Settings settings, CPUImage & output) {
+        post.set_settings(settings);
+        FrameGraph graph;
+        CPUFrameGraph images;
+        RenderTargetPool targets;
+        declare_test_frame(graph, images, post, frame);
+        graph.compile(targets);
+        images.execute(graph);
+        output = frame.output;
+        return graph.physical_bytes();
+    };
+    CPUImage reference;
+    size_t full_bytes = render(CPUPostProcess::Settings(), reference);
+    
+    DynamicResolution::Settings dr;
+    printf("\n%-6s %6s %10s %10s %10s\n", "pass", "scale", "size", "targets", "psnr dB");
+    for (int p = 0; p < DynamicResolution::PASS_COUNT; p++)
+    {
+        for (float scale = 1.0f - dr.scale_step; scale >= dr.min_scale[p] - 1e-4f; scale -= dr.scale_step)
+        {
+            CPUPostProcess::Settings settings;
+            float* scales[] = { &settings.ssss_scale, &settings.bloom_scale, &settings.dof_scale };
+            *scales[p] = scale;
+            CPUImage output;
+            size_t bytes = render(settings, output);
+            std::string size = std::to_string(DynamicResolution::scaled_size(width, scale)) + "x" +
+                               std::to_string(DynamicResolution::scaled_size(height, scale));
+            printf("%-6s %6.3f %10s %7.2f MB %10.2f\n", DynamicResolution::pass_name((DynamicResolution::Pass)p), scale,
+                   size.c_str(), bytes / (1024.0 * 1024.0), image_psnr(reference, output, 3));
+        }
+    }
+    printf("(full size: %.2f MB of targets)\n", full_bytes / (1024.0 * 1024.0));
+}
+
+static int dynres_replay(int argc, char** argv)
+{
+    typedef DynamicResolution::Pass Pass;
+    DynamicResolution::Settings settings;
+    settings.target_ms = atof(find_option(argc, argv, "--target", "16.667"));
+    double cost[DynamicResolution::PASS_COUNT] = { 0.3, 0.1, 0.2 };
+    for (int i = 0; i + 3 < argc; i++)
+    {
+        if (strcmp(argv[i], "--cost") == 0)
+        {
+            for (int p = 0; p < DynamicResolution::PASS_COUNT; p++)
+                cost[p] = atof(argv[i + 1 + p]);
+        }
+    }
+    auto frame_cost = [&](const float* scale) {
+        double c = 1.0;
+        for (int p = 0; p < DynamicResolution::PASS_COUNT; p++)
+            c += cost[p] * (scale[p] * scale[p] - 1.0);
+        return c;
+    };
+    
+    std::vector<TraceFrame> trace;
+    if (argc > 0 && argv[0][0] != '-')
+    {
+        if (!read_frame_trace(argv[0], trace))
+        {
+            fprintf(stderr, "can't read %s\n", argv[0]);
+            return 1;
+        }
+    }
+    else
+    {
+        synthetic_frame_trace(atoi(find_option(argc, argv, "--synthetic", "1800")), settings.target_ms, trace);
+    }
+    
+    DynamicResolution controller(settings);
+    printf("%6s %10s %7s %7s %7s\n", "frame", "window ms", "ssss", "bloom", "dof");
+    int over_fixed = 0, over_dynamic = 0;
+    int reversals = 0, last_direction = 0;
+    double sum_fixed = 0.0, sum_dynamic = 0.0;
+    double scale_sum[DynamicResolution::PASS_COUNT] = { 0.0, 0.0, 0.0 };
+    const float full[DynamicResolution::PASS_COUNT] = { 1.0f, 1.0f, 1.0f };
+    for (size_t i = 0; i < trace.size(); i++)
+    {
+        float scale[DynamicResolution::PASS_COUNT];
+        for (int p = 0; p < DynamicResolution::PASS_COUNT; p++)
+        {
+            scale[p] = controller.scale((Pass)p);
+            scale_sum[p] += scale[p];
+        }
+        double base_ms = trace[i].ms / frame_cost(trace[i].scale);
+        double fixed_ms = base_ms * frame_cost(full);
+        double ms = base_ms * frame_cost(scale);
+        sum_fixed += fixed_ms;
+        sum_dynamic += ms;
+        over_fixed += fixed_ms > settings.target_ms ? 1 : 0;
+        over_dynamic += ms > settings.target_ms ? 1 : 0;
+        
+        float before = 0.0f;
+        for (int p = 0; p < DynamicResolution::PASS_COUNT; p++)
+            before += scale[p];
+        if (controller.add_frame(ms))
+        {
+            float after = 0.0f;
+            for (int p = 0; p < DynamicResolution::PASS_COUNT; p++)
+                after += controller.scale((Pass)p);
+            int direction = after > before ? 1 : -1;
+            reversals += last_direction != 0 && direction != last_direction ? 1 : 0;
+            last_direction = direction;
+            printf("%6zu %10.2f %7.3f %7.3f %7.3f\n", i, controller.average_ms(), controller.scale(DynamicResolution::PassSSSS),
+                   controller.scale(DynamicResolution::PassBloom), controller.scale(DynamicResolution::PassDOF));
+        }
+    }
+    
+    int n = (int)trace.size();
+    printf("\n%d frames, budget %.2f ms, cost model ssss %.2f bloom %.2f dof %.2f\n", n, settings.target_ms, cost[0], cost[1], cost[2]);
+    printf("%-14s %10s %16s\n", "", "mean ms", "over budget");
+    printf("%-14s %10.2f %9d (%4.1f%%)\n", "full size", sum_fixed / n, over_fixed, 100.0 * over_fixed / n);
+    printf("%-14s %10.2f %9d (%4.1f%%)\n", "dynamic", sum_dynamic / n, over_dynamic, 100.0 * over_dynamic / n);
+    printf("mean scales: ssss %.3f, bloom %.3f, dof %.3f; %d changes, %d reversals\n", scale_sum[0] / n, scale_sum[1] / n,
+           scale_sum[2] / n, controller.changes(), reversals);
+    
+    if (has_flag(argc, argv, "--quality"))
+        dynres_quality(argc, argv);
+    return 0;
+}
+
+// main
+//******************************************************************
+struct Command
+{
+    const char* name;
+    int (*run)(int argc, char** argv);
+    const char* usage;
+};
+
+static const Command commands[] = {
+    { "kernel-bench", kernel_bench, "[iterations]  time SSS kernel generation" },
+    { "postprocess",  postprocess,  "run the CPU reference post-process chain on a capture" },
+    { "diff",         diff,         "a.pfm b.pfm  compare two images" },
+    { "blur-bench",   blur_bench,   "[--threads n]  SSS blur throughput, scalar vs SIMD, 1080p and 4K" },
+    { "framegraph-report", framegraph_report, "[--no-ssss] [--no-bloom] [--no-dof]  the frame's passes, attachment actions and aliasing, run on the CPU" },
+    { "rtpool-report", rtpool_report, "[--frames-per-step n] [--max-idle n]  render target pool over frames toggling effects and rotating" },
+    { "frame-constants-report", frame_constants_report, "[--frames n] [--threads n] [--frame-kb k]  frame constant allocator: ring, overflow and concurrency checks, cost" },
+    { "encode-bench", encode_bench, "[--frames n] [--threads n] [--cost-scale s] [--sleep]  parallel command encoding of a mock frame: ms per frame, submission order" },
+    { "shadow-cache-report", shadow_cache_report, "[--frames n]  shadow maps rendered and skipped by the cache over scripted frames" },
+    { "shadow-atlas-report", shadow_atlas_report, "[--frames n] [--trials n]  shadow atlas packing, importance and layout stability, 3 to 300 lights" },
+    { "light-cluster-bench", light_cluster_bench, "[--threads n] [--repeat n] [--points n]  clustered light culling: build time and lights per fragment at 3, 32 and 256 lights" },
+    { "ssss-mask-report", ssss_mask_report, "[--color c.pfm --alpha a.pfm --depth d.pfm] [--repeat n]  pixels the SSS skin mask skips, time and error" },
+    { "tile-report",  tile_report,  "[--color c.pfm --alpha a.pfm --depth d.pfm] [--repeat n]  tile classes of the tiled passes, time and error" },
+    { "bloom-report", bloom_report, "[--width w] [--height h] [--repeat n]  bytes per frame, pyramid vs separable bloom; level weights" },
+    { "precision-report", precision_report, "[--width w] [--height h] [--hdr s]  post-process target formats: memory, bandwidth, time and error" },
+    { "tonemap-report", tonemap_report, "[--exposure e] [--burnout b]  tone mapping operators: color conversions, gray ramp, Reinhard white" },
+    { "tonemap-lut-report", tonemap_lut_report, "[--exposure e] [--burnout b] [--repeat n]  tone mapping LUT: bake time, error, cost per pixel" },
+    { "resize-report", resize_report, "[--width w] [--height h] [--frames n]  resize protocol: targets created per resize, stale sizes, SSS isotropy" },
+    { "transmittance-report", transmittance_report, "[--falloff r g b]  LUT accuracy vs resolution, and cost" },
+    { "mesh-convert", mesh_convert, "source [--out f.mesh]  bake a mesh into the binary cache the app loads" },
+    { "mesh-load-bench", mesh_load_bench, "source [--cache f.mesh]  load time, Assimp vs mapped cache" },
+    { "vertex-pack-report", vertex_pack_report, "mesh  packed vertex layouts: size, fetch bandwidth, error" },
+    { "dds-info",     dds_info,     "file.dds  header and mip layout" },
+    { "dds-load-bench", dds_load_bench, "file.dds  load time and peak memory, heap copy vs mapped" },
+    { "mesh-opt-report", mesh_opt_report, "mesh [--threshold t]  ACMR/ATVR and overdraw of each optimization step" },
+    { "texture-compress", texture_compress, "file.dds [--format f] [--srgb]  encode to ETC2/EAC, writes the .ktx the app loads" },
+    { "texture-report", texture_report, "file.dds [--ktx f.ktx]  size, load time and PSNR, source vs compressed" },
+    { "startup-bench", startup_bench, "asset... [--trace f.json]  load meshes / textures serially vs through the task graph" },
+    { "dynres-replay", dynres_replay, "[trace.txt] [--target ms] [--cost s b d] [--quality]  dynamic resolution over a frame time trace" },
+};
+
+static void print_usage()
+{
+    printf("usage: ssss_tool <command> [args]\n");
+    for (auto& c : commands)
+        printf("  %-24s %s\n", c.name, c.usage);
+}
+
+int main(int argc, char** argv)
+{
+    if (argc < 2)
+    {
+        print_usage();
+        return 1;
+    }
+    for (auto& c : commands)
+    {
+        if (strcmp(argv[1], c.name) == 0)
+            return c.run(argc - 2, argv + 2);
+    }
+    print_usage();
+    return 1;
+}